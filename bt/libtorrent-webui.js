@@ -54,6 +54,12 @@
     return high * 4294967296 + low;
   }
 
+  // v must be a non-negative integer, less than 2^53
+  function write_uint64(view, offset, v) {
+    view.setUint32(offset, Math.floor(v / 4294967296));
+    view.setUint32(offset + 4, v % 4294967296);
+  }
+
   function _check_error(e, callback) {
     if (e == 0) return false;
 
@@ -104,6 +110,13 @@
         fun &= 0x7f;
         //			console.log('RESPONSE: fun: ' + fun + ' tid: ' + tid + ' error: ' + e);
 
+        // subscriptions receive any number of responses to the same call
+        var sub = self._subscriptions[fun];
+        if (sub && sub.tid == tid) {
+          sub.handler(view, fun, e);
+          return;
+        }
+
         if (!self._transactions.hasOwnProperty(tid)) return;
 
         var handler = self._transactions[tid];
@@ -121,6 +134,9 @@
     this._frame = 0;
     this._stats_frame = 0;
     this._transactions = {};
+    // function-id -> { tid, handler } of the calls whose responses keep
+    // coming, like subscribe_stats
+    this._subscriptions = {};
     this._tid = 0;
     // The spec the client used on the previous get_updates poll. The
     // library remembers it so the caller only has to pass the spec they
@@ -1675,6 +1691,367 @@
     this._socket.send(call);
   };
 
+  // Returns the names and types of the web UI's own metrics (as opposed to
+  // libtorrent's session stats), keyed by name. The id of a metric is its
+  // index into the values returned by get_metrics.
+  libtorrent_connection.prototype["list_metrics"] = function (callback) {
+    if (this._socket.readyState != WebSocket.OPEN) {
+      window.setTimeout(function () {
+        callback("socket closed");
+      }, 0);
+      return;
+    }
+
+    var tid = this._tid++;
+    if (this._tid > 65535) this._tid = 0;
+
+    var self = this;
+    this._transactions[tid] = function (view, fun, e) {
+      if (_check_error(e, callback)) return;
+
+      var num_metrics = view.getUint16(4);
+
+      self._metrics = [];
+
+      var offset = 6;
+      var ret = {};
+      for (var i = 0; i < num_metrics; ++i) {
+        var type = view.getUint8(offset);
+        var [name, len] = read_string8(view, offset + 1);
+        ret[name] = { type: type, id: i };
+        self._metrics[i] = name;
+        offset += 2 + len;
+      }
+      if (typeof callback !== "undefined") callback(ret);
+    };
+
+    var call = new ArrayBuffer(3);
+    var view = new DataView(call);
+    // function 27
+    view.setUint8(0, 27);
+    view.setUint16(1, tid);
+
+    this._socket.send(call);
+  };
+
+  // Returns the current values of all metrics, keyed by name. Metrics
+  // registered after the last call to list_metrics are keyed by id.
+  libtorrent_connection.prototype["get_metrics"] = function (callback) {
+    if (this._socket.readyState != WebSocket.OPEN) {
+      window.setTimeout(function () {
+        callback("socket closed");
+      }, 0);
+      return;
+    }
+
+    var tid = this._tid++;
+    if (this._tid > 65535) this._tid = 0;
+
+    var self = this;
+    this._transactions[tid] = function (view, fun, e) {
+      if (_check_error(e, callback)) return;
+
+      var num_metrics = view.getUint16(4);
+      var offset = 6;
+      var ret = {};
+      for (var i = 0; i < num_metrics; ++i) {
+        var name =
+          self._metrics != null && i < self._metrics.length
+            ? self._metrics[i]
+            : i;
+        ret[name] = read_uint64(view, offset);
+        offset += 8;
+      }
+      if (typeof callback !== "undefined") callback(ret);
+    };
+
+    var call = new ArrayBuffer(3);
+    var view = new DataView(call);
+    // function 28
+    view.setUint8(0, 28);
+    view.setUint16(1, tid);
+
+    this._socket.send(call);
+  };
+
+  // Returns the history of the session stats counters in the stats array
+  // (ids, as returned by list_stats), with samples taken between from and to
+  // (milliseconds since the epoch). resolution is 0 for one sample per
+  // second (the last 10 minutes), 1 for one per minute (the last day) and 2
+  // for one per hour (the last week). The result is an array of samples,
+  // oldest first, each with a 'time' field (milliseconds since the epoch)
+  // and the values keyed by counter name.
+  libtorrent_connection.prototype["get_stats_history"] = function (
+    stats,
+    resolution,
+    from,
+    to,
+    callback,
+  ) {
+    if (this._socket.readyState != WebSocket.OPEN) {
+      window.setTimeout(function () {
+        callback("socket closed");
+      }, 0);
+      return;
+    }
+
+    if (this._stats == null) {
+      window.setTimeout(function () {
+        callback("need to call list_stats first");
+      }, 0);
+      return;
+    }
+
+    var tid = this._tid++;
+    if (this._tid > 65535) this._tid = 0;
+
+    var self = this;
+    this._transactions[tid] = function (view, fun, e) {
+      if (_check_error(e, callback)) return;
+
+      var num_samples = view.getUint32(4);
+      var num_stats = view.getUint16(8);
+      var offset = 10;
+      var ret = [];
+      for (var i = 0; i < num_samples; ++i) {
+        var sample = { time: read_uint64(view, offset) };
+        offset += 8;
+        for (var k = 0; k < num_stats; ++k) {
+          sample[self._stats[stats[k]]] = read_uint64(view, offset);
+          offset += 8;
+        }
+        ret.push(sample);
+      }
+      if (typeof callback !== "undefined") callback(ret);
+    };
+
+    var call = new ArrayBuffer(3 + 1 + 8 + 8 + 2 + stats.length * 2);
+    var view = new DataView(call);
+    // function 29
+    view.setUint8(0, 29);
+    view.setUint16(1, tid);
+    view.setUint8(3, resolution);
+    write_uint64(view, 4, from);
+    write_uint64(view, 12, to);
+    view.setUint16(20, stats.length);
+
+    var offset = 22;
+    for (var i = 0; i < stats.length; ++i) {
+      view.setUint16(offset, stats[i]);
+      offset += 2;
+    }
+
+    this._socket.send(call);
+  };
+
+  // Subscribes to updates of the session stats counters in the stats array
+  // (ids, as returned by list_stats). The callback is first called with the
+  // current values of all the counters, and then every time some of them
+  // change, with the ones that changed. Values are keyed by counter name. A
+  // new subscription replaces the previous one, and subscribing to an empty
+  // array cancels it.
+  libtorrent_connection.prototype["subscribe_stats"] = function (
+    stats,
+    callback,
+  ) {
+    if (this._socket.readyState != WebSocket.OPEN) {
+      window.setTimeout(function () {
+        callback("socket closed");
+      }, 0);
+      return;
+    }
+
+    if (this._stats == null) {
+      window.setTimeout(function () {
+        callback("need to call list_stats first");
+      }, 0);
+      return;
+    }
+
+    var tid = this._tid++;
+    if (this._tid > 65535) this._tid = 0;
+
+    var self = this;
+    var handler = function (view, fun, e) {
+      if (_check_error(e, callback)) {
+        delete self._subscriptions[30];
+        return;
+      }
+
+      self._stats_frame = view.getUint32(4);
+
+      var num_updates = view.getUint16(8);
+      var offset = 10;
+
+      var ret = {};
+      for (var i = 0; i < num_updates; ++i) {
+        var id = view.getUint16(offset);
+        var val = read_uint64(view, offset + 2);
+        offset += 10;
+        ret[self._stats[id]] = val;
+      }
+      if (typeof callback !== "undefined") callback(ret);
+    };
+    if (stats.length > 0) {
+      this._subscriptions[30] = { tid: tid, handler: handler };
+    } else {
+      delete this._subscriptions[30];
+    }
+
+    var call = new ArrayBuffer(3 + 2 + stats.length * 2);
+    var view = new DataView(call);
+    // function 30
+    view.setUint8(0, 30);
+    view.setUint16(1, tid);
+    view.setUint16(3, stats.length);
+
+    var offset = 5;
+    for (var i = 0; i < stats.length; ++i) {
+      view.setUint16(offset, stats[i]);
+      offset += 2;
+    }
+
+    this._socket.send(call);
+  };
+
+  // Returns the history of the transfer rates, number of peers and progress
+  // of the torrent ih, with samples taken between from and to (milliseconds
+  // since the epoch). resolution is 0 for one sample per second (the last 10
+  // minutes), 1 for one per 5 minutes (the last day) and 2 for one per hour
+  // (the last 30 days). The result is an array of samples, oldest first.
+  // Progress is in parts per million.
+  libtorrent_connection.prototype["get_torrent_series"] = function (
+    ih,
+    resolution,
+    from,
+    to,
+    callback,
+  ) {
+    if (this._socket.readyState != WebSocket.OPEN) {
+      window.setTimeout(function () {
+        callback("socket closed");
+      }, 0);
+      return;
+    }
+
+    var tid = this._tid++;
+    if (this._tid > 65535) this._tid = 0;
+
+    this._transactions[tid] = function (view, fun, e) {
+      if (_check_error(e, callback)) return;
+
+      var num_samples = view.getUint32(4);
+      var offset = 8;
+      var ret = [];
+      for (var i = 0; i < num_samples; ++i) {
+        ret.push({
+          time: read_uint64(view, offset),
+          download_rate: view.getUint32(offset + 8),
+          upload_rate: view.getUint32(offset + 12),
+          num_peers: view.getUint32(offset + 16),
+          progress: view.getUint32(offset + 20),
+        });
+        offset += 24;
+      }
+      if (typeof callback !== "undefined") callback(ret);
+    };
+
+    // 3 header + 20 info-hash + 1 resolution + 8 from + 8 to = 40 bytes
+    var call = new ArrayBuffer(40);
+    var view = new DataView(call);
+    // function 31
+    view.setUint8(0, 31);
+    view.setUint16(1, tid);
+
+    var offset = write_infohash(view, 3, ih);
+    view.setUint8(offset, resolution);
+    write_uint64(view, offset + 1, from);
+    write_uint64(view, offset + 9, to);
+
+    this._socket.send(call);
+  };
+
+  // Returns statistics of the alerts dispatched to the observers in the
+  // server: how many of each type, how long each observer takes to handle a
+  // batch (with a histogram of the time, in power of 2 microsecond buckets),
+  // and the observer that was slowest the last time alerts were dropped.
+  libtorrent_connection.prototype["get_alert_stats"] = function (callback) {
+    if (this._socket.readyState != WebSocket.OPEN) {
+      window.setTimeout(function () {
+        callback("socket closed");
+      }, 0);
+      return;
+    }
+
+    var tid = this._tid++;
+    if (this._tid > 65535) this._tid = 0;
+
+    this._transactions[tid] = function (view, fun, e) {
+      if (_check_error(e, callback)) return;
+
+      var ret = {
+        batches: read_uint64(view, 4),
+        last_batch_size: view.getUint32(12),
+        max_batch_size: view.getUint32(16),
+        pop_wait_us: read_uint64(view, 20),
+        observer_wait_us: read_uint64(view, 28),
+        types: [],
+        observers: [],
+      };
+
+      var num_types = view.getUint16(36);
+      var offset = 38;
+      for (var i = 0; i < num_types; ++i) {
+        var type = {
+          type: view.getUint16(offset),
+          count: read_uint64(view, offset + 2),
+          rate: view.getUint32(offset + 10),
+          dropped: read_uint64(view, offset + 14),
+        };
+        var [name, len] = read_string8(view, offset + 22);
+        type.name = name;
+        offset += 23 + len;
+        ret.types.push(type);
+      }
+
+      var num_observers = view.getUint16(offset);
+      offset += 2;
+      for (var i = 0; i < num_observers; ++i) {
+        var [name, len] = read_string8(view, offset);
+        offset += 1 + len;
+        var observer = {
+          name: name,
+          batches: read_uint64(view, offset),
+          alerts: read_uint64(view, offset + 8),
+          total_us: read_uint64(view, offset + 16),
+          max_us: view.getUint32(offset + 24),
+          last_us: view.getUint32(offset + 28),
+          histogram: [],
+        };
+        var num_buckets = view.getUint8(offset + 32);
+        offset += 33;
+        for (var j = 0; j < num_buckets; ++j) {
+          observer.histogram.push(read_uint64(view, offset));
+          offset += 8;
+        }
+        ret.observers.push(observer);
+      }
+
+      var [slowest, len] = read_string8(view, offset);
+      ret.slowest_at_drop = slowest;
+
+      if (typeof callback !== "undefined") callback(ret);
+    };
+
+    var call = new ArrayBuffer(3);
+    var view = new DataView(call);
+    // function 32
+    view.setUint8(0, 32);
+    view.setUint16(1, tid);
+
+    this._socket.send(call);
+  };
+
   libtorrent_connection.prototype["close"] = function () {
     this._socket.close();
   };
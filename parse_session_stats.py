@@ -30,6 +30,8 @@
 
 # this script can parse and generate reports from the session_stats logs
 # produced by the stats_logging.cpp class.
+# The logs are binary, convert them to text with stats_export first:
+#   stats_export session_stats/<pid>.0000.stats > stats.log
 
 import os, sys, time, os, math
 from multiprocessing.pool import ThreadPool
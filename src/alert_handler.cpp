@@ -12,56 +12,450 @@ see LICENSE file.
 #include "libtorrent/settings_pack.hpp"
 
 #include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <exception>
 #include <mutex>
 #include <memory>
 #include <condition_variable>
 
 #include "alert_handler.hpp"
 #include "alert_observer.hpp"
+#include "metrics.hpp"
 
 namespace ltweb {
 
-alert_handler::alert_handler(lt::session& ses)
-	: m_abort(false)
+namespace {
+std::uint64_t to_us(lt::time_duration const d)
+{
+	auto const us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+	return std::uint64_t(std::max(std::int64_t(us), std::int64_t(0)));
+}
+
+void store_max(std::atomic<std::uint64_t>& v, std::uint64_t const n)
+{
+	std::uint64_t prev = v.load(std::memory_order_relaxed);
+	while (prev < n && !v.compare_exchange_weak(prev, n, std::memory_order_relaxed)) {
+	}
+}
+} // anonymous namespace
+
+alert_handler::alert_handler(lt::session& ses, dispatch_mode const mode)
+	: m_mode(mode)
+	, m_rate_time(lt::clock_type::now())
+	, m_dispatched_metric(
+		  global_metrics().register_metric("alerts.dispatched", metric_type::counter)
+	  )
+	, m_dropped_metric(global_metrics().register_metric("alerts.dropped", metric_type::counter))
+	, m_batches_metric(global_metrics().register_metric("alerts.batches", metric_type::counter))
+	, m_batch_size_metric(
+		  global_metrics().register_metric("alerts.batch_size", metric_type::gauge)
+	  )
+	, m_pop_wait_metric(
+		  global_metrics().register_metric("alerts.pop_wait_us", metric_type::counter)
+	  )
+	, m_observer_wait_metric(
+		  global_metrics().register_metric("alerts.observer_wait_us", metric_type::counter)
+	  )
+	, m_abort(false)
 	, m_ses(ses)
 {
 }
 
-void alert_handler::dispatch_alerts(std::vector<lt::alert*>& alerts) const
+alert_handler::~alert_handler()
+{
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		for (auto& w : m_workers)
+			w->stop = true;
+	}
+	m_worker_cond.notify_all();
+	for (auto& w : m_workers)
+		w->thread.join();
+}
+
+void alert_handler::dispatch_alerts(std::vector<lt::alert*>& alerts)
 {
+	if (m_mode == dispatch_mode::threaded) {
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_done_cond.wait(l, [this] { return batch_done(); });
+		count_batch(alerts);
+		m_batch.swap(alerts);
+		start_batch();
+		m_done_cond.wait(l, [this] { return batch_done(); });
+		m_batch.clear();
+		alerts.clear();
+		return;
+	}
+
+	// observers may unsubscribe while we're looping. They are only removed
+	// from the lists once we're done, so there's no need to copy them
+	struct dispatch_guard {
+		explicit dispatch_guard(alert_handler& h)
+			: handler(h)
+		{
+			++handler.m_dispatch_depth;
+		}
+		~dispatch_guard()
+		{
+			if (--handler.m_dispatch_depth == 0 && handler.m_unsubscribed)
+				handler.remove_unsubscribed();
+		}
+		alert_handler& handler;
+	} guard(*this);
+
+	if (alerts.empty()) return;
+	count_batch(alerts);
+
+	// observers subscribing while we're looping are appended, and don't get
+	// this batch. The list may be reallocated, so it's indexed. An observer
+	// unsubscribing (and going away) clears its entry. The time of each call
+	// is added up per observer, with one clock read per call
+	std::size_t const num_observers = m_observers.size();
+	lt::time_point t = lt::clock_type::now();
 	for (lt::alert* a : alerts) {
-		int const type = a->type();
+		std::size_t const type = std::size_t(a->type());
+		for (std::size_t i = 0; i < num_observers; ++i) {
+			alert_observer* o = m_observers[i];
+			if (o == nullptr || !o->types[type]) continue;
+			// the counters outlive the observer
+			observer_counters& c = *o->counters;
+			o->handle_alert(a);
+			lt::time_point const now = lt::clock_type::now();
+			c.batch_time += now - t;
+			++c.batch_alerts;
+			c.batch_called = true;
+			t = now;
+		}
+	}
 
-		// copy this vector since handlers may unsubscribe while we're looping
-		std::vector<alert_observer*> alert_dispatchers = m_observers[type];
-		for (auto* h : alert_dispatchers)
-			h->handle_alert(a);
+	for (std::size_t i = 0; i < num_observers; ++i) {
+		alert_observer* o = m_observers[i];
+		if (o == nullptr || !(o->flags & batch_end)) continue;
+		observer_counters& c = *o->counters;
+		o->alerts_dispatched();
+		lt::time_point const now = lt::clock_type::now();
+		c.batch_time += now - t;
+		c.batch_called = true;
+		t = now;
+	}
+
+	// observers sharing a name share their counters, and the batch is
+	// recorded once for all of them. The counters of observers that
+	// unsubscribed during the batch are still here
+	std::lock_guard<std::mutex> l(m_stats_mutex);
+	for (auto const& c : m_observer_counters) {
+		if (!c->batch_called) continue;
+		record_batch(*c, c->batch_time, c->batch_alerts);
+		c->batch_time = lt::time_duration(0);
+		c->batch_alerts = 0;
+		c->batch_called = false;
 	}
 	alerts.clear();
 }
 
-void alert_handler::dispatch_alerts(lt::time_duration const max_wait) const
+void alert_handler::dispatch_batch(
+	alert_observer* o,
+	std::bitset<256> const& types,
+	int const flags,
+	std::vector<lt::alert*> const& alerts
+)
+{
+	observer_counters& c = *o->counters;
+	lt::time_point const start = lt::clock_type::now();
+	std::int64_t num_alerts = 0;
+	for (lt::alert* a : alerts) {
+		if (!types[std::size_t(a->type())]) continue;
+		o->handle_alert(a);
+		++num_alerts;
+	}
+	bool const batch_end_call = flags & batch_end;
+	if (batch_end_call) o->alerts_dispatched();
+	if (num_alerts > 0 || batch_end_call)
+		record_batch(c, lt::clock_type::now() - start, num_alerts);
+}
+
+void alert_handler::count_batch(std::vector<lt::alert*> const& alerts)
 {
-	std::vector<lt::alert*> alert_queue;
-	if (m_ses.wait_for_alert(max_wait) == nullptr) return;
+	if (alerts.empty()) return;
+	for (lt::alert* a : alerts) {
+		m_type_counts[std::size_t(a->type())].fetch_add(1, std::memory_order_relaxed);
+		if (auto const* d = lt::alert_cast<lt::alerts_dropped_alert>(a)) alerts_dropped(*d);
+	}
+
+	std::uint64_t const size = alerts.size();
+	m_batches.fetch_add(1, std::memory_order_relaxed);
+	m_last_batch_size.store(size, std::memory_order_relaxed);
+	store_max(m_max_batch_size, size);
+	metrics& mx = global_metrics();
+	mx.inc(m_dispatched_metric, std::int64_t(size));
+	mx.inc(m_batches_metric);
+	mx.set(m_batch_size_metric, std::int64_t(size));
 
-	m_ses.pop_alerts(&alert_queue);
-	dispatch_alerts(alert_queue);
+	lt::time_point const now = lt::clock_type::now();
+	auto const ms =
+		std::chrono::duration_cast<std::chrono::milliseconds>(now - m_rate_time).count();
+	if (ms < 1000) return;
+	for (std::size_t t = 0; t < m_type_counts.size(); ++t) {
+		std::uint64_t const count = m_type_counts[t].load(std::memory_order_relaxed);
+		m_type_rates[t].store(
+			(count - m_rate_counts[t]) * 1000 / std::uint64_t(ms), std::memory_order_relaxed
+		);
+		m_rate_counts[t] = count;
+	}
+	m_rate_time = now;
+}
+
+void alert_handler::record_batch(
+	observer_counters& c, lt::time_duration const t, std::int64_t const alerts
+)
+{
+	std::uint64_t const us = to_us(t);
+	c.batches.fetch_add(1, std::memory_order_relaxed);
+	c.alerts.fetch_add(std::uint64_t(alerts), std::memory_order_relaxed);
+	c.total_us.fetch_add(us, std::memory_order_relaxed);
+	c.last_us.store(us, std::memory_order_relaxed);
+	store_max(c.max_us, us);
+	int const bucket = std::min(int(std::bit_width(us)), observer_histogram_buckets - 1);
+	c.histogram[std::size_t(bucket)].fetch_add(1, std::memory_order_relaxed);
+	global_metrics().inc(c.metric, std::int64_t(us));
+}
+
+void alert_handler::alerts_dropped(lt::alerts_dropped_alert const& a)
+{
+	global_metrics().inc(m_dropped_metric);
+
+	std::string types;
+	std::size_t const num_types = std::min(a.dropped_alerts.size(), m_type_dropped.size());
+	for (std::size_t t = 0; t < num_types; ++t) {
+		if (!a.dropped_alerts[t]) continue;
+		m_type_dropped[t].fetch_add(1, std::memory_order_relaxed);
+		if (!types.empty()) types += ", ";
+		types += lt::alert_name(int(t));
+	}
+
+	// the observer holding up the alert queue is most likely the one that
+	// was slowest to handle its last batch
+	std::lock_guard<std::mutex> l(m_stats_mutex);
+	observer_counters const* slowest = nullptr;
+	for (auto const& c : m_observer_counters) {
+		if (slowest == nullptr
+			|| c->last_us.load(std::memory_order_relaxed)
+				> slowest->last_us.load(std::memory_order_relaxed))
+			slowest = c.get();
+	}
+	m_slowest_at_drop = slowest ? slowest->name : std::string();
+	std::fprintf(
+		stderr,
+		"the alert queue overflowed, alerts were dropped: %s. Slowest observer: %s (%d us on "
+		"its last batch)\n",
+		types.c_str(),
+		slowest ? slowest->name.c_str() : "none",
+		slowest ? int(slowest->last_us.load(std::memory_order_relaxed)) : 0
+	);
+}
+
+alert_stats alert_handler::stats() const
+{
+	alert_stats ret;
+	for (std::size_t t = 0; t < m_type_counts.size(); ++t) {
+		std::uint64_t const count = m_type_counts[t].load(std::memory_order_relaxed);
+		std::uint64_t const dropped = m_type_dropped[t].load(std::memory_order_relaxed);
+		if (count == 0 && dropped == 0) continue;
+		ret.types.push_back(
+			{int(t), count, m_type_rates[t].load(std::memory_order_relaxed), dropped}
+		);
+	}
+
+	ret.batches = m_batches.load(std::memory_order_relaxed);
+	ret.last_batch_size = m_last_batch_size.load(std::memory_order_relaxed);
+	ret.max_batch_size = m_max_batch_size.load(std::memory_order_relaxed);
+	ret.pop_wait_us = m_pop_wait_us.load(std::memory_order_relaxed);
+	ret.observer_wait_us = m_observer_wait_us.load(std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> l(m_stats_mutex);
+	for (auto const& c : m_observer_counters) {
+		alert_stats::observer o;
+		o.name = c->name;
+		o.batches = c->batches.load(std::memory_order_relaxed);
+		o.alerts = c->alerts.load(std::memory_order_relaxed);
+		o.total_us = c->total_us.load(std::memory_order_relaxed);
+		o.max_us = c->max_us.load(std::memory_order_relaxed);
+		o.last_us = c->last_us.load(std::memory_order_relaxed);
+		for (std::size_t i = 0; i < o.histogram.size(); ++i)
+			o.histogram[i] = c->histogram[i].load(std::memory_order_relaxed);
+		ret.observers.push_back(std::move(o));
+	}
+	ret.slowest_at_drop = m_slowest_at_drop;
+	return ret;
+}
+
+observer_counters* alert_handler::counters_for(alert_observer const* o)
+{
+	std::string name = o->observer_name();
+	std::lock_guard<std::mutex> l(m_stats_mutex);
+	for (auto const& c : m_observer_counters)
+		if (c->name == name) return c.get();
+
+	auto c = std::make_unique<observer_counters>();
+	c->metric =
+		global_metrics().register_metric("alerts.observer_us." + name, metric_type::counter);
+	c->name = std::move(name);
+	m_observer_counters.push_back(std::move(c));
+	return m_observer_counters.back().get();
+}
+
+void alert_handler::remove_unsubscribed()
+{
+	m_observers.erase(
+		std::remove(m_observers.begin(), m_observers.end(), nullptr), m_observers.end()
+	);
+	m_unsubscribed = false;
+}
+
+void alert_handler::dispatch_alerts(lt::time_duration const max_wait)
+{
+	if (m_mode == dispatch_mode::threaded) {
+		lt::time_point const start = lt::clock_type::now();
+		std::unique_lock<std::mutex> l(m_mutex);
+		bool const done = m_done_cond.wait_for(l, max_wait, [this] { return batch_done(); });
+		l.unlock();
+		lt::time_point const observers_done = lt::clock_type::now();
+		m_observer_wait_us.fetch_add(to_us(observers_done - start), std::memory_order_relaxed);
+		global_metrics().inc(m_observer_wait_metric, std::int64_t(to_us(observers_done - start)));
+		if (!done) return;
+
+		lt::time_duration const left = max_wait - (observers_done - start);
+		bool const got_alerts =
+			m_ses.wait_for_alert(std::max(left, lt::time_duration(0))) != nullptr;
+		std::uint64_t const waited = to_us(lt::clock_type::now() - observers_done);
+		m_pop_wait_us.fetch_add(waited, std::memory_order_relaxed);
+		global_metrics().inc(m_pop_wait_metric, std::int64_t(waited));
+		if (!got_alerts) return;
+
+		// this is the only thread starting batches, so the workers are still
+		// done with the previous one
+		l.lock();
+		m_ses.pop_alerts(&m_batch);
+		count_batch(m_batch);
+		start_batch();
+		return;
+	}
+
+	lt::time_point const start = lt::clock_type::now();
+	bool const got_alerts = m_ses.wait_for_alert(max_wait) != nullptr;
+	std::uint64_t const waited = to_us(lt::clock_type::now() - start);
+	m_pop_wait_us.fetch_add(waited, std::memory_order_relaxed);
+	global_metrics().inc(m_pop_wait_metric, std::int64_t(waited));
+	if (!got_alerts) return;
+
+	m_ses.pop_alerts(&m_alert_queue);
+	dispatch_alerts(m_alert_queue);
+}
+
+void alert_handler::start_batch()
+{
+	++m_batch_seq;
+	m_batch_pending = int(m_workers.size());
+	m_worker_cond.notify_all();
+}
+
+void alert_handler::worker_thread(worker& w)
+{
+	std::unique_lock<std::mutex> l(m_mutex);
+	for (;;) {
+		m_worker_cond.wait(l, [&] {
+			if (w.done == m_batch_seq) return w.stop;
+			return std::all_of(w.dependencies.begin(), w.dependencies.end(), [&](worker* d) {
+				return d->done == m_batch_seq;
+			});
+		});
+		// the batch we were given is finished before stopping
+		if (w.done == m_batch_seq) break;
+
+		// m_batch is left alone until every worker is done with it. The
+		// subscription may change while we're dispatching
+		std::bitset<256> const types = w.observer->types;
+		int const flags = w.observer->flags;
+		l.unlock();
+		try {
+			if (!m_batch.empty()) dispatch_batch(w.observer, types, flags, m_batch);
+		} catch (std::exception const& e) {
+			std::fprintf(stderr, "alert observer failed: %s\n", e.what());
+		}
+		l.lock();
+
+		w.done = m_batch_seq;
+		if (--m_batch_pending == 0) m_done_cond.notify_all();
+		// wakes up the workers depending on this one
+		m_worker_cond.notify_all();
+	}
+}
+
+void alert_handler::dispatch_after(alert_observer* after, alert_observer* before)
+{
+	// in caller mode, observers are called in the order they appear in
+	// m_observers. Move `after` behind `before`
+	auto const bi = std::find(m_observers.begin(), m_observers.end(), before);
+	auto const ai = std::find(m_observers.begin(), m_observers.end(), after);
+	if (ai != m_observers.end() && bi != m_observers.end() && ai < bi)
+		std::rotate(ai, ai + 1, bi + 1);
+
+	std::lock_guard<std::mutex> l(m_mutex);
+	auto const find_worker = [this](alert_observer* o) -> worker* {
+		for (auto& w : m_workers)
+			if (w->observer == o) return w.get();
+		return nullptr;
+	};
+	worker* const a = find_worker(after);
+	worker* const b = find_worker(before);
+	TORRENT_ASSERT((a == nullptr) == (b == nullptr));
+	if (a == nullptr || b == nullptr) return;
+	if (std::find(a->dependencies.begin(), a->dependencies.end(), b) == a->dependencies.end())
+		a->dependencies.push_back(b);
 }
 
 void alert_handler::unsubscribe(alert_observer* o)
 {
-	for (int i = 0; i < o->num_types; ++i) {
-		int const type = o->types[i];
-		if (type == 0) continue;
-		TORRENT_ASSERT(type >= 0);
-		TORRENT_ASSERT(type < int(m_observers.size()));
-		if (type < 0 || type >= int(m_observers.size())) continue;
-		auto& alert_observers = m_observers[type];
-		auto j = std::find(alert_observers.begin(), alert_observers.end(), o);
-		if (j != alert_observers.end()) alert_observers.erase(j);
+	if (m_mode == dispatch_mode::threaded) {
+		std::unique_ptr<worker> w;
+		{
+			std::lock_guard<std::mutex> l(m_mutex);
+			auto const i = std::find_if(m_workers.begin(), m_workers.end(), [o](auto const& e) {
+				return e->observer == o;
+			});
+			if (i != m_workers.end()) {
+				w = std::move(*i);
+				m_workers.erase(i);
+				w->stop = true;
+				// the observers it depends on may go away before its thread
+				// has stopped
+				w->dependencies.clear();
+				for (auto& e : m_workers) {
+					auto& deps = e->dependencies;
+					deps.erase(std::remove(deps.begin(), deps.end(), w.get()), deps.end());
+				}
+			}
+		}
+		if (w) {
+			TORRENT_ASSERT(w->thread.get_id() != std::this_thread::get_id());
+			m_worker_cond.notify_all();
+			// if the worker still has a batch to handle, m_batch_pending
+			// counts it. It finishes the batch before stopping
+			w->thread.join();
+		}
+	}
+
+	o->types.reset();
+	auto const j = std::find(m_observers.begin(), m_observers.end(), o);
+	if (j == m_observers.end()) return;
+	if (m_dispatch_depth > 0) {
+		*j = nullptr;
+		m_unsubscribed = true;
+	} else {
+		m_observers.erase(j);
 	}
-	o->num_types = 0;
 }
 
 void alert_handler::subscribe_impl(
@@ -71,21 +465,38 @@ void alert_handler::subscribe_impl(
 	lt::alert_category_t const cats
 )
 {
-	o->types.fill(0);
-	o->flags = flags;
+	std::bitset<256> mask;
 	for (int const type : types) {
 		if (type == 0) break;
-
-		// only subscribe once per observer per type
-		if (std::count(o->types.data(), o->types.data() + o->num_types, type) > 0) continue;
-
 		TORRENT_ASSERT(type >= 0);
-		TORRENT_ASSERT(type < int(m_observers.size()));
-		if (type < 0 || type >= int(m_observers.size())) continue;
+		TORRENT_ASSERT(type < lt::num_alert_types);
+		if (type < 0 || type >= lt::num_alert_types) continue;
+		mask.set(std::size_t(type));
+	}
+
+	if (o->counters == nullptr) o->counters = counters_for(o);
+	if (std::find(m_observers.begin(), m_observers.end(), o) == m_observers.end())
+		m_observers.push_back(o);
 
-		o->types[o->num_types++] = type;
-		m_observers[type].push_back(o);
-		TORRENT_ASSERT(o->num_types < 64);
+	if (m_mode == dispatch_mode::caller) {
+		o->types = mask;
+		o->flags = flags;
+	} else {
+		// the worker reads the subscription with m_mutex held
+		std::lock_guard<std::mutex> l(m_mutex);
+		o->types = mask;
+		o->flags = flags;
+		auto const i = std::find_if(m_workers.begin(), m_workers.end(), [o](auto const& e) {
+			return e->observer == o;
+		});
+		if (i == m_workers.end()) {
+			m_workers.push_back(std::make_unique<worker>());
+			worker& w = *m_workers.back();
+			w.observer = o;
+			// a batch already started is not handed to a new observer
+			w.done = m_batch_seq;
+			w.thread = std::thread(&alert_handler::worker_thread, this, std::ref(w));
+		}
 	}
 
 	lt::alert_category_t const new_mask = m_subscribed_categories | cats;
@@ -16,18 +16,124 @@ see LICENSE file.
 #include <deque>
 #include <future>
 #include <array>
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <cstdint>
+#include <string>
+#include <thread>
 #include "libtorrent/fwd.hpp"
 #include "libtorrent/alert.hpp" // for alert_category_t
 #include "libtorrent/alert_types.hpp" // for num_alert_types
 #include "libtorrent/span.hpp"
+#include "libtorrent/time.hpp"
 
 namespace ltweb {
 
 struct alert_observer;
 
+// the number of buckets of the observer time histograms. Bucket i counts
+// the batches an observer took less than 2^i microseconds to handle, but at
+// least 2^(i-1). The last bucket counts the slower ones too
+constexpr int observer_histogram_buckets = 20;
+
+// the time spent by an observer, or by all observers sharing a name. The
+// thread dispatching alerts to the observer updates them, while they may
+// be read by others
+struct observer_counters {
+	std::string name;
+
+	// the number of batches of alerts the observer handled, and of alerts
+	std::atomic<std::uint64_t> batches{0};
+	std::atomic<std::uint64_t> alerts{0};
+
+	// microseconds spent in handle_alert() and alerts_dispatched(), in
+	// total, the most for a single batch, and for the last batch
+	std::atomic<std::uint64_t> total_us{0};
+	std::atomic<std::uint64_t> max_us{0};
+	std::atomic<std::uint64_t> last_us{0};
+
+	std::array<std::atomic<std::uint64_t>, observer_histogram_buckets> histogram{};
+
+	// the index of the observer's alerts.observer_us metric
+	int metric = 0;
+
+	// the time and the number of alerts of the batch being dispatched, and
+	// whether the observer was called for it, in caller mode. Only accessed
+	// by the dispatching thread
+	lt::time_duration batch_time{0};
+	std::int64_t batch_alerts = 0;
+	bool batch_called = false;
+};
+
+// a snapshot of the alert handler statistics
+struct alert_stats {
+	struct alert_type {
+		int type;
+		// the number of alerts of this type dispatched
+		std::uint64_t count;
+		// alerts per second, over the last second or more
+		std::uint64_t rate;
+		// the number of times the session reported dropping alerts of this
+		// type, because its alert queue was full. How many were dropped each
+		// time isn't known
+		std::uint64_t dropped;
+	};
+	struct observer {
+		std::string name;
+		std::uint64_t batches;
+		std::uint64_t alerts;
+		std::uint64_t total_us;
+		std::uint64_t max_us;
+		std::uint64_t last_us;
+		std::array<std::uint64_t, observer_histogram_buckets> histogram;
+	};
+
+	// the alert types that have been dispatched or dropped
+	std::vector<alert_type> types;
+	std::vector<observer> observers;
+
+	// the number of batches popped from the session, the size of the last
+	// one and of the largest one
+	std::uint64_t batches = 0;
+	std::uint64_t last_batch_size = 0;
+	std::uint64_t max_batch_size = 0;
+
+	// microseconds spent waiting for alerts, and (in threaded mode) for
+	// the observers to finish the previous batch before popping the next
+	std::uint64_t pop_wait_us = 0;
+	std::uint64_t observer_wait_us = 0;
+
+	// the observer that took the longest to handle its last batch, when
+	// alerts were last dropped. Empty if none were
+	std::string slowest_at_drop;
+};
+
 // TODO: rename to alert_dispatcher
 struct TORRENT_EXPORT alert_handler {
-	alert_handler(lt::session& ses);
+	// with caller, observers are called one at a time, on the thread calling
+	// dispatch_alerts(), in the order they subscribed. Each alert is passed
+	// to every observer subscribed to it before the next alert is, and once
+	// the batch is done, alerts_dispatched() is called in the same order.
+	//
+	// With threaded, every observer is called on a thread of its own,
+	// concurrently with the other observers. Each observer is passed all its
+	// alerts of a batch, in order, followed by alerts_dispatched(). The
+	// observers must then be safe to call on that thread, and must not
+	// unsubscribe from within handle_alert()
+	enum class dispatch_mode { caller, threaded };
+
+	explicit alert_handler(lt::session& ses, dispatch_mode mode = dispatch_mode::caller);
+
+	// stops the threads of observers that are still subscribed
+	~alert_handler();
+
+	alert_handler(alert_handler const&) = delete;
+	alert_handler& operator=(alert_handler const&) = delete;
+
+	// subscription flags. Observers subscribed with batch_end have
+	// alerts_dispatched() called after each batch of alerts
+	static constexpr int batch_end = 1;
 
 	// subscribes `o` to a set of alert types, given as a list of alert
 	// classes (each must expose the `alert_type` and `static_category`
@@ -44,23 +150,172 @@ struct TORRENT_EXPORT alert_handler {
 		subscribe_impl(lt::span<int const>{types}, o, flags, cats);
 	}
 
-	void dispatch_alerts(std::vector<lt::alert*>& alerts) const;
-	void dispatch_alerts(lt::time_duration max_wait) const;
+	// makes `after` see each alert only once `before` has handled it. In
+	// caller mode, that's alert by alert, and `after` gets alerts_dispatched()
+	// after `before` does. In threaded mode, `after` gets a batch once
+	// `before` has handled all of it, including alerts_dispatched(). For
+	// instance, an observer looking up torrents in torrent_history when they
+	// are added must run after it. Both must already be subscribed, and the
+	// dependencies must not form a cycle. Must not be called from within
+	// handle_alert()
+	void dispatch_after(alert_observer* after, alert_observer* before);
+
+	// dispatches alerts popped from the session by the caller. In threaded
+	// mode, this blocks until all observers are done with them
+	void dispatch_alerts(std::vector<lt::alert*>& alerts);
+
+	// waits at most max_wait for alerts, pops and dispatches them. In
+	// threaded mode, this returns as soon as the alerts are handed to the
+	// observer threads. The alerts are only valid until the next call to
+	// pop_alerts(), so if the observers are still busy with the previous
+	// batch, this waits for them (still at most max_wait) rather than
+	// popping more. The session keeps queuing alerts meanwhile
+	void dispatch_alerts(lt::time_duration max_wait);
+
+	// in threaded mode, this waits for the observer's thread to finish the
+	// batch it's working on, and stops it
 	void unsubscribe(alert_observer* o);
 
 	void abort();
 
+	lt::session& session() const { return m_ses; }
+
+	// may be called from any thread
+	alert_stats stats() const;
+
 private:
 	void subscribe_impl(
 		lt::span<int const> types, alert_observer* o, int flags, lt::alert_category_t cats
 	);
 
-	std::array<std::vector<alert_observer*>, lt::num_alert_types> m_observers;
+	// the thread calling an observer, in threaded mode
+	struct worker {
+		alert_observer* observer = nullptr;
+
+		// the observers that must be done with a batch before this one gets
+		// it
+		std::vector<worker*> dependencies;
+
+		// the sequence number of the last batch this observer is done with
+		std::uint64_t done = 0;
+
+		bool stop = false;
+		std::thread thread;
+	};
+
+	void worker_thread(worker& w);
+
+	// passes the alerts o is subscribed to to it, and calls
+	// alerts_dispatched() if it's subscribed with batch_end, recording the
+	// time it takes. Used in threaded mode
+	void dispatch_batch(
+		alert_observer* o,
+		std::bitset<256> const& types,
+		int flags,
+		std::vector<lt::alert*> const& alerts
+	);
+
+	// returns the counters for observers named like o, creating them if
+	// they don't exist
+	observer_counters* counters_for(alert_observer const* o);
+
+	// updates the alert type counters and rates, and looks for dropped
+	// alerts. Called by the dispatching thread for every batch, before it's
+	// dispatched
+	void count_batch(std::vector<lt::alert*> const& alerts);
+
+	// records the time an observer spent on a batch
+	void record_batch(observer_counters& c, lt::time_duration t, std::int64_t alerts);
+
+	// called when the session reports having dropped alerts
+	void alerts_dropped(lt::alerts_dropped_alert const& a);
+
+	// hands m_batch to the worker threads. Must be called with m_mutex held,
+	// once all workers are done with the previous batch
+	void start_batch();
+
+	// must be called with m_mutex held
+	bool batch_done() const { return m_batch_pending == 0; }
+
+	dispatch_mode const m_mode;
+
+	// removes the entries cleared by unsubscribe() while dispatching
+	void remove_unsubscribed();
+
+	// the subscribed observers, in the order they're called. An observer
+	// unsubscribing while alerts are being dispatched leaves a nullptr
+	// entry, removed once the dispatch is done. That way the list can be
+	// iterated without copying it
+	std::vector<alert_observer*> m_observers;
+
+	// the number of dispatch_alerts() calls on the stack, in caller mode
+	int m_dispatch_depth = 0;
+
+	// set when there are nullptr entries in m_observers
+	bool m_unsubscribed = false;
+
+	// the alerts popped by dispatch_alerts() in caller mode. It's kept to
+	// reuse its allocation
+	std::vector<lt::alert*> m_alert_queue;
 
 	// running OR of every subscriber's category bits. pushed to the
 	// session via apply_settings() whenever it grows.
 	lt::alert_category_t m_subscribed_categories{};
 
+	// the rest is only used in threaded mode, and protected by m_mutex
+	std::vector<std::unique_ptr<worker>> m_workers;
+
+	// the alerts being handled by the workers, and their sequence number.
+	// They're kept until the next pop_alerts()
+	std::vector<lt::alert*> m_batch;
+	std::uint64_t m_batch_seq = 0;
+
+	// the number of workers not done with m_batch yet. A new batch is only
+	// started once this is 0
+	int m_batch_pending = 0;
+
+	std::mutex m_mutex;
+
+	// signals the workers that a batch has started, or that a worker is done
+	// with one (which the workers depending on it wait for)
+	std::condition_variable m_worker_cond;
+
+	// signals the dispatching thread that m_batch_pending reached 0
+	std::condition_variable m_done_cond;
+
+	// the counters of every observer that has been subscribed, by name.
+	// They're kept after the observer unsubscribes. m_stats_mutex protects
+	// the list, the counters are atomic
+	std::vector<std::unique_ptr<observer_counters>> m_observer_counters;
+	mutable std::mutex m_stats_mutex;
+
+	// the number of alerts of each type dispatched, alerts per second, and
+	// the number of times alerts of the type were dropped
+	std::array<std::atomic<std::uint64_t>, lt::num_alert_types> m_type_counts{};
+	std::array<std::atomic<std::uint64_t>, lt::num_alert_types> m_type_rates{};
+	std::array<std::atomic<std::uint64_t>, lt::num_alert_types> m_type_dropped{};
+
+	// the counts as of the last time the rates were computed. Only used by
+	// the dispatching thread
+	std::array<std::uint64_t, lt::num_alert_types> m_rate_counts{};
+	lt::time_point m_rate_time;
+
+	std::atomic<std::uint64_t> m_batches{0};
+	std::atomic<std::uint64_t> m_last_batch_size{0};
+	std::atomic<std::uint64_t> m_max_batch_size{0};
+	std::atomic<std::uint64_t> m_pop_wait_us{0};
+	std::atomic<std::uint64_t> m_observer_wait_us{0};
+
+	// protected by m_stats_mutex
+	std::string m_slowest_at_drop;
+
+	int const m_dispatched_metric;
+	int const m_dropped_metric;
+	int const m_batches_metric;
+	int const m_batch_size_metric;
+	int const m_pop_wait_metric;
+	int const m_observer_wait_metric;
+
 	// when set to true, all outstanding (std::future-based) subscriptions
 	// are cancelled, and new such subscriptions are disabled, by failing
 	// immediately
@@ -12,12 +12,14 @@ see LICENSE file.
 #define LTWEB_ALERT_OBSERVER_HPP_INCLUDED
 
 #include <cstdint>
-#include <array>
+#include <bitset>
 
 #include "libtorrent/fwd.hpp"
 
 namespace ltweb {
 
+struct observer_counters;
+
 struct alert_observer {
 	friend struct alert_handler;
 
@@ -26,10 +28,21 @@ struct alert_observer {
 
 	virtual void handle_alert(lt::alert const* a) = 0;
 
+	// called once the observer has been passed all its alerts among the
+	// ones popped from the session in one go, for observers subscribed with
+	// alert_handler::batch_end. Lets an observer accumulate work in
+	// handle_alert() and do it in bulk
+	virtual void alerts_dispatched() {}
+
+	// identifies the observer in the alert_handler statistics. Observers
+	// with the same name share their statistics
+	virtual char const* observer_name() const { return "unnamed"; }
+
 private:
-	std::array<std::uint8_t, 64> types;
-	int num_types = 0;
+	// the alert types the observer is subscribed to
+	std::bitset<256> types;
 	int flags = 0;
+	observer_counters* counters = nullptr;
 };
 
 } // namespace ltweb
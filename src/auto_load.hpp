@@ -40,6 +40,7 @@ struct auto_load : alert_observer {
 
 private:
 	void handle_alert(lt::alert const* a) override;
+	char const* observer_name() const override { return "auto_load"; }
 	void on_scan(lt::error_code const& ec);
 
 	void thread_fun();
@@ -0,0 +1,195 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "byte_ranges.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+
+namespace ltweb {
+
+namespace {
+
+char const* const weekdays[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+char const* const months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+bool parse_int(std::string_view const s, std::int64_t& out)
+{
+	if (s.empty()) return false;
+	auto const ret = std::from_chars(s.data(), s.data() + s.size(), out);
+	return ret.ec == std::errc{} && ret.ptr == s.data() + s.size() && out >= 0;
+}
+
+} // namespace
+
+range_status
+parse_byte_ranges(std::string_view value, std::int64_t const size, std::vector<byte_range>& ranges)
+{
+	ranges.clear();
+	value = trim(value);
+	if (!starts_with(value, "bytes=")) return range_status::ignored;
+	value.remove_prefix(6);
+
+	bool any_spec = false;
+	std::int64_t total = 0;
+	while (!value.empty()) {
+		auto const [spec_str, rest] = split(value, ',');
+		value = rest;
+		std::string_view const spec = trim(spec_str);
+
+		// empty list elements are allowed
+		if (spec.empty()) continue;
+		if (spec.find('-') == std::string_view::npos) return range_status::ignored;
+		any_spec = true;
+
+		auto const [first_str, last_str] = split(spec, '-');
+		byte_range r{};
+		if (first_str.empty()) {
+			// a suffix range, the last n bytes
+			std::int64_t n = 0;
+			if (!parse_int(last_str, n)) return range_status::ignored;
+			if (n == 0 || size == 0) continue;
+			r = {std::max(size - n, std::int64_t(0)), size - 1};
+		} else {
+			std::int64_t first = 0;
+			std::int64_t last = size - 1;
+			if (!parse_int(first_str, first)) return range_status::ignored;
+			if (!last_str.empty() && (!parse_int(last_str, last) || last < first))
+				return range_status::ignored;
+			if (first >= size) continue;
+			r = {first, std::min(last, size - 1)};
+		}
+
+		ranges.push_back(r);
+		total += r.last - r.first + 1;
+		if (ranges.size() > max_byte_ranges || total > size) {
+			ranges.clear();
+			return range_status::ignored;
+		}
+	}
+
+	if (!any_spec) return range_status::ignored;
+	return ranges.empty() ? range_status::unsatisfiable : range_status::satisfiable;
+}
+
+bool if_range_matches(
+	std::string_view value, std::string_view const etag, std::int64_t const last_modified
+)
+{
+	value = trim(value);
+
+	// weak entity tags never match
+	if (starts_with(value, "\"")) return !etag.empty() && value == etag;
+	if (starts_with(value, "W/")) return false;
+
+	auto const t = parse_http_date(value);
+	return t && last_modified > 0 && *t == last_modified;
+}
+
+std::string http_date(std::int64_t const t)
+{
+	using namespace std::chrono;
+	sys_seconds const tp{seconds(t)};
+	sys_days const day = floor<days>(tp);
+	year_month_day const ymd(day);
+	hh_mm_ss<seconds> const hms(tp - day);
+
+	char buf[64];
+	std::snprintf(
+		buf,
+		sizeof(buf),
+		"%s, %02u %s %04d %02d:%02d:%02d GMT",
+		weekdays[weekday(day).c_encoding()],
+		unsigned(ymd.day()),
+		months[unsigned(ymd.month()) - 1],
+		int(ymd.year()),
+		int(hms.hours().count()),
+		int(hms.minutes().count()),
+		int(hms.seconds().count())
+	);
+	return buf;
+}
+
+std::optional<std::int64_t> parse_http_date(std::string_view s)
+{
+	using namespace std::chrono;
+
+	// Sun, 06 Nov 1994 08:49:37 GMT
+	s = trim(s);
+	if (s.size() != 29 || s.substr(3, 2) != ", " || s.substr(25) != " GMT" || s[7] != ' '
+		|| s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':')
+		return std::nullopt;
+
+	auto const num = [&](std::size_t const pos, std::size_t const len) -> int {
+		std::int64_t v = 0;
+		if (!parse_int(s.substr(pos, len), v)) return -1;
+		return int(v);
+	};
+
+	auto const m = std::find(std::begin(months), std::end(months), s.substr(8, 3));
+	int const d = num(5, 2);
+	int const y = num(12, 4);
+	int const hh = num(17, 2);
+	int const mm = num(20, 2);
+	int const ss = num(23, 2);
+	if (m == std::end(months) || d < 0 || y < 0 || hh < 0 || hh > 23 || mm < 0 || mm > 59
+		|| ss < 0 || ss > 60)
+		return std::nullopt;
+
+	year_month_day const ymd{
+		year(y), month(unsigned(std::distance(std::begin(months), m) + 1)), day(unsigned(d))
+	};
+	if (!ymd.ok()) return std::nullopt;
+
+	return (sys_days(ymd).time_since_epoch() + hours(hh) + minutes(mm) + seconds(ss)) / seconds(1);
+}
+
+std::vector<stream_segment> multipart_byteranges(
+	std::vector<stream_segment> const& body,
+	std::vector<byte_range> const& ranges,
+	std::string_view const content_type,
+	std::string_view const boundary
+)
+{
+	std::int64_t const size = segments_size(body);
+	std::vector<stream_segment> ret;
+	for (std::size_t i = 0; i < ranges.size(); ++i) {
+		byte_range const& r = ranges[i];
+		std::vector<stream_segment> part = body;
+		trim_segments(part, r.first, r.last);
+
+		// the CRLF preceding a boundary is part of the boundary
+		part.front().prefix.insert(
+			0,
+			str(i == 0 ? "" : "\r\n",
+				"--",
+				boundary,
+				"\r\nContent-Type: ",
+				content_type,
+				"\r\nContent-Range: bytes ",
+				r.first,
+				'-',
+				r.last,
+				'/',
+				size,
+				"\r\n\r\n")
+		);
+		std::move(part.begin(), part.end(), std::back_inserter(ret));
+	}
+	ret.push_back({str("\r\n--", boundary, "--\r\n"), -1, 0, 0});
+	return ret;
+}
+
+} // namespace ltweb
@@ -0,0 +1,75 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_BYTE_RANGES_HPP
+#define LTWEB_BYTE_RANGES_HPP
+
+#include "stream_segments.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ltweb {
+
+// an inclusive range of bytes of a response body
+struct byte_range {
+	std::int64_t first;
+	std::int64_t last;
+};
+
+enum class range_status {
+	// there's no valid Range header, send the whole body
+	ignored,
+	// at least one of the ranges overlaps the body
+	satisfiable,
+	// none of the ranges overlap the body, respond with 416
+	unsatisfiable
+};
+
+// the most ranges we accept in a single request. Requests for more are
+// served in full
+constexpr std::size_t max_byte_ranges = 32;
+
+// parse the value of a Range header (RFC 9110 sec. 14.2) for a body of size
+// bytes. Open ended ranges, suffix ranges and ranges extending past the end
+// are clipped to the body. Ranges starting past the end are dropped. A
+// header that's malformed, asks for too many ranges, or for more bytes in
+// total than the body itself (overlapping ranges), is ignored.
+range_status
+parse_byte_ranges(std::string_view value, std::int64_t size, std::vector<byte_range>& ranges);
+
+// returns true if the validator in an If-Range header matches the current
+// representation, i.e. the range request should be honoured. Entity tags are
+// compared strongly, dates must match last_modified exactly
+bool if_range_matches(std::string_view value, std::string_view etag, std::int64_t last_modified);
+
+// format t (seconds since epoch) as an IMF-fixdate,
+// e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+std::string http_date(std::int64_t t);
+
+// parse an IMF-fixdate. The obsolete RFC 850 and asctime formats are not
+// supported
+std::optional<std::int64_t> parse_http_date(std::string_view s);
+
+// returns the segments of a multipart/byteranges body (RFC 9110 sec. 14.6)
+// with the specified ranges of body. Each part is preceded by its
+// Content-Type and Content-Range headers
+std::vector<stream_segment> multipart_byteranges(
+	std::vector<stream_segment> const& body,
+	std::vector<byte_range> const& ranges,
+	std::string_view content_type,
+	std::string_view boundary
+);
+
+} // namespace ltweb
+
+#endif
@@ -0,0 +1,48 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "counter_diff.hpp"
+
+#include <algorithm>
+
+namespace ltweb {
+
+bool diff_counters(
+	std::span<std::int64_t> const values,
+	std::span<std::int64_t const> const current,
+	counter_bitmap& changed
+)
+{
+	std::size_t const n = std::min(values.size(), current.size());
+	changed.assign(counter_bitmap_words(n), 0);
+
+	std::uint64_t any = 0;
+	std::size_t i = 0;
+	for (std::uint64_t& word : changed) {
+		std::size_t const end = std::min(i + 64, n);
+		std::uint64_t bits = 0;
+		for (std::size_t k = i; k < end; ++k)
+			bits |= std::uint64_t(values[k] != current[k]) << (k - i);
+		word = bits;
+		any |= bits;
+		i = end;
+	}
+	if (any) std::copy(current.begin(), current.begin() + std::ptrdiff_t(n), values.begin());
+	return any != 0;
+}
+
+bool intersects(counter_bitmap const& a, counter_bitmap const& b)
+{
+	std::uint64_t any = 0;
+	for (std::size_t i = 0; i < std::min(a.size(), b.size()); ++i)
+		any |= a[i] & b[i];
+	return any != 0;
+}
+
+} // namespace ltweb
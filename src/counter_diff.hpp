@@ -0,0 +1,44 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_COUNTER_DIFF_HPP
+#define LTWEB_COUNTER_DIFF_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace ltweb {
+
+// a bitmap of counters, one bit per counter, 64 counters per word
+using counter_bitmap = std::vector<std::uint64_t>;
+
+inline std::size_t counter_bitmap_words(std::size_t const num_counters)
+{
+	return (num_counters + 63) / 64;
+}
+
+// sets bit i in changed if values[i] differs from current[i], and copies
+// current into values. The two spans must have the same size, and changed
+// must have counter_bitmap_words() words. Returns true if any counter
+// changed.
+//
+// The counters are compared 64 at a time, without branches, which lets the
+// compiler vectorize the comparison.
+bool diff_counters(
+	std::span<std::int64_t> values, std::span<std::int64_t const> current, counter_bitmap& changed
+);
+
+// returns true if any bit is set in both a and b
+bool intersects(counter_bitmap const& a, counter_bitmap const& b);
+
+} // namespace ltweb
+
+#endif
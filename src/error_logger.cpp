@@ -13,11 +13,15 @@ see LICENSE file.
 #include <boost/asio/ssl.hpp>
 
 #include "alert_handler.hpp"
+#include "log_writer.hpp"
 
+#include <cstdarg>
+#include <cstdio>
 #include <string>
 #include <sstream>
-#include <errno.h>
+#include <vector>
 #include <stdlib.h>
+#include <unistd.h>
 
 namespace {
 template <typename Endpoint>
@@ -30,50 +34,98 @@ std::string endpoint_str(Endpoint const& ep)
 } // namespace
 
 namespace ltweb {
-error_logger::error_logger(alert_handler* alerts, std::string const& log_file, bool redirect_stderr)
-	: m_file(NULL)
-	, m_alerts(alerts)
+
+namespace {
+// points stdout and stderr at each new log file
+struct redirect_format : log_file_format {
+	void file_opened(FILE* f) override
+	{
+		fflush(stdout);
+		fflush(stderr);
+		dup2(fileno(f), STDOUT_FILENO);
+		dup2(fileno(f), STDERR_FILENO);
+	}
+
+	// what's printed to stdout and stderr counts towards the size limit
+	bool shared_file() const override { return true; }
+};
+} // anonymous namespace
+
+error_logger::error_logger(
+	alert_handler* alerts,
+	std::string const& log_file,
+	bool const redirect_stderr,
+	std::uint64_t const max_size,
+	int const rate_limit,
+	bool const compress
+)
+	: m_alerts(alerts)
 {
-	if (!log_file.empty()) {
-		m_file = fopen(log_file.c_str(), "a");
-		if (m_file == NULL) {
-			fprintf(
-				stderr,
-				"failed to open error log \"%s\": (%d) %s\n",
-				log_file.c_str(),
-				errno,
-				strerror(errno)
-			);
-		} else if (redirect_stderr) {
-			dup2(fileno(m_file), STDOUT_FILENO);
-			dup2(fileno(m_file), STDERR_FILENO);
-		}
-		m_alerts->subscribe<
-			lt::peer_disconnected_alert,
-			lt::peer_error_alert,
-			lt::save_resume_data_failed_alert,
-			lt::torrent_delete_failed_alert,
-			lt::storage_moved_failed_alert,
-			lt::file_rename_failed_alert,
-			lt::torrent_error_alert,
-			lt::hash_failed_alert,
-			lt::file_error_alert,
-			lt::metadata_failed_alert,
-			lt::udp_error_alert,
-			lt::listen_failed_alert,
-			lt::invalid_request_alert>(this);
+	if (log_file.empty()) return;
+
+	log_sink_config cfg;
+	cfg.file_name = [log_file](int) { return log_file; };
+	cfg.append = true;
+	cfg.max_size = max_size;
+	cfg.rate_limit = rate_limit;
+	cfg.compress = compress;
+	if (redirect_stderr && compress) {
+		std::fprintf(
+			stderr,
+			"stdout and stderr can't be redirected to the compressed error log \"%s\"\n",
+			log_file.c_str()
+		);
+	} else if (redirect_stderr) {
+		cfg.format = std::make_shared<redirect_format>();
 	}
+
+	// the error is printed by the log writer
+	m_sink = global_log_writer().add_sink(std::move(cfg));
+	if (m_sink < 0) return;
+
+	m_alerts->subscribe<
+		lt::peer_disconnected_alert,
+		lt::peer_error_alert,
+		lt::save_resume_data_failed_alert,
+		lt::torrent_delete_failed_alert,
+		lt::storage_moved_failed_alert,
+		lt::file_rename_failed_alert,
+		lt::torrent_error_alert,
+		lt::hash_failed_alert,
+		lt::file_error_alert,
+		lt::metadata_failed_alert,
+		lt::udp_error_alert,
+		lt::listen_failed_alert,
+		lt::invalid_request_alert>(this);
 }
 
 error_logger::~error_logger()
 {
 	m_alerts->unsubscribe(this);
-	if (m_file) fclose(m_file);
+	global_log_writer().close_sink(m_sink);
+}
+
+void error_logger::log_line(char const* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	va_list copy;
+	va_copy(copy, args);
+	int const len = vsnprintf(nullptr, 0, fmt, copy);
+	va_end(copy);
+	if (len > 0) {
+		// vsnprintf writes a terminating null, which isn't logged
+		std::vector<char> line(std::size_t(len) + 1);
+		vsnprintf(line.data(), line.size(), fmt, args);
+		line.pop_back();
+		global_log_writer().write(m_sink, std::move(line));
+	}
+	va_end(args);
 }
 
 void error_logger::handle_alert(lt::alert const* a)
 {
-	if (m_file == NULL) return;
+	if (m_sink < 0) return;
 	time_t now = time(NULL);
 	std::array<char, 256> timestamp;
 	strncpy(timestamp.data(), ctime(&now), timestamp.size());
@@ -91,8 +143,7 @@ void error_logger::handle_alert(lt::alert const* a)
 			if (pe->error != lt::error_code(336027900, boost::asio::error::get_ssl_category()))
 #endif
 			{
-				fprintf(
-					m_file,
+				log_line(
 					"%s\terror [%s] (%s:%d) %s\n",
 					timestamp.data(),
 					endpoint_str(std::get<0>(pe->ep)).c_str(),
@@ -132,8 +183,7 @@ void error_logger::handle_alert(lt::alert const* a)
 				&& pd->error != lt::error_code(lt::errors::timed_out_no_request)
 				&& pd->error != lt::error_code(lt::errors::timed_out_no_handshake)
 				&& pd->error != lt::error_code(lt::errors::upload_upload_connection))
-				fprintf(
-					m_file,
+				log_line(
 					"%s\tdisconnect [%s][%s] (%s:%d) %s\n",
 					timestamp.data(),
 					endpoint_str(std::get<0>(pd->ep)).c_str(),
@@ -148,8 +198,7 @@ void error_logger::handle_alert(lt::alert const* a)
 			lt::save_resume_data_failed_alert const* rs =
 				lt::alert_cast<lt::save_resume_data_failed_alert>(a);
 			if (rs && rs->error != lt::error_code(lt::errors::resume_data_not_modified))
-				fprintf(
-					m_file,
+				log_line(
 					"%s\tsave-resume-failed (%s:%d) %s\n",
 					timestamp.data(),
 					rs->error.category().name(),
@@ -162,8 +211,7 @@ void error_logger::handle_alert(lt::alert const* a)
 			lt::torrent_delete_failed_alert const* td =
 				lt::alert_cast<lt::torrent_delete_failed_alert>(a);
 			if (td)
-				fprintf(
-					m_file,
+				log_line(
 					"%s\tstorage-delete-failed (%s:%d) %s\n",
 					timestamp.data(),
 					td->error.category().name(),
@@ -176,8 +224,7 @@ void error_logger::handle_alert(lt::alert const* a)
 			lt::storage_moved_failed_alert const* sm =
 				lt::alert_cast<lt::storage_moved_failed_alert>(a);
 			if (sm)
-				fprintf(
-					m_file,
+				log_line(
 					"%s\tstorage-move-failed (%s:%d) %s\n",
 					timestamp.data(),
 					sm->error.category().name(),
@@ -190,8 +237,7 @@ void error_logger::handle_alert(lt::alert const* a)
 			lt::file_rename_failed_alert const* rn =
 				lt::alert_cast<lt::file_rename_failed_alert>(a);
 			if (rn)
-				fprintf(
-					m_file,
+				log_line(
 					"%s\tfile-rename-failed (%s:%d) %s\n",
 					timestamp.data(),
 					rn->error.category().name(),
@@ -203,8 +249,7 @@ void error_logger::handle_alert(lt::alert const* a)
 		case lt::torrent_error_alert::alert_type: {
 			lt::torrent_error_alert const* te = lt::alert_cast<lt::torrent_error_alert>(a);
 			if (te)
-				fprintf(
-					m_file,
+				log_line(
 					"%s\ttorrent-error (%s:%d) %s\n",
 					timestamp.data(),
 					te->error.category().name(),
@@ -216,14 +261,13 @@ void error_logger::handle_alert(lt::alert const* a)
 		case lt::hash_failed_alert::alert_type: {
 			lt::hash_failed_alert const* hf = lt::alert_cast<lt::hash_failed_alert>(a);
 			if (hf)
-				fprintf(m_file, "%s\thash-failed %s\n", timestamp.data(), hf->message().c_str());
+				log_line("%s\thash-failed %s\n", timestamp.data(), hf->message().c_str());
 			break;
 		}
 		case lt::file_error_alert::alert_type: {
 			lt::file_error_alert const* fe = lt::alert_cast<lt::file_error_alert>(a);
 			if (fe)
-				fprintf(
-					m_file,
+				log_line(
 					"%s\tfile-error (%s:%d) %s\n",
 					timestamp.data(),
 					fe->error.category().name(),
@@ -235,8 +279,7 @@ void error_logger::handle_alert(lt::alert const* a)
 		case lt::metadata_failed_alert::alert_type: {
 			lt::metadata_failed_alert const* mf = lt::alert_cast<lt::metadata_failed_alert>(a);
 			if (mf)
-				fprintf(
-					m_file,
+				log_line(
 					"%s\tmetadata-error (%s:%d) %s\n",
 					timestamp.data(),
 					mf->error.category().name(),
@@ -248,8 +291,7 @@ void error_logger::handle_alert(lt::alert const* a)
 		case lt::udp_error_alert::alert_type: {
 			lt::udp_error_alert const* ue = lt::alert_cast<lt::udp_error_alert>(a);
 			if (ue)
-				fprintf(
-					m_file,
+				log_line(
 					"%s\tudp-error (%s:%d) %s %s\n",
 					timestamp.data(),
 					ue->error.category().name(),
@@ -262,8 +304,7 @@ void error_logger::handle_alert(lt::alert const* a)
 		case lt::listen_failed_alert::alert_type: {
 			lt::listen_failed_alert const* lf = lt::alert_cast<lt::listen_failed_alert>(a);
 			if (lf)
-				fprintf(
-					m_file,
+				log_line(
 					"%s\tlisten-error (%s:%d) %s\n",
 					timestamp.data(),
 					lf->error.category().name(),
@@ -275,9 +316,7 @@ void error_logger::handle_alert(lt::alert const* a)
 		case lt::invalid_request_alert::alert_type: {
 			lt::invalid_request_alert const* ira = lt::alert_cast<lt::invalid_request_alert>(a);
 			if (ira)
-				fprintf(
-					m_file, "%s\tinvalid-request %s\n", timestamp.data(), ira->message().c_str()
-				);
+				log_line("%s\tinvalid-request %s\n", timestamp.data(), ira->message().c_str());
 			break;
 		}
 	}
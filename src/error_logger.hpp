@@ -11,21 +11,40 @@ see LICENSE file.
 #define LTWEB_ERROR_LOGGER_HPP
 
 #include "alert_observer.hpp"
+#include "libtorrent/config.hpp" // for TORRENT_FORMAT
+#include <cstdint>
 #include <string>
-#include <stdio.h> // for FILE
 
 namespace ltweb {
 
 struct alert_handler;
 
+// Logs errors reported by libtorrent to log_file, through the global log
+// writer. The file is rotated once it grows beyond max_size bytes (0 means
+// never), the previous one is kept as log_file.1. At most rate_limit lines
+// per second are logged (0 means no limit), the rest are dropped and
+// counted. redirect_stderr also points stdout and stderr at the log file,
+// and what's printed to them counts towards max_size. It can't be combined
+// with a compressed log, in which case stdout and stderr are left alone, and
+// a warning is printed.
 struct error_logger : alert_observer {
-	error_logger(alert_handler* alerts, std::string const& log_file, bool redirect_stderr);
+	error_logger(
+		alert_handler* alerts,
+		std::string const& log_file,
+		bool redirect_stderr,
+		std::uint64_t max_size = 64 * 1024 * 1024,
+		int rate_limit = 1000,
+		bool compress = false
+	);
 	~error_logger();
 
 	void handle_alert(lt::alert const* a);
+	char const* observer_name() const { return "error_logger"; }
 
 private:
-	FILE* m_file;
+	void log_line(char const* fmt, ...) TORRENT_FORMAT(2, 3);
+
+	int m_sink = -1;
 	alert_handler* m_alerts;
 };
 
@@ -15,50 +15,219 @@ see LICENSE file.
 #include "alert_handler.hpp"
 #include "utils.hpp"
 #include "mime_type.hpp"
+#include "read_ahead.hpp"
+#include "piece_deadlines.hpp"
+#include "piece_cache.hpp"
+#include "metrics.hpp"
+#include "stream_segments.hpp"
+#include "byte_ranges.hpp"
+#include "file_response.hpp" // for etag_matches
+#include "tar_archive.hpp"
 
 #include "libtorrent/session.hpp"
 #include "libtorrent/extensions.hpp"
 #include "libtorrent/peer_id.hpp" // for lt::sha1_hash
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/file_storage.hpp"
+#include "libtorrent/torrent_status.hpp"
+#include "libtorrent/hasher.hpp"
 
 #include <boost/shared_array.hpp>
 #include <boost/beast/http/write.hpp>
+#include <algorithm>
+#include <atomic>
 #include <map>
 #include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <charconv>
+#include <cerrno>
 #include <filesystem>
 #include <sstream>
 
+#ifndef TORRENT_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
 #include "percent_encode.hpp"
+#include "url_decode.hpp"
 
 namespace ltweb {
 
 namespace fs = std::filesystem;
 
+namespace {
+// the size of the buffer used when reading pieces straight from the file on
+// disk. We send the piece in chunks of at most this size, so a stream never
+// needs to allocate a whole piece
+constexpr int direct_read_chunk = 128 * 1024;
+
+// the number of finished streams we remember the position of, to tell a
+// continuation of a stream apart from a seek
+constexpr std::size_t max_recent_streams = 16;
+
+// the number of bytes worth of pieces all streams of a single torrent may
+// have deadlines for, combined. This is shared fairly among the streams
+constexpr std::int64_t torrent_deadline_budget = 128 * 1024 * 1024;
+
+// the default size of the cache of recently delivered pieces
+constexpr std::int64_t default_piece_cache_size = 128 * 1024 * 1024;
+
+// the default number of bytes of piece buffers all HTTP downloads in the
+// process may hold on to, combined. This does not include the piece cache
+constexpr std::int64_t default_buffer_budget = 256 * 1024 * 1024;
+
+// a connection whose client hasn't accepted any data for this long is
+// disconnected
+constexpr lt::time_duration idle_timeout = lt::seconds(60);
+
+// when we're over the buffer budget, connections holding buffers whose
+// client drains them slower than this (bytes per second) are disconnected
+constexpr std::int64_t min_drain_rate = 32 * 1024;
+
+std::atomic<std::int64_t> g_buffer_budget{default_buffer_budget};
+std::atomic<std::int64_t> g_buffered_bytes{0};
+
+int register_gauge(char const* name)
+{
+	return global_metrics().register_metric(name, metric_type::gauge);
+}
+
+int register_counter(char const* name)
+{
+	return global_metrics().register_metric(name, metric_type::counter);
+}
+
+struct download_metrics {
+	int const buffered_bytes = register_gauge("download.buffered_bytes");
+	int const buffer_budget = register_gauge("download.buffer_budget");
+	int const active_streams = register_gauge("download.active_streams");
+	int const reclaimed_idle = register_counter("download.reclaimed_idle");
+	int const reclaimed_slow = register_counter("download.reclaimed_slow");
+	int const cache_bytes = register_gauge("download.piece_cache_bytes");
+	int const cache_hits = register_counter("download.piece_cache_hits");
+	int const cache_misses = register_counter("download.piece_cache_misses");
+};
+
+download_metrics const& dl_metrics()
+{
+	static download_metrics const m;
+	return m;
+}
+
+enum class reclaim_reason { none, idle, slow };
+} // namespace
+
+// the piece deadlines of all streams from one torrent. A piece only has a
+// single deadline in libtorrent, so streams can't set and reset them
+// independently. This keeps the earliest deadline any stream asked for, and
+// resets it once no stream wants the piece anymore.
+struct torrent_deadlines {
+	torrent_deadlines(lt::torrent_handle th, int piece_size)
+		: m_torrent(std::move(th))
+		, m_deadlines(int(std::max(std::int64_t(1), torrent_deadline_budget / piece_size)))
+	{
+	}
+
+	int add_stream()
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		return m_deadlines.add_stream();
+	}
+
+	void remove_stream(int const stream)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_deadlines.remove_stream(stream, m_updates);
+		apply_updates();
+	}
+
+	int window(int const stream, int const wanted)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		return m_deadlines.window(stream, wanted);
+	}
+
+	void request(int const stream, lt::piece_index_t const piece, int const deadline)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_deadlines.request(
+			stream, piece, lt::clock_type::now() + lt::milliseconds(deadline), m_updates
+		);
+		apply_updates();
+	}
+
+	void delivered(lt::piece_index_t const piece)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_deadlines.delivered(piece);
+	}
+
+private:
+	void apply_updates()
+	{
+		lt::time_point const now = lt::clock_type::now();
+		for (auto const& u : m_updates) {
+			if (u.set) {
+				int const deadline =
+					int(std::max(std::int64_t(1), lt::total_milliseconds(u.deadline - now)));
+				m_torrent.set_piece_deadline(
+					u.piece, deadline, lt::torrent_handle::alert_when_available
+				);
+			} else {
+				m_torrent.reset_piece_deadline(u.piece);
+			}
+		}
+		m_updates.clear();
+	}
+
+	std::mutex m_mutex;
+	lt::torrent_handle m_torrent;
+	piece_deadlines m_deadlines;
+
+	// scratch space for deadline changes to apply to the torrent
+	std::vector<piece_deadlines::deadline_update> m_updates;
+};
+
+// opens files of the torrent for reading pieces straight from disk. Returns
+// -1 if the file can't be read directly
+using file_opener = std::function<int(lt::file_index_t)>;
+
 struct file_request_conn : std::enable_shared_from_this<file_request_conn> {
 	file_request_conn(
 		beast::ssl_stream<beast::tcp_stream>& socket,
 		std::function<void(bool)> done,
 		lt::torrent_handle th,
-		lt::piece_index_t next_piece,
-		lt::piece_index_t end_piece,
-		int offset,
-		int piece_size,
-		std::int64_t left_to_send
+		std::shared_ptr<lt::torrent_info const> ti,
+		piece_cache& cache,
+		std::vector<stream_segment> segments,
+		file_opener open_file,
+		lt::typed_bitfield<lt::piece_index_t> have,
+		read_ahead ra
 	)
-		: m_next_piece(next_piece)
-		, m_next_priority_piece(next_piece)
-		, m_end_piece(end_piece)
-		, m_left_to_send(left_to_send)
+		: m_have(std::move(have))
+		, m_read_ahead(std::move(ra))
+		, m_segments(std::move(segments))
+		, m_open_file(std::move(open_file))
 		, m_socket(socket)
 		, m_done(std::move(done))
 		, m_torrent(std::move(th))
-		, m_piece_size(piece_size)
-		, m_offset(offset)
+		, m_torrent_file(std::move(ti))
+		, m_cache(cache)
+		, m_piece_size(m_torrent_file->layout().piece_length())
 	{
+		TORRENT_ASSERT(!m_segments.empty());
+		start_segment(0);
+	}
+
+	~file_request_conn()
+	{
+		if (m_deadlines) m_deadlines->remove_stream(m_stream_id);
+		std::int64_t const total = g_buffered_bytes -= m_buffered;
+		global_metrics().set(dl_metrics().buffered_bytes, total);
+		close_file();
 	}
 
 	bool stopped() const
@@ -73,53 +242,185 @@ struct file_request_conn : std::enable_shared_from_this<file_request_conn> {
 		abort();
 	}
 
+	// registers this stream with the piece deadlines of its torrent. This
+	// must be done before the stream is started, and in the same critical
+	// section as the stream is added to file_downloader's
+	// m_outstanding_requests, which is what keeps the deadlines around
+	void attach_deadlines(std::shared_ptr<torrent_deadlines> deadlines)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		TORRENT_ASSERT(!m_deadlines);
+		m_deadlines = std::move(deadlines);
+		m_stream_id = m_deadlines->add_stream();
+	}
+
 	void set_piece_deadlines()
 	{
 		std::lock_guard<std::mutex> l(m_mutex);
 		set_piece_deadlines_impl();
 	}
 
+	// the file and the offset into it where the response left off, and the
+	// state of the read-ahead window at that point. Used to pick up where we
+	// left off if the client continues the stream with another request
+	std::tuple<lt::file_index_t, std::int64_t, read_ahead> stream_position() const
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		return {m_file, m_file_offset, m_read_ahead};
+	}
+
+	// disconnects the client if it hasn't accepted any data in a long time,
+	// or if we're short on buffer space and it's holding on to buffers it
+	// drains too slowly
+	reclaim_reason reclaim(lt::time_point const now, bool const over_budget)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		if (m_stopped) return reclaim_reason::none;
+
+		if (m_writing && now - m_write_started > idle_timeout) {
+			abort();
+			return reclaim_reason::idle;
+		}
+
+		std::int64_t const drain_rate = m_read_ahead.drain_rate();
+		if (over_budget && m_buffered > 0 && drain_rate > 0 && drain_rate < min_drain_rate) {
+			abort();
+			return reclaim_reason::slow;
+		}
+		return reclaim_reason::none;
+	}
+
+	void on_torrent_state(lt::torrent_status const& st)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_read_ahead.torrent_state(st.download_payload_rate, st.distributed_copies);
+
+		// the window may have grown
+		set_piece_deadlines_impl();
+	}
+
 	void on_piece_alert(lt::read_piece_alert const& a)
 	{
 		std::lock_guard<std::mutex> l(m_mutex);
 
 		if (m_stopped) return;
 
-		if (a.piece == m_next_piece && !m_writing) {
+		// pieces we read straight off of disk are not requested from
+		// libtorrent, but another stream of the same torrent may have
+		// requested it
+		if (direct_piece(a.piece)) return;
 
-			if (a.error) return abort();
+		// only hold on to pieces in our window. Pieces further ahead were
+		// requested by another stream, we'll get them later (possibly from
+		// the piece cache)
+		if (a.piece < m_next_piece || a.piece >= m_next_priority_piece) return;
 
-			int const size = std::min(std::int64_t(m_piece_size - m_offset), m_left_to_send);
-			async_write(a.buffer, m_offset, size);
-			++m_next_piece;
-			TORRENT_ASSERT(m_left_to_send >= size);
-			m_left_to_send -= size;
-			m_offset = 0;
+		if (a.error) return abort();
+		m_out_of_order[a.piece] = a.buffer;
+		update_buffered();
 
-			set_piece_deadlines_impl();
-		} else if (a.piece >= m_next_piece && a.piece < m_end_piece) {
-			if (a.error) return abort();
-			m_out_of_order[a.piece] = a.buffer;
-		}
+		// this may be the piece we're waiting for
+		if (!m_writing) send_buffered();
 	}
 
-	void on_write(beast::error_code const& ec, std::size_t)
+	void on_write(beast::error_code const& ec, std::size_t const bytes_transferred)
 	{
 		std::unique_lock<std::mutex> l(m_mutex);
 
 		TORRENT_ASSERT(m_writing);
 		m_writing = false;
 		m_currently_sending = nullptr;
+		update_buffered();
 		if (ec) return abort();
 		if (m_stopped) return;
 
-		if (m_next_piece == m_end_piece) {
-			TORRENT_ASSERT(m_left_to_send == 0);
+		m_read_ahead.sent(std::int64_t(bytes_transferred), lt::clock_type::now() - m_write_started);
+
+		if (send_next()) {
 			m_stopped = true;
+			m_deadlines->remove_stream(m_stream_id);
 			l.unlock();
 			m_done(false);
+		}
+	}
+
+private:
+	// issue the next write to the socket, if we have what comes next in the
+	// response. Returns true once the whole response has been sent
+	bool send_next()
+	{
+		TORRENT_ASSERT(!m_writing);
+		for (;;) {
+			if (m_prefix_pending) {
+				m_prefix_pending = false;
+				if (!m_segments[m_segment].prefix.empty()) {
+					write_prefix();
+					return false;
+				}
+			}
+
+			if (m_left_to_send > 0) {
+				if (direct_piece(m_next_piece))
+					write_direct();
+				else
+					send_buffered();
+				return false;
+			}
+
+			if (m_segment + 1 == m_segments.size()) return true;
+			start_segment(m_segment + 1);
+			set_piece_deadlines_impl();
+		}
+	}
+
+	// set up the state to send segment idx, starting with its prefix
+	void start_segment(std::size_t const idx)
+	{
+		m_segment = idx;
+		m_prefix_pending = true;
+		stream_segment const& s = m_segments[idx];
+		m_file = lt::file_index_t(s.source);
+		m_file_offset = s.offset;
+		m_left_to_send = s.length;
+		close_file();
+
+		if (s.length == 0) {
+			m_end_piece = m_next_priority_piece = m_next_piece;
+			m_offset = 0;
 			return;
 		}
+
+		lt::peer_request const req = m_torrent_file->map_file(m_file, s.offset, 0);
+		m_next_piece = req.piece;
+		m_next_priority_piece = req.piece;
+		m_end_piece = next(m_torrent_file->map_file(m_file, s.offset + s.length - 1, 0).piece);
+		m_offset = req.start;
+
+		// pieces before this segment won't be needed anymore. A piece the
+		// previous file ended in may also be where this one starts though
+		m_out_of_order.erase(m_out_of_order.begin(), m_out_of_order.lower_bound(m_next_piece));
+		update_buffered();
+
+		if (m_open_file) m_fd = m_open_file(m_file);
+	}
+
+	void write_prefix()
+	{
+		TORRENT_ASSERT(!m_writing);
+		using boost::asio::buffer;
+		boost::asio::async_write(
+			m_socket,
+			buffer(m_segments[m_segment].prefix),
+			beast::bind_front_handler(&file_request_conn::on_write, shared_from_this())
+		);
+		m_writing = true;
+		m_write_started = lt::clock_type::now();
+	}
+
+	// if we have the next piece to send buffered, send it
+	void send_buffered()
+	{
+		TORRENT_ASSERT(!m_writing);
 		auto const it = m_out_of_order.find(m_next_piece);
 		if (it == m_out_of_order.end()) return;
 
@@ -129,27 +430,146 @@ struct file_request_conn : std::enable_shared_from_this<file_request_conn> {
 		++m_next_piece;
 		TORRENT_ASSERT(m_left_to_send >= size);
 		m_left_to_send -= size;
+		m_file_offset += size;
 		m_offset = 0;
 
 		set_piece_deadlines_impl();
 	}
-
-private:
 	void set_piece_deadlines_impl()
 	{
 		if (m_stopped) return;
 
-		// this 4 MiB should be picked in a more sophisticated way
-		lt::piece_index_t::diff_type const prefetch(std::max(1, 4 * 1024 * 1024 / m_piece_size));
-		int deadline = 1;
+		// the window is capped by our share of the torrent's deadline
+		// budget, so one stream can't starve the others
+		lt::piece_index_t::diff_type prefetch(
+			m_deadlines->window(m_stream_id, m_read_ahead.window_pieces())
+		);
+
+		// when all downloads combined hold more piece buffers than the
+		// budget, shrink the window in proportion. Under heavy pressure we
+		// only request the piece we're about to send
+		std::int64_t const buffered = g_buffered_bytes;
+		std::int64_t const budget = g_buffer_budget;
+		if (buffered > budget) {
+			prefetch = lt::piece_index_t::diff_type(std::max(
+				1, int(static_cast<int>(prefetch) * std::max(budget, std::int64_t(0)) / buffered)
+			));
+		}
+
+		int last_deadline = 0;
 		while (m_next_priority_piece - m_next_piece < prefetch
 			   && m_next_priority_piece < m_end_piece) {
-			m_torrent.set_piece_deadline(
-				m_next_priority_piece, deadline, lt::torrent_handle::alert_when_available
-			);
-			++deadline;
+			if (direct_piece(m_next_priority_piece)) {
+				// pieces we already have are read from disk directly, there's
+				// no need to ask libtorrent for them
+			} else if (auto buf = m_cache.find(m_torrent, m_next_priority_piece)) {
+				// another stream had this piece delivered recently
+				m_out_of_order[m_next_priority_piece] = std::move(buf);
+			} else {
+				// the deadline is when we expect the client to need the piece.
+				// Deadlines are kept strictly increasing, to have libtorrent
+				// pick the pieces in order
+				std::int64_t const bytes_ahead =
+					std::int64_t(static_cast<int>(m_next_priority_piece - m_next_piece))
+						* m_piece_size
+					- m_offset;
+				last_deadline = std::max(last_deadline + 1, m_read_ahead.deadline(bytes_ahead));
+				m_deadlines->request(m_stream_id, m_next_priority_piece, last_deadline);
+			}
 			++m_next_priority_piece;
 		}
+		update_buffered();
+	}
+
+	// recompute the number of bytes of piece buffers we hold on to, and
+	// update the process-wide count
+	void update_buffered()
+	{
+		std::int64_t const buffered = std::int64_t(m_out_of_order.size()
+			+ (m_currently_sending ? 1 : 0)) * m_piece_size;
+		if (buffered == m_buffered) return;
+		std::int64_t const total = g_buffered_bytes += buffered - m_buffered;
+		m_buffered = buffered;
+		global_metrics().set(dl_metrics().buffered_bytes, total);
+	}
+
+	// returns true if piece p is served by reading the file on disk rather
+	// than waiting for a read_piece_alert. The have-bitfield is a snapshot
+	// taken when the request was made, pieces completing after that take
+	// the deadline path
+	bool direct_piece(lt::piece_index_t const p) const
+	{
+		return m_fd >= 0 && p < m_have.end_index() && m_have[p];
+	}
+
+	// read the next chunk of m_next_piece from the file and send it. This is
+	// a blocking read on the socket's thread, which is fine since pieces we
+	// have are typically in the page cache, and it saves us from copying the
+	// entire piece into a heap buffer first (which is what libtorrent's
+	// read_piece() does)
+	void write_direct()
+	{
+		TORRENT_ASSERT(!m_writing);
+		TORRENT_ASSERT(direct_piece(m_next_piece));
+		int const size = int(std::min(
+			std::int64_t(std::min(m_piece_size - m_offset, direct_read_chunk)), m_left_to_send
+		));
+
+		if (!m_read_buffer) m_read_buffer.reset(new char[direct_read_chunk]);
+
+#ifndef TORRENT_WINDOWS
+		int read = 0;
+		while (read < size) {
+			ssize_t const ret =
+				::pread(m_fd, m_read_buffer.get() + read, size - read, m_file_offset + read);
+			if (ret < 0 && errno == EINTR) continue;
+			if (ret <= 0) break;
+			read += int(ret);
+		}
+		if (read < size) return fall_back_to_deadlines();
+#else
+		return fall_back_to_deadlines();
+#endif
+
+		using boost::asio::buffer;
+		boost::asio::async_write(
+			m_socket,
+			buffer(m_read_buffer.get(), size),
+			beast::bind_front_handler(&file_request_conn::on_write, shared_from_this())
+		);
+		m_writing = true;
+		m_write_started = lt::clock_type::now();
+
+		TORRENT_ASSERT(m_left_to_send >= size);
+		m_left_to_send -= size;
+		m_file_offset += size;
+		m_offset += size;
+		if (m_offset == m_piece_size || m_left_to_send == 0) {
+			++m_next_piece;
+			m_offset = 0;
+			set_piece_deadlines_impl();
+		}
+	}
+
+	// if we fail to read from the file (it may have been moved, truncated or
+	// deleted underneath us) we stop reading from disk and request the
+	// remaining pieces from libtorrent instead
+	void fall_back_to_deadlines()
+	{
+		close_file();
+		m_next_priority_piece = m_next_piece;
+		set_piece_deadlines_impl();
+
+		// the next piece may have been in the piece cache
+		if (!m_writing) send_buffered();
+	}
+
+	void close_file()
+	{
+#ifndef TORRENT_WINDOWS
+		if (m_fd >= 0) ::close(m_fd);
+#endif
+		m_fd = -1;
 	}
 
 	void abort()
@@ -157,11 +577,11 @@ private:
 		if (m_stopped) return;
 		m_stopped = true;
 		m_out_of_order.clear();
-		for (lt::piece_index_t i = m_next_piece; i < m_next_priority_piece; ++i) {
-			m_torrent.reset_piece_deadline(i);
-		}
-		//TODO: It would be nice to have reference counting, so we won't remove the
-		// deadline in case there are other requests in flight
+		update_buffered();
+
+		// this only resets the deadlines of pieces no other stream is waiting
+		// for
+		m_deadlines->remove_stream(m_stream_id);
 
 		// we can't call m_done here, since we have m_mutex locked, and the done
 		// callback will inspect our stopped() state, which also requires
@@ -180,7 +600,9 @@ private:
 			beast::bind_front_handler(&file_request_conn::on_write, shared_from_this())
 		);
 		m_writing = true;
+		m_write_started = lt::clock_type::now();
 		m_currently_sending = std::move(buf);
+		update_buffered();
 	}
 
 	// since we only have a single async operation outstanding (async_write())
@@ -198,12 +620,46 @@ private:
 	// async_write() call, to keep it alive.
 	boost::shared_array<char> m_currently_sending;
 
-	lt::piece_index_t m_next_piece;
-	lt::piece_index_t m_next_priority_piece;
-	lt::piece_index_t m_end_piece;
+	// the number of bytes of piece buffers in m_out_of_order and
+	// m_currently_sending. This is our contribution to g_buffered_bytes
+	std::int64_t m_buffered = 0;
+
+	// buffer used for reading pieces directly from the file. Allocated on
+	// first use, and reused for every subsequent chunk
+	std::unique_ptr<char[]> m_read_buffer;
+
+	// the pieces the torrent had when the request was made. These are the
+	// pieces we read directly from disk, if m_fd is valid
+	lt::typed_bitfield<lt::piece_index_t> m_have;
+
+	// decides how far ahead of the send position we request pieces, and
+	// with which deadlines
+	read_ahead m_read_ahead;
 
-	// the number of bytes left to send
-	std::int64_t m_left_to_send;
+	// the time the outstanding write to the socket was issued. Used to
+	// measure the rate the client drains the socket
+	lt::time_point m_write_started = lt::clock_type::now();
+
+	// the parts the response body is made up of, and the one we're currently
+	// sending. Unless m_prefix_pending is set, the prefix of the current
+	// segment has been sent, and what's left to send is in its file
+	std::vector<stream_segment> m_segments;
+	std::size_t m_segment = 0;
+	bool m_prefix_pending = true;
+
+	// used to open the file of each segment for reading directly from disk.
+	// Empty if we can't read from disk
+	file_opener m_open_file;
+
+	lt::piece_index_t m_next_piece{0};
+	lt::piece_index_t m_next_priority_piece{0};
+	lt::piece_index_t m_end_piece{0};
+
+	// the number of bytes left to send of the current segment's file
+	std::int64_t m_left_to_send = 0;
+
+	// the offset into the file of the next byte to send
+	std::int64_t m_file_offset = 0;
 
 	// the socket to write the response to
 	beast::ssl_stream<beast::tcp_stream>& m_socket;
@@ -215,11 +671,32 @@ private:
 	// as we receive pieces
 	lt::torrent_handle m_torrent;
 
+	// used to map file ranges of the segments to pieces
+	std::shared_ptr<lt::torrent_info const> m_torrent_file;
+
+	// the deadlines of all streams of m_torrent. We request pieces through
+	// this, rather than directly on m_torrent. Set by attach_deadlines()
+	std::shared_ptr<torrent_deadlines> m_deadlines;
+	int m_stream_id = -1;
+
+	// pieces recently delivered to any stream. We check here before
+	// requesting a piece from libtorrent
+	piece_cache& m_cache;
+
+	// the file (in m_torrent) of the segment we're sending. This is -1 for
+	// segments that only have a prefix
+	lt::file_index_t m_file{-1};
+
 	int m_piece_size;
 
 	// offset into the next piece (should be zero except for the first
-	// piece)
-	int m_offset;
+	// piece of a segment, or when we're sending a piece read from disk in
+	// chunks)
+	int m_offset = 0;
+
+	// the file of the current segment opened for reading, when we can read
+	// pieces directly from disk. -1 otherwise
+	int m_fd = -1;
 
 	// when this is true, we have an outstanding write operation to the
 	// socket and we cannot issue another one until it completes.
@@ -229,8 +706,6 @@ private:
 	// when the request has been fully sent, or aborted, this is set to true, to
 	// prevent anything else from being sent on the socket
 	bool m_stopped = false;
-
-	// TODO: there should be a timeout too
 };
 
 namespace {
@@ -244,42 +719,22 @@ struct write_header_op {
 };
 } // namespace
 
-std::tuple<std::int64_t, std::int64_t, bool>
-parse_range(http::request<http::string_body> const& req, std::int64_t file_size)
-{
-	auto range_header = req.find(http::field::range);
-	if (range_header == req.end()) return {0, file_size - 1, false};
-
-	auto range_str = trim(range_header->value());
-	if (!starts_with(range_str, "bytes=")) return {0, file_size - 1, false};
-
-	// skip bytes=
-	auto const [first, last] = split(range_str.substr(6), '-');
-
-	std::int64_t first_byte = 0;
-	std::from_chars_result ret =
-		std::from_chars(first.data(), first.data() + first.size(), first_byte);
-
-	if (ret.ec != std::errc{} || ret.ptr != first.data() + first.size())
-		return {0, file_size - 1, false};
-
-	std::int64_t last_byte = file_size - 1;
-	if (!last.empty()) {
-		ret = std::from_chars(last.data(), last.data() + last.size(), last_byte);
-		if (ret.ec != std::errc{} || ret.ptr != last.data() + last.size())
-			return {0, file_size - 1, false};
-	}
-
-	return {first_byte, last_byte, true};
-}
-
 file_downloader::file_downloader(lt::session& s, alert_handler* alert, auth_interface const& auth)
 	: m_ses(s)
 	, m_auth(auth)
 	, m_attachment(true)
 	, m_alert(alert)
+	, m_cache(default_piece_cache_size)
 {
-	m_alert->subscribe<lt::read_piece_alert>(this);
+	m_alert->subscribe<
+		lt::read_piece_alert,
+		lt::state_update_alert,
+		lt::torrent_removed_alert,
+		lt::piece_finished_alert,
+		lt::file_prio_alert,
+		lt::storage_moved_alert,
+		lt::torrent_checked_alert,
+		lt::alerts_dropped_alert>(this);
 }
 
 file_downloader::~file_downloader() { m_alert->unsubscribe(this); }
@@ -298,19 +753,257 @@ void file_downloader::shutdown()
 
 std::string file_downloader::path_prefix() const { return "/download/"; }
 
+void file_downloader::set_buffer_budget(std::int64_t const bytes)
+{
+	g_buffer_budget = bytes;
+	global_metrics().set(dl_metrics().buffer_budget, bytes);
+}
+
+void file_downloader::reclaim_connections()
+{
+	download_metrics const& m = dl_metrics();
+	metrics& mx = global_metrics();
+	mx.set(m.active_streams, std::int64_t(m_outstanding_requests.size()));
+	mx.set(m.buffer_budget, g_buffer_budget);
+	mx.set(m.cache_bytes, m_cache.size());
+	mx.set(m.cache_hits, m_cache.hits());
+	mx.set(m.cache_misses, m_cache.misses());
+
+	lt::time_point const now = lt::clock_type::now();
+	bool const over_budget = g_buffered_bytes > g_buffer_budget;
+	for (auto& [_, conn] : m_outstanding_requests) {
+		// aborted connections are removed from m_outstanding_requests once
+		// their done handler runs
+		reclaim_reason const r = conn->reclaim(now, over_budget);
+		if (r == reclaim_reason::idle)
+			mx.inc(m.reclaimed_idle);
+		else if (r == reclaim_reason::slow)
+			mx.inc(m.reclaimed_slow);
+	}
+}
+
+file_downloader::torrent_state file_downloader::torrent_state_for(lt::torrent_handle const& h)
+{
+	std::uint64_t epoch;
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		auto const it = m_torrents.find(h);
+		if (it != m_torrents.end()) return it->second;
+		epoch = m_torrents_epoch;
+	}
+
+	// this is the first request for this torrent (since its state was
+	// dropped). These calls are synchronous, but only made once
+	lt::status_flags_t status_flags = lt::torrent_handle::query_distributed_copies;
+#ifndef TORRENT_WINDOWS
+	status_flags |= lt::torrent_handle::query_pieces | lt::torrent_handle::query_save_path;
+#endif
+	lt::torrent_status st = h.status(status_flags);
+	torrent_state ret;
+	ret.download_payload_rate = st.download_payload_rate;
+	ret.distributed_copies = st.distributed_copies;
+#ifndef TORRENT_WINDOWS
+	if (!st.pieces.empty()) {
+		ret.save_path = std::move(st.save_path);
+		ret.priorities = h.get_file_priorities();
+		ret.have = std::move(st.pieces);
+	}
+#endif
+
+	std::lock_guard<std::mutex> l(m_mutex);
+	// if a state was dropped while we fetched this one, it may already be
+	// out of date. It's still good enough for this request
+	if (epoch == m_torrents_epoch) m_torrents.emplace(h, ret);
+	return ret;
+}
+
+void file_downloader::drop_torrent_state(lt::torrent_handle const& h)
+{
+	m_torrents.erase(h);
+	++m_torrents_epoch;
+}
+
 void file_downloader::handle_alert(lt::alert const* a)
 {
+	if (auto const* su = lt::alert_cast<lt::state_update_alert>(a)) {
+		std::lock_guard<std::mutex> l(m_mutex);
+		// we get these regularly, which makes it a good time to update our
+		// metrics and look for connections to reclaim
+		reclaim_connections();
+		for (lt::torrent_status const& st : su->status) {
+			auto requests = m_outstanding_requests.equal_range(st.handle);
+			for (auto i = requests.first; i != requests.second; ++i)
+				i->second->on_torrent_state(st);
+
+			auto const t = m_torrents.find(st.handle);
+			if (t == m_torrents.end()) continue;
+			t->second.download_payload_rate = st.download_payload_rate;
+			t->second.distributed_copies = st.distributed_copies;
+		}
+		return;
+	}
+
+	if (auto const* pf = lt::alert_cast<lt::piece_finished_alert>(a)) {
+		std::lock_guard<std::mutex> l(m_mutex);
+		auto const t = m_torrents.find(pf->handle);
+		if (t == m_torrents.end()) return;
+		lt::typed_bitfield<lt::piece_index_t>& have = t->second.have;
+		if (pf->piece_index < have.end_index()) have.set_bit(pf->piece_index);
+		return;
+	}
+
+	if (auto const* sm = lt::alert_cast<lt::storage_moved_alert>(a)) {
+		std::lock_guard<std::mutex> l(m_mutex);
+		auto const t = m_torrents.find(sm->handle);
+		if (t != m_torrents.end()) t->second.save_path = sm->storage_path();
+		return;
+	}
+
+	// a recheck may have found pieces missing, and we don't know which file
+	// priorities changed. Nor what we missed, if alerts were dropped
+	if (lt::alert_cast<lt::file_prio_alert>(a) || lt::alert_cast<lt::torrent_checked_alert>(a)) {
+		std::lock_guard<std::mutex> l(m_mutex);
+		drop_torrent_state(static_cast<lt::torrent_alert const*>(a)->handle);
+		return;
+	}
+
+	if (lt::alert_cast<lt::alerts_dropped_alert>(a)) {
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_torrents.clear();
+		++m_torrents_epoch;
+		return;
+	}
+
+	if (auto const* tr = lt::alert_cast<lt::torrent_removed_alert>(a)) {
+		m_cache.erase(tr->handle);
+		std::lock_guard<std::mutex> l(m_mutex);
+		drop_torrent_state(tr->handle);
+		return;
+	}
+
 	lt::read_piece_alert const* rp = lt::alert_cast<lt::read_piece_alert>(a);
 	if (!rp) return;
 
+	// keep the piece around for streams that are a little behind
+	if (!rp->error) m_cache.insert(rp->handle, rp->piece, rp->buffer, rp->size);
+
 	lt::torrent_handle h = rp->handle;
 	std::lock_guard<std::mutex> l(m_mutex);
+
+	// libtorrent clears the deadline of the piece once it's been read
+	auto const d = m_deadlines.find(h);
+	if (d != m_deadlines.end()) d->second->delivered(rp->piece);
+
 	auto requests = m_outstanding_requests.equal_range(h);
 	for (auto i = requests.first; i != requests.second; ++i) {
 		i->second->on_piece_alert(*rp);
 	}
 }
 
+namespace {
+#ifndef TORRENT_WINDOWS
+// open file f of the torrent for reading pieces straight from disk. Returns
+// -1 if the file isn't stored in its default location, or doesn't look like
+// what we expect
+int open_direct(
+	lt::file_storage const& fs,
+	lt::renamed_files const& renames,
+	std::string const& save_path,
+	std::vector<lt::download_priority_t> const& priorities,
+	lt::file_index_t const f
+)
+{
+	if (fs.pad_file_at(f)) return -1;
+
+	// files with priority 0 may have their pieces stored in the part-file,
+	// rather than in the file itself. Those we can't read directly
+	std::size_t const idx = std::size_t(static_cast<int>(f));
+	if (idx < priorities.size() && priorities[idx] == lt::dont_download) return -1;
+
+	std::string const path = renames.file_path(fs, f, save_path);
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct ::stat file_stat;
+	if (fd >= 0 && (::fstat(fd, &file_stat) != 0 || file_stat.st_size < fs.file_size(f))) {
+		// the file on disk doesn't look like what we expect. This is not
+		// the default storage layout
+		::close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+#endif
+
+// the files of the torrent in directory dir (or all files, if dir is empty)
+// as members of a tar archive. Pad files are left out. The file index of
+// each member is appended to files
+std::vector<archive_member> archive_members(
+	lt::torrent_info const& ti,
+	lt::renamed_files const& renames,
+	std::string const& dir,
+	std::vector<lt::file_index_t>& files
+)
+{
+	lt::file_storage const& fs = ti.layout();
+	std::vector<archive_member> ret;
+	for (lt::file_index_t const i : fs.file_range()) {
+		if (fs.pad_file_at(i)) continue;
+
+		std::string name = renames.file_path(fs, i, "");
+		std::replace(name.begin(), name.end(), '\\', '/');
+		if (!dir.empty() && !starts_with(name, dir + '/')) continue;
+
+		std::int64_t mtime = fs.mtime(i);
+		if (mtime == 0) mtime = ti.creation_date();
+		ret.push_back({std::move(name), fs.file_size(i), mtime});
+		files.push_back(i);
+	}
+	return ret;
+}
+// a strong validator of a response body made up of segments. It covers the
+// torrent, the layout of the body (including archive headers) and the piece
+// hashes (or merkle roots, for v2 torrents) of every file range in it, so it
+// changes whenever the content could
+std::string body_etag(lt::torrent_info const& ti, std::vector<stream_segment> const& segments)
+{
+	lt::file_storage const& fs = ti.layout();
+	lt::hasher h;
+	lt::sha1_hash const ih = ti.info_hashes().get_best();
+	h.update(ih.data(), int(ih.size()));
+	for (stream_segment const& s : segments) {
+		h.update(s.prefix.data(), int(s.prefix.size()));
+		std::int64_t const layout[] = {s.source, s.offset, s.length};
+		h.update(reinterpret_cast<char const*>(layout), int(sizeof(layout)));
+		if (s.source < 0 || s.length == 0) continue;
+
+		lt::file_index_t const f(s.source);
+		if (ti.v2()) {
+			lt::sha256_hash const root = fs.root(f);
+			h.update(root.data(), int(root.size()));
+		}
+		if (ti.v1()) {
+			lt::piece_index_t const first = ti.map_file(f, s.offset, 0).piece;
+			lt::piece_index_t const last = ti.map_file(f, s.offset + s.length - 1, 0).piece;
+			for (lt::piece_index_t p = first; p <= last; ++p) {
+				lt::sha1_hash const ph = ti.hash_for_piece(p);
+				h.update(ph.data(), int(ph.size()));
+			}
+		}
+	}
+
+	std::stringstream ret;
+	ret << '"' << h.final() << '"';
+	return ret.str();
+}
+
+// the value of header field f of req, or an empty string if it's not set
+std::string_view header_value(http::request<http::string_body> const& req, http::field const f)
+{
+	auto const it = req.find(f);
+	if (it == req.end()) return {};
+	return {it->value().data(), it->value().size()};
+}
+} // namespace
+
 void file_downloader::handle_http(
 	http::request<http::string_body> request,
 	beast::ssl_stream<beast::tcp_stream>& socket,
@@ -321,7 +1014,7 @@ void file_downloader::handle_http(
 	if (!perms || !perms->allow_get_data())
 		return send_http(socket, std::move(done), http_error(request, http::status::unauthorized));
 
-	auto const [info_hash_str, file_str] = split(request.target().substr(10), '/');
+	auto const [info_hash_str, path_str] = split(request.target().substr(10), '/');
 
 	if (info_hash_str.size() != 40)
 		return send_http(socket, std::move(done), http_error(request, http::status::bad_request));
@@ -330,8 +1023,6 @@ void file_downloader::handle_http(
 	if (!from_hex(info_hash_str, info_hash.data()))
 		return send_http(socket, std::move(done), http_error(request, http::status::bad_request));
 
-	lt::file_index_t const file{atoi(std::string(file_str).c_str())};
-
 	// TODO: find_torrent() is synchronous, we should use async functions only
 	lt::torrent_handle h = m_ses.find_torrent(info_hash);
 
@@ -342,18 +1033,94 @@ void file_downloader::handle_http(
 	if (!ti || !ti->is_valid())
 		return send_http(socket, std::move(done), http_error(request, http::status::not_found));
 
-	if (file < lt::file_index_t{} || file >= ti->layout().end_file())
-		return send_http(socket, std::move(done), http_error(request, http::status::not_found));
+	lt::file_storage const& fs = ti->layout();
+
+	// TODO: get_renamed_files() is synchronous, we should use async functions only
+	lt::renamed_files const renames = h.get_renamed_files();
 
-	std::int64_t const file_size = ti->layout().file_size(file);
+	// the response is either a single file, or a tar archive of all files in
+	// the torrent (/download/<info-hash>/tar) or in one of its directories
+	// (/download/<info-hash>/tar/<directory>)
+	bool const archive = path_str == "tar" || starts_with(path_str, "tar/");
+	lt::file_index_t file{-1};
+	std::vector<stream_segment> segments;
+	std::string filename;
+	std::int64_t last_modified = 0;
+	if (archive) {
+		boost::system::error_code ec;
+		// skip tar/
+		std::string_view const dir_str = path_str.size() > 4 ? path_str.substr(4) : "";
+		std::string dir = url_decode(std::string(dir_str), ec);
+		if (ec) {
+			return send_http(
+				socket, std::move(done), http_error(request, http::status::bad_request)
+			);
+		}
+		while (!dir.empty() && dir.back() == '/')
+			dir.pop_back();
+
+		std::vector<lt::file_index_t> files;
+		std::vector<archive_member> const members = archive_members(*ti, renames, dir, files);
+		if (members.empty())
+			return send_http(socket, std::move(done), http_error(request, http::status::not_found));
+
+		// the segment sources are indices into members, we want file indices
+		segments = tar_segments(members);
+		for (stream_segment& s : segments) {
+			if (s.source >= 0) s.source = static_cast<int>(files[std::size_t(s.source)]);
+		}
+		filename = str(dir.empty() ? ti->name() : dir.substr(dir.find_last_of('/') + 1), ".tar");
+		for (archive_member const& m : members)
+			last_modified = std::max(last_modified, m.mtime);
+	} else {
+		file = lt::file_index_t{atoi(std::string(path_str).c_str())};
+		if (file < lt::file_index_t{} || file >= fs.end_file())
+			return send_http(socket, std::move(done), http_error(request, http::status::not_found));
+
+		segments.push_back({{}, static_cast<int>(file), 0, fs.file_size(file)});
+		filename = std::string(renames.file_name(fs, file));
+		last_modified = fs.mtime(file);
+		if (last_modified == 0) last_modified = ti->creation_date();
+	}
 
-	auto const [range_first_byte, range_last_byte, range_request] = parse_range(request, file_size);
+	std::int64_t const content_size = segments_size(segments);
+	std::string const etag = body_etag(*ti, segments);
+	std::string const content_type =
+		std::string(archive ? "application/x-tar" : mime_type(extension(filename)));
+
+	// the client may already have this response cached. If-None-Match takes
+	// precedence over If-Modified-Since (RFC 9110 sec. 13.2.2)
+	bool not_modified = false;
+	std::string_view const if_none_match = header_value(request, http::field::if_none_match);
+	std::string_view const if_modified_since =
+		header_value(request, http::field::if_modified_since);
+	if (!if_none_match.empty()) {
+		not_modified = aux::etag_matches(if_none_match, etag);
+	} else if (!if_modified_since.empty() && last_modified > 0) {
+		auto const since = parse_http_date(if_modified_since);
+		not_modified = since && last_modified <= *since;
+	}
 
-	if (range_request
-		&& (range_first_byte > range_last_byte || range_last_byte >= file_size
-			|| range_first_byte < 0)) {
+	if (not_modified) {
+		http::response<http::empty_body> response(http::status::not_modified, request.version());
+		response.keep_alive(request.keep_alive());
+		response.set(http::field::etag, etag);
+		if (last_modified > 0) response.set(http::field::last_modified, http_date(last_modified));
+		return send_http(socket, std::move(done), std::move(response));
+	}
+
+	// a range request is only honoured if the part the client already has
+	// is of the same representation as this one
+	std::vector<byte_range> ranges;
+	range_status ranged = range_status::ignored;
+	if (request.find(http::field::if_range) == request.end()
+		|| if_range_matches(header_value(request, http::field::if_range), etag, last_modified)) {
+		ranged = parse_byte_ranges(header_value(request, http::field::range), content_size, ranges);
+	}
+
+	if (ranged == range_status::unsatisfiable) {
 		std::stringstream content_range;
-		content_range << "*/" << file_size;
+		content_range << "*/" << content_size;
 		http::response<http::empty_body> response(
 			http::status::range_not_satisfiable, request.version()
 		);
@@ -362,10 +1129,69 @@ void file_downloader::handle_http(
 		return send_http(socket, std::move(done), std::move(response));
 	}
 
-	lt::peer_request const req = ti->map_file(file, range_first_byte, 0);
-	lt::piece_index_t const first_piece = req.piece;
-	lt::piece_index_t const end_piece = next(ti->map_file(file, range_last_byte, 0).piece);
-	int offset = req.start;
+	// multiple ranges are sent as a multipart/byteranges body. The boundary
+	// is derived from the ETag, which is a hash of the content
+	bool const range_request = ranged == range_status::satisfiable;
+	bool const multipart = range_request && ranges.size() > 1;
+	std::string const boundary = str("ltweb-", etag.substr(1, etag.size() - 2));
+	if (multipart)
+		segments = multipart_byteranges(segments, ranges, content_type, boundary);
+	else if (range_request)
+		trim_segments(segments, ranges.front().first, ranges.front().last);
+
+	std::int64_t const body_size = segments_size(segments);
+
+	// the offset the stream starts at, in the first file
+	std::int64_t const range_first_byte = range_request ? ranges.front().first : 0;
+
+	// if we already have some of the pieces, and the files are stored in
+	// their default location on disk, we can read those pieces straight from
+	// the files rather than having libtorrent copy them into a heap
+	// allocated buffer for us.
+	torrent_state st = torrent_state_for(h);
+	file_opener open_file;
+#ifndef TORRENT_WINDOWS
+	if (!st.have.empty()) {
+		open_file = [ti,
+					 renames,
+					 save_path = std::move(st.save_path),
+					 priorities = std::move(st.priorities)](lt::file_index_t const f) {
+			return open_direct(ti->layout(), renames, save_path, priorities, f);
+		};
+	}
+#endif
+
+	// if this request continues where a previous stream of this file left
+	// off, we pick up its read-ahead window. If it's for another position in
+	// a file we recently streamed, the client sought, and the window starts
+	// over. The drain rate of the client is still a good estimate though.
+	// Archives always start with a fresh window
+	read_ahead ra(fs.piece_length());
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		auto it = std::find_if(
+			m_recent_streams.begin(),
+			m_recent_streams.end(),
+			[&](stream_position const& s) {
+				return !archive && s.torrent == h && s.file == file && s.offset == range_first_byte;
+			}
+		);
+		if (it == m_recent_streams.end()) {
+			it = std::find_if(
+				m_recent_streams.begin(),
+				m_recent_streams.end(),
+				[&](stream_position const& s) {
+					return !archive && s.torrent == h && s.file == file;
+				}
+			);
+		}
+		if (it != m_recent_streams.end()) {
+			ra = it->state;
+			if (it->offset != range_first_byte) ra.restart();
+			m_recent_streams.erase(it);
+		}
+	}
+	ra.torrent_state(st.download_payload_rate, st.distributed_copies);
 
 	// wrap the done callback to also remove the file_downloader_conn from the
 	// map
@@ -374,11 +1200,17 @@ void file_downloader::handle_http(
 			std::lock_guard<std::mutex> l(m_mutex);
 			auto conns = m_outstanding_requests.equal_range(h);
 			for (auto it = conns.first; it != conns.second;) {
-				if (it->second->stopped())
+				if (it->second->stopped()) {
+					auto [f, offset, state] = it->second->stream_position();
+					m_recent_streams.push_front({h, f, offset, std::move(state)});
+					if (m_recent_streams.size() > max_recent_streams)
+						m_recent_streams.pop_back();
 					it = m_outstanding_requests.erase(it);
-				else
+				} else {
 					++it;
+				}
 			}
+			if (m_outstanding_requests.count(h) == 0) m_deadlines.erase(h);
 		}
 		d(close);
 	};
@@ -387,15 +1219,23 @@ void file_downloader::handle_http(
 		socket,
 		std::move(wrap_done),
 		h,
-		first_piece,
-		end_piece,
-		offset,
-		ti->layout().piece_length(),
-		range_last_byte - range_first_byte + 1
+		ti,
+		m_cache,
+		std::move(segments),
+		std::move(open_file),
+		std::move(st.have),
+		std::move(ra)
 	);
 
 	{
+		// the deadlines of a torrent are dropped once it has no outstanding
+		// requests. Finding them and adding this request must happen
+		// together, or they may be dropped in between, and this stream end
+		// up with deadlines of its own
 		std::lock_guard<std::mutex> l(m_mutex);
+		auto& d = m_deadlines[h];
+		if (!d) d = std::make_shared<torrent_deadlines>(h, fs.piece_length());
+		freq->attach_deadlines(d);
 		m_outstanding_requests.emplace(h, freq);
 	}
 
@@ -405,21 +1245,25 @@ void file_downloader::handle_http(
 
 	// TODO: this could use make_unique
 	auto op = std::make_shared<write_header_op>(status, request.version());
-	op->res.content_length(range_last_byte - range_first_byte + 1);
+	op->res.content_length(body_size);
 	op->res.keep_alive(request.keep_alive());
 	op->res.set(http::field::accept_ranges, "bytes");
-	// TODO: get_renamed_files() is synchronous, we should use async functions only
-	lt::renamed_files const renames = h.get_renamed_files();
-	lt::string_view const fname = renames.file_name(ti->layout(), file);
-	op->res.set(http::field::content_type, mime_type(extension(fname)));
-	if (m_attachment) {
+	op->res.set(http::field::etag, etag);
+	if (last_modified > 0) op->res.set(http::field::last_modified, http_date(last_modified));
+	if (multipart) {
+		op->res.set(http::field::content_type, str("multipart/byteranges; boundary=", boundary));
+	} else {
+		op->res.set(http::field::content_type, content_type);
+	}
+	if (m_attachment || archive) {
 		op->res.set(
-			http::field::content_disposition, str("attachment; filename=", percent_encode(fname))
+			http::field::content_disposition, str("attachment; filename=", percent_encode(filename))
 		);
 	}
-	if (range_request) {
+	if (range_request && !multipart) {
 		std::stringstream range;
-		range << "bytes " << range_first_byte << '-' << range_last_byte << '/' << file_size;
+		range << "bytes " << ranges.front().first << '-' << ranges.front().last << '/'
+			  << content_size;
 		op->res.set(http::field::content_range, range.str());
 	}
 
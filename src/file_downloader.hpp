@@ -10,13 +10,22 @@ see LICENSE file.
 #ifndef LTWEB_FILE_DOWNLOADER_HPP
 #define LTWEB_FILE_DOWNLOADER_HPP
 
+#include <cstdint>
+#include <deque>
+#include <map>
 #include <memory>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "webui.hpp"
 #include "alert_observer.hpp"
+#include "read_ahead.hpp"
+#include "piece_cache.hpp"
 
 #include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/bitfield.hpp"
+#include "libtorrent/download_priority.hpp"
 
 namespace ltweb {
 struct alert_handler;
@@ -24,6 +33,7 @@ struct piece_alert_dispatch;
 struct auth_interface;
 struct piece_alert_dispatch;
 struct file_request_conn;
+struct torrent_deadlines;
 
 struct file_downloader
 	: http_handler
@@ -33,6 +43,15 @@ struct file_downloader
 
 	void set_disposition(bool attachment) { m_attachment = attachment; }
 
+	// the number of bytes of recently delivered pieces to keep in memory,
+	// for other streams of the same torrent to use
+	void set_piece_cache_size(std::int64_t size) { m_cache.set_max_size(size); }
+
+	// the number of bytes of piece buffers all downloads in the process may
+	// hold on to, combined. When exceeded, downloads shrink their read-ahead
+	// windows and connections to slow clients are closed
+	static void set_buffer_budget(std::int64_t bytes);
+
 private:
 	std::string path_prefix() const override;
 
@@ -45,6 +64,30 @@ private:
 	void shutdown() override;
 
 	void handle_alert(lt::alert const* a) override;
+	char const* observer_name() const override { return "file_downloader"; }
+
+	// update metrics, and close connections whose clients are idle, or slow
+	// while we're over the buffer budget. Must be called with m_mutex held
+	void reclaim_connections();
+
+	// what we need to know about a torrent to stream from it. To avoid
+	// asking libtorrent for it on every request, it's fetched by the first
+	// request for a torrent, and then kept up to date by alerts. Alerts we
+	// can't apply (like changed file priorities) drop the torrent's state,
+	// to be fetched again by its next request
+	struct torrent_state {
+		std::string save_path;
+		std::vector<lt::download_priority_t> priorities;
+		lt::typed_bitfield<lt::piece_index_t> have;
+		int download_payload_rate = 0;
+		float distributed_copies = 0.f;
+	};
+
+	// returns a copy of the state of h, fetching it if we don't have it
+	torrent_state torrent_state_for(lt::torrent_handle const& h);
+
+	// forgets the state of h. Must be called with m_mutex held
+	void drop_torrent_state(lt::torrent_handle const& h);
 
 	lt::session& m_ses;
 	auth_interface const& m_auth;
@@ -55,8 +98,33 @@ private:
 
 	alert_handler* m_alert;
 
+	// recently delivered pieces, shared by all streams
+	piece_cache m_cache;
+
 	std::mutex m_mutex;
 	std::multimap<lt::torrent_handle, std::shared_ptr<file_request_conn>> m_outstanding_requests;
+
+	// the piece deadlines of the streams of each torrent in
+	// m_outstanding_requests
+	std::map<lt::torrent_handle, std::shared_ptr<torrent_deadlines>> m_deadlines;
+
+	// where recently finished streams left off, most recent first. A
+	// request that continues one of them inherits its read-ahead window
+	struct stream_position {
+		lt::torrent_handle torrent;
+		lt::file_index_t file;
+		std::int64_t offset;
+		read_ahead state;
+	};
+	std::deque<stream_position> m_recent_streams;
+
+	// the state of the torrents we've streamed from, by handle. Protected
+	// by m_mutex
+	std::map<lt::torrent_handle, torrent_state> m_torrents;
+
+	// incremented every time a torrent's state is dropped. A state fetched
+	// while this changed may be stale, and is not kept
+	std::uint64_t m_torrents_epoch = 0;
 };
 } // namespace ltweb
 
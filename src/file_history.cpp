@@ -145,4 +145,10 @@ file_history::query(frame_t since_frame, std::uint16_t requested_mask) const
 	return masks;
 }
 
+std::size_t file_history::memory_used() const
+{
+	return sizeof(*this) + m_files.capacity() * sizeof(file_history_entry)
+		+ m_open_files.capacity() * sizeof(lt::file_index_t);
+}
+
 } // namespace ltweb
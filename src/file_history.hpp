@@ -17,6 +17,7 @@ see LICENSE file.
 #include "libtorrent/disk_interface.hpp" // open_file_state
 
 #include <vector>
+#include <cstddef>
 #include <cstdint>
 
 namespace ltweb {
@@ -47,6 +48,9 @@ struct file_history {
 	lt::sha1_hash const& info_hash() const { return m_ih; }
 	frame_t frame() const { return m_frame; }
 
+	// an estimate of the memory used by the history, in bytes
+	std::size_t memory_used() const;
+
 	// Feed a fresh snapshot of the dynamic fields.
 	// Pass nullptr for any field not fetched this round — it is treated as
 	// unchanged and its frame counter is left alone.
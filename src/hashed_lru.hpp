@@ -0,0 +1,216 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_HASHED_LRU_HPP
+#define LTWEB_HASHED_LRU_HPP
+
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace ltweb {
+
+// A cache of per-torrent state, bounded by the memory its entries use rather
+// than by their number. Entries are found through a hash table, and evicted
+// in least-recently-used order.
+//
+// The cache is split into shards by the hash of the key, each with its own
+// mutex and an equal share of the memory budget, so clients looking at
+// different torrents rarely contend. The mutexes are only held while a shard
+// is looked up or changed. Entries are handed out as shared_ptrs, and the
+// values need a lock of their own (if they're not immutable). An evicted
+// entry lives on until the last client using it lets go of it.
+//
+// The memory used by an entry is set by the client, through set_memory(),
+// whenever it may have changed. The entry used last is never evicted, so a
+// single entry larger than its shard's budget is still cached.
+//
+// The lookups and evictions are reported through the <name>.hits,
+// <name>.misses and <name>.evictions metrics, and the size of the cache
+// through <name>.entries and <name>.memory.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+struct hashed_lru {
+	hashed_lru(std::string const& name, std::size_t const max_memory, int const num_shards = 8)
+		: m_num_shards(std::size_t(std::max(num_shards, 1)))
+		, m_shard_budget(max_memory / m_num_shards)
+		, m_shards(new shard[m_num_shards])
+		, m_hits_metric(global_metrics().register_metric(name + ".hits", metric_type::counter))
+		, m_misses_metric(global_metrics().register_metric(name + ".misses", metric_type::counter))
+		, m_evictions_metric(
+			  global_metrics().register_metric(name + ".evictions", metric_type::counter)
+		  )
+		, m_entries_metric(global_metrics().register_metric(name + ".entries", metric_type::gauge))
+		, m_memory_metric(global_metrics().register_metric(name + ".memory", metric_type::gauge))
+	{}
+
+	~hashed_lru()
+	{
+		// the gauges are shared with other instances of the same name
+		global_metrics().inc(m_entries_metric, -m_entries.load());
+		global_metrics().inc(m_memory_metric, -m_memory.load());
+	}
+
+	hashed_lru(hashed_lru const&) = delete;
+	hashed_lru& operator=(hashed_lru const&) = delete;
+
+	// returns the entry of key, and marks it as the most recently used. If
+	// it's not in the cache, it's created by make(), which returns a
+	// shared_ptr<Value>. make() is called with the shard's mutex held, so
+	// nothing else can look up the key before it's in the cache
+	template <typename Make>
+	std::shared_ptr<Value> get(Key const& key, Make&& make)
+	{
+		shard& s = shard_for(key);
+		std::lock_guard<std::mutex> l(s.mutex);
+		auto const it = s.index.find(key);
+		if (it != s.index.end()) {
+			s.lru.splice(s.lru.begin(), s.lru, it->second);
+			global_metrics().inc(m_hits_metric);
+			return it->second->value;
+		}
+
+		global_metrics().inc(m_misses_metric);
+		s.lru.push_front(node{key, make(), sizeof(Value)});
+		s.index.emplace(key, s.lru.begin());
+		s.memory += sizeof(Value);
+		add_totals(1, std::int64_t(sizeof(Value)));
+		evict(s);
+		return s.lru.front().value;
+	}
+
+	// returns the entry of key, or nullptr if it's not in the cache. Unlike
+	// get(), this doesn't count as a use of the entry
+	std::shared_ptr<Value> find(Key const& key) const
+	{
+		shard const& s = shard_for(key);
+		std::lock_guard<std::mutex> l(s.mutex);
+		auto const it = s.index.find(key);
+		if (it == s.index.end()) return {};
+		return it->second->value;
+	}
+
+	// removes the entry of key. If v is set, only if it's still the entry
+	// of key, and not one created since
+	void erase(Key const& key, Value const* v = nullptr)
+	{
+		shard& s = shard_for(key);
+		std::lock_guard<std::mutex> l(s.mutex);
+		auto const it = s.index.find(key);
+		if (it == s.index.end()) return;
+		if (v != nullptr && it->second->value.get() != v) return;
+		remove(s, it->second);
+	}
+
+	// records the memory used by v, the entry of key, and evicts the least
+	// recently used entries of its shard if it's over budget
+	void set_memory(Key const& key, Value const* v, std::size_t const bytes)
+	{
+		shard& s = shard_for(key);
+		std::lock_guard<std::mutex> l(s.mutex);
+		auto const it = s.index.find(key);
+		if (it == s.index.end() || it->second->value.get() != v) return;
+		std::int64_t const diff = std::int64_t(bytes) - std::int64_t(it->second->memory);
+		it->second->memory = bytes;
+		s.memory = std::size_t(std::int64_t(s.memory) + diff);
+		add_totals(0, diff);
+		evict(s);
+	}
+
+	// returns all entries, to be visited without holding the shards' mutexes
+	std::vector<std::pair<Key, std::shared_ptr<Value>>> entries() const
+	{
+		std::vector<std::pair<Key, std::shared_ptr<Value>>> ret;
+		for (std::size_t i = 0; i < m_num_shards; ++i) {
+			shard const& s = m_shards[i];
+			std::lock_guard<std::mutex> l(s.mutex);
+			for (node const& n : s.lru)
+				ret.emplace_back(n.key, n.value);
+		}
+		return ret;
+	}
+
+	std::size_t size() const { return std::size_t(m_entries.load()); }
+	std::size_t memory_used() const { return std::size_t(m_memory.load()); }
+
+private:
+	struct node {
+		Key key;
+		std::shared_ptr<Value> value;
+		std::size_t memory;
+	};
+
+	struct shard {
+		mutable std::mutex mutex;
+		// most recently used at the front
+		std::list<node> lru;
+		std::unordered_map<Key, typename std::list<node>::iterator, Hash> index;
+		std::size_t memory = 0;
+	};
+
+	shard& shard_for(Key const& key) { return m_shards[Hash{}(key) % m_num_shards]; }
+	shard const& shard_for(Key const& key) const
+	{
+		return m_shards[Hash{}(key) % m_num_shards];
+	}
+
+	// must be called with the shard's mutex held
+	void remove(shard& s, typename std::list<node>::iterator const it)
+	{
+		s.memory -= it->memory;
+		add_totals(-1, -std::int64_t(it->memory));
+		s.index.erase(it->key);
+		s.lru.erase(it);
+	}
+
+	// must be called with the shard's mutex held
+	void evict(shard& s)
+	{
+		while (s.memory > m_shard_budget && s.lru.size() > 1) {
+			remove(s, std::prev(s.lru.end()));
+			global_metrics().inc(m_evictions_metric);
+		}
+	}
+
+	void add_totals(std::int64_t const entries, std::int64_t const memory)
+	{
+		m_entries.fetch_add(entries, std::memory_order_relaxed);
+		m_memory.fetch_add(memory, std::memory_order_relaxed);
+		global_metrics().inc(m_entries_metric, entries);
+		global_metrics().inc(m_memory_metric, memory);
+	}
+
+	std::size_t const m_num_shards;
+	std::size_t const m_shard_budget;
+	std::unique_ptr<shard[]> m_shards;
+
+	std::atomic<std::int64_t> m_entries{0};
+	std::atomic<std::int64_t> m_memory{0};
+
+	int const m_hits_metric;
+	int const m_misses_metric;
+	int const m_evictions_metric;
+	int const m_entries_metric;
+	int const m_memory_metric;
+};
+
+} // namespace ltweb
+
+#endif
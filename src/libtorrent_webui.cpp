@@ -16,7 +16,9 @@ see LICENSE file.
 #include <algorithm>
 #include <iterator>
 #include <optional>
+#include <unordered_map>
 #include <utility>
+#include <bit>
 
 #include "libtorrent_webui.hpp"
 #include "libtorrent/session.hpp"
@@ -33,6 +35,7 @@ see LICENSE file.
 #include "torrent_history.hpp"
 #include "websocket_conn.hpp"
 #include "wire_flags.hpp"
+#include "metrics.hpp"
 
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/core/multi_buffer.hpp>
@@ -127,7 +130,7 @@ struct rpc_entry {
 	bool (libtorrent_webui::*handler)(websocket_conn*, function_call);
 };
 
-static std::array<rpc_entry, 27> const functions = {{
+static std::array<rpc_entry, 33> const functions = {{
 	{"get-torrent-updates", &libtorrent_webui::get_torrent_updates},
 	{"start", &libtorrent_webui::start},
 	{"stop", &libtorrent_webui::stop},
@@ -155,8 +158,17 @@ static std::array<rpc_entry, 27> const functions = {{
 	{"get-tracker-updates", &libtorrent_webui::get_tracker_updates},
 	{"get-piece-states", &libtorrent_webui::get_piece_states},
 	{"set-tag", &libtorrent_webui::set_tag},
+	{"list-metrics", &libtorrent_webui::list_metrics},
+	{"get-metrics", &libtorrent_webui::get_metrics},
+	{"get-stats-history", &libtorrent_webui::get_stats_history},
+	{"subscribe-stats", &libtorrent_webui::subscribe_stats},
+	{"get-torrent-series", &libtorrent_webui::get_torrent_series},
+	{"get-alert-stats", &libtorrent_webui::get_alert_stats},
 }};
 
+// stats updates are pushed to subscribers as responses to this function
+constexpr int subscribe_stats_function = 30;
+
 // maps torrent field to RPC field. These fields are the ones defined in
 // torrent_history_entry
 std::array<int const, torrent_history_entry::num_fields> const torrent_field_map = {{
@@ -343,15 +355,16 @@ libtorrent_webui::libtorrent_webui(
 	, m_settings(sett)
 {
 
-	if (m_stats.size() < lt::counters::num_counters)
-		m_stats.resize(lt::counters::num_counters, std::pair<std::int64_t, frame_t>(0, 0));
+	m_stats_values.resize(lt::counters::num_counters, 0);
+	m_stats_frames.resize(lt::counters::num_counters, 0);
 
 	m_alert.subscribe<
 		lt::session_stats_alert,
 		lt::add_torrent_alert,
 		lt::piece_finished_alert,
 		lt::hash_failed_alert,
-		lt::torrent_checked_alert>(this);
+		lt::torrent_checked_alert,
+		lt::alerts_dropped_alert>(this);
 }
 
 libtorrent_webui::~libtorrent_webui() { m_alert.unsubscribe(this); }
@@ -1014,6 +1027,292 @@ bool libtorrent_webui::list_stats(websocket_conn* st, function_call f)
 	return st->send_packet(std::move(response));
 }
 
+bool libtorrent_webui::list_metrics(websocket_conn* st, function_call f)
+{
+	if (!st->perms()->allow_session_status()) return error(st, f, permission_denied);
+
+	std::vector<char> response;
+	std::back_insert_iterator<std::vector<char>> ptr(response);
+
+	write_uint8(f.function_id | 0x80, ptr);
+	write_uint16(f.transaction_id, ptr);
+	write_uint8(no_error, ptr);
+
+	std::vector<metrics::metric_info> const list = global_metrics().list();
+	write_uint16(list.size(), ptr);
+
+	for (auto const& m : list) {
+		write_uint8(static_cast<std::uint8_t>(m.type), ptr);
+		TORRENT_ASSERT(m.name.size() < 256);
+		write_uint8(m.name.size(), ptr);
+		std::copy(m.name.begin(), m.name.end(), ptr);
+	}
+
+	return st->send_packet(std::move(response));
+}
+
+bool libtorrent_webui::get_metrics(websocket_conn* st, function_call f)
+{
+	if (!st->perms()->allow_session_status()) return error(st, f, permission_denied);
+
+	std::vector<std::int64_t> const values = global_metrics().values();
+
+	std::vector<char> response = make_rpc_response(
+		f.function_id, f.transaction_id, no_error, 2 + values.size() * 8
+	);
+	auto ptr = std::back_inserter(response);
+
+	write_uint16(values.size(), ptr);
+	for (std::int64_t const v : values)
+		write_uint64(v, ptr);
+
+	return st->send_packet(std::move(response));
+}
+
+bool libtorrent_webui::get_stats_history(websocket_conn* st, function_call f)
+{
+	if (!st->perms()->allow_session_status()) return error(st, f, permission_denied);
+
+	char const* iptr = f.data;
+	if (f.len < 19) return error(st, f, invalid_number_of_args);
+	int const resolution = read_uint8(iptr);
+	std::int64_t const from = std::int64_t(read_uint64(iptr));
+	std::int64_t const to = std::int64_t(read_uint64(iptr));
+	int const num_stats = read_uint16(iptr);
+	if (f.len != 19 + num_stats * 2) return error(st, f, invalid_number_of_args);
+
+	std::vector<int> counters(std::size_t(num_stats));
+	for (int& c : counters) {
+		c = read_uint16(iptr);
+		if (c >= lt::counters::num_counters) return error(st, f, invalid_argument);
+	}
+
+	stats_history::result r;
+	{
+		std::lock_guard<std::mutex> l(m_stats_mutex);
+		if (resolution >= m_stats_history.num_resolutions())
+			return error(st, f, invalid_argument);
+		r = m_stats_history.query(resolution, from, to, counters);
+	}
+
+	std::vector<char> response = make_rpc_response(
+		f.function_id, f.transaction_id, no_error, 6 + r.timestamps.size() * 8 + r.values.size() * 8
+	);
+	auto ptr = std::back_inserter(response);
+
+	write_uint32(std::uint32_t(r.timestamps.size()), ptr);
+	write_uint16(std::uint16_t(num_stats), ptr);
+	auto value = r.values.begin();
+	for (std::int64_t const ts : r.timestamps) {
+		write_uint64(std::uint64_t(ts), ptr);
+		for (int i = 0; i < num_stats; ++i, ++value)
+			write_uint64(std::uint64_t(*value), ptr);
+	}
+
+	return st->send_packet(std::move(response));
+}
+
+bool libtorrent_webui::subscribe_stats(websocket_conn* st, function_call f)
+{
+	if (!st->perms()->allow_session_status()) return error(st, f, permission_denied);
+
+	char const* iptr = f.data;
+	if (f.len < 2) return error(st, f, invalid_number_of_args);
+	int const num_stats = read_uint16(iptr);
+	if (f.len != 2 + num_stats * 2) return error(st, f, invalid_number_of_args);
+
+	std::vector<int> counters(std::size_t(num_stats));
+	for (int& c : counters) {
+		c = read_uint16(iptr);
+		if (c >= lt::counters::num_counters) return error(st, f, invalid_argument);
+	}
+	std::sort(counters.begin(), counters.end());
+	counters.erase(std::unique(counters.begin(), counters.end()), counters.end());
+
+	std::vector<char> response =
+		make_rpc_response(f.function_id, f.transaction_id, no_error, 6 + counters.size() * 10);
+	auto ptr = std::back_inserter(response);
+
+	std::lock_guard<std::mutex> l(m_stats_mutex);
+
+	// a connection has at most one subscription. A new one replaces it
+	for (auto it = m_stats_subscriptions.begin(); it != m_stats_subscriptions.end();) {
+		auto& subs = it->second.subscribers;
+		subs.erase(
+			std::remove_if(
+				subs.begin(),
+				subs.end(),
+				[&](stats_subscriber const& s) {
+					auto const c = s.conn.lock();
+					return !c || c.get() == st;
+				}
+			),
+			subs.end()
+		);
+		if (subs.empty())
+			it = m_stats_subscriptions.erase(it);
+		else
+			++it;
+	}
+
+	// the response has the current values of all the counters. After that,
+	// only the ones that change are sent
+	write_uint32(m_stats_frame, ptr);
+	write_uint16(std::uint16_t(counters.size()), ptr);
+	for (int const c : counters) {
+		write_uint16(std::uint16_t(c), ptr);
+		write_uint64(std::uint64_t(m_stats_values[std::size_t(c)]), ptr);
+	}
+
+	// subscribing to no counters cancels the subscription
+	if (!counters.empty()) {
+		auto [it, added] = m_stats_subscriptions.try_emplace(counters);
+		if (added) {
+			it->second.mask.resize(counter_bitmap_words(lt::counters::num_counters), 0);
+			for (int const c : counters)
+				it->second.mask[std::size_t(c) / 64] |= std::uint64_t(1) << (c % 64);
+		}
+		it->second.subscribers.push_back({st->shared_from_this(), f.transaction_id});
+	}
+
+	return st->send_packet(std::move(response));
+}
+
+bool libtorrent_webui::get_torrent_series(websocket_conn* st, function_call f)
+{
+	if (!st->perms()->allow_list()) return error(st, f, permission_denied);
+
+	char const* iptr = f.data;
+	if (f.len != 37) return error(st, f, invalid_number_of_args);
+	lt::sha1_hash const ih(iptr);
+	iptr += 20;
+	int const resolution = read_uint8(iptr);
+	std::int64_t const from = std::int64_t(read_uint64(iptr));
+	std::int64_t const to = std::int64_t(read_uint64(iptr));
+
+	if (resolution >= m_hist.series_resolutions()) return error(st, f, invalid_argument);
+
+	// a torrent whose history was evicted has no samples, but still exists
+	std::vector<series_sample> samples;
+	if (!m_hist.query_series(ih, resolution, from, to, samples)
+		&& !m_hist.get_torrent_status(ih).handle.is_valid())
+		return error(st, f, resource_not_found);
+
+	std::vector<char> response =
+		make_rpc_response(f.function_id, f.transaction_id, no_error, 4 + samples.size() * 24);
+	auto ptr = std::back_inserter(response);
+
+	write_uint32(std::uint32_t(samples.size()), ptr);
+	for (series_sample const& s : samples) {
+		write_uint64(std::uint64_t(s.timestamp), ptr);
+		write_uint32(std::uint32_t(s.download_rate), ptr);
+		write_uint32(std::uint32_t(s.upload_rate), ptr);
+		write_uint32(std::uint32_t(s.num_peers), ptr);
+		write_uint32(std::uint32_t(s.progress_ppm), ptr);
+	}
+
+	return st->send_packet(std::move(response));
+}
+
+bool libtorrent_webui::get_alert_stats(websocket_conn* st, function_call f)
+{
+	if (!st->perms()->allow_session_status()) return error(st, f, permission_denied);
+
+	alert_stats const s = m_alert.stats();
+
+	std::vector<char> response = make_rpc_response(f.function_id, f.transaction_id, no_error);
+	auto ptr = std::back_inserter(response);
+
+	// strings are prefixed by an 8 bit length, and truncated to fit
+	auto const write_string = [&](std::string_view const str) {
+		std::size_t const len = std::min(str.size(), std::size_t(255));
+		write_uint8(len, ptr);
+		std::copy(str.begin(), str.begin() + std::ptrdiff_t(len), ptr);
+	};
+
+	write_uint64(s.batches, ptr);
+	write_uint32(std::uint32_t(s.last_batch_size), ptr);
+	write_uint32(std::uint32_t(s.max_batch_size), ptr);
+	write_uint64(s.pop_wait_us, ptr);
+	write_uint64(s.observer_wait_us, ptr);
+
+	write_uint16(s.types.size(), ptr);
+	for (alert_stats::alert_type const& t : s.types) {
+		write_uint16(std::uint16_t(t.type), ptr);
+		write_uint64(t.count, ptr);
+		write_uint32(std::uint32_t(t.rate), ptr);
+		write_uint64(t.dropped, ptr);
+		write_string(lt::alert_name(t.type));
+	}
+
+	write_uint16(s.observers.size(), ptr);
+	for (alert_stats::observer const& o : s.observers) {
+		write_string(o.name);
+		write_uint64(o.batches, ptr);
+		write_uint64(o.alerts, ptr);
+		write_uint64(o.total_us, ptr);
+		write_uint32(std::uint32_t(std::min(o.max_us, std::uint64_t(0xffffffff))), ptr);
+		write_uint32(std::uint32_t(std::min(o.last_us, std::uint64_t(0xffffffff))), ptr);
+		write_uint8(o.histogram.size(), ptr);
+		for (std::uint64_t const n : o.histogram)
+			write_uint64(n, ptr);
+	}
+
+	write_string(s.slowest_at_drop);
+
+	return st->send_packet(std::move(response));
+}
+
+void libtorrent_webui::push_stats(counter_bitmap const& changed)
+{
+	for (auto it = m_stats_subscriptions.begin(); it != m_stats_subscriptions.end();) {
+		stats_subscription& sub = it->second;
+		if (!intersects(changed, sub.mask)) {
+			++it;
+			continue;
+		}
+
+		// the update is encoded once for all subscribers of this set. Only
+		// the response header differs between them
+		std::vector<char> body;
+		auto ptr = std::back_inserter(body);
+		write_uint32(m_stats_frame, ptr);
+		write_uint16(0, ptr);
+		int num_updates = 0;
+		for (int const c : it->first) {
+			if ((changed[std::size_t(c) / 64] & (std::uint64_t(1) << (c % 64))) == 0) continue;
+			write_uint16(std::uint16_t(c), ptr);
+			write_uint64(std::uint64_t(m_stats_values[std::size_t(c)]), ptr);
+			++num_updates;
+		}
+		char* counter_ptr = &body[4];
+		write_uint16(std::uint16_t(num_updates), counter_ptr);
+
+		auto& subs = sub.subscribers;
+		subs.erase(
+			std::remove_if(
+				subs.begin(),
+				subs.end(),
+				[&](stats_subscriber const& s) {
+					auto const conn = s.conn.lock();
+					if (!conn) return true;
+					std::vector<char> packet = make_rpc_response(
+						subscribe_stats_function, s.transaction_id, no_error, body.size()
+					);
+					packet.insert(packet.end(), body.begin(), body.end());
+					conn->send_packet(std::move(packet));
+					return false;
+				}
+			),
+			subs.end()
+		);
+		if (subs.empty())
+			it = m_stats_subscriptions.erase(it);
+		else
+			++it;
+	}
+}
+
 void libtorrent_webui::handle_alert(lt::alert const* a)
 {
 	if (auto* ss = lt::alert_cast<lt::session_stats_alert>(a)) {
@@ -1023,14 +1322,22 @@ void libtorrent_webui::handle_alert(lt::alert const* a)
 		lt::span<std::int64_t const> stats = ss->counters();
 
 		// first update our copy of the stats, and update their frame counters
-		for (int i = 0; i < lt::counters::num_counters; ++i) {
-			if (m_stats[i].first != stats[i]) {
-				m_stats[i].second = m_stats_frame;
-				m_stats[i].first = stats[i];
+		counter_bitmap changed;
+		if (diff_counters(m_stats_values, {stats.data(), std::size_t(stats.size())}, changed)) {
+			for (std::size_t w = 0; w < changed.size(); ++w) {
+				for (std::uint64_t bits = changed[w]; bits != 0; bits &= bits - 1)
+					m_stats_frames[w * 64 + std::size_t(std::countr_zero(bits))] = m_stats_frame;
 			}
+			push_stats(changed);
 		}
 
-		// TODO: notify handler?
+		// the alert may have been posted a while ago
+		auto const posted =
+			std::chrono::system_clock::now() - (lt::clock_type::now() - ss->timestamp());
+		auto const since_epoch = posted.time_since_epoch();
+		std::int64_t const timestamp =
+			std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count();
+		m_stats_history.add(timestamp, {stats.data(), std::size_t(stats.size())});
 	} else if (auto* at = lt::alert_cast<lt::add_torrent_alert>(a)) {
 		auto* ud = static_cast<add_torrent_user_data*>(at->params.userdata);
 		if (ud == nullptr) return;
@@ -1042,7 +1349,8 @@ void libtorrent_webui::handle_alert(lt::alert const* a)
 		// unconditionally so the sentinel frame[tag] is bumped even when the
 		// effective tag is 0 (permission denied), making the true effective tag
 		// visible in the first get-torrent-updates response. Requires
-		// torrent_history to have subscribed to add_torrent_alert first so the
+		// torrent_history to have subscribed to add_torrent_alert first (or
+		// to be ordered first with alert_handler::dispatch_after()) so the
 		// entry already exists when we arrive here.
 		if (!at->error) {
 			lt::sha1_hash const ih = at->handle.info_hashes().get_best();
@@ -1058,30 +1366,59 @@ void libtorrent_webui::handle_alert(lt::alert const* a)
 		// created on demand by the first get-piece-states query, and we
 		// don't want every piece_finished alert to materialize one.
 		lt::sha1_hash const ih = pf->handle.info_hashes().get_best();
-		std::lock_guard<std::mutex> l(m_piece_states_mutex);
-		auto it = std::find_if(
-			m_piece_state_histories.begin(),
-			m_piece_state_histories.end(),
-			[&](piece_state_history const& ph) { return ph.info_hash() == ih; }
-		);
-		if (it != m_piece_state_histories.end()) it->on_piece_finished(pf->piece_index);
+		if (auto const e = m_piece_state_histories.find(ih)) {
+			std::lock_guard<std::mutex> l(e->mutex);
+			e->history.on_piece_finished(pf->piece_index);
+		}
 	} else if (auto* hf = lt::alert_cast<lt::hash_failed_alert>(a)) {
 		// Possible regression: a piece we may have considered "have" failed
 		// hash verification. Drop the history; the next query will rebuild
 		// it from the live bitfield.
-		lt::sha1_hash const ih = hf->handle.info_hashes().get_best();
-		std::lock_guard<std::mutex> l(m_piece_states_mutex);
-		m_piece_state_histories.remove_if([&](piece_state_history const& ph) {
-			return ph.info_hash() == ih;
-		});
+		m_piece_state_histories.erase(hf->handle.info_hashes().get_best());
 	} else if (auto* tc = lt::alert_cast<lt::torrent_checked_alert>(a)) {
 		// Force-recheck just completed; pieces may have regressed. Same
 		// drop-and-recreate treatment as hash_failed.
-		lt::sha1_hash const ih = tc->handle.info_hashes().get_best();
-		std::lock_guard<std::mutex> l(m_piece_states_mutex);
-		m_piece_state_histories.remove_if([&](piece_state_history const& ph) {
-			return ph.info_hash() == ih;
-		});
+		m_piece_state_histories.erase(tc->handle.info_hashes().get_best());
+	} else if (auto* ad = lt::alert_cast<lt::alerts_dropped_alert>(a)) {
+		if (!ad->dropped_alerts[lt::piece_finished_alert::alert_type]
+			&& !ad->dropped_alerts[lt::hash_failed_alert::alert_type]
+			&& !ad->dropped_alerts[lt::torrent_checked_alert::alert_type])
+			return;
+
+		// The piece-state histories may have missed completions, or a
+		// regression. Catch them up with the live bitfields, so clients
+		// keep getting correct deltas. The ones that regressed, or whose
+		// torrent is gone, are dropped, like on hash_failed. The bitfields
+		// of all the cached torrents are fetched in a single session call
+		auto const cached = m_piece_state_histories.entries();
+		if (cached.empty()) return;
+		std::unordered_map<lt::sha1_hash, lt::torrent_status> live;
+		for (auto const& [ih, e] : cached)
+			live.emplace(ih, lt::torrent_status());
+		std::vector<lt::torrent_status> st;
+		try {
+			m_ses.get_torrent_status(
+				&st,
+				[&](lt::torrent_status const& s) {
+					return live.count(s.info_hashes.get_best()) > 0;
+				},
+				lt::torrent_handle::query_pieces
+			);
+		} catch (lt::system_error const&) {
+			return;
+		}
+		for (auto& s : st)
+			live[s.info_hashes.get_best()] = std::move(s);
+
+		for (auto const& [ih, e] : cached) {
+			lt::torrent_status const& s = live[ih];
+			bool keep = false;
+			if (s.handle.is_valid()) {
+				std::lock_guard<std::mutex> l(e->mutex);
+				keep = e->history.reconcile(s.pieces);
+			}
+			if (!keep) m_piece_state_histories.erase(ih, e.get());
+		}
 	}
 }
 
@@ -1120,11 +1457,11 @@ bool libtorrent_webui::get_stats(websocket_conn* st, function_call f)
 	int num_updates = 0;
 	for (int i = 0; i < num_stats; ++i) {
 		int c = read_uint16(iptr);
-		if (c < 0 || c > int(m_stats.size())) return error(st, f, invalid_argument);
+		if (c < 0 || c >= int(m_stats_values.size())) return error(st, f, invalid_argument);
 
-		if (m_stats[c].second <= frame) continue;
+		if (m_stats_frames[c] <= frame) continue;
 		write_uint16(c, ptr);
-		write_uint64(m_stats[c].first, ptr);
+		write_uint64(m_stats_values[c], ptr);
 		++num_updates;
 	}
 
@@ -1167,95 +1504,97 @@ bool libtorrent_webui::get_file_updates(websocket_conn* st, function_call f)
 
 	lt::file_storage const& fs = t->layout();
 
-	// Only fetch data for the fields the client requested.
-	// file_progress(), get_file_priorities() and file_status() are all
-	// synchronous calls; skip them when not needed.
-	std::vector<std::int64_t> fp;
-	if (field_mask & 0x08) {
-		fp = h.file_progress(lt::torrent_handle::piece_granularity);
-		fp.resize(fs.num_files(), 0);
-	}
-
-	std::vector<lt::download_priority_t> fprio;
-	if (field_mask & 0x10) {
-		fprio = h.get_file_priorities();
-		fprio.resize(fs.num_files(), lt::default_priority);
-	}
-
-	std::vector<lt::open_file_state> fstatus;
-	if (field_mask & 0x20) fstatus = h.file_status();
+	// Only fetch data for the fields requested, by this client or the ones
+	// polling the torrent before it. file_progress(), get_file_priorities()
+	// and file_status() are all synchronous calls; skip them when not needed.
+	struct file_sample {
+		std::uint32_t fields = 0;
+		std::vector<std::int64_t> progress;
+		std::vector<lt::download_priority_t> priorities;
+		std::vector<lt::open_file_state> status;
+	};
+	auto sample = [&](std::uint32_t const fields) {
+		file_sample ret;
+		ret.fields = fields;
+		if (fields & 0x08) {
+			ret.progress = h.file_progress(lt::torrent_handle::piece_granularity);
+			ret.progress.resize(fs.num_files(), 0);
+		}
+		if (fields & 0x10) {
+			ret.priorities = h.get_file_priorities();
+			ret.priorities.resize(fs.num_files(), lt::default_priority);
+		}
+		if (fields & 0x20) ret.status = h.file_status();
+		return ret;
+	};
+	auto feed = [](file_history& fh, file_sample s) {
+		fh.update(
+			(s.fields & 0x08) ? &s.progress : nullptr,
+			(s.fields & 0x10) ? &s.priorities : nullptr,
+			(s.fields & 0x20) ? &s.status : nullptr
+		);
+	};
 
-	// Find or create the file_history for this info-hash in the LRU cache.
-	// Hold the mutex through response serialisation; release before send_packet.
+	// the response is serialised with the cache's mutex held, so the
+	// history can't change underneath it
 	std::vector<char> response;
-	std::unique_lock<std::mutex> l(m_file_mutex);
-	auto fh_it =
-		std::find_if(m_file_histories.begin(), m_file_histories.end(), [&](file_history const& fh) {
-			return fh.info_hash() == ih;
-		});
-	if (fh_it != m_file_histories.end())
-		m_file_histories.splice(m_file_histories.begin(), m_file_histories, fh_it);
-	else {
-		m_file_histories.emplace_front(ih, fs);
-		if (m_file_histories.size() > 10) m_file_histories.pop_back();
-	}
-	file_history& fh = m_file_histories.front();
-
-	frame_t const new_frame = fh.update(
-		(field_mask & 0x08) ? &fp : nullptr,
-		(field_mask & 0x10) ? &fprio : nullptr,
-		(field_mask & 0x20) ? &fstatus : nullptr
-	);
-
-	auto const per_file_masks = fh.query(client_frame, field_mask);
-
-	std::back_insert_iterator<std::vector<char>> ptr(response);
-
-	write_uint8(f.function_id | 0x80, ptr);
-	write_uint16(f.transaction_id, ptr);
-	write_uint8(no_error, ptr);
+	m_file_histories.get(
+		ih,
+		field_mask & 0x38,
+		[&] { return file_history(ih, fs); },
+		sample,
+		feed,
+		[&](file_history const& fh) {
+			auto const per_file_masks = fh.query(client_frame, field_mask);
+
+			std::back_insert_iterator<std::vector<char>> ptr(response);
+
+			write_uint8(f.function_id | 0x80, ptr);
+			write_uint16(f.transaction_id, ptr);
+			write_uint8(no_error, ptr);
+
+			write_uint32(fh.frame(), ptr);
+
+			// number of files
+			write_uint32(fs.num_files(), ptr);
+
+			for (auto const fi : fs.file_range()) {
+				int const i = static_cast<int>(fi);
+
+				if ((i % 8) == 0) {
+					// Build the 8-file presence bitmask using per-file masks.
+					int const remaining = fs.num_files() - i;
+					int const chunk = remaining < 8 ? remaining : 8;
+					std::uint8_t presence = 0;
+					for (int k = 0; k < chunk; ++k)
+						if (per_file_masks[i + k] != 0) presence |= std::uint8_t(0x80 >> k);
+					write_uint8(presence, ptr);
+				}
 
-	write_uint32(new_frame, ptr);
+				std::uint16_t const fmask = per_file_masks[i];
+				if (fmask == 0) continue;
 
-	// number of files
-	write_uint32(fs.num_files(), ptr);
+				write_uint16(fmask, ptr);
 
-	for (auto const fi : fs.file_range()) {
-		int const i = static_cast<int>(fi);
+				if (fmask & 0x01) write_uint8(static_cast<std::uint8_t>(fs.file_flags(fi)), ptr);
 
-		if ((i % 8) == 0) {
-			// Build the 8-file presence bitmask using per-file masks.
-			int const remaining = fs.num_files() - i;
-			int const chunk = remaining < 8 ? remaining : 8;
-			std::uint8_t presence = 0;
-			for (int k = 0; k < chunk; ++k)
-				if (per_file_masks[i + k] != 0) presence |= std::uint8_t(0x80 >> k);
-			write_uint8(presence, ptr);
-		}
+				if (fmask & 0x02) {
+					std::string name = fs.file_path(fi);
+					if (name.size() > 65535) name.resize(65535);
+					write_uint16(name.size(), ptr);
+					std::copy(name.begin(), name.end(), ptr);
+				}
 
-		std::uint16_t const fmask = per_file_masks[i];
-		if (fmask == 0) continue;
+				if (fmask & 0x04) write_uint64(fs.file_size(fi), ptr);
 
-		write_uint16(fmask, ptr);
+				if (fmask & 0x08) write_uint64(fh.progress(i), ptr);
 
-		if (fmask & 0x01) write_uint8(static_cast<std::uint8_t>(fs.file_flags(fi)), ptr);
+				if (fmask & 0x10) write_uint8(static_cast<std::uint8_t>(fh.priority(i)), ptr);
 
-		if (fmask & 0x02) {
-			std::string name = fs.file_path(fi);
-			if (name.size() > 65535) name.resize(65535);
-			write_uint16(name.size(), ptr);
-			std::copy(name.begin(), name.end(), ptr);
+				if (fmask & 0x20) write_uint8(static_cast<std::uint8_t>(fh.open_mode(i)), ptr);
+			}
 		}
-
-		if (fmask & 0x04) write_uint64(fs.file_size(fi), ptr);
-
-		if (fmask & 0x08) write_uint64(fh.progress(i), ptr);
-
-		if (fmask & 0x10) write_uint8(static_cast<std::uint8_t>(fh.priority(i)), ptr);
-
-		if (fmask & 0x20) write_uint8(static_cast<std::uint8_t>(fh.open_mode(i)), ptr);
-	}
-	l.unlock();
+	);
 
 	return st->send_packet(std::move(response));
 }
@@ -1274,40 +1613,37 @@ bool libtorrent_webui::get_peers_updates(websocket_conn* st, function_call f)
 	lt::torrent_handle h = m_hist.get_torrent_status(ih).handle;
 	if (!h.is_valid()) return error(st, f, invalid_argument);
 
-	std::vector<lt::peer_info> peers;
-	// TODO: get_peer_info() is a synchronous call. use the async. call
-	h.get_peer_info(peers);
+	auto sample = [&](std::uint32_t) {
+		std::vector<lt::peer_info> peers;
+		// TODO: get_peer_info() is a synchronous call. use the async. call
+		h.get_peer_info(peers);
 
-	// filter connections that haven't been established yet
-	// TODO: use remove_if() when we update to C++20
-	auto new_end = std::remove_if(peers.begin(), peers.end(), [](lt::peer_info& pi) {
-		return (pi.flags & lt::peer_info::connecting) || (pi.flags & lt::peer_info::handshake);
-	});
-	peers.erase(new_end, peers.end());
+		// filter connections that haven't been established yet
+		// TODO: use remove_if() when we update to C++20
+		auto new_end = std::remove_if(peers.begin(), peers.end(), [](lt::peer_info& pi) {
+			return (pi.flags & lt::peer_info::connecting) || (pi.flags & lt::peer_info::handshake);
+		});
+		peers.erase(new_end, peers.end());
+		return peers;
+	};
 
-	// Find or create the peer_history for this info-hash in the LRU cache.
 	// query() returns a self-contained value, so we can release the mutex
 	// before serialising the response.
 	frame_t new_frame;
 	peer_history::query_result r;
-	{
-		std::lock_guard<std::mutex> l(m_peer_mutex);
-		auto it = std::find_if(
-			m_peer_histories.begin(),
-			m_peer_histories.end(),
-			[&](peer_history const& ph) { return ph.info_hash() == ih; }
-		);
-		if (it != m_peer_histories.end())
-			m_peer_histories.splice(m_peer_histories.begin(), m_peer_histories, it);
-		else {
-			m_peer_histories.emplace_front(ih);
-			if (m_peer_histories.size() > 10) m_peer_histories.pop_back();
+	m_peer_histories.get(
+		ih,
+		1,
+		[&] { return peer_history(ih); },
+		sample,
+		[](peer_history& history, std::vector<lt::peer_info> peers) {
+			history.update(std::move(peers));
+		},
+		[&](peer_history const& history) {
+			new_frame = history.frame();
+			r = history.query(client_frame, field_mask);
 		}
-		peer_history& history = m_peer_histories.front();
-
-		new_frame = history.update(std::move(peers));
-		r = history.query(client_frame, field_mask);
-	}
+	);
 
 	if (r.updated.size() > std::size_t(0xffffffffu)) r.updated.resize(std::size_t(0xffffffffu));
 	if (r.removed.size() > std::size_t(0xfffffffeu)) r.removed.resize(std::size_t(0xfffffffeu));
@@ -1469,64 +1805,59 @@ bool libtorrent_webui::get_piece_updates(websocket_conn* st, function_call f)
 	lt::torrent_handle h = m_hist.get_torrent_status(ih).handle;
 	if (!h.is_valid()) return error(st, f, invalid_argument);
 
-	// Find or create the piece_history for this info-hash in the LRU cache.
 	// get_download_queue() returns block_info pointers into libtorrent's shared
-	// internal storage; concurrent calls are not safe. Hold the mutex across
-	// the call and all access to its result, releasing before send_packet.
+	// internal storage; concurrent calls are not safe. m_piece_histories
+	// samples it with its mutex held, and the response is serialised before
+	// it's released.
 	std::vector<char> response;
-	std::unique_lock<std::mutex> l(m_piece_mutex);
-	auto pieces = h.get_download_queue();
-	auto it = std::find_if(
-		m_piece_histories.begin(),
-		m_piece_histories.end(),
-		[&](piece_history const& ph) { return ph.info_hash() == ih; }
+	m_piece_histories.get(
+		ih,
+		1,
+		[&] { return piece_history(ih); },
+		[&](std::uint32_t) { return h.get_download_queue(); },
+		[](piece_history& history, std::vector<lt::partial_piece_info> pieces) {
+			history.update(std::move(pieces));
+		},
+		[&](piece_history const& history) {
+			auto const r = history.query(client_frame);
+
+			// cap all counts to 16-bit
+			std::uint16_t const n_full =
+				static_cast<std::uint16_t>(std::min(r.full_pieces.size(), std::size_t(0xffffu)));
+			std::uint16_t const n_updates =
+				static_cast<std::uint16_t>(std::min(r.block_updates.size(), std::size_t(0xffffu)));
+			std::uint16_t const n_removed =
+				static_cast<std::uint16_t>(std::min(r.removed.size(), std::size_t(0xffffu)));
+
+			std::back_insert_iterator<std::vector<char>> ptr(response);
+
+			write_uint8(f.function_id | 0x80, ptr);
+			write_uint16(f.transaction_id, ptr);
+			write_uint8(no_error, ptr);
+			write_uint32(history.frame(), ptr);
+			write_uint16(n_full, ptr);
+			write_uint16(n_updates, ptr);
+			write_uint16(r.is_snapshot ? std::uint16_t(0xffffu) : n_removed, ptr);
+
+			for (std::uint16_t i = 0; i < n_full; ++i) {
+				auto const& e = r.full_pieces[i];
+				write_uint32(static_cast<int>(e.piece_index), ptr);
+				write_uint16(static_cast<std::uint16_t>(e.num_blocks), ptr);
+				for (int b = 0; b < e.num_blocks; ++b)
+					write_uint8(e.state(b), ptr);
+			}
+			for (std::uint16_t i = 0; i < n_updates; ++i) {
+				auto const& bu = r.block_updates[i];
+				write_uint32(static_cast<int>(bu.piece_index), ptr);
+				write_uint16(static_cast<std::uint16_t>(bu.block_index), ptr);
+				write_uint8(bu.state, ptr);
+			}
+			if (!r.is_snapshot) {
+				for (std::uint16_t i = 0; i < n_removed; ++i)
+					write_uint32(static_cast<int>(r.removed[i]), ptr);
+			}
+		}
 	);
-	if (it != m_piece_histories.end())
-		m_piece_histories.splice(m_piece_histories.begin(), m_piece_histories, it);
-	else {
-		m_piece_histories.emplace_front(ih);
-		if (m_piece_histories.size() > 10) m_piece_histories.pop_back();
-	}
-	frame_t const new_frame = m_piece_histories.front().update(std::move(pieces));
-
-	auto const r = m_piece_histories.front().query(client_frame);
-
-	// cap all counts to 16-bit
-	std::uint16_t const n_full =
-		static_cast<std::uint16_t>(std::min(r.full_pieces.size(), std::size_t(0xffffu)));
-	std::uint16_t const n_updates =
-		static_cast<std::uint16_t>(std::min(r.block_updates.size(), std::size_t(0xffffu)));
-	std::uint16_t const n_removed =
-		static_cast<std::uint16_t>(std::min(r.removed.size(), std::size_t(0xffffu)));
-
-	std::back_insert_iterator<std::vector<char>> ptr(response);
-
-	write_uint8(f.function_id | 0x80, ptr);
-	write_uint16(f.transaction_id, ptr);
-	write_uint8(no_error, ptr);
-	write_uint32(new_frame, ptr);
-	write_uint16(n_full, ptr);
-	write_uint16(n_updates, ptr);
-	write_uint16(r.is_snapshot ? std::uint16_t(0xffffu) : n_removed, ptr);
-
-	for (std::uint16_t i = 0; i < n_full; ++i) {
-		auto const* e = r.full_pieces[i];
-		write_uint32(static_cast<int>(e->piece_index), ptr);
-		write_uint16(static_cast<std::uint16_t>(e->blocks.size()), ptr);
-		for (auto const& b : e->blocks)
-			write_uint8(b.state, ptr);
-	}
-	for (std::uint16_t i = 0; i < n_updates; ++i) {
-		auto const& bu = r.block_updates[i];
-		write_uint32(static_cast<int>(bu.piece_index), ptr);
-		write_uint16(static_cast<std::uint16_t>(bu.block_index), ptr);
-		write_uint8(bu.state, ptr);
-	}
-	if (!r.is_snapshot) {
-		for (std::uint16_t i = 0; i < n_removed; ++i)
-			write_uint32(static_cast<int>(r.removed[i]), ptr);
-	}
-	l.unlock();
 
 	return st->send_packet(std::move(response));
 }
@@ -1544,33 +1875,26 @@ bool libtorrent_webui::get_piece_states(websocket_conn* st, function_call f)
 	lt::torrent_handle h = m_hist.get_torrent_status(ih).handle;
 	if (!h.is_valid()) return error(st, f, resource_not_found);
 
-	std::unique_lock<std::mutex> l(m_piece_states_mutex);
-
-	auto it = std::find_if(
-		m_piece_state_histories.begin(),
-		m_piece_state_histories.end(),
-		[&](piece_state_history const& ph) { return ph.info_hash() == ih; }
-	);
-	if (it != m_piece_state_histories.end()) {
-		m_piece_state_histories.splice(
-			m_piece_state_histories.begin(), m_piece_state_histories, it
-		);
-	} else {
-		// No history yet (or it was just dropped due to a regression).
-		// Seed a fresh one from the live bitfield. status() is a
-		// cross-thread call to libtorrent, so the brief block on the
-		// network thread happens under our mutex; that's acceptable here
-		// because the cache is small and per-torrent first-query cost is
-		// already dominated by the bitfield copy.
+	// No history yet (or it was just dropped due to a regression): seed a
+	// fresh one from the live bitfield. status() is a cross-thread call to
+	// libtorrent, made with the cache shard's mutex held, so no
+	// piece_finished alert can slip in between the bitfield and the history
+	// being cached.
+	auto const e = m_piece_state_histories.get(ih, [&] {
 		lt::torrent_status ts = h.status(lt::torrent_handle::query_pieces);
-		m_piece_state_histories.emplace_front(ih, std::move(ts.pieces));
-		if (m_piece_state_histories.size() > 10) m_piece_state_histories.pop_back();
-	}
+		return std::make_shared<piece_state_entry>(ih, std::move(ts.pieces));
+	});
 
-	auto const r = m_piece_state_histories.front().query(client_frame);
 	// query_result owns its bitfield and added vector, so nothing below
 	// touches the cache. Drop the mutex before serializing.
-	l.unlock();
+	piece_state_history::query_result r;
+	std::size_t memory;
+	{
+		std::lock_guard<std::mutex> l(e->mutex);
+		r = e->history.query(client_frame);
+		memory = sizeof(piece_state_entry) + e->history.memory_used();
+	}
+	m_piece_state_histories.set_memory(ih, e.get(), memory);
 
 	std::vector<char> response;
 	std::back_insert_iterator<std::vector<char>> ptr(response);
@@ -1691,6 +2015,19 @@ bool libtorrent_webui::set_file_priority(websocket_conn* st, function_call f)
 	return error(st, f, no_error);
 }
 
+std::size_t libtorrent_webui::tracker_list::memory_used() const
+{
+	std::size_t ret = sizeof(*this) + trackers.capacity() * sizeof(lt::announce_entry);
+	for (lt::announce_entry const& ae : trackers) {
+		ret += ae.url.capacity() + ae.trackerid.capacity();
+		ret += ae.endpoints.capacity() * sizeof(lt::announce_endpoint);
+		for (lt::announce_endpoint const& ep : ae.endpoints)
+			for (lt::announce_infohash const& aih : ep.info_hashes)
+				ret += aih.message.capacity();
+	}
+	return ret;
+}
+
 bool libtorrent_webui::get_tracker_updates(websocket_conn* st, function_call f)
 {
 	if (!st->perms()->allow_list()) return error(st, f, permission_denied);
@@ -1704,8 +2041,19 @@ bool libtorrent_webui::get_tracker_updates(websocket_conn* st, function_call f)
 	lt::torrent_handle h = m_hist.get_torrent_status(ih).handle;
 	if (!h.is_valid()) return error(st, f, invalid_argument);
 
-	std::vector<lt::announce_entry> const trackers = h.trackers();
-	lt::info_hash_t const info_hashes = h.info_hashes();
+	std::vector<lt::announce_entry> trackers;
+	lt::info_hash_t info_hashes;
+	m_tracker_lists.get(
+		ih,
+		1,
+		[&] { return tracker_list{ih, {}, {}}; },
+		[&](std::uint32_t) { return tracker_list{ih, h.info_hashes(), h.trackers()}; },
+		[](tracker_list& l, tracker_list s) { l = std::move(s); },
+		[&](tracker_list const& l) {
+			trackers = l.trackers;
+			info_hashes = l.info_hashes;
+		}
+	);
 
 	std::vector<char> response;
 	std::back_insert_iterator<std::vector<char>> ptr(response);
@@ -15,6 +15,10 @@ see LICENSE file.
 #include "peer_history.hpp"
 #include "piece_state_history.hpp"
 #include "file_history.hpp"
+#include "stats_history.hpp"
+#include "counter_diff.hpp"
+#include "polled_cache.hpp"
+#include "hashed_lru.hpp"
 #include "libtorrent/torrent_handle.hpp"
 #include "libtorrent/fwd.hpp"
 #include "alert_observer.hpp"
@@ -22,12 +26,18 @@ see LICENSE file.
 
 #include "libtorrent/torrent_handle.hpp"
 #include "libtorrent/add_torrent_params.hpp"
+#include "libtorrent/announce_entry.hpp"
+#include "libtorrent/info_hash.hpp"
+#include "libtorrent/performance_counters.hpp"
 #include "libtorrent/fwd.hpp"
 
 #include <atomic>
-#include <list>
+#include <chrono>
+#include <cstddef>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <utility>
 #include <vector>
 
 #include <boost/beast/websocket/stream.hpp>
@@ -43,6 +53,9 @@ struct save_settings_interface;
 
 struct function_call;
 
+// the session stats history and the subscribe-stats pushes are fed by
+// session_stats_alerts. The host is expected to call
+// session::post_session_stats() periodically; they follow its rate
 struct libtorrent_webui
 	: http_handler
 	, alert_observer {
@@ -84,6 +97,12 @@ struct libtorrent_webui
 	bool get_tracker_updates(websocket_conn* st, function_call f);
 	bool get_piece_states(websocket_conn* st, function_call f);
 	bool set_tag(websocket_conn* st, function_call f);
+	bool list_metrics(websocket_conn* st, function_call f);
+	bool get_metrics(websocket_conn* st, function_call f);
+	bool get_stats_history(websocket_conn* st, function_call f);
+	bool subscribe_stats(websocket_conn* st, function_call f);
+	bool get_torrent_series(websocket_conn* st, function_call f);
+	bool get_alert_stats(websocket_conn* st, function_call f);
 
 	bool on_websocket_read(websocket_conn* st, lt::span<char const> data);
 
@@ -99,6 +118,7 @@ private:
 	) override;
 
 	void handle_alert(lt::alert const* a) override;
+	char const* observer_name() const override { return "libtorrent_webui"; }
 
 	bool respond(websocket_conn* st, function_call f, int error, int val);
 
@@ -127,40 +147,87 @@ private:
 	alert_handler& m_alert;
 	save_settings_interface& m_settings;
 
-	// LRU cache of piece histories, most-recently-used at the front.
-	// Capped at 10 entries; the least-recently-used is evicted when full.
-	// m_piece_mutex protects both the list structure and the entries in it.
-	std::mutex m_piece_mutex;
-	std::list<piece_history> m_piece_histories;
-
-	// LRU cache of peer histories, same eviction policy.
-	// m_peer_mutex protects both the list structure and the entries in it.
-	std::mutex m_peer_mutex;
-	std::list<peer_history> m_peer_histories;
-
-	// LRU cache of file histories, same eviction policy.
-	// m_file_mutex protects both the list structure and the entries in it.
-	std::mutex m_file_mutex;
-	std::list<file_history> m_file_histories;
-
-	// LRU cache of piece-state histories (the "have" bitfield for each
-	// torrent), same eviction policy. Accessed from both the websocket
-	// thread (queries) and the alert thread (piece_finished, hash_failed,
-	// torrent_checked). m_piece_states_mutex protects both the list
-	// structure and the entries.
-	std::mutex m_piece_states_mutex;
-	std::list<piece_state_history> m_piece_state_histories;
+	// the per-torrent details are sampled from libtorrent at most this often,
+	// all clients polling a torrent in between share the last sample
+	static constexpr std::chrono::milliseconds detail_interval{500};
+
+	// the memory each cache of per-torrent details may use, before the least
+	// recently used torrents are evicted
+	static constexpr std::size_t detail_cache_memory = 8 * 1024 * 1024;
+
+	// caches of the per-torrent details. get_download_queue() returns
+	// block_info pointers into storage shared by all torrents, so the
+	// download queues are sampled one at a time
+	polled_cache<piece_history> m_piece_histories{
+		"pieces", detail_cache_memory, detail_interval, true
+	};
+	polled_cache<peer_history> m_peer_histories{"peers", detail_cache_memory, detail_interval};
+	polled_cache<file_history> m_file_histories{"files", detail_cache_memory, detail_interval};
+
+	// the last tracker list of a torrent. Trackers don't have a history of
+	// their own, clients always get all of them
+	struct tracker_list {
+		lt::sha1_hash ih;
+		lt::info_hash_t info_hashes;
+		std::vector<lt::announce_entry> trackers;
+		lt::sha1_hash const& info_hash() const { return ih; }
+		std::size_t memory_used() const;
+	};
+	polled_cache<tracker_list> m_tracker_lists{
+		"trackers", detail_cache_memory / 8, detail_interval
+	};
+
+	// the piece-state histories (the "have" bitfield for each torrent).
+	// Accessed from both the websocket threads (queries) and the alert
+	// thread (piece_finished, hash_failed, torrent_checked), under the
+	// entry's mutex
+	struct piece_state_entry {
+		piece_state_entry(lt::sha1_hash const& ih, lt::typed_bitfield<lt::piece_index_t> pieces)
+			: history(ih, std::move(pieces))
+		{}
+		std::mutex mutex;
+		piece_state_history history;
+	};
+	hashed_lru<lt::sha1_hash, piece_state_entry> m_piece_state_histories{
+		"detail.piece_states", detail_cache_memory
+	};
 
 	std::mutex m_conns_mutex;
 	std::vector<std::weak_ptr<websocket_conn>> m_connections;
 
+	// sends the changed counters to the subscribers of stats updates
+	void push_stats(counter_bitmap const& changed);
+
 	std::mutex m_stats_mutex;
 	// TODO: factor this out into its own class
-	// the frame numbers where the stats counters changed
-	std::vector<std::pair<std::int64_t, frame_t>> m_stats;
+	// the latest values of the stats counters, and the frame numbers where
+	// they last changed
+	std::vector<std::int64_t> m_stats_values;
+	std::vector<frame_t> m_stats_frames;
 	// the current stats frame (incremented every time) stats
 	// are requested
 	frame_t m_stats_frame = 0;
+
+	struct stats_subscriber {
+		std::weak_ptr<websocket_conn> conn;
+		// the updates are sent as responses to the subscribe-stats call
+		std::uint16_t transaction_id;
+	};
+
+	// connections subscribing to the same set of counters share the encoded
+	// updates. The set is in mask, one bit per counter
+	struct stats_subscription {
+		counter_bitmap mask;
+		std::vector<stats_subscriber> subscribers;
+	};
+
+	// keyed by the (sorted) counters subscribed to. Protected by
+	// m_stats_mutex
+	std::map<std::vector<int>, stats_subscription> m_stats_subscriptions;
+
+	// the values of the stats counters over the last week, at a few
+	// resolutions. Also protected by m_stats_mutex
+	stats_history m_stats_history{lt::counters::num_counters};
 };
 } // namespace ltweb
 
@@ -0,0 +1,346 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "log_writer.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+
+namespace ltweb {
+
+namespace {
+std::int64_t current_second()
+{
+	auto const now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::seconds>(now).count();
+}
+} // anonymous namespace
+
+log_ring::log_ring(std::size_t const capacity)
+	: m_mask(std::bit_ceil(std::max(capacity, std::size_t(2))) - 1)
+{
+	m_slots.reset(new slot[m_mask + 1]);
+	for (std::size_t i = 0; i <= m_mask; ++i)
+		m_slots[i].seq.store(i, std::memory_order_relaxed);
+}
+
+bool log_ring::push(log_record& r)
+{
+	std::size_t pos = m_head.load(std::memory_order_relaxed);
+	for (;;) {
+		slot& s = m_slots[pos & m_mask];
+		std::size_t const seq = s.seq.load(std::memory_order_acquire);
+		auto const diff = std::ptrdiff_t(seq - pos);
+		if (diff == 0) {
+			// the slot is free in this lap. Claim it, unless another producer
+			// got there first
+			if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				s.record = std::move(r);
+				s.seq.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			// the slot still holds a record from the previous lap
+			return false;
+		} else {
+			pos = m_head.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+bool log_ring::pop(log_record& r)
+{
+	std::size_t const pos = m_tail.load(std::memory_order_relaxed);
+	slot& s = m_slots[pos & m_mask];
+	if (s.seq.load(std::memory_order_acquire) != pos + 1) return false;
+	r = std::move(s.record);
+	s.record.data = {};
+	// the slot is free for the next lap
+	s.seq.store(pos + m_mask + 1, std::memory_order_release);
+	m_tail.store(pos + 1, std::memory_order_relaxed);
+	return true;
+}
+
+std::size_t log_ring::size() const
+{
+	std::size_t const tail = m_tail.load(std::memory_order_relaxed);
+	std::size_t const head = m_head.load(std::memory_order_relaxed);
+	return head >= tail ? head - tail : 0;
+}
+
+log_writer::log_writer(std::size_t const queue_size, std::chrono::milliseconds const flush_interval)
+	: m_ring(queue_size)
+	, m_flush_interval(flush_interval)
+	, m_dropped_metric(global_metrics().register_metric("log.dropped", metric_type::counter))
+	, m_rate_limited_metric(
+		  global_metrics().register_metric("log.rate_limited", metric_type::counter)
+	  )
+	, m_written_metric(global_metrics().register_metric("log.written_bytes", metric_type::counter))
+{
+	m_thread = std::thread(&log_writer::thread_fun, this);
+}
+
+log_writer::~log_writer()
+{
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_stop = true;
+	}
+	m_work.notify_one();
+	m_thread.join();
+
+	std::lock_guard<std::mutex> l(m_mutex);
+	for (sink_state& s : m_sinks) {
+		s.open.store(false, std::memory_order_relaxed);
+		close_file(s);
+	}
+}
+
+int log_writer::add_sink(log_sink_config cfg)
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	for (int i = 0; i < max_sinks; ++i) {
+		sink_state& s = m_sinks[std::size_t(i)];
+		// a closed sink may still have a file, if its close record hasn't
+		// been written yet
+		if (s.open.load(std::memory_order_relaxed) || s.file || s.gz) continue;
+
+		s.cfg = std::move(cfg);
+		s.seq = 0;
+		if (!open_file(s)) return -1;
+
+		s.rate_limit = s.cfg.rate_limit;
+		s.window.store(0, std::memory_order_relaxed);
+		s.window_count.store(0, std::memory_order_relaxed);
+		s.rate_limited.store(0, std::memory_order_relaxed);
+		s.open.store(true, std::memory_order_release);
+		return i;
+	}
+	std::fprintf(stderr, "too many log files open\n");
+	return -1;
+}
+
+void log_writer::close_sink(int const sink)
+{
+	if (sink < 0 || sink >= max_sinks) return;
+	if (!m_sinks[std::size_t(sink)].open.exchange(false)) return;
+
+	// the close record must not be dropped. Wait for the writer to make room
+	log_record r{sink, true, {}};
+	while (!m_ring.push(r)) {
+		m_wake.store(true, std::memory_order_relaxed);
+		m_work.notify_one();
+		std::this_thread::yield();
+	}
+	flush();
+}
+
+bool log_writer::write(int const sink, std::vector<char> data)
+{
+	if (sink < 0 || sink >= max_sinks) return false;
+	sink_state& s = m_sinks[std::size_t(sink)];
+	if (!s.open.load(std::memory_order_acquire)) return false;
+
+	if (s.rate_limit > 0) {
+		std::int64_t const second = current_second();
+		std::int64_t window = s.window.load(std::memory_order_relaxed);
+		if (window != second
+			&& s.window.compare_exchange_strong(window, second, std::memory_order_relaxed))
+			s.window_count.store(0, std::memory_order_relaxed);
+		if (s.window_count.fetch_add(1, std::memory_order_relaxed) >= s.rate_limit) {
+			s.rate_limited.fetch_add(1, std::memory_order_relaxed);
+			global_metrics().inc(m_rate_limited_metric);
+			return false;
+		}
+	}
+
+	log_record r{sink, false, std::move(data)};
+	if (!m_ring.push(r)) {
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		global_metrics().inc(m_dropped_metric);
+		return false;
+	}
+
+	// don't wait for the flush interval if the ring is filling up. Only the
+	// first producer to see it wakes up the writer
+	if (m_ring.size() >= m_ring.capacity() / 2 && !m_wake.exchange(true, std::memory_order_relaxed))
+		m_work.notify_one();
+	return true;
+}
+
+void log_writer::flush()
+{
+	std::unique_lock<std::mutex> l(m_mutex);
+	// the writer isn't in the middle of a batch while we hold the mutex, so
+	// the next batch writes everything queued before this call
+	std::uint64_t const target = m_batches + 1;
+	m_wake.store(true, std::memory_order_relaxed);
+	m_work.notify_one();
+	m_written_cond.wait(l, [&] { return m_batches >= target || m_stop; });
+}
+
+std::uint64_t log_writer::rate_limited(int const sink) const
+{
+	if (sink < 0 || sink >= max_sinks) return 0;
+	return m_sinks[std::size_t(sink)].rate_limited.load(std::memory_order_relaxed);
+}
+
+bool log_writer::open_file(sink_state& s)
+{
+	std::string const name = s.cfg.file_name(s.seq);
+	if (s.seq > 0 && name == s.cfg.file_name(s.seq - 1)) {
+		std::error_code ec;
+		std::filesystem::rename(name, name + ".1", ec);
+	}
+
+	char const* mode = s.cfg.append ? "ab" : "wb";
+	if (s.cfg.compress)
+		s.gz = gzopen(name.c_str(), mode);
+	else
+		s.file = std::fopen(name.c_str(), mode);
+
+	if (s.file == nullptr && s.gz == nullptr) {
+		std::fprintf(
+			stderr,
+			"failed to open log file \"%s\": (%d) %s\n",
+			name.c_str(),
+			errno,
+			strerror(errno)
+		);
+		return false;
+	}
+
+	// the size limit applies to the uncompressed data written
+	s.offset = 0;
+	if (s.cfg.append && s.file) {
+		std::error_code ec;
+		auto const size = std::filesystem::file_size(name, ec);
+		if (!ec) s.offset = size;
+	}
+	s.opened = std::chrono::steady_clock::now();
+
+	if (s.cfg.format) {
+		if (s.file) s.cfg.format->file_opened(s.file);
+		std::vector<char> const header = s.cfg.format->begin_file();
+		write_file(s, header);
+	}
+	s.data_start = s.offset;
+	return true;
+}
+
+void log_writer::close_file(sink_state& s)
+{
+	if (s.file == nullptr && s.gz == nullptr) return;
+	if (s.cfg.format) {
+		std::vector<char> const trailer = s.cfg.format->end_file(s.offset);
+		write_file(s, trailer);
+	}
+	if (s.file) std::fclose(s.file);
+	if (s.gz) gzclose(s.gz);
+	s.file = nullptr;
+	s.gz = nullptr;
+	s.dirty = false;
+}
+
+void log_writer::rotate(sink_state& s)
+{
+	close_file(s);
+	++s.seq;
+	open_file(s);
+}
+
+void log_writer::check_shared_size(sink_state& s)
+{
+	if (s.file == nullptr || !s.cfg.format || !s.cfg.format->shared_file()) return;
+
+	std::error_code ec;
+	auto const size = std::filesystem::file_size(s.cfg.file_name(s.seq), ec);
+	if (ec) return;
+	s.offset = std::max(s.offset, std::uint64_t(size));
+	if (s.cfg.max_size > 0 && s.offset > s.cfg.max_size && s.offset > s.data_start) rotate(s);
+}
+
+void log_writer::write_file(sink_state& s, std::span<char const> const data)
+{
+	if (data.empty()) return;
+	if (s.file) std::fwrite(data.data(), 1, data.size(), s.file);
+	if (s.gz) gzwrite(s.gz, data.data(), unsigned(data.size()));
+	s.offset += data.size();
+	s.dirty = true;
+	global_metrics().inc(m_written_metric, std::int64_t(data.size()));
+}
+
+void log_writer::drain()
+{
+	log_record r;
+	while (m_ring.pop(r)) {
+		if (r.sink < 0 || r.sink >= max_sinks) continue;
+		sink_state& s = m_sinks[std::size_t(r.sink)];
+		if (r.close) {
+			close_file(s);
+			continue;
+		}
+		if (s.file == nullptr && s.gz == nullptr) continue;
+
+		if (s.cfg.max_size > 0 && s.offset > s.data_start
+			&& s.offset + r.data.size() > s.cfg.max_size) {
+			rotate(s);
+			if (s.file == nullptr && s.gz == nullptr) continue;
+		}
+
+		if (s.cfg.format) s.cfg.format->record(r.data, s.offset);
+		write_file(s, r.data);
+	}
+}
+
+void log_writer::thread_fun()
+{
+	std::unique_lock<std::mutex> l(m_mutex);
+	for (;;) {
+		m_work.wait_for(l, m_flush_interval, [&] {
+			return m_stop || m_wake.load(std::memory_order_relaxed);
+		});
+		m_wake.store(false, std::memory_order_relaxed);
+
+		drain();
+
+		auto const now = std::chrono::steady_clock::now();
+		for (sink_state& s : m_sinks) {
+			if (s.file == nullptr && s.gz == nullptr) continue;
+			// a file without records isn't rotated
+			if (s.cfg.max_age.count() > 0 && now - s.opened >= s.cfg.max_age
+				&& s.offset > s.data_start) {
+				rotate(s);
+				continue;
+			}
+			if (s.dirty) {
+				if (s.file) std::fflush(s.file);
+				if (s.gz) gzflush(s.gz, Z_SYNC_FLUSH);
+				s.dirty = false;
+			}
+			check_shared_size(s);
+		}
+
+		++m_batches;
+		m_written_cond.notify_all();
+		if (m_stop) break;
+	}
+}
+
+log_writer& global_log_writer()
+{
+	static log_writer w;
+	return w;
+}
+
+} // namespace ltweb
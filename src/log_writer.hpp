@@ -0,0 +1,237 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_LOG_WRITER_HPP
+#define LTWEB_LOG_WRITER_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+namespace ltweb {
+
+struct log_record {
+	int sink = -1;
+	// the sink is closed once the records before this one are written
+	bool close = false;
+	std::vector<char> data;
+};
+
+// A bounded queue of log records, for any number of producer threads and a
+// single consumer. Neither side takes a lock, a producer finding the queue
+// full fails rather than waiting. Each slot has a sequence number telling
+// whether it's ready to be written or read in the current lap of the ring.
+struct log_ring {
+	// the capacity is rounded up to a power of 2
+	explicit log_ring(std::size_t capacity);
+
+	log_ring(log_ring const&) = delete;
+	log_ring& operator=(log_ring const&) = delete;
+
+	// returns false, leaving r untouched, if the queue is full
+	bool push(log_record& r);
+
+	// returns false if the queue is empty. Must only be called by one thread
+	// at a time
+	bool pop(log_record& r);
+
+	std::size_t capacity() const { return m_mask + 1; }
+
+	// the number of records in the queue. Only approximate while records are
+	// being pushed or popped
+	std::size_t size() const;
+
+private:
+	struct slot {
+		std::atomic<std::size_t> seq;
+		log_record record;
+	};
+
+	std::unique_ptr<slot[]> m_slots;
+	std::size_t const m_mask;
+
+	// the producers and the consumer are kept on separate cache lines
+	alignas(64) std::atomic<std::size_t> m_head{0};
+	alignas(64) std::atomic<std::size_t> m_tail{0};
+};
+
+// Hooks for file formats with a header or a trailer. They are called on the
+// writer thread (or the thread adding the sink, for the first file)
+struct log_file_format {
+	virtual ~log_file_format() = default;
+
+	// returns what to write at the start of a new file
+	virtual std::vector<char> begin_file() { return {}; }
+
+	// called before a record is written at offset
+	virtual void record(std::span<char const>, std::uint64_t) {}
+
+	// returns what to write at offset, before the file is closed
+	virtual std::vector<char> end_file(std::uint64_t) { return {}; }
+
+	// called once a file is opened. Not called for compressed files
+	virtual void file_opened(FILE*) {}
+
+	// returns true if others write to the file too (like a redirected
+	// stderr). The size limit of such a file counts what they've written,
+	// as of the end of each batch
+	virtual bool shared_file() const { return false; }
+};
+
+struct log_sink_config {
+	// returns the name of the file with the specified sequence number,
+	// starting at 0. When a file is rotated and the next file has the same
+	// name, the old one is renamed to name.1 first, replacing an earlier one
+	std::function<std::string(int)> file_name;
+
+	// open existing files for appending, rather than truncating them
+	bool append = false;
+
+	// rotate the file once it's grown beyond this size, 0 means never
+	std::uint64_t max_size = 0;
+
+	// rotate the file once it's been open this long, 0 means never
+	std::chrono::seconds max_age{0};
+
+	// write the file with gzip compression
+	bool compress = false;
+
+	// at most this many records per second are accepted, 0 means no limit
+	int rate_limit = 0;
+
+	std::shared_ptr<log_file_format> format;
+};
+
+// Writes log files on a thread of its own, so the threads producing the log
+// records never wait for the disk. Records are queued in a log_ring, and
+// written in batches every flush_interval, or sooner if the ring is filling
+// up. Records that don't fit in the ring, or exceed the rate limit of their
+// sink, are dropped and counted.
+//
+// The number of records dropped is reported through the log.dropped and
+// log.rate_limited metrics.
+struct log_writer {
+	// the largest number of sinks open at the same time
+	static constexpr int max_sinks = 8;
+
+	explicit log_writer(
+		std::size_t queue_size = 8192,
+		std::chrono::milliseconds flush_interval = std::chrono::milliseconds(200)
+	);
+
+	// writes everything still queued and closes all sinks before returning
+	~log_writer();
+
+	log_writer(log_writer const&) = delete;
+	log_writer& operator=(log_writer const&) = delete;
+
+	// opens the first file of a sink. Returns the sink, to pass to write(),
+	// or -1 if the file couldn't be opened or there are too many sinks
+	int add_sink(log_sink_config cfg);
+
+	// writes the records queued for the sink and closes it, before returning.
+	// The sink must not be written to after this
+	void close_sink(int sink);
+
+	// queues a record to be written to the sink. Returns false if it was
+	// dropped. Never blocks
+	bool write(int sink, std::vector<char> data);
+
+	// blocks until the records queued so far have been written
+	void flush();
+
+	// the number of records dropped because the queue was full, or because
+	// of the rate limit of the sink
+	std::uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+	std::uint64_t rate_limited(int sink) const;
+
+private:
+	struct sink_state {
+		// these are read by the producers
+		std::atomic<bool> open{false};
+		int rate_limit = 0;
+		// the second the rate limit counts records for, and how many
+		std::atomic<std::int64_t> window{0};
+		std::atomic<int> window_count{0};
+		std::atomic<std::uint64_t> rate_limited{0};
+
+		// the rest is protected by m_mutex
+		log_sink_config cfg;
+		FILE* file = nullptr;
+		gzFile gz = nullptr;
+		int seq = 0;
+		// the number of bytes written to the current file, and where the first
+		// record is
+		std::uint64_t offset = 0;
+		std::uint64_t data_start = 0;
+		// set when the file has been written to since it was last flushed
+		bool dirty = false;
+		std::chrono::steady_clock::time_point opened;
+	};
+
+	bool open_file(sink_state& s);
+	void close_file(sink_state& s);
+	void rotate(sink_state& s);
+	// picks up the size of a shared file (see log_file_format::shared_file()),
+	// and rotates it if it's grown beyond the limit
+	void check_shared_size(sink_state& s);
+	void write_file(sink_state& s, std::span<char const> data);
+	void thread_fun();
+
+	// writes everything in the ring. Must be called with m_mutex held
+	void drain();
+
+	log_ring m_ring;
+	std::chrono::milliseconds const m_flush_interval;
+
+	std::array<sink_state, max_sinks> m_sinks;
+
+	std::atomic<std::uint64_t> m_dropped{0};
+
+	int const m_dropped_metric;
+	int const m_rate_limited_metric;
+	int const m_written_metric;
+
+	std::mutex m_mutex;
+
+	// wakes up the writer thread before the flush interval has passed
+	std::condition_variable m_work;
+	std::atomic<bool> m_wake{false};
+
+	// signals flush() and close_sink() that a batch has been written
+	std::condition_variable m_written_cond;
+
+	// the number of batches written. flush() waits for it to increment
+	std::uint64_t m_batches = 0;
+
+	bool m_stop = false;
+
+	// this is last, to be started once everything else is initialized
+	std::thread m_thread;
+};
+
+// the process-wide log writer, shared by stats_logging and error_logger
+log_writer& global_log_writer();
+
+} // namespace ltweb
+
+#endif
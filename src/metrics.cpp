@@ -0,0 +1,65 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace ltweb {
+
+metrics::metrics()
+{
+	for (auto& v : m_values)
+		v.store(0, std::memory_order_relaxed);
+}
+
+int metrics::register_metric(std::string name, metric_type const type)
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	auto const it = std::find_if(m_info.begin(), m_info.end(), [&](metric_info const& m) {
+		return m.name == name;
+	});
+	if (it != m_info.end()) return int(it - m_info.begin());
+
+	if (int(m_info.size()) >= max_metrics) throw std::length_error("too many metrics");
+
+	m_info.push_back({std::move(name), type});
+	return int(m_info.size()) - 1;
+}
+
+std::vector<metrics::metric_info> metrics::list() const
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	return m_info;
+}
+
+std::vector<std::int64_t> metrics::values() const
+{
+	int const num = size();
+	std::vector<std::int64_t> ret;
+	ret.reserve(num);
+	for (int i = 0; i < num; ++i)
+		ret.push_back(value(i));
+	return ret;
+}
+
+int metrics::size() const
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	return int(m_info.size());
+}
+
+metrics& global_metrics()
+{
+	static metrics m;
+	return m;
+}
+
+} // namespace ltweb
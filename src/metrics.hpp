@@ -0,0 +1,82 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_METRICS_HPP
+#define LTWEB_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ltweb {
+
+// the types match lt::metric_type_t, so clients can treat these the same way
+// as the session stats
+enum class metric_type : std::uint8_t { counter = 0, gauge = 1 };
+
+// A registry of the web UI's own counters and gauges, as opposed to
+// libtorrent's session stats. Components register their metrics by name
+// once, and then update them through the returned index. Updating a metric
+// is a relaxed atomic operation, so it's cheap enough to do on every event.
+//
+// Metrics are never unregistered. Registering a name that already exists
+// returns the existing index, so a component that's created more than once
+// shares its metrics with its earlier instances.
+struct metrics {
+	// the maximum number of metrics that can be registered
+	static constexpr int max_metrics = 256;
+
+	metrics();
+
+	// returns the index of the metric with the specified name, registering
+	// it if it doesn't already exist. Throws std::length_error if the
+	// registry is full
+	int register_metric(std::string name, metric_type type);
+
+	void inc(int const idx, std::int64_t const n = 1)
+	{
+		m_values[idx].fetch_add(n, std::memory_order_relaxed);
+	}
+	void set(int const idx, std::int64_t const n)
+	{
+		m_values[idx].store(n, std::memory_order_relaxed);
+	}
+	std::int64_t value(int const idx) const
+	{
+		return m_values[idx].load(std::memory_order_relaxed);
+	}
+
+	struct metric_info {
+		std::string name;
+		metric_type type;
+	};
+
+	// the names and types of all registered metrics, in index order
+	std::vector<metric_info> list() const;
+
+	// the current values of all registered metrics, in index order
+	std::vector<std::int64_t> values() const;
+
+	int size() const;
+
+private:
+	mutable std::mutex m_mutex;
+	std::vector<metric_info> m_info;
+	std::array<std::atomic<std::int64_t>, max_metrics> m_values;
+};
+
+// the process-wide metrics registry
+metrics& global_metrics();
+
+} // namespace ltweb
+
+#endif
@@ -0,0 +1,182 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_ORDERED_PIPELINE_HPP
+#define LTWEB_ORDERED_PIPELINE_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace ltweb {
+
+// Transforms a sequence of items on a pool of worker threads, and delivers the
+// results in the order the items were pushed. Items are grouped in batches,
+// and the sink is called with one batch of results at a time, from a thread of
+// its own. At most max_batches are in flight at any time (queued, being
+// transformed or waiting to be delivered), push() blocks when the pipeline is
+// full. This bounds the memory used, and makes a slow sink slow down the
+// producer.
+template <typename In, typename Out>
+struct ordered_pipeline {
+	using transform_fun = std::function<Out(In&)>;
+	using sink_fun = std::function<void(std::vector<Out>&)>;
+
+	ordered_pipeline(
+		int const num_workers,
+		std::size_t const batch_size,
+		std::size_t const max_batches,
+		transform_fun transform,
+		sink_fun sink
+	)
+		: m_batch_size(std::max(batch_size, std::size_t(1)))
+		, m_max_batches(std::max(max_batches, std::size_t(1)))
+		, m_transform(std::move(transform))
+		, m_sink(std::move(sink))
+	{
+		for (int i = 0; i < std::max(num_workers, 1); ++i)
+			m_workers.emplace_back([this] { worker(); });
+		m_sink_thread = std::thread([this] { deliver(); });
+	}
+
+	// delivers everything pushed so far
+	~ordered_pipeline() { finish(); }
+
+	ordered_pipeline(ordered_pipeline const&) = delete;
+	ordered_pipeline& operator=(ordered_pipeline const&) = delete;
+
+	void push(In item)
+	{
+		if (!m_filling) m_filling = std::make_shared<batch>();
+		m_filling->in.push_back(std::move(item));
+		if (m_filling->in.size() >= m_batch_size) submit();
+	}
+
+	// submits the last, partial, batch and returns once all batches have been
+	// delivered to the sink, and the threads have exited
+	void finish()
+	{
+		if (!m_sink_thread.joinable()) return;
+		if (m_filling) submit();
+		{
+			std::lock_guard<std::mutex> l(m_mutex);
+			m_finished = true;
+		}
+		m_work_cond.notify_all();
+		m_done_cond.notify_all();
+		for (auto& t : m_workers)
+			t.join();
+		m_sink_thread.join();
+	}
+
+private:
+	struct batch {
+		std::vector<In> in;
+		std::vector<Out> out;
+		std::size_t remaining = 0;
+	};
+
+	// called by the producer thread
+	void submit()
+	{
+		std::shared_ptr<batch> b = std::move(m_filling);
+		b->out.resize(b->in.size());
+		b->remaining = b->in.size();
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_space_cond.wait(l, [&] { return m_batches.size() < m_max_batches; });
+		m_batches.push_back(b);
+		for (std::size_t i = 0; i < b->in.size(); ++i)
+			m_work.emplace_back(b, i);
+		l.unlock();
+		m_work_cond.notify_all();
+	}
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (;;) {
+			m_work_cond.wait(l, [&] { return m_finished || !m_work.empty(); });
+			if (m_work.empty()) return;
+
+			auto [b, i] = std::move(m_work.front());
+			m_work.pop_front();
+			l.unlock();
+
+			Out result = m_transform(b->in[i]);
+
+			l.lock();
+			b->out[i] = std::move(result);
+			if (--b->remaining == 0 && b == m_batches.front()) m_done_cond.notify_one();
+		}
+	}
+
+	void deliver()
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (;;) {
+			m_done_cond.wait(l, [&] {
+				return (m_finished && m_batches.empty())
+					|| (!m_batches.empty() && m_batches.front()->remaining == 0);
+			});
+			if (m_batches.empty()) return;
+
+			std::shared_ptr<batch> b = std::move(m_batches.front());
+			m_batches.pop_front();
+			l.unlock();
+			m_space_cond.notify_one();
+
+			m_sink(b->out);
+
+			l.lock();
+		}
+	}
+
+	std::size_t const m_batch_size;
+	std::size_t const m_max_batches;
+	transform_fun m_transform;
+	sink_fun m_sink;
+
+	// the batch the producer is currently filling. Only touched by the
+	// producer thread
+	std::shared_ptr<batch> m_filling;
+
+	std::mutex m_mutex;
+
+	// batches in flight, in the order they were pushed
+	std::deque<std::shared_ptr<batch>> m_batches;
+
+	// items waiting to be picked up by a worker
+	std::deque<std::pair<std::shared_ptr<batch>, std::size_t>> m_work;
+
+	// signalled when there's work for the workers
+	std::condition_variable m_work_cond;
+
+	// signalled when the first batch is complete
+	std::condition_variable m_done_cond;
+
+	// signalled when a batch has been delivered, and there's room for another
+	std::condition_variable m_space_cond;
+
+	bool m_finished = false;
+
+	std::vector<std::thread> m_workers;
+	std::thread m_sink_thread;
+};
+
+} // namespace ltweb
+
+#endif
@@ -229,4 +229,13 @@ void peer_history_entry::update_info(lt::peer_info pi, frame_t const f)
 	info = std::move(pi);
 }
 
+std::size_t peer_history::memory_used() const
+{
+	std::size_t ret = sizeof(*this) + m_peers.capacity() * sizeof(peer_history_entry)
+		+ m_removed.size() * sizeof(removed_entry);
+	for (auto const& p : m_peers)
+		ret += std::size_t(p.info.pieces.num_bytes()) + p.info.client.capacity();
+	return ret;
+}
+
 } // namespace ltweb
@@ -15,6 +15,7 @@ see LICENSE file.
 #include "libtorrent/peer_info.hpp"
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <deque>
 #include <vector>
@@ -66,6 +67,9 @@ struct peer_history {
 	// Any query with since_frame < horizon() is treated as a full snapshot.
 	frame_t horizon() const { return m_horizon; }
 
+	// an estimate of the memory used by the history, in bytes
+	std::size_t memory_used() const;
+
 	// Feed a fresh peer snapshot.
 	// Always increments the internal frame counter and returns the new frame.
 	// Takes peers by value: callers may std::move() to avoid the copy, since
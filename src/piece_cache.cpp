@@ -0,0 +1,109 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "piece_cache.hpp"
+
+namespace ltweb {
+
+piece_cache::piece_cache(std::int64_t const max_size)
+	: m_max_size(max_size)
+{
+}
+
+void piece_cache::insert(
+	lt::torrent_handle const& h,
+	lt::piece_index_t const piece,
+	boost::shared_array<char> buf,
+	int const size
+)
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	if (size > m_max_size || !buf) return;
+
+	key const k{h, piece};
+	auto const it = m_index.find(k);
+	if (it != m_index.end()) {
+		m_size -= it->second->size;
+		m_lru.erase(it->second);
+		m_index.erase(it);
+	}
+
+	m_lru.push_front(entry{k, std::move(buf), size});
+	m_index.emplace(k, m_lru.begin());
+	m_size += size;
+	evict();
+}
+
+boost::shared_array<char>
+piece_cache::find(lt::torrent_handle const& h, lt::piece_index_t const piece)
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	auto const it = m_index.find(key{h, piece});
+	if (it == m_index.end()) {
+		++m_misses;
+		return {};
+	}
+	++m_hits;
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	return it->second->buffer;
+}
+
+void piece_cache::erase(lt::torrent_handle const& h)
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	auto it = m_index.lower_bound(key{h, lt::piece_index_t{0}});
+	while (it != m_index.end() && it->first.first == h) {
+		m_size -= it->second->size;
+		m_lru.erase(it->second);
+		it = m_index.erase(it);
+	}
+}
+
+void piece_cache::set_max_size(std::int64_t const max_size)
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	m_max_size = max_size;
+	evict();
+}
+
+std::int64_t piece_cache::size() const
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	return m_size;
+}
+
+int piece_cache::num_pieces() const
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	return int(m_lru.size());
+}
+
+std::int64_t piece_cache::hits() const
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	return m_hits;
+}
+
+std::int64_t piece_cache::misses() const
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	return m_misses;
+}
+
+void piece_cache::evict()
+{
+	while (m_size > m_max_size && !m_lru.empty()) {
+		entry const& e = m_lru.back();
+		m_size -= e.size;
+		m_index.erase(e.k);
+		m_lru.pop_back();
+	}
+}
+
+} // namespace ltweb
@@ -0,0 +1,90 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_PIECE_CACHE_HPP
+#define LTWEB_PIECE_CACHE_HPP
+
+#include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/units.hpp" // piece_index_t
+
+#include <boost/shared_array.hpp>
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace ltweb {
+
+// An LRU cache of piece buffers recently delivered by libtorrent (in
+// read_piece_alerts), bounded by the total number of bytes. This lets
+// streams of the same content that are a little behind each other share the
+// pieces, rather than having libtorrent read them from disk again.
+//
+// The buffers are reference counted, so evicting a piece that's still being
+// sent to a client doesn't free it, it just doesn't count towards the
+// budget anymore.
+//
+// All member functions are thread safe.
+struct piece_cache {
+	explicit piece_cache(std::int64_t max_size);
+
+	// add the buffer for the specified piece. If the piece is already in the
+	// cache, its buffer is replaced. Least recently used pieces are evicted
+	// to stay within the size limit. Pieces larger than the entire cache are
+	// not inserted
+	void insert(
+		lt::torrent_handle const& h, lt::piece_index_t piece, boost::shared_array<char> buf, int size
+	);
+
+	// returns the buffer for the piece, or an empty buffer if it's not in the
+	// cache. A hit makes the piece the most recently used
+	boost::shared_array<char> find(lt::torrent_handle const& h, lt::piece_index_t piece);
+
+	// remove all pieces belonging to the specified torrent
+	void erase(lt::torrent_handle const& h);
+
+	// change the size limit, evicting pieces if necessary
+	void set_max_size(std::int64_t max_size);
+
+	// the number of bytes of piece buffers in the cache
+	std::int64_t size() const;
+	int num_pieces() const;
+
+	std::int64_t hits() const;
+	std::int64_t misses() const;
+
+private:
+	void evict();
+
+	using key = std::pair<lt::torrent_handle, lt::piece_index_t>;
+
+	struct entry {
+		key k;
+		boost::shared_array<char> buffer;
+		int size;
+	};
+
+	mutable std::mutex m_mutex;
+
+	// most recently used first
+	std::list<entry> m_lru;
+	std::map<key, std::list<entry>::iterator> m_index;
+
+	std::int64_t m_size = 0;
+	std::int64_t m_max_size;
+
+	std::int64_t m_hits = 0;
+	std::int64_t m_misses = 0;
+};
+
+} // namespace ltweb
+
+#endif
@@ -0,0 +1,150 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "piece_deadlines.hpp"
+
+#include <algorithm>
+
+namespace ltweb {
+
+namespace {
+
+using interest = std::vector<std::pair<int, lt::time_point>>;
+
+lt::time_point earliest(interest const& streams)
+{
+	auto const it = std::min_element(
+		streams.begin(),
+		streams.end(),
+		[](auto const& lhs, auto const& rhs) { return lhs.second < rhs.second; }
+	);
+	return it->second;
+}
+
+} // namespace
+
+piece_deadlines::piece_deadlines(int const budget)
+	: m_budget(budget)
+{
+}
+
+int piece_deadlines::add_stream()
+{
+	int const ret = m_next_stream++;
+	m_streams.emplace(ret, 1);
+	return ret;
+}
+
+void piece_deadlines::remove_stream(int const stream, std::vector<deadline_update>& out)
+{
+	if (m_streams.erase(stream) == 0) return;
+	for (auto it = m_pieces.begin(); it != m_pieces.end();) {
+		auto const next = std::next(it);
+		release_impl(it, stream, out);
+		it = next;
+	}
+}
+
+int piece_deadlines::window(int const stream, int wanted)
+{
+	wanted = std::max(1, wanted);
+	m_streams[stream] = wanted;
+
+	int total = 0;
+	for (auto const& s : m_streams)
+		total += s.second;
+	if (total <= m_budget) return wanted;
+
+	// water-filling. Streams asking for less than an even split of what's
+	// left get what they ask for, the rest share the remainder evenly
+	std::vector<int> wants;
+	wants.reserve(m_streams.size());
+	for (auto const& s : m_streams)
+		wants.push_back(s.second);
+	std::sort(wants.begin(), wants.end());
+
+	int left = m_budget;
+	int num_left = int(wants.size());
+	int level = 0;
+	for (int const w : wants) {
+		level = left / num_left;
+		if (w > level) break;
+		left -= w;
+		--num_left;
+	}
+	return std::min(wanted, std::max(1, level));
+}
+
+void piece_deadlines::request(
+	int const stream,
+	lt::piece_index_t const piece,
+	lt::time_point const deadline,
+	std::vector<deadline_update>& out
+)
+{
+	interest& streams = m_pieces[piece];
+	bool const first = streams.empty();
+	lt::time_point const before = first ? lt::time_point::max() : earliest(streams);
+
+	auto const it = std::find_if(streams.begin(), streams.end(), [=](auto const& s) {
+		return s.first == stream;
+	});
+	if (it == streams.end())
+		streams.emplace_back(stream, deadline);
+	else
+		it->second = deadline;
+
+	lt::time_point const after = earliest(streams);
+	if (first || after != before) out.push_back({piece, true, after});
+}
+
+void piece_deadlines::release(
+	int const stream, lt::piece_index_t const piece, std::vector<deadline_update>& out
+)
+{
+	auto const it = m_pieces.find(piece);
+	if (it == m_pieces.end()) return;
+	release_impl(it, stream, out);
+}
+
+void piece_deadlines::release_impl(
+	std::map<lt::piece_index_t, interest>::iterator const it,
+	int const stream,
+	std::vector<deadline_update>& out
+)
+{
+	interest& streams = it->second;
+	auto const s = std::find_if(streams.begin(), streams.end(), [=](auto const& e) {
+		return e.first == stream;
+	});
+	if (s == streams.end()) return;
+
+	lt::time_point const before = earliest(streams);
+	streams.erase(s);
+	if (streams.empty()) {
+		out.push_back({it->first, false, lt::time_point{}});
+		m_pieces.erase(it);
+		return;
+	}
+
+	// if the stream we removed had the earliest deadline, the piece isn't
+	// as urgent anymore
+	lt::time_point const after = earliest(streams);
+	if (after != before) out.push_back({it->first, true, after});
+}
+
+void piece_deadlines::delivered(lt::piece_index_t const piece) { m_pieces.erase(piece); }
+
+int piece_deadlines::refcount(lt::piece_index_t const piece) const
+{
+	auto const it = m_pieces.find(piece);
+	return it == m_pieces.end() ? 0 : int(it->second.size());
+}
+
+} // namespace ltweb
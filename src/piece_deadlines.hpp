@@ -0,0 +1,104 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_PIECE_DEADLINES_HPP
+#define LTWEB_PIECE_DEADLINES_HPP
+
+#include "libtorrent/units.hpp" // piece_index_t
+#include "libtorrent/time.hpp"
+
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace ltweb {
+
+// Keeps track of the piece deadlines requested by all concurrent streams of
+// a single torrent. libtorrent only has one deadline per piece, so streams
+// cannot set and reset deadlines independently without clobbering each
+// other. Instead, every stream registers its interest in a piece here, and
+// the deadline libtorrent sees is the earliest of all interested streams.
+// The deadline is only reset once no stream is interested in the piece
+// anymore.
+//
+// It also divides a per-torrent budget of outstanding pieces among the
+// streams, so that one stream with a large read-ahead window can't starve
+// the others.
+//
+// This type does not talk to libtorrent itself. Operations that change the
+// deadline of a piece append a deadline_update, for the caller to apply.
+struct piece_deadlines {
+	struct deadline_update {
+		lt::piece_index_t piece;
+		// when false, nobody is interested in the piece anymore and its
+		// deadline should be reset. Otherwise the deadline should be set to
+		// deadline
+		bool set;
+		lt::time_point deadline;
+	};
+
+	// budget is the total number of pieces all streams may have deadlines
+	// for at any given time. Every stream is always granted at least one
+	// piece, regardless of the budget
+	explicit piece_deadlines(int budget);
+
+	// register a new stream, returning its ID
+	int add_stream();
+
+	// unregister a stream, releasing all pieces it's interested in
+	void remove_stream(int stream, std::vector<deadline_update>& out);
+
+	// returns the number of pieces the stream may keep deadlines for, given
+	// that it wants a window of wanted pieces. The budget is divided max-min
+	// fair among the streams, based on the most recent number of pieces each
+	// one asked for. A stream asking for less than its fair share leaves the
+	// remainder to the others
+	int window(int stream, int wanted);
+
+	// the stream needs piece by the specified time
+	void request(
+		int stream, lt::piece_index_t piece, lt::time_point deadline, std::vector<deadline_update>& out
+	);
+
+	// the stream is no longer interested in piece
+	void release(int stream, lt::piece_index_t piece, std::vector<deadline_update>& out);
+
+	// the piece was delivered (i.e. libtorrent posted a read_piece_alert
+	// for it). libtorrent clears the deadline of a piece once it's been
+	// delivered, so no update is needed. Streams that want the piece again
+	// need to request it again
+	void delivered(lt::piece_index_t piece);
+
+	int num_streams() const { return int(m_streams.size()); }
+	int num_pieces() const { return int(m_pieces.size()); }
+
+	// the number of streams interested in piece
+	int refcount(lt::piece_index_t piece) const;
+
+private:
+	void release_impl(
+		std::map<lt::piece_index_t, std::vector<std::pair<int, lt::time_point>>>::iterator it,
+		int stream,
+		std::vector<deadline_update>& out
+	);
+
+	int m_budget;
+	int m_next_stream = 0;
+
+	// stream ID -> the window it asked for most recently
+	std::map<int, int> m_streams;
+
+	// the streams interested in each piece, and the deadline each of them
+	// asked for
+	std::map<lt::piece_index_t, std::vector<std::pair<int, lt::time_point>>> m_pieces;
+};
+
+} // namespace ltweb
+
+#endif
@@ -10,9 +10,41 @@ see LICENSE file.
 #include "piece_history.hpp"
 #include "libtorrent/assert.hpp"
 #include <algorithm>
+#include <bit>
 
 namespace ltweb {
 
+namespace {
+
+int num_words(int const blocks) { return (blocks + 31) / 32; }
+
+// packs the states of the blocks of p, 2 bits each, 32 to a word
+void pack_states(lt::partial_piece_info const& p, std::uint64_t* out)
+{
+	for (int w = 0; w < num_words(p.blocks_in_piece); ++w) {
+		lt::block_info const* b = p.blocks + w * 32;
+		int const n = std::min(p.blocks_in_piece - w * 32, 32);
+		std::uint64_t word = 0;
+		for (int i = 0; i < n; ++i)
+			word |= std::uint64_t(b[i].state & 3) << (2 * i);
+		out[w] = word;
+	}
+}
+
+// returns one bit for each of the 32 2-bit lanes of x, set if the lane isn't 0
+std::uint32_t nonzero_lanes(std::uint64_t x)
+{
+	x = (x | (x >> 1)) & 0x5555555555555555ull;
+	x = (x | (x >> 1)) & 0x3333333333333333ull;
+	x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0full;
+	x = (x | (x >> 4)) & 0x00ff00ff00ff00ffull;
+	x = (x | (x >> 8)) & 0x0000ffff0000ffffull;
+	x = (x | (x >> 16)) & 0x00000000ffffffffull;
+	return std::uint32_t(x);
+}
+
+} // anonymous namespace
+
 piece_history::piece_history(lt::sha1_hash const& ih, std::size_t max_tombstones)
 	: m_ih(ih)
 	, m_max_tombstones(max_tombstones)
@@ -42,45 +74,65 @@ frame_t piece_history::update(std::vector<lt::partial_piece_info> pieces)
 		== pieces.end()
 	);
 
-	// Remove pieces that are no longer in the download queue.
-	auto incoming_it = pieces.begin();
-	for (auto it = m_pieces.begin(); it != m_pieces.end();) {
-		while (incoming_it != pieces.end() && incoming_it->piece_index < it->first)
-			++incoming_it;
-		if (incoming_it == pieces.end() || incoming_it->piece_index != it->first) {
-			m_removed.push_front({frame, it->second.added_frame, it->first});
-			it = m_pieces.erase(it);
-		} else {
-			++incoming_it;
-			++it;
-		}
-	}
+	// The next frame is built in new arrays, merging the incoming pieces
+	// with the current ones, both sorted by piece index.
+	std::size_t total_words = 0;
+	for (auto const& p : pieces)
+		total_words += std::size_t(num_words(p.blocks_in_piece));
+	std::vector<piece_entry> next_pieces;
+	next_pieces.reserve(pieces.size());
+	std::vector<std::uint64_t> next_states(total_words);
+	std::vector<std::uint32_t> next_changed(total_words);
 
-	// Add or update pieces.
 	bool any_inserted = false;
+	std::uint32_t offset = 0;
+	auto old = m_pieces.begin();
 	for (auto const& p : pieces) {
-		auto [it, inserted] = m_pieces.emplace(p.piece_index, piece_history_entry{});
-		piece_history_entry& entry = it->second;
-
-		if (inserted) {
-			entry.piece_index = p.piece_index;
-			entry.added_frame = frame;
-			entry.blocks.resize(p.blocks_in_piece);
-			for (int i = 0; i < p.blocks_in_piece; ++i)
-				entry.blocks[i] = {std::uint8_t(p.blocks[i].state), frame};
-			any_inserted = true;
-		} else {
-			// Grow the block array if the piece reports more blocks than stored
-			// (shouldn't normally happen, but be defensive).
-			if (static_cast<int>(entry.blocks.size()) < p.blocks_in_piece)
-				entry.blocks.resize(p.blocks_in_piece, {0, frame});
-
-			for (int i = 0; i < p.blocks_in_piece; ++i) {
-				auto const new_state = std::uint8_t(p.blocks[i].state);
-				if (entry.blocks[i].state != new_state) entry.blocks[i] = {new_state, frame};
+		// Remove pieces that are no longer in the download queue.
+		for (; old != m_pieces.end() && old->piece_index < p.piece_index; ++old)
+			m_removed.push_front({frame, old->added_frame, old->piece_index});
+
+		int const words = num_words(p.blocks_in_piece);
+		std::uint64_t* const states = next_states.data() + offset;
+		std::uint32_t* const changed = next_changed.data() + offset;
+		pack_states(p, states);
+
+		piece_entry e{p.piece_index, p.blocks_in_piece, offset, frame, frame, frame};
+		if (old != m_pieces.end() && old->piece_index == p.piece_index) {
+			e.added_frame = old->added_frame;
+			// If the number of blocks changed (shouldn't normally happen),
+			// the piece is treated as changed twice in this frame, so every
+			// client gets all of it.
+			if (old->num_blocks == p.blocks_in_piece) {
+				// the lanes that differ between the old and new words are the
+				// blocks that changed
+				std::uint64_t const* const prev = m_states.data() + old->offset;
+				std::uint32_t any_changed = 0;
+				for (int w = 0; w < words; ++w) {
+					changed[w] = nonzero_lanes(states[w] ^ prev[w]);
+					any_changed |= changed[w];
+				}
+				if (any_changed == 0) {
+					e.changed_frame = old->changed_frame;
+					e.prev_changed_frame = old->prev_changed_frame;
+					std::copy_n(m_changed.data() + old->offset, words, changed);
+				} else {
+					e.prev_changed_frame = old->changed_frame;
+				}
 			}
+			++old;
+		} else {
+			any_inserted = true;
 		}
+		next_pieces.push_back(e);
+		offset += std::uint32_t(words);
 	}
+	for (; old != m_pieces.end(); ++old)
+		m_removed.push_front({frame, old->added_frame, old->piece_index});
+
+	m_pieces = std::move(next_pieces);
+	m_states = std::move(next_states);
+	m_changed = std::move(next_changed);
 
 	// A tombstone whose piece_index is back in m_pieces was re-inserted this
 	// call and must be cleared — a piece can only hold a tombstone if it was
@@ -88,7 +140,15 @@ frame_t piece_history::update(std::vector<lt::partial_piece_info> pieces)
 	// since m_pieces and m_removed are always disjoint.
 	if (!m_removed.empty() && any_inserted) {
 		auto const rem_end = std::remove_if(m_removed.begin(), m_removed.end(), [&](auto const& r) {
-			return m_pieces.contains(r.piece_index);
+			auto const it = std::lower_bound(
+				m_pieces.begin(),
+				m_pieces.end(),
+				r.piece_index,
+				[](piece_entry const& e, lt::piece_index_t const idx) {
+					return e.piece_index < idx;
+				}
+			);
+			return it != m_pieces.end() && it->piece_index == r.piece_index;
 		});
 		m_removed.erase(rem_end, m_removed.end());
 	}
@@ -109,9 +169,13 @@ piece_history::query_result piece_history::query(frame_t since_frame) const
 	if (since_frame < m_horizon) since_frame = 0;
 	result.is_snapshot = (since_frame == 0);
 
+	auto const blocks = [&](piece_entry const& e) {
+		return piece_blocks{e.piece_index, e.num_blocks, m_states.data() + e.offset};
+	};
+
 	if (result.is_snapshot) {
-		for (auto const& [idx, entry] : m_pieces)
-			result.full_pieces.push_back(&entry);
+		for (auto const& e : m_pieces)
+			result.full_pieces.push_back(blocks(e));
 		return result;
 	}
 
@@ -123,25 +187,31 @@ piece_history::query_result piece_history::query(frame_t since_frame) const
 	}
 
 	// Changed pieces.
-	for (auto const& [idx, entry] : m_pieces) {
-		if (entry.added_frame > since_frame) {
-			result.full_pieces.push_back(&entry);
+	for (auto const& e : m_pieces) {
+		if (e.changed_frame <= since_frame) continue;
+
+		// the client hasn't seen the piece, or it has changed more than once
+		// since the client last saw it
+		if (e.added_frame > since_frame || e.prev_changed_frame > since_frame) {
+			result.full_pieces.push_back(blocks(e));
 			continue;
 		}
 
-		int const num_blocks = static_cast<int>(entry.blocks.size());
+		std::uint32_t const* const mask = m_changed.data() + e.offset;
+		int const words = num_words(e.num_blocks);
 		int changed = 0;
-		for (auto const& b : entry.blocks)
-			if (b.frame > since_frame) ++changed;
-
-		if (changed == 0) continue;
+		for (int w = 0; w < words; ++w)
+			changed += std::popcount(mask[w]);
 
-		if (num_blocks + 6 <= changed * 7) {
-			result.full_pieces.push_back(&entry);
+		if (e.num_blocks + 6 <= changed * 7) {
+			result.full_pieces.push_back(blocks(e));
 		} else {
-			for (int i = 0; i < num_blocks; ++i) {
-				if (entry.blocks[i].frame > since_frame)
-					result.block_updates.push_back({idx, i, entry.blocks[i].state});
+			piece_blocks const b = blocks(e);
+			for (int w = 0; w < words; ++w) {
+				for (std::uint32_t m = mask[w]; m != 0; m &= m - 1) {
+					int const i = w * 32 + std::countr_zero(m);
+					result.block_updates.push_back({e.piece_index, i, b.state(i)});
+				}
 			}
 		}
 	}
@@ -149,4 +219,12 @@ piece_history::query_result piece_history::query(frame_t since_frame) const
 	return result;
 }
 
+std::size_t piece_history::memory_used() const
+{
+	return sizeof(*this) + m_pieces.capacity() * sizeof(piece_entry)
+		+ m_states.capacity() * sizeof(std::uint64_t)
+		+ m_changed.capacity() * sizeof(std::uint32_t)
+		+ m_removed.size() * sizeof(removed_entry);
+}
+
 } // namespace ltweb
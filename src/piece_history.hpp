@@ -16,26 +16,22 @@ see LICENSE file.
 #include "libtorrent/torrent_handle.hpp" // partial_piece_info
 
 #include <vector>
-#include <map>
 #include <deque>
+#include <cstddef>
 #include <cstdint>
 
 namespace ltweb {
 
-struct block_history_entry {
-	std::uint8_t state; // current block state (0-3)
-	frame_t frame; // frame this block last changed
-};
-
-struct piece_history_entry {
-	lt::piece_index_t piece_index;
-	std::vector<block_history_entry> blocks; // one per block in piece
-	frame_t added_frame; // frame when this piece was added
-};
-
 // Tracks per-block state history for the pieces of a single downloading torrent.
 // Each instance is permanently associated with one info-hash; create a new
 // instance for a different torrent.
+//
+// The block states (0-3) are packed 2 bits per block, 32 blocks per 64 bit
+// word, in one array for all pieces. The pieces refer to their words, and are
+// kept sorted by piece index. Rather than a frame per block, each piece has
+// the frames of its last two changes, and a bitmask of the blocks that changed
+// in the last one. A client that saw the piece before its last change gets
+// just those blocks, a client further behind gets the whole piece.
 struct piece_history {
 	explicit piece_history(lt::sha1_hash const& ih, std::size_t max_tombstones = 1000);
 
@@ -46,10 +42,25 @@ struct piece_history {
 	// Any query with since_frame < horizon() is treated as a full snapshot.
 	frame_t horizon() const { return m_horizon; }
 
+	// an estimate of the memory used by the history, in bytes
+	std::size_t memory_used() const;
+
 	// Feed a fresh download queue snapshot.
 	// Increments the internal frame counter and returns the new frame.
 	frame_t update(std::vector<lt::partial_piece_info> pieces);
 
+	// the blocks of a piece, valid until the next call to update()
+	struct piece_blocks {
+		lt::piece_index_t piece_index;
+		int num_blocks;
+		std::uint64_t const* states;
+
+		std::uint8_t state(int const block) const
+		{
+			return std::uint8_t((states[block / 32] >> (2 * (block % 32))) & 3);
+		}
+	};
+
 	struct block_update {
 		lt::piece_index_t piece_index;
 		int block_index;
@@ -63,7 +74,7 @@ struct piece_history {
 		// Pieces whose full block array should be sent.
 		// Includes: pieces new since since_frame, and pieces where sending all
 		// blocks is cheaper than individual block updates.
-		std::vector<piece_history_entry const*> full_pieces;
+		std::vector<piece_blocks> full_pieces;
 
 		// Individual block updates for pieces with few changed blocks.
 		std::vector<block_update> block_updates;
@@ -84,7 +95,8 @@ struct piece_history {
 	//   full piece update:  num_blocks + 6 bytes
 	//   k block updates:    k * 7 bytes
 	// A piece goes to full_pieces when (num_blocks + 6) <= (changed * 7).
-	// Newly-added pieces always go to full_pieces.
+	// Newly-added pieces always go to full_pieces, and so do pieces that
+	// changed more than once since since_frame.
 	query_result query(frame_t since_frame) const;
 
 private:
@@ -93,8 +105,26 @@ private:
 	frame_t m_horizon = 0;
 	std::size_t m_max_tombstones;
 
-	// ordered by piece_index for deterministic iteration
-	std::map<lt::piece_index_t, piece_history_entry> m_pieces;
+	struct piece_entry {
+		lt::piece_index_t piece_index;
+		int num_blocks;
+		// the index of the piece's first word in m_states and m_changed
+		std::uint32_t offset;
+		frame_t added_frame;
+		// the frames of the last change to the piece, and the one before it
+		frame_t changed_frame;
+		frame_t prev_changed_frame;
+	};
+
+	// sorted by piece_index
+	std::vector<piece_entry> m_pieces;
+
+	// the block states of all pieces, 2 bits per block
+	std::vector<std::uint64_t> m_states;
+
+	// the blocks that changed in the last change of their piece, 1 bit per
+	// block. Word i holds the blocks of m_states[i]
+	std::vector<std::uint32_t> m_changed;
 
 	struct removed_entry {
 		frame_t removed_frame;
@@ -46,6 +46,17 @@ void piece_state_history::on_piece_finished(lt::piece_index_t const idx)
 	}
 }
 
+bool piece_state_history::reconcile(lt::typed_bitfield<lt::piece_index_t> const& live)
+{
+	if (live.size() != m_bitfield.size()) return false;
+	for (lt::piece_index_t const i : m_bitfield.range())
+		if (m_bitfield.get_bit(i) && !live.get_bit(i)) return false;
+
+	for (lt::piece_index_t const i : live.range())
+		if (live.get_bit(i)) on_piece_finished(i);
+	return true;
+}
+
 piece_state_history::query_result piece_state_history::query(frame_t const since_frame) const
 {
 	query_result r;
@@ -72,4 +83,10 @@ piece_state_history::query_result piece_state_history::query(frame_t const since
 	return r;
 }
 
+std::size_t piece_state_history::memory_used() const
+{
+	return sizeof(*this) + std::size_t(m_bitfield.num_bytes())
+		+ m_queue.size() * sizeof(lt::piece_index_t);
+}
+
 } // namespace ltweb
@@ -48,12 +48,23 @@ struct piece_state_history {
 	// since_frame strictly below this is served as a snapshot.
 	frame_t horizon() const { return m_horizon; }
 
+	// an estimate of the memory used by the history, in bytes
+	std::size_t memory_used() const;
+
 	// Record that a piece has been completed. No-op if the piece is already
 	// set in m_bitfield. Otherwise the bit is set immediately and the
 	// completion is appended to the delta queue. When the queue grows past
 	// max_queue, the oldest entry is dropped and m_horizon advances.
 	void on_piece_finished(lt::piece_index_t idx);
 
+	// Brings the have-set up to date with live, the torrent's current
+	// bitfield, after piece_finished alerts may have been lost. The pieces
+	// missing from the history are recorded as completions, so deltas stay
+	// correct. Returns false, leaving the history untouched, if live has a
+	// different size or lacks a piece the history has. The history must
+	// then be discarded.
+	bool reconcile(lt::typed_bitfield<lt::piece_index_t> const& live);
+
 	struct query_result {
 		// When true, a complete bitfield is returned (the response-type 1
 		// payload from the spec). When false, only the list of piece indices
@@ -0,0 +1,183 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_POLLED_CACHE_HPP
+#define LTWEB_POLLED_CACHE_HPP
+
+#include "hashed_lru.hpp"
+#include "metrics.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace ltweb {
+
+// A cache of per-torrent histories (peers, download queue, files, trackers)
+// that are sampled from libtorrent at most once per interval, no matter how
+// many clients poll the same torrent. A client asking for a history while
+// another one is sampling it waits for that sample, rather than taking one
+// of its own, so concurrent requests cost one libtorrent call. All other
+// clients are answered from the history as it is.
+//
+// A sample may be limited to a set of fields (e.g. the file progress, but not
+// the priorities). A request for fields the last sample didn't include takes
+// a new sample, including the fields asked for earlier.
+//
+// The histories are kept in a hashed_lru, bounded by the memory they use, and
+// each has a mutex of its own. Clients of different torrents only share the
+// lookup in the hashed_lru.
+//
+// The number of samples taken, and requests answered from an existing sample,
+// are reported through the detail.<name>.samples and detail.<name>.shared
+// metrics, and the cache through the detail.<name> metrics of hashed_lru.
+//
+// The History type must have an info_hash() member, used as the key, and a
+// memory_used() member returning the number of bytes it uses.
+template <typename History>
+struct polled_cache {
+	using key_type = std::decay_t<decltype(std::declval<History const&>().info_hash())>;
+	using clock_type = std::chrono::steady_clock;
+
+	// if sample_locked is set, the samples of all torrents are serialized.
+	// This is for libtorrent calls that aren't safe to make concurrently.
+	// The sample is also added to the history before the next one is taken
+	polled_cache(
+		std::string const& name,
+		std::size_t const max_memory,
+		std::chrono::milliseconds const interval,
+		bool const sample_locked = false,
+		int const num_shards = 8
+	)
+		: m_entries("detail." + name, max_memory, num_shards)
+		, m_interval(interval)
+		, m_sample_locked(sample_locked)
+		, m_samples_metric(
+			  global_metrics().register_metric("detail." + name + ".samples", metric_type::counter)
+		  )
+		, m_shared_metric(
+			  global_metrics().register_metric("detail." + name + ".shared", metric_type::counter)
+		  )
+	{}
+
+	polled_cache(polled_cache const&) = delete;
+	polled_cache& operator=(polled_cache const&) = delete;
+
+	// Returns fun(history), called with the history's mutex held, once the
+	// history of key is up to date with the fields asked for. make() returns
+	// a new history, if key isn't in the cache. If a sample is due,
+	// sample(fields) takes it (without the mutex held, unless sample_locked),
+	// and feed(history, sample) adds it to the history.
+	template <typename Make, typename Sample, typename Feed, typename Fun>
+	auto get(
+		key_type const& key,
+		std::uint32_t const fields,
+		Make&& make,
+		Sample&& sample,
+		Feed&& feed,
+		Fun&& fun
+	)
+	{
+		// if the entry is evicted while we use it, it lives on until we're done
+		std::shared_ptr<entry> const e =
+			m_entries.get(key, [&] { return std::make_shared<entry>(make); });
+
+		std::unique_lock<std::mutex> l(e->mutex);
+		// the sample that was in progress when we started waiting, if any
+		std::uint64_t waited_for = 0;
+		bool waited = false;
+		while (e->sampling) {
+			waited_for = e->generation;
+			waited = true;
+			e->sampled_cond.wait(l);
+		}
+
+		bool const has_fields = (e->fields & fields) == fields;
+		bool const fresh = e->generation > 0
+			&& ((waited && e->generation != waited_for)
+				|| clock_type::now() - e->sampled < m_interval);
+		if (has_fields && fresh) {
+			global_metrics().inc(m_shared_metric);
+			return fun(e->history);
+		}
+
+		std::uint32_t const want = fields | e->fields;
+		e->sampling = true;
+		e->sampled = clock_type::now();
+		try {
+			if (m_sample_locked) {
+				std::lock_guard<std::mutex> sl(m_sample_mutex);
+				feed(e->history, sample(want));
+			} else {
+				l.unlock();
+				auto s = sample(want);
+				l.lock();
+				feed(e->history, std::move(s));
+			}
+		} catch (...) {
+			if (!l.owns_lock()) l.lock();
+			e->sampling = false;
+			e->sampled_cond.notify_all();
+			throw;
+		}
+		e->sampling = false;
+		e->fields = want;
+		++e->generation;
+		global_metrics().inc(m_samples_metric);
+		e->sampled_cond.notify_all();
+		m_entries.set_memory(key, e.get(), sizeof(entry) + e->history.memory_used());
+		return fun(e->history);
+	}
+
+	std::size_t size() const { return m_entries.size(); }
+	std::size_t memory_used() const { return m_entries.memory_used(); }
+
+private:
+	struct entry {
+		template <typename Make>
+		explicit entry(Make& make)
+			: history(make())
+		{}
+
+		std::mutex mutex;
+		// signalled when a sample is done
+		std::condition_variable sampled_cond;
+
+		// the rest is protected by mutex
+		History history;
+		// when the last sample was started, and which fields it included
+		clock_type::time_point sampled;
+		std::uint32_t fields = 0;
+		// incremented every time a sample has been added to the history
+		std::uint64_t generation = 0;
+		// set while a client is taking a sample
+		bool sampling = false;
+	};
+
+	hashed_lru<key_type, entry> m_entries;
+
+	std::chrono::milliseconds const m_interval;
+	bool const m_sample_locked;
+
+	// held while taking a sample, if m_sample_locked is set
+	std::mutex m_sample_mutex;
+
+	int const m_samples_metric;
+	int const m_shared_metric;
+};
+
+} // namespace ltweb
+
+#endif
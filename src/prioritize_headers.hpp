@@ -64,6 +64,7 @@ struct prioritize_headers : alert_observer {
 	~prioritize_headers();
 
 	void handle_alert(lt::alert const* a) override;
+	char const* observer_name() const override { return "prioritize_headers"; }
 
 private:
 	// No-op if the torrent has no metadata yet or the handle has been
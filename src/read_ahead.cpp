@@ -0,0 +1,113 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "read_ahead.hpp"
+
+#include <algorithm>
+
+namespace ltweb {
+
+namespace {
+// the window we start out with. Keeping it small makes libtorrent focus on
+// the first pieces, which is what the client is waiting for
+constexpr std::int64_t initial_window = 1024 * 1024;
+
+// the window used before we have a drain rate estimate
+constexpr std::int64_t default_window = 4 * 1024 * 1024;
+
+constexpr std::int64_t min_window = 2 * 1024 * 1024;
+constexpr std::int64_t max_window = 64 * 1024 * 1024;
+
+// the number of seconds of playback we try to have buffered ahead of the
+// client, when the torrent keeps up and pieces are readily available
+constexpr double lookahead_seconds = 8.;
+
+// we need at least this much write time to form a drain rate sample
+constexpr lt::time_duration min_sample_time = lt::milliseconds(500);
+
+// the rate we assume the client consumes data at before we have an
+// estimate. Deadlines are spaced according to this
+constexpr std::int64_t assumed_drain_rate = 4 * 1024 * 1024;
+
+constexpr int max_deadline = 60 * 1000;
+} // namespace
+
+read_ahead::read_ahead(int const piece_size)
+	: m_piece_size(piece_size)
+	, m_ramp(initial_window)
+{
+}
+
+void read_ahead::sent(std::int64_t const bytes, lt::time_duration const write_time)
+{
+	m_ramp = std::min(m_ramp + bytes, max_window);
+
+	m_sample_bytes += bytes;
+	m_sample_time += write_time;
+	if (m_sample_time < min_sample_time) return;
+
+	std::int64_t const sample = m_sample_bytes * 1000 / lt::total_milliseconds(m_sample_time);
+	m_drain_rate = m_drain_rate == 0 ? sample : (m_drain_rate * 3 + sample) / 4;
+	m_sample_bytes = 0;
+	m_sample_time = lt::time_duration{};
+}
+
+void read_ahead::torrent_state(int const download_rate, float const distributed_copies)
+{
+	m_download_rate = download_rate;
+	m_distributed_copies = distributed_copies;
+}
+
+void read_ahead::restart()
+{
+	m_ramp = initial_window;
+	m_sample_bytes = 0;
+	m_sample_time = lt::time_duration{};
+}
+
+std::int64_t read_ahead::window_bytes() const
+{
+	std::int64_t target = default_window;
+	if (m_drain_rate > 0) {
+		double seconds = lookahead_seconds;
+
+		// if the torrent downloads slower than the client consumes data, we
+		// need a deeper buffer (and more pieces in parallel) to not stall. If
+		// it downloads a lot faster, pieces arrive well ahead of their
+		// deadlines and a shallower buffer is enough
+		if (m_download_rate > 0)
+			seconds *= std::clamp(double(m_drain_rate) / m_download_rate, 0.5, 3.);
+
+		// when some pieces are only available from one peer, or not at all,
+		// they may take a long time to arrive
+		if (m_distributed_copies >= 0.f && m_distributed_copies < 1.f)
+			seconds *= 2.;
+		else if (m_distributed_copies >= 1.f && m_distributed_copies < 2.f)
+			seconds *= 1.5;
+
+		target = std::clamp(
+			std::int64_t(double(m_drain_rate) * seconds), min_window, max_window
+		);
+	}
+	return std::min(target, m_ramp);
+}
+
+int read_ahead::window_pieces() const
+{
+	return std::max(1, int((window_bytes() + m_piece_size - 1) / m_piece_size));
+}
+
+int read_ahead::deadline(std::int64_t const bytes_ahead) const
+{
+	std::int64_t const rate = m_drain_rate > 0 ? m_drain_rate : assumed_drain_rate;
+	std::int64_t const ms = std::max(bytes_ahead, std::int64_t(0)) * 1000 / rate;
+	return int(std::clamp(ms, std::int64_t(1), std::int64_t(max_deadline)));
+}
+
+} // namespace ltweb
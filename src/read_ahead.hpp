@@ -0,0 +1,85 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_READ_AHEAD_HPP
+#define LTWEB_READ_AHEAD_HPP
+
+#include "libtorrent/time.hpp"
+
+#include <cstdint>
+
+namespace ltweb {
+
+// Sizes the read-ahead window of a file being streamed over /download/
+// while the torrent is still downloading. The window is the number of bytes
+// past the current send position we ask libtorrent to have ready, via piece
+// deadlines.
+//
+// The window is derived from the rate at which the client drains the
+// socket (roughly the playback bitrate, for video), scaled up when the
+// torrent downloads slower than that or when pieces are scarce in the
+// swarm. It starts small, to get the first bytes to the client quickly, and
+// grows as data is delivered. A seek restarts the ramp-up.
+struct read_ahead {
+	explicit read_ahead(int piece_size);
+
+	// record that bytes were written to the client socket, and that the
+	// write took the specified amount of time to complete. Time spent waiting
+	// for pieces to download is not counted, so the drain rate reflects how
+	// fast the client consumes data, not how fast we can deliver it
+	void sent(std::int64_t bytes, lt::time_duration write_time);
+
+	// update the state of the torrent we're streaming from. download_rate is
+	// the payload download rate in bytes per second, distributed_copies is
+	// the corresponding field of lt::torrent_status (negative if unknown)
+	void torrent_state(int download_rate, float distributed_copies);
+
+	// the client sought to a different position in the file. The window
+	// starts over from its initial size, but the measured drain rate is
+	// kept, since it's a property of the client, not the position
+	void restart();
+
+	// the estimated rate (bytes per second) the client consumes data at. 0
+	// means we don't have an estimate yet
+	std::int64_t drain_rate() const { return m_drain_rate; }
+
+	// the size of the read-ahead window, in bytes
+	std::int64_t window_bytes() const;
+
+	// the size of the read-ahead window, in number of pieces. Always at
+	// least 1
+	int window_pieces() const;
+
+	// the deadline (in milliseconds) for a piece starting bytes_ahead bytes
+	// past the current send position. This is when we expect the client to
+	// need it, given the drain rate. Always at least 1
+	int deadline(std::int64_t bytes_ahead) const;
+
+private:
+	int m_piece_size;
+
+	// exponentially weighted moving average of the rate the client consumes
+	// data, in bytes per second. 0 until the first sample is complete
+	std::int64_t m_drain_rate = 0;
+
+	// bytes and write time accumulated for the current drain rate sample
+	std::int64_t m_sample_bytes = 0;
+	lt::time_duration m_sample_time{};
+
+	// the upper bound on the window while ramping up. It starts small and
+	// grows by the number of bytes delivered to the client
+	std::int64_t m_ramp;
+
+	int m_download_rate = 0;
+	float m_distributed_copies = -1.f;
+};
+
+} // namespace ltweb
+
+#endif
@@ -0,0 +1,82 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "resume_codec.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#include <zlib.h>
+
+namespace ltweb {
+
+namespace {
+
+constexpr char magic[] = {'L', 'T', 'Z', '1'};
+constexpr std::size_t header_size = sizeof(magic) + 4;
+
+} // anonymous namespace
+
+std::vector<char> compress_resume(std::string_view const resume)
+{
+	std::vector<char> ret;
+	if (resume.size() > max_resume_size) return {resume.begin(), resume.end()};
+
+	uLongf size = compressBound(uLong(resume.size()));
+	ret.resize(header_size + size);
+	// resume data is saved continuously, for every torrent. Favor speed
+	if (compress2(
+			reinterpret_cast<Bytef*>(ret.data() + header_size),
+			&size,
+			reinterpret_cast<Bytef const*>(resume.data()),
+			uLong(resume.size()),
+			Z_BEST_SPEED
+		)
+			!= Z_OK
+		|| header_size + size >= resume.size()) {
+		return {resume.begin(), resume.end()};
+	}
+
+	std::memcpy(ret.data(), magic, sizeof(magic));
+	std::uint32_t const len = std::uint32_t(resume.size());
+	for (int i = 0; i < 4; ++i)
+		ret[sizeof(magic) + std::size_t(i)] = char((len >> (24 - i * 8)) & 0xff);
+	ret.resize(header_size + size);
+	return ret;
+}
+
+bool decompress_resume(std::string_view const blob, std::vector<char>& out)
+{
+	if (blob.size() < header_size || std::memcmp(blob.data(), magic, sizeof(magic)) != 0) {
+		out.assign(blob.begin(), blob.end());
+		return true;
+	}
+
+	std::uint32_t len = 0;
+	for (std::size_t i = 0; i < 4; ++i)
+		len = (len << 8) | std::uint8_t(blob[sizeof(magic) + i]);
+	if (len > max_resume_size) return false;
+
+	out.resize(len);
+	uLongf size = len;
+	if (uncompress(
+			reinterpret_cast<Bytef*>(out.data()),
+			&size,
+			reinterpret_cast<Bytef const*>(blob.data() + header_size),
+			uLong(blob.size() - header_size)
+		)
+			!= Z_OK
+		|| size != len) {
+		out.clear();
+		return false;
+	}
+	return true;
+}
+
+} // namespace ltweb
@@ -0,0 +1,35 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_RESUME_CODEC_HPP
+#define LTWEB_RESUME_CODEC_HPP
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace ltweb {
+
+// The RESUME column holds the bencoded resume data, zlib compressed when that
+// makes it smaller. A compressed blob starts with a header that can't be the
+// start of a bencoded dictionary, followed by the uncompressed size (32 bits,
+// big endian) and the zlib stream. Rows written before compression was
+// introduced are plain bencoded dictionaries, and are read as they are.
+std::vector<char> compress_resume(std::string_view resume);
+
+// sets out to the bencoded resume data in blob. Returns false if blob is
+// compressed, but corrupt
+bool decompress_resume(std::string_view blob, std::vector<char>& out);
+
+// decompressed resume data larger than this is considered corrupt
+constexpr std::size_t max_resume_size = 64 * 1024 * 1024;
+
+} // namespace ltweb
+
+#endif
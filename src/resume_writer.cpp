@@ -0,0 +1,253 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "resume_writer.hpp"
+#include "resume_codec.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace ltweb {
+
+resume_writer::resume_writer(
+	std::string const& db_file,
+	std::size_t const max_batch,
+	std::chrono::milliseconds const max_delay,
+	bool const compress
+)
+	: m_max_batch(std::max(max_batch, std::size_t(1)))
+	, m_max_delay(max_delay)
+	, m_compress(compress)
+{
+	if (sqlite3_open(db_file.c_str(), &m_db) != SQLITE_OK) {
+		fprintf(
+			stderr, "Can't open resume file [%s]: %s\n", db_file.c_str(), sqlite3_errmsg(m_db)
+		);
+		sqlite3_close(m_db);
+		m_db = nullptr;
+	}
+
+	if (m_db) {
+		// in WAL mode, a commit appends to the log rather than rewriting
+		// pages of the database in place. With synchronous=NORMAL it's not
+		// synced until the log is checkpointed. A crash may lose the last
+		// transactions, but never corrupts the database. The journal mode
+		// is persistent, it also applies to other connections
+		sqlite3_exec(m_db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+		sqlite3_exec(m_db, "PRAGMA synchronous=NORMAL;", nullptr, nullptr, nullptr);
+		sqlite3_busy_timeout(m_db, 5000);
+
+		struct {
+			sqlite3_stmt** stmt;
+			char const* sql;
+		} const statements[] = {
+			{&m_insert,
+			 "INSERT OR REPLACE INTO TORRENTS(INFOHASH,RESUME,QUEUE_POSITION,TAG) "
+			 "VALUES(?, ?, ?, ?);"},
+			{&m_update_queue_pos, "UPDATE TORRENTS SET QUEUE_POSITION = ? WHERE INFOHASH = ?;"},
+			{&m_delete, "DELETE FROM TORRENTS WHERE INFOHASH = ?;"},
+			// the metadata of a torrent never changes, it's only written once
+			{&m_insert_metadata, "INSERT OR IGNORE INTO METADATA(INFOHASH,INFO) VALUES(?, ?);"},
+			{&m_delete_metadata, "DELETE FROM METADATA WHERE INFOHASH = ?;"},
+		};
+		for (auto const& s : statements) {
+			if (sqlite3_prepare_v3(m_db, s.sql, -1, SQLITE_PREPARE_PERSISTENT, s.stmt, nullptr)
+				!= SQLITE_OK) {
+				fprintf(stderr, "failed to prepare statement: %s\n", sqlite3_errmsg(m_db));
+			}
+		}
+	}
+
+	m_thread = std::thread(&resume_writer::thread_fun, this);
+}
+
+resume_writer::~resume_writer()
+{
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_stop = true;
+	}
+	m_work.notify_one();
+	m_thread.join();
+
+	sqlite3_finalize(m_insert);
+	sqlite3_finalize(m_update_queue_pos);
+	sqlite3_finalize(m_delete);
+	sqlite3_finalize(m_insert_metadata);
+	sqlite3_finalize(m_delete_metadata);
+	sqlite3_close(m_db);
+}
+
+void resume_writer::save(
+	std::string info_hash,
+	std::vector<char> resume,
+	int const queue_position,
+	std::uint64_t const tag
+)
+{
+	push({op_type::save, std::move(info_hash), std::move(resume), queue_position, tag});
+}
+
+void resume_writer::set_queue_position(std::string info_hash, int const queue_position)
+{
+	push({op_type::queue_position, std::move(info_hash), {}, queue_position, 0});
+}
+
+void resume_writer::save_metadata(std::string info_hash, std::vector<char> metadata)
+{
+	push({op_type::metadata, std::move(info_hash), std::move(metadata), 0, 0});
+}
+
+void resume_writer::remove(std::string info_hash)
+{
+	push({op_type::remove, std::move(info_hash), {}, 0, 0});
+}
+
+void resume_writer::flush()
+{
+	std::unique_lock<std::mutex> l(m_mutex);
+	std::uint64_t const target = m_enqueued;
+	++m_flushing;
+	m_work.notify_one();
+	m_committed_cond.wait(l, [&] { return m_committed >= target; });
+	--m_flushing;
+}
+
+std::size_t resume_writer::queue_size() const
+{
+	std::lock_guard<std::mutex> l(m_mutex);
+	return m_queue.size();
+}
+
+void resume_writer::push(write_op op)
+{
+	std::size_t queued;
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_queue.push_back(std::move(op));
+		++m_enqueued;
+		queued = m_queue.size();
+	}
+	// the writer only needs waking up for the first write of a batch, and
+	// when the batch is full
+	if (queued == 1 || queued == m_max_batch) m_work.notify_one();
+}
+
+void resume_writer::thread_fun()
+{
+	std::vector<write_op> batch;
+	std::unique_lock<std::mutex> l(m_mutex);
+	for (;;) {
+		m_work.wait(l, [&] { return m_stop || !m_queue.empty(); });
+		if (m_queue.empty()) break;
+
+		// give the batch some time to fill up, unless we're asked to hurry
+		m_work.wait_for(l, m_max_delay, [&] {
+			return m_stop || m_flushing > 0 || m_queue.size() >= m_max_batch;
+		});
+
+		batch.swap(m_queue);
+		std::uint64_t const committed = m_enqueued;
+		l.unlock();
+
+		write_batch(batch);
+		batch.clear();
+
+		l.lock();
+		m_committed = committed;
+		m_committed_cond.notify_all();
+	}
+}
+
+void resume_writer::write_batch(std::vector<write_op> const& batch)
+{
+	if (!m_db) return;
+
+	for (std::size_t start = 0; start < batch.size(); start += m_max_batch) {
+		std::size_t const end = std::min(batch.size(), start + m_max_batch);
+		if (sqlite3_exec(m_db, "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+			fprintf(stderr, "failed to begin transaction: %s\n", sqlite3_errmsg(m_db));
+			return;
+		}
+
+		for (std::size_t i = start; i < end; ++i)
+			write(batch[i]);
+
+		if (sqlite3_exec(m_db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+			fprintf(stderr, "failed to commit resume data: %s\n", sqlite3_errmsg(m_db));
+			sqlite3_exec(m_db, "ROLLBACK;", nullptr, nullptr, nullptr);
+		}
+	}
+}
+
+bool resume_writer::write(write_op const& op)
+{
+	auto const bind_key = [&](sqlite3_stmt* stmt, int const col) {
+		return sqlite3_bind_text(
+			stmt, col, op.info_hash.data(), int(op.info_hash.size()), SQLITE_STATIC
+		);
+	};
+	auto const bind_blob = [&](sqlite3_stmt* stmt, int const col, std::vector<char> const& b) {
+		return sqlite3_bind_blob(stmt, col, b.data(), int(b.size()), SQLITE_STATIC);
+	};
+
+	switch (op.type) {
+		case op_type::save: {
+			if (!m_insert) return false;
+			std::vector<char> compressed;
+			if (m_compress) compressed = compress_resume({op.resume.data(), op.resume.size()});
+			int ret = bind_key(m_insert, 1);
+			if (ret == SQLITE_OK) ret = bind_blob(m_insert, 2, m_compress ? compressed : op.resume);
+			// queue_position is -1 (lt::no_pos) for seeds/finished torrents;
+			// we store the sentinel as-is and rely on the load-side ORDER BY
+			// to put such rows after the queued ones
+			if (ret == SQLITE_OK) ret = sqlite3_bind_int(m_insert, 3, op.queue_position);
+			// tag bitfield, stored as a 64-bit integer. We always write it,
+			// even when 0 -- so a row that had a tag and then gets cleared is
+			// rewritten with TAG = 0 rather than left at its previous value.
+			if (ret == SQLITE_OK)
+				ret = sqlite3_bind_int64(m_insert, 4, static_cast<sqlite3_int64>(op.tag));
+			return step(m_insert, ret);
+		}
+		case op_type::queue_position: {
+			if (!m_update_queue_pos) return false;
+			int ret = sqlite3_bind_int(m_update_queue_pos, 1, op.queue_position);
+			if (ret == SQLITE_OK) ret = bind_key(m_update_queue_pos, 2);
+			return step(m_update_queue_pos, ret);
+		}
+		case op_type::metadata: {
+			if (!m_insert_metadata) return false;
+			int ret = bind_key(m_insert_metadata, 1);
+			if (ret == SQLITE_OK) ret = bind_blob(m_insert_metadata, 2, op.resume);
+			return step(m_insert_metadata, ret);
+		}
+		case op_type::remove: {
+			if (!m_delete || !m_delete_metadata) return false;
+			// the metadata goes with the torrent
+			bool const ret = step(m_delete, bind_key(m_delete, 1));
+			return step(m_delete_metadata, bind_key(m_delete_metadata, 1)) && ret;
+		}
+	}
+	return false;
+}
+
+bool resume_writer::step(sqlite3_stmt* stmt, int ret)
+{
+	if (ret != SQLITE_OK) {
+		fprintf(stderr, "failed to bind resume statement: %s\n", sqlite3_errmsg(m_db));
+	} else if (sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "failed to step resume statement: %s\n", sqlite3_errmsg(m_db));
+		ret = SQLITE_ERROR;
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return ret == SQLITE_OK;
+}
+
+} // namespace ltweb
@@ -0,0 +1,131 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_RESUME_WRITER_HPP
+#define LTWEB_RESUME_WRITER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sqlite3.h>
+
+namespace ltweb {
+
+// Writes changes to the TORRENTS table of the resume database on a thread of
+// its own, so the alert thread never waits for the disk. Writes are queued,
+// and committed in transactions of up to max_batch rows. A transaction is
+// started once max_batch writes are queued, or max_delay after the first
+// one, whichever comes first. The database is put in WAL mode, where a
+// commit is a single append to the log.
+//
+// The immutable metadata of torrents (their info-dictionaries) is kept in
+// the METADATA table, written once per torrent, and the TORRENTS table only
+// holds the resume data, which changes.
+struct resume_writer {
+	// opens a connection of its own to the database at db_file. The TORRENTS
+	// and METADATA tables must already exist. When compress is set, resume
+	// data is stored compressed (see resume_codec.hpp)
+	resume_writer(
+		std::string const& db_file,
+		std::size_t max_batch = 256,
+		std::chrono::milliseconds max_delay = std::chrono::milliseconds(500),
+		bool compress = false
+	);
+
+	// writes everything still queued before returning
+	~resume_writer();
+
+	resume_writer(resume_writer const&) = delete;
+	resume_writer& operator=(resume_writer const&) = delete;
+
+	// info_hash is the 40 hex digit key of the torrent. resume is the
+	// bencoded resume data
+	void save(
+		std::string info_hash, std::vector<char> resume, int queue_position, std::uint64_t tag
+	);
+	void set_queue_position(std::string info_hash, int queue_position);
+
+	// stores the metadata of a torrent, unless it's already stored
+	void save_metadata(std::string info_hash, std::vector<char> metadata);
+
+	// removes both the resume data and the metadata of the torrent
+	void remove(std::string info_hash);
+
+	// blocks until everything queued so far has been committed
+	void flush();
+
+	// the number of writes waiting to be committed
+	std::size_t queue_size() const;
+
+private:
+	enum class op_type : std::uint8_t { save, queue_position, metadata, remove };
+
+	struct write_op {
+		op_type type;
+		std::string info_hash;
+		// the resume data or the metadata
+		std::vector<char> resume;
+		int queue_position;
+		std::uint64_t tag;
+	};
+
+	void push(write_op op);
+	void thread_fun();
+	void write_batch(std::vector<write_op> const& batch);
+	bool write(write_op const& op);
+
+	// steps stmt, unless binding its parameters failed (ret is the result of
+	// the binding), and resets it
+	bool step(sqlite3_stmt* stmt, int ret);
+
+	// only used by the writer thread, once it's started
+	sqlite3* m_db = nullptr;
+	sqlite3_stmt* m_insert = nullptr;
+	sqlite3_stmt* m_update_queue_pos = nullptr;
+	sqlite3_stmt* m_delete = nullptr;
+	sqlite3_stmt* m_insert_metadata = nullptr;
+	sqlite3_stmt* m_delete_metadata = nullptr;
+
+	std::size_t const m_max_batch;
+	std::chrono::milliseconds const m_max_delay;
+	bool const m_compress;
+
+	mutable std::mutex m_mutex;
+
+	// signals the writer thread that there's something to do
+	std::condition_variable m_work;
+
+	// signals flush() that a batch has been committed
+	std::condition_variable m_committed_cond;
+
+	std::vector<write_op> m_queue;
+
+	// the number of writes ever queued and committed. flush() waits for
+	// m_committed to catch up with m_enqueued
+	std::uint64_t m_enqueued = 0;
+	std::uint64_t m_committed = 0;
+
+	// the number of threads blocked in flush(). The writer doesn't wait for
+	// the batch to fill up while someone is waiting
+	int m_flushing = 0;
+
+	bool m_stop = false;
+
+	// this is last, to be started once everything else is initialized
+	std::thread m_thread;
+};
+
+} // namespace ltweb
+
+#endif
@@ -10,7 +10,13 @@ see LICENSE file.
 #include "save_resume.hpp"
 #include "save_settings.hpp" // for load_file and save_file
 
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
 #include <functional>
+#include <iterator>
+#include <memory>
+#include <vector>
 
 #include "libtorrent/add_torrent_params.hpp"
 #include "libtorrent/read_resume_data.hpp"
@@ -20,10 +26,15 @@ see LICENSE file.
 #include "libtorrent/entry.hpp"
 #include "libtorrent/bencode.hpp"
 #include "libtorrent/alert_types.hpp"
+#include "libtorrent/torrent_info.hpp"
 
 #include "alert_handler.hpp"
 #include "hex.hpp"
 #include "torrent_history.hpp"
+#include "resume_writer.hpp"
+#include "ordered_pipeline.hpp"
+#include "resume_codec.hpp"
+#include "metrics.hpp"
 
 namespace s = std::placeholders;
 
@@ -40,6 +51,109 @@ std::string info_hash_key(lt::info_hash_t const& ih)
 	return to_hex(lt::span<char const>{best.data(), lt::sha1_hash::size()});
 }
 
+// rows are decoded in batches of this many, and at most max_load_batches
+// batches are in the pipeline at a time
+constexpr std::size_t load_batch_size = 256;
+constexpr std::size_t max_load_batches = 8;
+
+// the number of torrents passed to async_add_torrent() that we haven't seen
+// the add_torrent_alert for yet. Keeps the session's queue of adds, and the
+// alert queue, from growing to the size of the whole database
+constexpr std::int64_t max_adds_in_flight = 2048;
+
+// a torrent that has transferred this many bytes since its resume data was
+// last saved is saved within min_save_delay, rather than m_interval, since a
+// crash would lose more of its progress
+constexpr std::int64_t dirty_bytes_threshold = 64 * 1024 * 1024;
+constexpr lt::seconds min_save_delay(30);
+
+// the maximum number of torrents to ask for resume data on each tick, to
+// spread the work out when many torrents are due at the same time
+constexpr int max_saves_per_tick = 100;
+
+// when shutting down, this many resume data requests are kept in flight.
+// Asking for all of them at once would flood the disk thread
+constexpr int max_flush_in_flight = 64;
+
+struct load_metrics {
+	int const rows = global_metrics().register_metric("resume.load_rows", metric_type::gauge);
+	int const decoded =
+		global_metrics().register_metric("resume.load_decoded", metric_type::counter);
+	int const failed = global_metrics().register_metric("resume.load_failed", metric_type::counter);
+	int const submitted =
+		global_metrics().register_metric("resume.load_submitted", metric_type::counter);
+	int const loading = global_metrics().register_metric("resume.loading", metric_type::gauge);
+	int const flushing = global_metrics().register_metric("resume.flushing", metric_type::gauge);
+	int const flush_remaining =
+		global_metrics().register_metric("resume.flush_remaining", metric_type::gauge);
+	int const flush_saved =
+		global_metrics().register_metric("resume.flush_saved", metric_type::counter);
+};
+
+load_metrics const& resume_metrics()
+{
+	static load_metrics const m;
+	return m;
+}
+
+// a row of the TORRENTS table, and the torrent's metadata, on its way
+// through the loader
+struct resume_row {
+	std::vector<char> resume;
+	std::vector<char> metadata;
+	int queue_position = -1;
+	std::uint64_t tag = 0;
+	lt::add_torrent_params params;
+	bool ok = false;
+	bool metadata_stored = false;
+};
+
+// the METADATA table holds the info-dictionary of a torrent, along with the
+// other fields of the .torrent file that don't change and aren't part of the
+// resume data. It's stored as a bencoded dictionary, like a .torrent file
+// without trackers
+std::vector<char> torrent_metadata(lt::torrent_info const& ti)
+{
+	lt::entry e;
+	lt::span<char const> const info = ti.info_section();
+	e["info"] = lt::entry::preformatted_type(info.begin(), info.end());
+	if (!ti.comment().empty()) e["comment"] = ti.comment();
+	if (!ti.creator().empty()) e["created by"] = ti.creator();
+	if (ti.creation_date() != 0) e["creation date"] = std::int64_t(ti.creation_date());
+
+	std::vector<char> ret;
+	lt::bencode(std::back_inserter(ret), e);
+	return ret;
+}
+
+// decodes the resume data of r, and adds the metadata from the METADATA
+// table, if it's not in the resume data already (it is in rows saved before
+// the METADATA table existed)
+void decode_row(resume_row& r)
+{
+	std::vector<char> resume;
+	if (!decompress_resume({r.resume.data(), r.resume.size()}, resume)) return;
+
+	lt::error_code ec;
+	r.params = lt::read_resume_data({resume.data(), std::ptrdiff_t(resume.size())}, ec);
+	if (ec) return;
+	r.ok = true;
+
+	if (r.metadata.empty()) return;
+	if (!r.params.ti) {
+		auto ti = std::make_shared<lt::torrent_info>(
+			lt::span<char const>{r.metadata.data(), std::ptrdiff_t(r.metadata.size())},
+			ec,
+			lt::from_span
+		);
+		// if the metadata doesn't match the torrent, it's added without it,
+		// and downloads it from peers
+		if (ec || ti->info_hashes().get_best() != r.params.info_hashes.get_best()) return;
+		r.params.ti = std::move(ti);
+	}
+	r.metadata_stored = true;
+}
+
 } // anonymous namespace
 
 save_resume::save_resume(
@@ -48,8 +162,6 @@ save_resume::save_resume(
 	: m_ses(s)
 	, m_alerts(alerts)
 	, m_hist(hist)
-	, m_cursor(m_torrents.begin())
-	, m_last_save(lt::clock_type::now())
 	, m_interval(lt::minutes(15))
 	, m_num_in_flight(0)
 	, m_shutting_down(false)
@@ -62,15 +174,6 @@ save_resume::save_resume(
 		return;
 	}
 
-	m_alerts->subscribe<
-		lt::add_torrent_alert,
-		lt::torrent_removed_alert,
-		lt::save_resume_data_alert,
-		lt::save_resume_data_failed_alert,
-		lt::metadata_received_alert,
-		lt::torrent_finished_alert,
-		lt::state_update_alert>(this);
-
 	ret = sqlite3_exec(
 		m_db,
 		"CREATE TABLE TORRENTS("
@@ -90,6 +193,22 @@ save_resume::save_resume(
 	// exist (and sqlite doesn't give a reasonable way to
 	// know what failed programatically).
 
+	// the metadata of torrents is stored separately from the resume data.
+	// It never changes, so it's written once, rather than every time the
+	// resume data is saved
+	ret = sqlite3_exec(
+		m_db,
+		"CREATE TABLE IF NOT EXISTS METADATA("
+		"INFOHASH STRING PRIMARY KEY NOT NULL,"
+		"INFO BLOB NOT NULL);",
+		nullptr,
+		0,
+		nullptr
+	);
+	if (ret != SQLITE_OK) {
+		fprintf(stderr, "Failed to create metadata table: %s\n", sqlite3_errmsg(m_db));
+	}
+
 	// Additive schema migration for databases created before QUEUE_POSITION
 	// existed. On a fresh DB the column is already in the CREATE above and
 	// this ALTER fails with "duplicate column name"; on an already-migrated
@@ -104,17 +223,46 @@ save_resume::save_resume(
 	// back as NULL until the next save rewrites them; the load path treats
 	// NULL as tag 0 (the default for a never-tagged torrent).
 	sqlite3_exec(m_db, "ALTER TABLE TORRENTS ADD COLUMN TAG INTEGER;", nullptr, nullptr, nullptr);
+
+	// all writes happen on the writer's own thread and connection. This
+	// connection is only used to set up the schema and to load. The writer
+	// puts the database in WAL mode, where loading doesn't block on writes
+	sqlite3_busy_timeout(m_db, 5000);
+	m_writer = std::make_unique<resume_writer>(
+		resume_file, 256, std::chrono::milliseconds(500), true
+	);
+
+	m_alerts->subscribe<
+		lt::add_torrent_alert,
+		lt::torrent_removed_alert,
+		lt::save_resume_data_alert,
+		lt::save_resume_data_failed_alert,
+		lt::metadata_received_alert,
+		lt::torrent_finished_alert,
+		lt::state_update_alert,
+		lt::alerts_dropped_alert>(this);
 }
 
 save_resume::~save_resume()
 {
 	m_alerts->unsubscribe(this);
+
+	{
+		std::lock_guard<std::mutex> l(m_load_mutex);
+		m_load_abort = true;
+	}
+	m_load_cond.notify_all();
+	if (m_loader.joinable()) m_loader.join();
+
+	// commits everything still queued
+	m_writer.reset();
 	sqlite3_close(m_db);
 	m_db = nullptr;
 }
 
 void save_resume::handle_alert(lt::alert const* a)
 try {
+	std::lock_guard<std::mutex> state_lock(m_mutex);
 	lt::add_torrent_alert const* ta = lt::alert_cast<lt::add_torrent_alert>(a);
 	lt::torrent_removed_alert const* td = lt::alert_cast<lt::torrent_removed_alert>(a);
 	lt::save_resume_data_alert const* sr = lt::alert_cast<lt::save_resume_data_alert>(a);
@@ -123,286 +271,430 @@ try {
 	lt::metadata_received_alert const* mr = lt::alert_cast<lt::metadata_received_alert>(a);
 	lt::torrent_finished_alert const* tf = lt::alert_cast<lt::torrent_finished_alert>(a);
 	lt::state_update_alert const* su = lt::alert_cast<lt::state_update_alert>(a);
+	lt::alerts_dropped_alert const* ad = lt::alert_cast<lt::alerts_dropped_alert>(a);
 	if (ta) {
-		lt::torrent_status st = ta->handle.status(lt::torrent_handle::query_name);
-		printf("added torrent: %s\n", st.name.c_str());
-		m_torrents.insert(ta->handle);
-		if (st.has_metadata) {
-			ta->handle.save_resume_data(
-				lt::torrent_handle::save_info_dict | lt::torrent_handle::only_if_modified
-			);
-			++m_num_in_flight;
+		lt::info_hash_t const ta_ih =
+			ta->params.ti ? ta->params.ti->info_hashes() : ta->params.info_hashes;
+		std::uint64_t pending_tag = 0;
+		bool metadata_stored = false;
+		{
+			std::lock_guard<std::mutex> l(m_load_mutex);
+			++m_load_added;
+			auto const pt = m_pending_tags.find(ta_ih.get_best());
+			if (pt != m_pending_tags.end()) {
+				pending_tag = pt->second;
+				m_pending_tags.erase(pt);
+			}
+			metadata_stored = m_loaded_metadata.erase(ta_ih.get_best()) > 0;
 		}
-
-		if (m_cursor == m_torrents.end()) m_cursor = m_torrents.begin();
+		m_load_cond.notify_one();
+		if (ta->error) return;
+
+		// both the name and whether we have metadata are known from the
+		// add_torrent_params, without a round-trip to the network thread.
+		// That matters when thousands of torrents are loaded at startup
+		printf("added torrent: %s\n", ta->torrent_name());
+		// the entry exists already if resync() found the torrent before its
+		// alert arrived
+		torrent_entry& e = m_torrents[ta->handle];
+		e.info_hash = ta_ih.get_best();
+		e.metadata_stored = e.metadata_stored || metadata_stored;
+		m_info_hashes[e.info_hash] = ta->handle;
+		if (ta->params.ti) save(ta->handle);
 
 		// If this torrent was loaded from disk and carried a persisted tag,
 		// apply it now -- torrent_history's add_torrent_alert handler ran
-		// before us (it subscribed first), so the entry is already in
-		// m_queue and set_tag can find it. Runtime additions never appear
-		// in m_pending_tags, so the lookup is a benign miss.
-		lt::sha1_hash const ih = ta->handle.info_hashes().get_best();
-		auto const pt = m_pending_tags.find(ih);
-		if (pt != m_pending_tags.end()) {
-			m_hist.set_tag(ih, pt->second, ~std::uint64_t(0));
-			m_pending_tags.erase(pt);
-		}
+		// before us (it subscribed first, or is ordered first with
+		// alert_handler::dispatch_after()), so it knows about the torrent and
+		// set_tag can find it. Runtime additions never appear in
+		// m_pending_tags, so the lookup is a benign miss.
+		if (pending_tag != 0) m_hist.set_tag(ta_ih.get_best(), pending_tag, ~std::uint64_t(0));
 	} else if (mr) {
-		mr->handle.save_resume_data(
-			lt::torrent_handle::save_info_dict | lt::torrent_handle::only_if_modified
-		);
-		++m_num_in_flight;
+		// the metadata and the state change are saved right away
+		save(mr->handle);
 	} else if (tf) {
-		tf->handle.save_resume_data(
-			lt::torrent_handle::save_info_dict | lt::torrent_handle::only_if_modified
-		);
-		++m_num_in_flight;
+		save(tf->handle);
 	} else if (td) {
-		bool wrapped = false;
-		auto i = m_torrents.find(td->handle);
-		if (i == m_torrents.end()) {
-			// this is a bit sad...
-			// maybe this should be a bimap, so we can look it up by info-hash as well
-			for (i = m_torrents.begin(); i != m_torrents.end(); ++i) {
-				if (!i->is_valid()) continue;
-				if (i->info_hashes() == td->info_hashes) break;
-			}
-			if (i == m_torrents.end()) return;
-		}
-		if (m_cursor == i) {
-			++m_cursor;
-			if (m_cursor == m_torrents.end()) wrapped = true;
-		}
-
-		m_torrents.erase(i);
-		if (wrapped) m_cursor = m_torrents.begin();
-
-		m_last_queue_pos.erase(td->info_hashes.get_best());
-
-		// we need to delete the resume file from the resume directory
-		// as well, to prevent it from being reloaded on next startup
-		sqlite3_stmt* stmt = nullptr;
-		int ret = sqlite3_prepare_v2(
-			m_db, "DELETE FROM TORRENTS WHERE INFOHASH = :ih;", -1, &stmt, nullptr
-		);
-		if (ret != SQLITE_OK) {
-			printf("failed to prepare remove statement: %s\n", sqlite3_errmsg(m_db));
-			return;
-		}
-		std::string const ih = info_hash_key(td->info_hashes);
-		ret = sqlite3_bind_text(stmt, 1, ih.c_str(), 40, SQLITE_STATIC);
-		if (ret != SQLITE_OK) {
-			printf("failed to bind remove statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
-		}
-		ret = sqlite3_step(stmt);
-		if (ret != SQLITE_DONE) {
-			printf("failed to step remove statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
-		}
-
-		sqlite3_finalize(stmt);
-		printf("removing %s\n", ih.c_str());
+		auto const i = find_torrent(td->handle, td->info_hashes.get_best());
+		if (i == m_torrents.end()) return;
+		remove_torrent(i);
 	} else if (sr) {
-		TORRENT_ASSERT(m_num_in_flight > 0);
-		--m_num_in_flight;
-		std::vector<char> buf = write_resume_data_buf(sr->params);
-
-		sqlite3_stmt* stmt = nullptr;
-		int ret = sqlite3_prepare_v2(
-			m_db,
-			"INSERT OR REPLACE INTO TORRENTS(INFOHASH,RESUME,QUEUE_POSITION,TAG) "
-			"VALUES(?, ?, ?, ?);",
-			-1,
-			&stmt,
-			nullptr
-		);
-		if (ret != SQLITE_OK) {
-			fprintf(stderr, "failed to prepare insert statement: %s\n", sqlite3_errmsg(m_db));
-			return;
-		}
-
+		save_returned(sr->handle, sr->params.info_hashes.get_best());
 		std::string const ih = info_hash_key(sr->params.info_hashes);
-		ret = sqlite3_bind_text(stmt, 1, ih.c_str(), 40, SQLITE_STATIC);
-		if (ret != SQLITE_OK) {
-			printf("failed to bind insert statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
-		}
-		ret = sqlite3_bind_blob(stmt, 2, buf.data(), buf.size(), SQLITE_STATIC);
-		if (ret != SQLITE_OK) {
-			printf("failed to bind insert statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
+
+		// the metadata is stored once, in the METADATA table, and left out
+		// of the resume data. The info-dictionary is by far the largest part
+		// of it
+		std::vector<char> buf;
+		if (sr->params.ti) {
+			auto const i = find_torrent(sr->handle, sr->params.info_hashes.get_best());
+			if (i != m_torrents.end() && !i->second.metadata_stored) {
+				m_writer->save_metadata(ih, torrent_metadata(*sr->params.ti));
+				i->second.metadata_stored = true;
+			}
+			lt::add_torrent_params p = sr->params;
+			p.ti.reset();
+			buf = write_resume_data_buf(p);
+		} else {
+			buf = write_resume_data_buf(sr->params);
 		}
-		// queue_position is -1 (lt::no_pos) for seeds/finished torrents; we
-		// store the sentinel as-is and rely on the load-side ORDER BY to put
-		// such rows after the queued ones. This is a synchronous call into
-		// the libtorrent network thread.
+
+		// queue_position is not part of the resume data. This is a
+		// synchronous call into the libtorrent network thread.
 		int const qp = static_cast<int>(sr->handle.queue_position());
 		lt::sha1_hash const sr_ih = sr->params.info_hashes.get_best();
-		if (qp >= 0)
-			m_last_queue_pos[sr_ih] = qp;
-		else
-			m_last_queue_pos.erase(sr_ih);
-		ret = sqlite3_bind_int(stmt, 3, qp);
-		if (ret != SQLITE_OK) {
-			printf("failed to bind insert statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
-		}
-		// tag bitfield, stored as a 64-bit integer. We always write it, even
-		// when 0 -- so a row that had a tag and then gets cleared is rewritten
-		// with TAG = 0 rather than left at its previous value.
-		std::uint64_t const tag = m_hist.get_tag(sr->handle);
-		ret = sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(tag));
-		if (ret != SQLITE_OK) {
-			printf("failed to bind insert statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
+		{
+			std::lock_guard<std::mutex> l(m_load_mutex);
+			if (qp >= 0)
+				m_last_queue_pos[sr_ih] = qp;
+			else
+				m_last_queue_pos.erase(sr_ih);
 		}
 
-		ret = sqlite3_step(stmt);
-		if (ret != SQLITE_DONE) {
-			printf("failed to step insert statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
-		}
-		sqlite3_finalize(stmt);
+		m_writer->save(ih, std::move(buf), qp, m_hist.get_tag(sr->handle));
 		printf("saving %s\n", ih.c_str());
 	} else if (su) {
 		// Queue position is not part of the resume blob, so a reorder by
 		// itself never produces a save_resume_data_alert. We watch the
-		// per-torrent status feed instead and emit a single-cell UPDATE
+		// per-torrent status feed instead and queue a single-cell UPDATE
 		// when the value diverges from the last one we persisted. Only
 		// torrents that libtorrent reports as changed appear in
 		// su->status, so we never scan the full set.
-		sqlite3_stmt* stmt = nullptr;
-		for (lt::torrent_status const& st : su->status) {
-			int const qp = static_cast<int>(st.queue_position);
-			lt::sha1_hash const ih = st.info_hashes.get_best();
-
-			auto it = m_last_queue_pos.find(ih);
-			if (it == m_last_queue_pos.end()) {
-				// Seeds are not queued and stay unqueued for life, so
-				// there is nothing to track. For a downloading torrent
-				// we seed the cache without writing -- the value
-				// either matches what we loaded from the DB or will be
-				// picked up by the next full save_resume_data path.
-				if (qp >= 0) m_last_queue_pos.emplace(ih, qp);
-				continue;
-			}
-			if (it->second == qp) continue;
-
-			if (!stmt) {
-				int const pret = sqlite3_prepare_v2(
-					m_db,
-					"UPDATE TORRENTS SET QUEUE_POSITION = ? WHERE INFOHASH = ?;",
-					-1,
-					&stmt,
-					nullptr
-				);
-				if (pret != SQLITE_OK) {
-					fprintf(stderr, "failed to prepare qp update: %s\n", sqlite3_errmsg(m_db));
-					return;
-				}
-			}
-			std::string const ih_hex =
-				to_hex(lt::span<char const>{ih.data(), lt::sha1_hash::size()});
-			sqlite3_bind_int(stmt, 1, qp);
-			sqlite3_bind_text(stmt, 2, ih_hex.c_str(), 40, SQLITE_TRANSIENT);
-			if (sqlite3_step(stmt) != SQLITE_DONE) {
-				fprintf(stderr, "failed to step qp update: %s\n", sqlite3_errmsg(m_db));
-			}
-			sqlite3_reset(stmt);
-			sqlite3_clear_bindings(stmt);
-
-			// Persist the new value, then drop the entry once the
-			// torrent has transitioned to a seed -- it will not get a
-			// non-negative queue_position again, so there is no point
-			// keeping it in the cache.
-			if (qp < 0)
-				m_last_queue_pos.erase(it);
-			else
-				it->second = qp;
-		}
-		if (stmt) sqlite3_finalize(stmt);
+		//
+		// The same feed tells us which torrents have changes to save
+		// (need_save_resume). Those are scheduled to be saved by tick().
+		lt::time_point const now = lt::clock_type::now();
+		std::lock_guard<std::mutex> l(m_load_mutex);
+		for (lt::torrent_status const& st : su->status)
+			status_updated(st, now);
 	} else if (sf) {
-		TORRENT_ASSERT(m_num_in_flight > 0);
-		--m_num_in_flight;
+		// not modified since it was last saved
+		save_returned(sf->handle, lt::sha1_hash());
+	} else if (ad) {
+		resync(*ad);
 	}
 } catch (std::exception const&) {
 }
 
+void save_resume::status_updated(lt::torrent_status const& st, lt::time_point const now)
+{
+	auto const te = m_torrents.find(st.handle);
+	if (te != m_torrents.end()) {
+		torrent_entry& e = te->second;
+		e.transferred = st.all_time_download + st.all_time_upload;
+		if (st.need_save_resume) {
+			schedule_save(te->first, e, now + m_interval);
+			if (e.transferred - e.saved_transferred >= dirty_bytes_threshold)
+				schedule_save(te->first, e, now + min_save_delay);
+		}
+	}
+
+	int const qp = static_cast<int>(st.queue_position);
+	lt::sha1_hash const ih = st.info_hashes.get_best();
+
+	auto it = m_last_queue_pos.find(ih);
+	if (it == m_last_queue_pos.end()) {
+		// Seeds are not queued and stay unqueued for life, so
+		// there is nothing to track. For a downloading torrent
+		// we seed the cache without writing -- the value
+		// either matches what we loaded from the DB or will be
+		// picked up by the next full save_resume_data path.
+		if (qp >= 0) m_last_queue_pos.emplace(ih, qp);
+		return;
+	}
+	if (it->second == qp) return;
+
+	m_writer->set_queue_position(
+		to_hex(lt::span<char const>{ih.data(), lt::sha1_hash::size()}), qp
+	);
+
+	// Persist the new value, then drop the entry once the
+	// torrent has transitioned to a seed -- it will not get a
+	// non-negative queue_position again, so there is no point
+	// keeping it in the cache.
+	if (qp < 0)
+		m_last_queue_pos.erase(it);
+	else
+		it->second = qp;
+}
+
+void save_resume::save_returned(lt::torrent_handle const& h, lt::sha1_hash const& ih)
+{
+	// a reply to a save we asked for again, after alerts were dropped, or
+	// for a torrent that's been removed, isn't counted
+	auto const i = find_torrent(h, ih);
+	if (i == m_torrents.end() || i->second.saves_in_flight == 0) return;
+	--i->second.saves_in_flight;
+	TORRENT_ASSERT(m_num_in_flight > 0);
+	--m_num_in_flight;
+	if (m_shutting_down) {
+		++m_num_flushed;
+		global_metrics().inc(resume_metrics().flush_saved);
+	}
+}
+
+void save_resume::remove_torrent(torrent_map::iterator const i)
+{
+	lt::sha1_hash const info_hash = i->second.info_hash;
+	m_num_in_flight -= i->second.saves_in_flight;
+	m_save_queue.erase({i->second.deadline, i->first});
+	m_info_hashes.erase(info_hash);
+	m_torrents.erase(i);
+
+	{
+		std::lock_guard<std::mutex> l(m_load_mutex);
+		m_last_queue_pos.erase(info_hash);
+	}
+
+	// we need to delete the resume file from the resume directory
+	// as well, to prevent it from being reloaded on next startup
+	std::string const ih = to_hex(lt::span<char const>{info_hash.data(), lt::sha1_hash::size()});
+	m_writer->remove(ih);
+	printf("removing %s\n", ih.c_str());
+}
+
+void save_resume::resync(lt::alerts_dropped_alert const& a)
+{
+	auto const& dropped = a.dropped_alerts;
+	bool const adds = dropped[lt::add_torrent_alert::alert_type];
+	bool const removes = dropped[lt::torrent_removed_alert::alert_type];
+	bool const updates = dropped[lt::state_update_alert::alert_type]
+		|| dropped[lt::metadata_received_alert::alert_type]
+		|| dropped[lt::torrent_finished_alert::alert_type];
+	bool const replies = dropped[lt::save_resume_data_alert::alert_type]
+		|| dropped[lt::save_resume_data_failed_alert::alert_type];
+
+	// the torrents waiting for a reply may never get one. Ask again. If the
+	// first reply was only late, the second isn't counted
+	if (replies) {
+		for (auto const& [h, e] : m_torrents)
+			if (e.saves_in_flight > 0) h.save_resume_data(save_flags(h));
+	}
+	if (!adds && !removes && !updates) return;
+
+	// the history resyncs after the same drop, and shares its snapshot of
+	// the session with us
+	auto const st = m_hist.session_snapshot(a);
+	lt::time_point const now = lt::clock_type::now();
+
+	std::unordered_set<lt::torrent_handle> live;
+	std::vector<std::pair<lt::sha1_hash, std::uint64_t>> tags;
+	int added = 0;
+	std::vector<lt::torrent_handle> to_save;
+	{
+		std::lock_guard<std::mutex> l(m_load_mutex);
+		for (lt::torrent_status const& ts : *st) {
+			live.insert(ts.handle);
+			// changes reported by a lost state update are picked up here.
+			// For the torrents that didn't change this does nothing
+			if (updates) status_updated(ts, now);
+			if (!adds || m_torrents.count(ts.handle) > 0) continue;
+
+			// the add_torrent_alert was lost. Do what it would have done
+			torrent_entry& e = m_torrents[ts.handle];
+			e.info_hash = ts.info_hashes.get_best();
+			e.metadata_stored = m_loaded_metadata.erase(e.info_hash) > 0;
+			m_info_hashes[e.info_hash] = ts.handle;
+			auto const pt = m_pending_tags.find(e.info_hash);
+			if (pt != m_pending_tags.end()) {
+				tags.emplace_back(pt->first, pt->second);
+				m_pending_tags.erase(pt);
+			}
+			++m_load_added;
+			++added;
+			if (ts.has_metadata) to_save.push_back(ts.handle);
+		}
+	}
+	m_load_cond.notify_one();
+
+	for (auto const& [ih, tag] : tags)
+		m_hist.set_tag(ih, tag, ~std::uint64_t(0));
+	for (lt::torrent_handle const& h : to_save)
+		save(h);
+
+	// the torrent_removed_alerts of these were lost
+	int removed = 0;
+	for (auto i = m_torrents.begin(); removes && i != m_torrents.end();) {
+		if (live.count(i->first) > 0) {
+			++i;
+			continue;
+		}
+		remove_torrent(i++);
+		++removed;
+	}
+
+	printf("alerts were dropped, resynced resume data: %d added, %d removed\n", added, removed);
+}
+
 void save_resume::tick()
 try {
-	// is it time to save resume data for another torrent?
-	if (m_torrents.empty()) return;
-
+	std::lock_guard<std::mutex> l(m_mutex);
 	if (m_shutting_down) return;
 
-	// calculate how many torrents we should save this tick. It depends on
-	// how long since we last tried to save one. Every m_interval seconds,
-	// we should have saved all torrents
-	int num_torrents = m_torrents.size();
-	int seconds_since_last = lt::total_seconds(lt::clock_type::now() - m_last_save);
-	int num_to_save = num_torrents * seconds_since_last / lt::total_seconds(m_interval);
-
-	// never save more than all torrents
-	num_to_save = (std::min)(num_to_save, num_torrents);
+	// save the torrents that are due, the most overdue first
+	lt::time_point const now = lt::clock_type::now();
+	int num_saved = 0;
+	while (!m_save_queue.empty() && num_saved < max_saves_per_tick) {
+		auto const [deadline, h] = *m_save_queue.begin();
+		if (deadline > now) break;
+		m_save_queue.erase(m_save_queue.begin());
+		save(h);
+		++num_saved;
+	}
 
-	if (num_to_save > 0) {
+	if (num_saved > 0) {
 		printf(
-			"saving resume data. [ time: %ds num-torrents: %d interval: %ds ]\n",
-			seconds_since_last,
-			num_to_save,
-			int(lt::total_seconds(m_interval))
+			"saving resume data. [ torrents: %d dirty: %d ]\n",
+			num_saved,
+			int(m_save_queue.size())
 		);
 	}
+} catch (std::exception const&) {
+}
 
-	while (num_to_save > 0) {
-		if (m_cursor == m_torrents.end()) m_cursor = m_torrents.begin();
+void save_resume::schedule_save(
+	lt::torrent_handle const& h, torrent_entry& e, lt::time_point const deadline
+)
+{
+	if (deadline >= e.deadline) return;
+	if (e.deadline != lt::time_point::max()) m_save_queue.erase({e.deadline, h});
+	e.deadline = deadline;
+	m_save_queue.emplace(deadline, h);
+}
 
-		m_cursor->save_resume_data(
-			lt::torrent_handle::save_info_dict | lt::torrent_handle::only_if_modified
-		);
-		printf("saving resume data for: %s\n", m_cursor->status().name.c_str());
+void save_resume::save(lt::torrent_handle const& h)
+{
+	auto const i = m_torrents.find(h);
+	if (i != m_torrents.end()) {
+		torrent_entry& e = i->second;
+		if (e.deadline != lt::time_point::max()) m_save_queue.erase({e.deadline, h});
+		e.deadline = lt::time_point::max();
+		e.saved_transferred = e.transferred;
+	}
+	h.save_resume_data(save_flags(h));
+	// replies for torrents we don't know about aren't waited for
+	if (i != m_torrents.end()) {
+		++i->second.saves_in_flight;
 		++m_num_in_flight;
-		--num_to_save;
-		++m_cursor;
+	}
+}
+
+void save_resume::save_all(lt::time_duration const timeout)
+{
+	std::lock_guard<std::mutex> state_lock(m_mutex);
+	if (m_shutting_down) return;
 
-		m_last_save = lt::clock_type::now();
+	// the dirty torrents are the ones in m_save_queue. ok_to_quit() saves
+	// them, the most overdue first, keeping a bounded number in flight.
+	// Torrents without changes have nothing to save
+	m_shutting_down = true;
+	lt::time_point const now = lt::clock_type::now();
+	m_flush_deadline = now + timeout;
+	global_metrics().set(resume_metrics().flushing, 1);
+
+	// torrents modified since the last state update haven't been scheduled
+	// yet. Ask the session for them, rather than for all torrents
+	std::vector<lt::torrent_status> dirty;
+	m_ses.get_torrent_status(
+		&dirty, [](lt::torrent_status const& st) { return st.need_save_resume; }, {}
+	);
+
+	{
+		// torrents that haven't been loaded yet are left in the database as
+		// they are
+		std::lock_guard<std::mutex> l(m_load_mutex);
+		m_load_abort = true;
+
+		for (lt::torrent_status const& st : dirty) {
+			auto const te = m_torrents.find(st.handle);
+			if (te != m_torrents.end()) schedule_save(te->first, te->second, now);
+		}
 	}
-} catch (std::exception const&) {
+	m_load_cond.notify_all();
+	printf("saving resume data for %d torrents\n", int(m_save_queue.size()));
 }
 
-void save_resume::save_all()
+bool save_resume::ok_to_quit()
 {
-	for (auto i = m_torrents.begin(), end(m_torrents.end()); i != end; ++i) {
-		i->save_resume_data(
-			lt::torrent_handle::save_info_dict | lt::torrent_handle::only_if_modified
+	std::lock_guard<std::mutex> l(m_mutex);
+	if (!m_shutting_down) return false;
+
+	bool const timed_out = lt::clock_type::now() >= m_flush_deadline;
+	while (!timed_out && !m_save_queue.empty() && m_num_in_flight < max_flush_in_flight) {
+		lt::torrent_handle const h = m_save_queue.begin()->second;
+		m_save_queue.erase(m_save_queue.begin());
+		try {
+			save(h);
+		} catch (std::exception const&) {
+			// the torrent was removed
+		}
+	}
+
+	int const remaining = int(m_save_queue.size()) + m_num_in_flight;
+	global_metrics().set(resume_metrics().flush_remaining, remaining);
+	printf("\rsaved %d torrents, %d remaining\x1b[K", m_num_flushed, remaining);
+	fflush(stdout);
+
+	if (remaining == 0) {
+		printf("\n");
+	} else if (timed_out) {
+		// whatever was saved is still committed by the writer. The rest
+		// will resume from their last saved state
+		printf("\n");
+		fprintf(
+			stderr,
+			"resume data flush timed out: %d torrents saved, %d not saved\n",
+			m_num_flushed,
+			remaining
 		);
-		++m_num_in_flight;
+	} else {
+		return false;
 	}
-	m_shutting_down = true;
+	global_metrics().set(resume_metrics().flushing, 0);
+	return true;
 }
 
-bool save_resume::ok_to_quit() const
+lt::resume_data_flags_t save_resume::save_flags(lt::torrent_handle const& h) const
 {
-	static int spinner = 0;
-	static const char bar[] = "|/-\\";
-	printf("\r%d %c\x1b[K", m_num_in_flight, bar[spinner]);
-	fflush(stdout);
-	spinner = (spinner + 1) & 3;
-	return m_num_in_flight == 0;
+	auto const i = m_torrents.find(h);
+	if (i != m_torrents.end() && i->second.metadata_stored)
+		return lt::torrent_handle::only_if_modified;
+	return lt::torrent_handle::save_info_dict | lt::torrent_handle::only_if_modified;
+}
+
+save_resume::torrent_map::iterator
+save_resume::find_torrent(lt::torrent_handle const& h, lt::sha1_hash const& ih)
+{
+	auto const i = m_torrents.find(h);
+	if (i != m_torrents.end()) return i;
+	auto const j = m_info_hashes.find(ih);
+	if (j == m_info_hashes.end()) return m_torrents.end();
+	return m_torrents.find(j->second);
 }
 
 void save_resume::load(lt::error_code& ec)
 {
 	ec.clear();
+	if (m_db == nullptr || m_loader.joinable()) return;
+	m_loader = std::thread(&save_resume::load_thread, this);
+}
+
+void save_resume::load_thread()
+{
+	metrics& mx = global_metrics();
+	load_metrics const& lm = resume_metrics();
+	auto const start = std::chrono::steady_clock::now();
+
+	mx.set(lm.loading, 1);
+
 	sqlite3_stmt* stmt = nullptr;
+	if (sqlite3_prepare_v2(m_db, "SELECT COUNT(*) FROM TORRENTS;", -1, &stmt, nullptr)
+		== SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) mx.set(lm.rows, sqlite3_column_int64(stmt, 0));
+	}
+	sqlite3_finalize(stmt);
+	stmt = nullptr;
+
 	// Load in queue-position order so libtorrent assigns new positions in
 	// the same order the user previously curated. The boolean first key
 	// (NULL or negative) sorts legacy rows and seeds/finished torrents
@@ -411,8 +703,9 @@ void save_resume::load(lt::error_code& ec)
 	// seeds from the queue after the resume check.
 	int ret = sqlite3_prepare_v2(
 		m_db,
-		"SELECT RESUME, QUEUE_POSITION, TAG FROM TORRENTS "
-		"ORDER BY (QUEUE_POSITION IS NULL OR QUEUE_POSITION < 0), QUEUE_POSITION;",
+		"SELECT T.RESUME, T.QUEUE_POSITION, T.TAG, M.INFO FROM TORRENTS T "
+		"LEFT JOIN METADATA M ON M.INFOHASH = T.INFOHASH "
+		"ORDER BY (T.QUEUE_POSITION IS NULL OR T.QUEUE_POSITION < 0), T.QUEUE_POSITION;",
 		-1,
 		&stmt,
 		nullptr
@@ -420,44 +713,98 @@ void save_resume::load(lt::error_code& ec)
 	if (ret != SQLITE_OK) {
 		// TODO: improve error reporting
 		fprintf(stderr, "failed to prepare select statement: %s\n", sqlite3_errmsg(m_db));
+		mx.set(lm.loading, 0);
 		return;
 	}
 
-	for (ret = sqlite3_step(stmt); ret == SQLITE_ROW; ret = sqlite3_step(stmt)) {
-		int bytes = sqlite3_column_bytes(stmt, 0);
-		if (bytes <= 0) continue;
+	std::int64_t num_added = 0;
+
+	// decoding the resume data is the expensive part, it's done by the
+	// workers. The batches come out in the order the rows were read, and are
+	// added to the session from the pipeline's sink
+	ordered_pipeline<resume_row, resume_row> pipeline(
+		std::max(1, int(std::thread::hardware_concurrency())),
+		load_batch_size,
+		max_load_batches,
+		[&](resume_row& r) {
+			decode_row(r);
+			mx.inc(r.ok ? lm.decoded : lm.failed);
+			std::vector<char>().swap(r.resume);
+			std::vector<char>().swap(r.metadata);
+			return std::move(r);
+		},
+		[&](std::vector<resume_row>& batch) {
+			{
+				std::unique_lock<std::mutex> l(m_load_mutex);
+				m_load_cond.wait(l, [&] {
+					return m_load_abort || m_load_submitted - m_load_added < max_adds_in_flight;
+				});
+				if (m_load_abort) return;
+
+				for (auto const& r : batch) {
+					if (!r.ok) continue;
+					lt::sha1_hash const ih = r.params.info_hashes.get_best();
+
+					// populate m_last_queue_pos so the first
+					// state_update_alert compares against the persisted
+					// value. Seeds have no position to track.
+					if (r.queue_position >= 0) m_last_queue_pos.emplace(ih, r.queue_position);
+
+					// Stash the persisted tag for the matching
+					// add_torrent_alert to apply once torrent_history has
+					// an entry for this info-hash.
+					if (r.tag != 0) m_pending_tags.emplace(ih, r.tag);
+					if (r.metadata_stored) m_loaded_metadata.insert(ih);
+					++m_load_submitted;
+				}
+			}
 
-		void const* buffer = sqlite3_column_blob(stmt, 0);
-		lt::error_code ec;
-		lt::add_torrent_params p =
-			lt::read_resume_data({static_cast<char const*>(buffer), bytes}, ec);
-		if (ec) continue;
-
-		// populate m_last_queue_pos so the first state_update_alert
-		// compares against the persisted value. Skip NULL (unknown)
-		// and negative sentinels (seeds have no position to track).
-		if (sqlite3_column_type(stmt, 1) == SQLITE_INTEGER) {
-			int const qp = sqlite3_column_int(stmt, 1);
-			if (qp >= 0) m_last_queue_pos.emplace(p.info_hashes.get_best(), qp);
+			for (auto& r : batch) {
+				if (!r.ok) continue;
+				m_ses.async_add_torrent(std::move(r.params));
+				mx.inc(lm.submitted);
+				++num_added;
+			}
 		}
+	);
+
+	for (ret = sqlite3_step(stmt); ret == SQLITE_ROW && !m_load_abort; ret = sqlite3_step(stmt)) {
+		int const bytes = sqlite3_column_bytes(stmt, 0);
+		if (bytes <= 0) continue;
+
+		char const* buffer = static_cast<char const*>(sqlite3_column_blob(stmt, 0));
+		resume_row r;
+		r.resume.assign(buffer, buffer + bytes);
+
+		// NULL (unknown) and negative queue positions are both stored as -1
+		if (sqlite3_column_type(stmt, 1) == SQLITE_INTEGER)
+			r.queue_position = std::max(-1, sqlite3_column_int(stmt, 1));
 
-		// Stash the persisted tag for the matching add_torrent_alert to
-		// apply once torrent_history has an entry for this info-hash.
 		// sqlite3_column_int64 returns 0 on a NULL column (legacy rows
 		// that pre-date the TAG column), which is also the never-tagged
-		// default, so the single tag != 0 check covers both cases.
-		std::uint64_t const tag = static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 2));
-		if (tag != 0) m_pending_tags.emplace(p.info_hashes.get_best(), tag);
+		// default
+		r.tag = static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 2));
 
-		m_ses.async_add_torrent(std::move(p));
+		// NULL when the metadata isn't in the METADATA table
+		if (int const info_bytes = sqlite3_column_bytes(stmt, 3); info_bytes > 0) {
+			char const* info = static_cast<char const*>(sqlite3_column_blob(stmt, 3));
+			r.metadata.assign(info, info + info_bytes);
+		}
+		pipeline.push(std::move(r));
 	}
-	if (ret != SQLITE_DONE) {
+	if (ret != SQLITE_DONE && !m_load_abort) {
 		// TODO: improve error reporting
-		printf("failed to step select statement: %s\n", sqlite3_errmsg(m_db));
-		sqlite3_finalize(stmt);
-		return;
+		fprintf(stderr, "failed to step select statement: %s\n", sqlite3_errmsg(m_db));
 	}
 	sqlite3_finalize(stmt);
+
+	pipeline.finish();
+	mx.set(lm.loading, 0);
+
+	auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start
+	);
+	printf("loaded %" PRId64 " torrents in %d ms\n", num_added, int(elapsed.count()));
 }
 
 } // namespace ltweb
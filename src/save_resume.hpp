@@ -15,17 +15,24 @@ see LICENSE file.
 #include "libtorrent/sha1_hash.hpp"
 #include "alert_observer.hpp"
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <memory>
 #include <set>
 #include <string>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
 #include <sqlite3.h>
 
 namespace ltweb {
 struct alert_handler;
 struct torrent_history;
+struct resume_writer;
 
 struct save_resume : alert_observer {
 	save_resume(
@@ -33,23 +40,118 @@ struct save_resume : alert_observer {
 	);
 	~save_resume();
 
+	// starts loading all torrents from the resume database, on a thread of
+	// its own. Resume data is decoded on a pool of worker threads, and the
+	// torrents are added to the session in batches, in queue order. The
+	// progress is reported through the resume.load_* metrics
 	void load(lt::error_code& ec);
 
 	// implements alert_observer
 	virtual void handle_alert(lt::alert const* a);
+	virtual char const* observer_name() const { return "save_resume"; }
 
 	void tick();
-	void save_all();
-	bool ok_to_quit() const;
+
+	// starts saving the resume data of all torrents with unsaved changes,
+	// before shutting down. Torrents without changes are not saved. Call
+	// ok_to_quit() until it returns true. If the flush takes longer than
+	// timeout, the remaining torrents are given up on
+	void save_all(lt::time_duration timeout = lt::seconds(30));
+
+	// keeps a bounded number of saves in flight while shutting down.
+	// Returns true once all torrents have been saved, or the flush timed
+	// out. The progress is printed, and reported through the
+	// resume.flush_* metrics
+	bool ok_to_quit();
 
 private:
+	void load_thread();
+
+	// the flags to pass to save_resume_data() for h. The info-dictionary is
+	// only requested until it's been stored in the METADATA table
+	lt::resume_data_flags_t save_flags(lt::torrent_handle const& h) const;
+
 	lt::session& m_ses;
 	alert_handler* m_alerts;
 	torrent_history& m_hist;
 	sqlite3* m_db;
 
+	// all changes to the database are made through this, on a separate
+	// thread, in batches
+	std::unique_ptr<resume_writer> m_writer;
+
+	// what we know about a loaded torrent
+	struct torrent_entry {
+		lt::sha1_hash info_hash;
+
+		// set once the metadata of the torrent is stored in the METADATA
+		// table. Its resume data is then saved without the info-dictionary
+		bool metadata_stored = false;
+
+		// when the torrent is due to be saved, or time_point::max() when
+		// there are no changes to save. While dirty, the torrent is in
+		// m_save_queue under this time
+		lt::time_point deadline = lt::time_point::max();
+
+		// all_time_download + all_time_upload, as of the last status update
+		// and as of the last time we asked for the resume data. The
+		// difference is how much progress a crash would lose
+		std::int64_t transferred = 0;
+		std::int64_t saved_transferred = 0;
+
+		// the number of save_resume_data() calls we're waiting for a reply
+		// to. They're counted in m_num_in_flight too
+		int saves_in_flight = 0;
+	};
+
+	// marks the torrent as dirty, and due to be saved at deadline (or
+	// earlier, if it already was)
+	void schedule_save(lt::torrent_handle const& h, torrent_entry& e, lt::time_point deadline);
+
+	// asks for the resume data of h
+	void save(lt::torrent_handle const& h);
+
+	// looks up a torrent by its handle, or by its info-hash if the handle
+	// doesn't match (the handle in a torrent_removed_alert refers to a
+	// torrent that no longer exists). Returns m_torrents.end() if the
+	// torrent isn't loaded
+	using torrent_map = std::unordered_map<lt::torrent_handle, torrent_entry>;
+	torrent_map::iterator find_torrent(lt::torrent_handle const& h, lt::sha1_hash const& ih);
+
+	// forgets a torrent that's been removed from the session, and removes
+	// it from the database
+	void remove_torrent(torrent_map::iterator i);
+
+	// schedules the torrent to be saved if it has changes, and persists its
+	// queue position. Must be called with m_load_mutex held
+	void status_updated(lt::torrent_status const& st, lt::time_point now);
+
+	// accounts for the reply to a save_resume_data() call
+	void save_returned(lt::torrent_handle const& h, lt::sha1_hash const& ih);
+
+	// reconciles the loaded torrents with the session, after it dropped
+	// alerts. Torrents whose add or remove was missed are added or removed,
+	// the saves whose reply may have been lost are asked for again, and lost
+	// state updates are made up for. The session is looked at through
+	// m_hist's snapshot of it, so the drop costs a single query
+	void resync(lt::alerts_dropped_alert const& a);
+
+	// protects the state of the loaded torrents and of the shutdown flush,
+	// below. With a threaded alert_handler, handle_alert() is called on
+	// another thread than tick(), save_all() and ok_to_quit(). Must be
+	// locked before m_load_mutex
+	std::mutex m_mutex;
+
 	// all torrents currently loaded
-	std::set<lt::torrent_handle> m_torrents;
+	torrent_map m_torrents;
+
+	// the handles of all torrents in m_torrents, by info-hash
+	std::unordered_map<lt::sha1_hash, lt::torrent_handle> m_info_hashes;
+
+	// the dirty torrents, ordered by when they are due to be saved. Clean
+	// torrents, like seeds that aren't uploading, are not in here, and cost
+	// nothing
+	std::set<std::pair<lt::time_point, lt::torrent_handle>> m_save_queue;
 
 	// Last queue_position value we persisted to the DB, keyed by info-hash.
 	// queue_position is not part of the resume blob, so libtorrent's
@@ -69,19 +171,42 @@ private:
 	// bounded by the resume file's row count.
 	std::unordered_map<lt::sha1_hash, std::uint64_t> m_pending_tags;
 
-	// the next torrent to save (may point to end)
-	std::set<lt::torrent_handle>::iterator m_cursor;
+	// info-hashes of torrents loaded with their metadata from the METADATA
+	// table, waiting for their add_torrent_alert to set metadata_stored on
+	// their entry in m_torrents
+	std::unordered_set<lt::sha1_hash> m_loaded_metadata;
+
+	// protects m_last_queue_pos, m_pending_tags and m_loaded_metadata, which
+	// the loader thread populates, and the load counters below
+	std::mutex m_load_mutex;
+
+	// signals the loader thread that more torrents have been added, or that
+	// it should stop
+	std::condition_variable m_load_cond;
 
-	// the last time we visited a torrent to potentially
-	// save its fast-resume
-	lt::time_point m_last_save;
+	// the number of torrents the loader has passed to async_add_torrent(),
+	// and the number of add_torrent_alerts we've seen. The loader waits for
+	// the difference to go down, rather than filling the session's queue
+	// with all torrents at once
+	std::int64_t m_load_submitted = 0;
+	std::int64_t m_load_added = 0;
 
-	// save resum data for all torrents every X seconds
-	// must be at least 1
+	// set when shutting down, to stop the loader
+	std::atomic<bool> m_load_abort{false};
+
+	std::thread m_loader;
+
+	// a torrent with changes is saved at most this long after it was first
+	// reported as having changes
 	lt::time_duration m_interval;
 
 	int m_num_in_flight;
 
+	// while shutting down, the number of torrents saved so far, and when we
+	// give up on the rest
+	int m_num_flushed = 0;
+	lt::time_point m_flush_deadline;
+
 	// when set, we stop saving periodically, and just wait
 	// for all outstanding saves to return.
 	bool m_shutting_down;
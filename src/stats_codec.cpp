@@ -0,0 +1,363 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "stats_codec.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <zlib.h>
+
+namespace ltweb {
+
+namespace {
+
+constexpr char header_magic[] = {'L', 'T', 'S', 'S'};
+constexpr char block_magic[] = {'L', 'T', 'S', 'B'};
+constexpr char index_magic[] = {'L', 'T', 'S', 'I'};
+
+// magic, payload size, number of samples and CRC-32
+constexpr std::size_t block_header_size = 16;
+constexpr std::size_t index_entry_size = 24;
+// magic, number of entries and the offset of the index
+constexpr std::size_t trailer_size = 16;
+
+// a header claiming more metrics than this is considered corrupt
+constexpr std::uint32_t max_metrics = 1 << 16;
+
+void write_u32(std::vector<char>& out, std::uint32_t const v)
+{
+	for (int i = 0; i < 4; ++i)
+		out.push_back(char((v >> (i * 8)) & 0xff));
+}
+
+void write_u64(std::vector<char>& out, std::uint64_t const v)
+{
+	for (int i = 0; i < 8; ++i)
+		out.push_back(char((v >> (i * 8)) & 0xff));
+}
+
+void write_varint(std::vector<char>& out, std::uint64_t v)
+{
+	while (v >= 0x80) {
+		out.push_back(char((v & 0x7f) | 0x80));
+		v >>= 7;
+	}
+	out.push_back(char(v));
+}
+
+std::uint32_t crc(std::string_view const buf, uLong const init = crc32(0, nullptr, 0))
+{
+	return std::uint32_t(crc32(init, reinterpret_cast<Bytef const*>(buf.data()), uInt(buf.size())));
+}
+
+// the CRC of a block covers the payload size and the number of samples from
+// its header, as well as the payload. A corrupt header is caught before
+// its sizes are trusted
+std::uint32_t
+block_crc(std::uint32_t const size, std::uint32_t const n, std::string_view const payload)
+{
+	std::vector<char> header;
+	write_u32(header, size);
+	write_u32(header, n);
+	return crc(payload, crc({header.data(), header.size()}));
+}
+
+// the difference between two values, mapped to an unsigned number so that
+// small negative and positive differences both make short varints. The
+// arithmetic is unsigned, and wraps rather than overflows
+std::uint64_t zigzag_delta(std::int64_t const prev, std::int64_t const v)
+{
+	std::uint64_t const d = std::uint64_t(v) - std::uint64_t(prev);
+	return (d << 1) ^ (0 - (d >> 63));
+}
+
+std::int64_t apply_zigzag_delta(std::int64_t const prev, std::uint64_t const z)
+{
+	std::uint64_t const d = (z >> 1) ^ (0 - (z & 1));
+	return std::int64_t(std::uint64_t(prev) + d);
+}
+
+// encodes the column of n values starting at values, stride apart
+void encode_column(
+	std::vector<char>& out,
+	std::int64_t const* values,
+	std::size_t const n,
+	std::size_t const stride
+)
+{
+	std::int64_t prev = 0;
+	for (std::size_t i = 0; i < n;) {
+		std::uint64_t const z = zigzag_delta(prev, values[i * stride]);
+		write_varint(out, z);
+		prev = values[i * stride];
+		++i;
+		if (z != 0) continue;
+
+		std::size_t run = 0;
+		while (i < n && values[i * stride] == prev) {
+			++run;
+			++i;
+		}
+		write_varint(out, run);
+	}
+}
+
+// reads fixed size and varint fields from a buffer, and fails (rather than
+// reading past the end) if the buffer is too short
+struct cursor {
+	std::string_view buf;
+	bool ok = true;
+
+	bool have(std::size_t const n) const { return ok && buf.size() >= n; }
+
+	bool skip_magic(char const (&magic)[4])
+	{
+		if (!have(4) || std::memcmp(buf.data(), magic, 4) != 0) return ok = false;
+		buf.remove_prefix(4);
+		return true;
+	}
+
+	std::uint64_t read_fixed(int const bytes)
+	{
+		if (!have(std::size_t(bytes))) {
+			ok = false;
+			return 0;
+		}
+		std::uint64_t ret = 0;
+		for (int i = 0; i < bytes; ++i)
+			ret |= std::uint64_t(std::uint8_t(buf[std::size_t(i)])) << (i * 8);
+		buf.remove_prefix(std::size_t(bytes));
+		return ret;
+	}
+
+	std::uint32_t read_u32() { return std::uint32_t(read_fixed(4)); }
+	std::uint64_t read_u64() { return read_fixed(8); }
+
+	std::uint64_t read_varint()
+	{
+		std::uint64_t ret = 0;
+		for (int shift = 0; shift < 64 && have(1); shift += 7) {
+			std::uint8_t const b = std::uint8_t(buf.front());
+			buf.remove_prefix(1);
+			ret |= std::uint64_t(b & 0x7f) << shift;
+			if ((b & 0x80) == 0) return ret;
+		}
+		ok = false;
+		return 0;
+	}
+};
+
+// decodes a column of n values into values, stride apart
+bool decode_column(cursor& c, std::int64_t* values, std::size_t const n, std::size_t const stride)
+{
+	std::int64_t prev = 0;
+	for (std::size_t i = 0; i < n;) {
+		std::uint64_t const z = c.read_varint();
+		prev = apply_zigzag_delta(prev, z);
+		values[i * stride] = prev;
+		++i;
+		if (z != 0) continue;
+
+		std::uint64_t const run = c.read_varint();
+		if (!c.ok || run > n - i) return false;
+		for (std::uint64_t k = 0; k < run; ++k, ++i)
+			values[i * stride] = prev;
+	}
+	return c.ok;
+}
+
+} // anonymous namespace
+
+std::vector<char>
+encode_stats_header(std::int64_t const start_time, std::vector<std::string> const& metrics)
+{
+	std::vector<char> ret(std::begin(header_magic), std::end(header_magic));
+	write_u32(ret, stats_log_version);
+	write_u64(ret, std::uint64_t(start_time));
+	write_u32(ret, std::uint32_t(metrics.size()));
+	for (auto const& name : metrics) {
+		write_varint(ret, name.size());
+		ret.insert(ret.end(), name.begin(), name.end());
+	}
+	return ret;
+}
+
+stats_block_encoder::stats_block_encoder(std::size_t const num_metrics)
+	: m_num_metrics(num_metrics)
+{
+}
+
+void stats_block_encoder::add(std::int64_t const timestamp, std::span<std::int64_t const> values)
+{
+	m_timestamps.push_back(timestamp);
+	values = values.first(std::min(values.size(), m_num_metrics));
+	m_values.insert(m_values.end(), values.begin(), values.end());
+	m_values.resize(m_timestamps.size() * m_num_metrics, 0);
+}
+
+std::vector<char> stats_block_encoder::finish()
+{
+	std::size_t const n = m_timestamps.size();
+	std::vector<char> ret(std::begin(block_magic), std::end(block_magic));
+	// the payload size and CRC are filled in once the payload is encoded
+	ret.resize(block_header_size);
+
+	encode_column(ret, m_timestamps.data(), n, 1);
+	for (std::size_t m = 0; m < m_num_metrics; ++m)
+		encode_column(ret, m_values.data() + m, n, m_num_metrics);
+
+	std::uint32_t const size = std::uint32_t(ret.size() - block_header_size);
+	std::vector<char> header;
+	write_u32(header, size);
+	write_u32(header, std::uint32_t(n));
+	write_u32(header, block_crc(size, std::uint32_t(n), {ret.data() + block_header_size, size}));
+	std::copy(header.begin(), header.end(), ret.begin() + sizeof(block_magic));
+
+	m_timestamps.clear();
+	m_values.clear();
+	return ret;
+}
+
+std::vector<char>
+encode_stats_index(std::vector<stats_block_info> const& blocks, std::uint64_t const offset)
+{
+	std::vector<char> ret;
+	ret.reserve(blocks.size() * index_entry_size + trailer_size);
+	for (auto const& b : blocks) {
+		write_u64(ret, std::uint64_t(b.first_timestamp));
+		write_u64(ret, b.offset);
+		write_u32(ret, b.num_samples);
+		write_u32(ret, 0);
+	}
+	ret.insert(ret.end(), std::begin(index_magic), std::end(index_magic));
+	write_u32(ret, std::uint32_t(blocks.size()));
+	write_u64(ret, offset);
+	return ret;
+}
+
+bool read_stats_block_info(std::string_view const block, stats_block_info& info)
+{
+	cursor c{block};
+	if (!c.skip_magic(block_magic)) return false;
+	std::uint32_t const size = c.read_u32();
+	std::uint32_t const num_samples = c.read_u32();
+	c.read_u32();
+	if (!c.ok || num_samples == 0 || c.buf.size() != size) return false;
+
+	// the timestamp column comes first, its first value is against 0
+	std::int64_t const first = apply_zigzag_delta(0, c.read_varint());
+	if (!c.ok) return false;
+	info = {first, 0, num_samples};
+	return true;
+}
+
+bool stats_log_reader::parse(std::string_view const buf)
+{
+	m_buf = buf;
+	m_metrics.clear();
+	m_blocks.clear();
+
+	cursor c{buf};
+	if (!c.skip_magic(header_magic)) return false;
+	std::uint32_t const version = c.read_u32();
+	m_start_time = std::int64_t(c.read_u64());
+	std::uint32_t const num_metrics = c.read_u32();
+	if (!c.ok || version > stats_log_version || num_metrics > max_metrics) return false;
+
+	for (std::uint32_t i = 0; i < num_metrics; ++i) {
+		std::uint64_t const len = c.read_varint();
+		if (!c.have(len)) return false;
+		m_metrics.emplace_back(c.buf.substr(0, len));
+		c.buf.remove_prefix(len);
+	}
+	m_data_start = buf.size() - c.buf.size();
+
+	if (!parse_index()) scan_blocks();
+	return true;
+}
+
+bool stats_log_reader::parse_index()
+{
+	if (m_buf.size() < m_data_start + trailer_size) return false;
+
+	cursor c{m_buf.substr(m_buf.size() - trailer_size)};
+	if (!c.skip_magic(index_magic)) return false;
+	std::uint64_t const num_entries = c.read_u32();
+	std::uint64_t const offset = c.read_u64();
+	if (!c.ok || offset < m_data_start
+		|| offset + num_entries * index_entry_size + trailer_size != m_buf.size()) {
+		return false;
+	}
+
+	c.buf = m_buf.substr(offset, num_entries * index_entry_size);
+	std::vector<stats_block_info> blocks;
+	for (std::uint64_t i = 0; i < num_entries; ++i) {
+		stats_block_info b;
+		b.first_timestamp = std::int64_t(c.read_u64());
+		b.offset = c.read_u64();
+		b.num_samples = c.read_u32();
+		c.read_u32();
+		if (b.offset < m_data_start || b.offset + block_header_size > offset) return false;
+		blocks.push_back(b);
+	}
+	m_blocks = std::move(blocks);
+	return true;
+}
+
+void stats_log_reader::scan_blocks()
+{
+	std::size_t offset = m_data_start;
+	for (;;) {
+		cursor c{m_buf.substr(offset)};
+		if (!c.skip_magic(block_magic)) break;
+		std::size_t const size = c.read_u32();
+		std::uint32_t const num_samples = c.read_u32();
+		c.read_u32();
+		if (!c.have(size) || num_samples == 0) break;
+
+		// the first value of the timestamp column is the timestamp itself
+		std::int64_t const first = apply_zigzag_delta(0, c.read_varint());
+		if (!c.ok) break;
+		m_blocks.push_back({first, offset, num_samples});
+		offset += block_header_size + size;
+	}
+}
+
+bool stats_log_reader::read_block(std::size_t const i, std::vector<stats_sample>& out) const
+{
+	if (i >= m_blocks.size()) return false;
+
+	cursor c{m_buf.substr(std::min(std::size_t(m_blocks[i].offset), m_buf.size()))};
+	if (!c.skip_magic(block_magic)) return false;
+	std::size_t const size = c.read_u32();
+	std::uint32_t const n = c.read_u32();
+	std::uint32_t const checksum = c.read_u32();
+	if (!c.have(size) || n > max_block_samples) return false;
+
+	c.buf = c.buf.substr(0, size);
+	if (block_crc(std::uint32_t(size), n, c.buf) != checksum) return false;
+
+	std::size_t const num_metrics = m_metrics.size();
+	if (std::uint64_t(n) * num_metrics > max_block_values) return false;
+	std::vector<std::int64_t> timestamps(n);
+	std::vector<std::int64_t> values(std::size_t(n) * num_metrics);
+	if (!decode_column(c, timestamps.data(), n, 1)) return false;
+	for (std::size_t m = 0; m < num_metrics; ++m)
+		if (!decode_column(c, values.data() + m, n, num_metrics)) return false;
+	if (!c.buf.empty()) return false;
+
+	for (std::size_t s = 0; s < n; ++s) {
+		auto const first = values.begin() + std::ptrdiff_t(s * num_metrics);
+		out.push_back({timestamps[s], {first, first + std::ptrdiff_t(num_metrics)}});
+	}
+	return true;
+}
+
+} // namespace ltweb
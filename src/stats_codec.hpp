@@ -0,0 +1,138 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_STATS_CODEC_HPP
+#define LTWEB_STATS_CODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ltweb {
+
+// The binary session stats log format. All fixed size fields are little
+// endian. A log file is made up of:
+//
+// a header:
+//   "LTSS", version (uint32), the wall clock time the log was started
+//   (int64, microseconds since the epoch), the number of metrics (uint32),
+//   followed by the name of each metric (a varint length and the name). A
+//   metric without a name has an empty name.
+//
+// blocks of samples:
+//   "LTSB", payload size (uint32), number of samples (uint32), CRC-32 of
+//   the payload size, the number of samples and the payload (uint32),
+//   followed by the payload. The payload is columnar:
+//   first the timestamps (microseconds since the log was started), then each
+//   metric, in order. A column is encoded as the difference of each value to
+//   the one before it (the first against 0, so every block can be decoded on
+//   its own), zig-zag encoded as a varint. A zero difference is followed by
+//   a varint of the number of additional zeros following it, which makes
+//   counters that don't change cost a couple of bytes per block.
+//
+// the index, once the log is closed:
+//   one entry per block, with the timestamp of its first sample (int64),
+//   its offset in the file (uint64), the number of samples (uint32) and 4
+//   reserved bytes. Followed by the trailer: "LTSI", the number of entries
+//   (uint32) and the offset of the index (uint64). The entries have a fixed
+//   size, so the index can be binary searched in place in a mapped file.
+//
+// A log that wasn't closed (e.g. because of a crash) has no index, and is
+// read by scanning the blocks.
+
+constexpr std::uint32_t stats_log_version = 1;
+
+std::vector<char>
+encode_stats_header(std::int64_t start_time, std::vector<std::string> const& metrics);
+
+// accumulates samples into a block
+struct stats_block_encoder {
+	explicit stats_block_encoder(std::size_t num_metrics);
+
+	// values missing from the end of a sample are recorded as 0, and values
+	// beyond the number of metrics are ignored
+	void add(std::int64_t timestamp, std::span<std::int64_t const> values);
+
+	std::size_t num_samples() const { return m_timestamps.size(); }
+	std::int64_t first_timestamp() const { return m_timestamps.front(); }
+
+	// returns the encoded block, and starts a new one
+	std::vector<char> finish();
+
+private:
+	std::size_t const m_num_metrics;
+	std::vector<std::int64_t> m_timestamps;
+
+	// the samples, one after another
+	std::vector<std::int64_t> m_values;
+};
+
+struct stats_block_info {
+	std::int64_t first_timestamp;
+	std::uint64_t offset;
+	std::uint32_t num_samples;
+};
+
+// offset is where in the file the index is written
+std::vector<char>
+encode_stats_index(std::vector<stats_block_info> const& blocks, std::uint64_t offset);
+
+// reads the number of samples and the first timestamp of an encoded block
+// (as returned by stats_block_encoder::finish()). The offset is left as 0.
+// Returns false if block isn't a complete block
+bool read_stats_block_info(std::string_view block, stats_block_info& info);
+
+struct stats_sample {
+	std::int64_t timestamp;
+	std::vector<std::int64_t> values;
+};
+
+// reads a log from memory. The buffer must outlive the reader
+struct stats_log_reader {
+	// returns false if buf isn't a stats log, or its header is corrupt
+	bool parse(std::string_view buf);
+
+	// the largest number of samples accepted in a block
+	static constexpr std::uint32_t max_block_samples = 1 << 20;
+
+	// the largest number of values (samples times metrics) accepted in a
+	// block. This bounds what reading a corrupt block can allocate
+	static constexpr std::uint64_t max_block_values = 1 << 22;
+
+	std::int64_t start_time() const { return m_start_time; }
+	std::vector<std::string> const& metrics() const { return m_metrics; }
+
+	// the blocks, from the index if there is one, otherwise the ones found
+	// by scanning. A truncated last block is not included
+	std::vector<stats_block_info> const& blocks() const { return m_blocks; }
+
+	// appends the samples of block i to out. Returns false if the block is
+	// corrupt, in which case nothing is appended
+	bool read_block(std::size_t i, std::vector<stats_sample>& out) const;
+
+private:
+	bool parse_index();
+	void scan_blocks();
+
+	std::string_view m_buf;
+
+	// where the first block starts
+	std::size_t m_data_start = 0;
+
+	std::int64_t m_start_time = 0;
+	std::vector<std::string> m_metrics;
+	std::vector<stats_block_info> m_blocks;
+};
+
+} // namespace ltweb
+
+#endif
@@ -0,0 +1,84 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "stats_history.hpp"
+
+#include <algorithm>
+
+namespace ltweb {
+
+stats_history::stats_history(
+	std::size_t const num_counters, std::span<resolution const> const resolutions
+)
+	: m_num_counters(num_counters)
+{
+	for (auto const& r : resolutions) {
+		level l;
+		l.interval = std::max(r.interval, std::int64_t(1));
+		l.capacity = std::max(r.capacity, std::size_t(1));
+		l.slot_interval.resize(l.capacity, -1);
+		l.timestamps.resize(l.capacity, 0);
+		l.values.resize(l.capacity * num_counters, 0);
+		m_levels.push_back(std::move(l));
+	}
+}
+
+void stats_history::add(std::int64_t const timestamp, std::span<std::int64_t const> values)
+{
+	if (timestamp < 0) return;
+	values = values.first(std::min(values.size(), m_num_counters));
+
+	for (level& l : m_levels) {
+		std::int64_t const interval = timestamp / l.interval;
+		// a later sample in the same interval replaces the earlier one. If
+		// the clock steps back, samples older than what the slot already
+		// holds are dropped
+		std::size_t const slot = std::size_t(interval) % l.capacity;
+		if (interval < l.slot_interval[slot]) continue;
+		l.slot_interval[slot] = interval;
+		l.timestamps[slot] = timestamp;
+		auto const row = l.values.begin() + std::ptrdiff_t(slot * m_num_counters);
+		std::copy(values.begin(), values.end(), row);
+		std::fill(row + std::ptrdiff_t(values.size()), row + std::ptrdiff_t(m_num_counters), 0);
+		l.head = std::max(l.head, interval);
+	}
+}
+
+stats_history::result stats_history::query(
+	int const resolution,
+	std::int64_t const from,
+	std::int64_t const to,
+	std::span<int const> const counters
+) const
+{
+	result ret;
+	if (resolution < 0 || resolution >= num_resolutions() || from > to) return ret;
+	level const& l = m_levels[std::size_t(resolution)];
+	if (l.head < 0) return ret;
+
+	// the slots only hold the last capacity intervals up to head
+	std::int64_t const oldest = std::max(l.head - std::int64_t(l.capacity) + 1, std::int64_t(0));
+	std::int64_t const first = std::max(std::max(from, std::int64_t(0)) / l.interval, oldest);
+	std::int64_t const last = std::min(to / l.interval, l.head);
+
+	for (std::int64_t i = first; i <= last; ++i) {
+		std::size_t const slot = std::size_t(i) % l.capacity;
+		if (l.slot_interval[slot] != i) continue;
+		std::int64_t const ts = l.timestamps[slot];
+		if (ts < from || ts > to) continue;
+
+		ret.timestamps.push_back(ts);
+		std::int64_t const* row = l.values.data() + slot * m_num_counters;
+		for (int const c : counters)
+			ret.values.push_back(row[c]);
+	}
+	return ret;
+}
+
+} // namespace ltweb
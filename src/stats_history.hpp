@@ -0,0 +1,93 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_STATS_HISTORY_HPP
+#define LTWEB_STATS_HISTORY_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace ltweb {
+
+// Keeps the recent history of the session stats counters in memory, at a few
+// resolutions. Each resolution is a ring buffer of a fixed number of
+// intervals, so the memory use is fixed: 8 bytes per counter per interval.
+// An interval holds the last sample taken in it. For counters, the
+// difference between two intervals is the rate over that time.
+//
+// Intervals without a sample (e.g. before the server was started) are
+// missing from the history. This class is not thread safe.
+struct stats_history {
+	struct resolution {
+		// the length of an interval, in milliseconds
+		std::int64_t interval;
+		// the number of intervals kept
+		std::size_t capacity;
+	};
+
+	// 10 minutes at 1 second, a day at 1 minute and a week at 1 hour
+	static constexpr std::array<resolution, 3> default_resolutions = {{
+		{1000, 600},
+		{60 * 1000, 24 * 60},
+		{60 * 60 * 1000, 7 * 24},
+	}};
+
+	explicit stats_history(
+		std::size_t num_counters,
+		std::span<resolution const> resolutions = default_resolutions
+	);
+
+	// timestamp is milliseconds since the epoch. Values missing from the end
+	// are recorded as 0, and values beyond num_counters are ignored
+	void add(std::int64_t timestamp, std::span<std::int64_t const> values);
+
+	int num_resolutions() const { return int(m_levels.size()); }
+	std::size_t num_counters() const { return m_num_counters; }
+
+	struct result {
+		std::vector<std::int64_t> timestamps;
+		// one row per timestamp, of one value per requested counter
+		std::vector<std::int64_t> values;
+	};
+
+	// returns the samples of the counters at the specified resolution, with
+	// timestamps in [from, to], oldest first. The counters must be less
+	// than num_counters()
+	result query(
+		int resolution, std::int64_t from, std::int64_t to, std::span<int const> counters
+	) const;
+
+private:
+	struct level {
+		std::int64_t interval;
+		std::size_t capacity;
+
+		// the interval number (timestamp / interval) held by each slot, or -1
+		std::vector<std::int64_t> slot_interval;
+
+		// the timestamp of the sample held by each slot
+		std::vector<std::int64_t> timestamps;
+
+		// capacity rows of num_counters values
+		std::vector<std::int64_t> values;
+
+		// the latest interval recorded
+		std::int64_t head = -1;
+	};
+
+	std::size_t const m_num_counters;
+	std::vector<level> m_levels;
+};
+
+} // namespace ltweb
+
+#endif
@@ -8,10 +8,11 @@ see LICENSE file.
 */
 
 #include <functional>
-#include <iomanip>
+#include <chrono>
 #include <cstdio>
 
 #include "stats_logging.hpp"
+#include "log_writer.hpp"
 #include "libtorrent/session.hpp"
 #include "alert_handler.hpp"
 #include "libtorrent/session_stats.hpp"
@@ -21,24 +22,67 @@ namespace ltweb {
 
 using namespace std::placeholders;
 
+namespace {
 
-stats_logging::stats_logging(alert_handler* h)
-	: m_alerts(h)
-	, m_log_seq(0)
+// with the default stats interval of a second, a block per minute. A crash
+// loses the samples not yet written
+constexpr std::size_t samples_per_block = 60;
+
+std::vector<std::string> metric_names()
 {
-	m_alerts->subscribe<lt::session_stats_alert>(this);
-	rotate_stats_log();
+	std::vector<std::string> ret;
+	for (lt::stats_metric const& c : lt::session_stats_metrics()) {
+		// just in case there are some indices that don't have names
+		// (it shouldn't really happen)
+		if (c.value_index >= int(ret.size())) ret.resize(std::size_t(c.value_index) + 1);
+		ret[std::size_t(c.value_index)] = c.name;
+	}
+	return ret;
 }
 
-stats_logging::~stats_logging() { m_alerts->unsubscribe(this); }
+// writes the header and the index of each log file. Called on the log
+// writer's thread
+struct stats_log_format : log_file_format {
+	stats_log_format(std::int64_t const start_time, std::vector<std::string> metrics)
+		: m_start_time(start_time)
+		, m_metrics(std::move(metrics))
+	{
+	}
+
+	std::vector<char> begin_file() override
+	{
+		m_blocks.clear();
+		return encode_stats_header(m_start_time, m_metrics);
+	}
 
-void stats_logging::rotate_stats_log()
-{
-	if (m_stats_logger.is_open()) {
-		++m_log_seq;
-		m_stats_logger.close();
+	void record(std::span<char const> const block, std::uint64_t const offset) override
+	{
+		stats_block_info info;
+		if (!read_stats_block_info({block.data(), block.size()}, info)) return;
+		info.offset = offset;
+		m_blocks.push_back(info);
 	}
 
+	std::vector<char> end_file(std::uint64_t const offset) override
+	{
+		return encode_stats_index(m_blocks, offset);
+	}
+
+private:
+	std::int64_t const m_start_time;
+	std::vector<std::string> const m_metrics;
+
+	// the blocks written to the current file
+	std::vector<stats_block_info> m_blocks;
+};
+
+} // anonymous namespace
+
+stats_logging::stats_logging(alert_handler* h)
+	: m_alerts(h)
+	, m_start(lt::clock_type::now())
+	, m_block(metric_names().size())
+{
 	{
 		std::error_code fec;
 		std::filesystem::create_directory("session_stats", fec);
@@ -49,38 +93,40 @@ void stats_logging::rotate_stats_log()
 #else
 	const int pid = getpid();
 #endif
-	char filename[100];
-	snprintf(filename, sizeof(filename), "session_stats/%d.%04d.log", pid, m_log_seq);
-	m_stats_logger.open(filename, std::ios::out | std::ios::trunc);
-	m_last_log_rotation = lt::clock_type::now();
-	if (!m_stats_logger) {
-		std::fprintf(stderr, "Failed to create lt::session stats log file \"%s\"\n", filename);
+
+	auto const now = std::chrono::system_clock::now().time_since_epoch();
+	std::int64_t const start_time =
+		std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+
+	log_sink_config cfg;
+	cfg.file_name = [pid](int const seq) {
+		char filename[100];
+		snprintf(filename, sizeof(filename), "session_stats/%d.%04d.stats", pid, seq);
+		return std::string(filename);
+	};
+	cfg.max_age = std::chrono::hours(1);
+	cfg.format = std::make_shared<stats_log_format>(start_time, metric_names());
+	m_sink = global_log_writer().add_sink(std::move(cfg));
+	if (m_sink < 0) {
+		std::fprintf(stderr, "Failed to create lt::session stats log file\n");
 		return;
 	}
 
-	std::vector<lt::stats_metric> cnts = lt::session_stats_metrics();
-	std::sort(
-		cnts.begin(),
-		cnts.end(),
-		[](lt::stats_metric const& lhs, lt::stats_metric const& rhs) {
-			return lhs.value_index < rhs.value_index;
-		}
-	);
+	m_alerts->subscribe<lt::session_stats_alert>(this);
+}
 
-	int idx = 0;
-	m_stats_logger << "second";
-	for (auto const c : cnts) {
-		// just in case there are some indices that don't have names
-		// (it shouldn't really happen)
-		while (idx < c.value_index) {
-			m_stats_logger << ':';
-			++idx;
-		}
+stats_logging::~stats_logging()
+{
+	m_alerts->unsubscribe(this);
+	flush_block();
+	// writes the index of the last file
+	global_log_writer().close_sink(m_sink);
+}
 
-		m_stats_logger << ':' << c.name;
-		++idx;
-	}
-	m_stats_logger << "\n\n";
+void stats_logging::flush_block()
+{
+	if (m_block.num_samples() == 0) return;
+	global_log_writer().write(m_sink, m_block.finish());
 }
 
 void stats_logging::handle_alert(lt::alert const* a)
@@ -88,16 +134,12 @@ void stats_logging::handle_alert(lt::alert const* a)
 	lt::session_stats_alert const* s = lt::alert_cast<lt::session_stats_alert>(a);
 	if (s == nullptr) return;
 
-	if (lt::clock_type::now() - m_last_log_rotation > lt::hours(1)) rotate_stats_log();
-
-	if (!m_stats_logger) return;
-
-	m_stats_logger << std::fixed << std::setprecision(6)
-				   << double(lt::total_microseconds(s->timestamp() - m_last_log_rotation))
-			/ 1000000.0;
-	for (auto const v : s->counters())
-		m_stats_logger << '\t' << v;
-	m_stats_logger << '\n';
+	auto const counters = s->counters();
+	m_block.add(
+		lt::total_microseconds(s->timestamp() - m_start),
+		{counters.data(), std::size_t(counters.size())}
+	);
+	if (m_block.num_samples() >= samples_per_block) flush_block();
 }
 
 } // namespace ltweb
@@ -11,33 +11,39 @@ see LICENSE file.
 #define LTWEB_STATS_LOGGING_HPP
 
 #include "alert_observer.hpp"
+#include "stats_codec.hpp"
 #include "libtorrent/time.hpp"
 #include "libtorrent/fwd.hpp"
-#include <fstream>
 
 namespace ltweb {
 struct alert_handler;
 
 /// writes logs to directory 'session_stats' in current working directory.
-/// logs are rotated each hour. Use parse_session_stats.py to parse logs.
+/// logs are rotated each hour. The logs are in the binary format described
+/// in stats_codec.hpp. Use stats_export to convert them to text, and
+/// parse_session_stats.py to parse that. The files are written by the
+/// global log writer. All files of a session share the start time in their
+/// header, the timestamps of the samples are relative to it.
 struct stats_logging : alert_observer {
 	stats_logging(alert_handler* h);
 	~stats_logging();
 
 private:
-	void rotate_stats_log();
 	void handle_alert(lt::alert const* a);
+	char const* observer_name() const { return "stats_logging"; }
+
+	// queues the samples accumulated so far as a block
+	void flush_block();
 
 	alert_handler* m_alerts;
 
-	// the last time we rotated the log file
-	lt::time_point m_last_log_rotation;
+	// the time the log was started
+	lt::time_point m_start;
+
+	stats_block_encoder m_block;
 
-	std::ofstream m_stats_logger;
-	// sequence number for log file. Log files are
-	// rotated every hour and the sequence number is
-	// incremented by one
-	int m_log_seq;
+	// the log writer sink for the log files, or -1
+	int m_sink = -1;
 };
 
 } // namespace ltweb
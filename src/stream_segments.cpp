@@ -0,0 +1,69 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "stream_segments.hpp"
+
+#include "libtorrent/assert.hpp"
+
+#include <algorithm>
+
+namespace ltweb {
+
+std::int64_t segments_size(std::vector<stream_segment> const& segments)
+{
+	std::int64_t ret = 0;
+	for (auto const& s : segments)
+		ret += std::int64_t(s.prefix.size()) + s.length;
+	return ret;
+}
+
+void trim_segments(std::vector<stream_segment>& segments, std::int64_t first, std::int64_t last)
+{
+	TORRENT_ASSERT(first >= 0);
+	TORRENT_ASSERT(first <= last);
+	TORRENT_ASSERT(last < segments_size(segments));
+
+	// the number of bytes to keep, counting from first
+	std::int64_t left = last - first + 1;
+
+	std::vector<stream_segment> ret;
+	for (auto& s : segments) {
+		if (left == 0) break;
+		std::int64_t const prefix_size = std::int64_t(s.prefix.size());
+
+		// skip segments entirely before the range
+		if (first >= prefix_size + s.length) {
+			first -= prefix_size + s.length;
+			continue;
+		}
+
+		// cut the front
+		if (first >= prefix_size) {
+			s.offset += first - prefix_size;
+			s.length -= first - prefix_size;
+			s.prefix.clear();
+		} else {
+			s.prefix.erase(0, std::size_t(first));
+		}
+		first = 0;
+
+		// cut the back
+		if (std::int64_t(s.prefix.size()) >= left) {
+			s.prefix.resize(std::size_t(left));
+			s.length = 0;
+		} else {
+			s.length = std::min(s.length, left - std::int64_t(s.prefix.size()));
+		}
+		left -= std::int64_t(s.prefix.size()) + s.length;
+		ret.push_back(std::move(s));
+	}
+	segments = std::move(ret);
+}
+
+} // namespace ltweb
@@ -0,0 +1,42 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_STREAM_SEGMENTS_HPP
+#define LTWEB_STREAM_SEGMENTS_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ltweb {
+
+// A part of an HTTP response body that's assembled from literal bytes and
+// ranges of files. First the bytes of prefix are sent, followed by length
+// bytes from source, starting at offset. What source refers to is up to the
+// user, for file_downloader it's the file index in the torrent.
+struct stream_segment {
+	std::string prefix;
+	int source;
+	std::int64_t offset;
+	std::int64_t length;
+};
+
+// the total number of bytes the segments make up
+std::int64_t segments_size(std::vector<stream_segment> const& segments);
+
+// restrict segments to the byte range [first, last] (inclusive) of the
+// stream they make up. Segments entirely outside of the range are removed
+// and segments straddling its ends are cut.
+//
+// Preconditions: 0 <= first <= last < segments_size(segments)
+void trim_segments(std::vector<stream_segment>& segments, std::int64_t first, std::int64_t last);
+
+} // namespace ltweb
+
+#endif
@@ -0,0 +1,119 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "tar_archive.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace ltweb {
+
+namespace {
+
+constexpr std::size_t block_size = 512;
+
+// the largest size representable in the 11 octal digits of the ustar size
+// field
+constexpr std::int64_t max_ustar_size = 077777777777;
+
+// write v as a zero-padded octal number, filling all but the last byte of
+// the field. The last byte is left as NUL
+void write_octal(char* field, std::size_t const len, std::int64_t v)
+{
+	for (std::size_t i = len - 1; i > 0; --i) {
+		field[i - 1] = char('0' + (v & 7));
+		v >>= 3;
+	}
+}
+
+void write_string(char* field, std::size_t const len, std::string const& s)
+{
+	std::memcpy(field, s.data(), std::min(len, s.size()));
+}
+
+std::string ustar_block(
+	std::string const& name, std::int64_t const size, std::int64_t const mtime, char const type
+)
+{
+	std::string ret(block_size, '\0');
+	char* h = ret.data();
+	write_string(h, 100, name);
+	write_octal(h + 100, 8, 0644); // mode
+	write_octal(h + 108, 8, 0); // uid
+	write_octal(h + 116, 8, 0); // gid
+	write_octal(h + 124, 12, std::min(size, max_ustar_size));
+	write_octal(h + 136, 12, std::max(mtime, std::int64_t(0)));
+	h[156] = type;
+	std::memcpy(h + 257, "ustar", 6);
+	std::memcpy(h + 263, "00", 2);
+
+	// the checksum is computed with the checksum field itself filled with
+	// spaces
+	std::memset(h + 148, ' ', 8);
+	std::int64_t sum = 0;
+	for (char const c : ret)
+		sum += static_cast<unsigned char>(c);
+	write_octal(h + 148, 7, sum);
+	h[155] = ' ';
+	return ret;
+}
+
+// a pax extended header record. The length prefix includes itself
+std::string pax_record(std::string const& key, std::string const& value)
+{
+	std::size_t const base = key.size() + value.size() + 3;
+	std::size_t len = base + std::to_string(base).size();
+	if (std::to_string(len).size() + base != len) ++len;
+	return std::to_string(len) + ' ' + key + '=' + value + '\n';
+}
+
+std::size_t padding(std::int64_t const size)
+{
+	return std::size_t((block_size - size % block_size) % block_size);
+}
+
+} // namespace
+
+std::string tar_header(archive_member const& m)
+{
+	std::string records;
+	if (m.name.size() > 100) records += pax_record("path", m.name);
+	if (m.size > max_ustar_size) records += pax_record("size", std::to_string(m.size));
+
+	std::string ret;
+	if (!records.empty()) {
+		ret = ustar_block("././@PaxHeader", std::int64_t(records.size()), m.mtime, 'x');
+		ret += records;
+		ret.append(padding(std::int64_t(records.size())), '\0');
+	}
+	ret += ustar_block(m.name, m.size, m.mtime, '0');
+	return ret;
+}
+
+std::vector<stream_segment> tar_segments(std::vector<archive_member> const& members)
+{
+	std::vector<stream_segment> ret;
+	ret.reserve(members.size() + 1);
+
+	// the padding after the previous member's contents
+	std::size_t pad = 0;
+	for (std::size_t i = 0; i < members.size(); ++i) {
+		archive_member const& m = members[i];
+		std::string prefix(pad, '\0');
+		prefix += tar_header(m);
+		ret.push_back({std::move(prefix), int(i), 0, m.size});
+		pad = padding(m.size);
+	}
+
+	// the end of the archive is marked by two empty blocks
+	ret.push_back({std::string(pad + 2 * block_size, '\0'), -1, 0, 0});
+	return ret;
+}
+
+} // namespace ltweb
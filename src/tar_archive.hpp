@@ -0,0 +1,44 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_TAR_ARCHIVE_HPP
+#define LTWEB_TAR_ARCHIVE_HPP
+
+#include "stream_segments.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ltweb {
+
+struct archive_member {
+	// the path of the file in the archive, '/' separated
+	std::string name;
+	std::int64_t size;
+	// modification time, seconds since epoch
+	std::int64_t mtime;
+};
+
+// returns the header(s) preceding the contents of m in a tar archive. This
+// is a ustar header, preceded by a pax extended header if the name is longer
+// than 100 bytes or the size doesn't fit in the ustar header. The returned
+// string is always a multiple of 512 bytes
+std::string tar_header(archive_member const& m);
+
+// returns the segments making up a tar archive of the specified members.
+// The source of each segment is the index of the member in members. The last
+// segment is the end-of-archive marker, and has a source of -1 and a length
+// of 0. Every member's contents are stored in a single segment, so the size
+// of the archive, and the offset of every byte in it, is known up front
+std::vector<stream_segment> tar_segments(std::vector<archive_member> const& members);
+
+} // namespace ltweb
+
+#endif
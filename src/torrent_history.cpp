@@ -9,12 +9,18 @@ see LICENSE file.
 
 #include "torrent_history.hpp"
 #include "libtorrent/alert_types.hpp"
+#include "libtorrent/session.hpp"
+#include "libtorrent/torrent_info.hpp"
 #include "alert_handler.hpp"
+#include "metrics.hpp"
 #include "libtorrent/units.hpp"
 #include "libtorrent/flags.hpp"
 #include "libtorrent/torrent_flags.hpp"
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <iostream>
+#include <unordered_set>
 
 namespace ltweb {
 
@@ -25,6 +31,48 @@ namespace {
 // will see stale state.
 constexpr lt::torrent_flags_t status_flags_mask =
 	lt::torrent_flags::paused | lt::torrent_flags::auto_managed;
+
+// the status fields torrent_history_entry tracks. The piece bitfields are
+// left out, they are expensive to copy and not part of the history
+constexpr lt::status_flags_t history_status_flags = lt::torrent_handle::query_distributed_copies
+	| lt::torrent_handle::query_accurate_download_counters
+	| lt::torrent_handle::query_last_seen_complete | lt::torrent_handle::query_torrent_file
+	| lt::torrent_handle::query_name | lt::torrent_handle::query_save_path;
+
+// the status of a torrent that was just added, as far as it's known from
+// its add_torrent_params. This saves a round-trip to the network thread per
+// torrent, which adds up when loading the resume database at startup. The
+// rest of the status is filled in by the torrent's first state update
+lt::torrent_status added_status(lt::add_torrent_alert const& ta)
+{
+	lt::add_torrent_params const& p = ta.params;
+	lt::torrent_status st;
+	st.handle = ta.handle;
+	st.info_hashes = p.ti ? p.ti->info_hashes() : p.info_hashes;
+	st.torrent_file = p.ti;
+	st.has_metadata = bool(p.ti);
+	st.name = p.ti ? p.ti->name() : p.name;
+	st.save_path = p.save_path;
+	st.flags = p.flags;
+	st.state = lt::torrent_status::checking_resume_data;
+	st.all_time_upload = p.total_uploaded;
+	st.all_time_download = p.total_downloaded;
+	st.added_time = p.added_time;
+	st.completed_time = p.completed_time;
+	return st;
+}
+
+series_sample make_sample(lt::torrent_status const& s, std::int64_t const now)
+{
+	return {now, s.download_payload_rate, s.upload_payload_rate, s.num_peers, s.progress_ppm};
+}
+
+// milliseconds since the epoch, the timestamps of the series
+std::int64_t series_now()
+{
+	auto const now = std::chrono::system_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+}
 } // anonymous namespace
 
 std::uint8_t status_bits(lt::torrent_status const& s)
@@ -71,10 +119,18 @@ torrent_history::torrent_history(alert_handler* h, std::size_t max_tombstones)
 	, m_frame(1)
 	, m_deferred_frame_count(false)
 	, m_max_tombstones(max_tombstones)
+	, m_series_memory_metric(
+		  global_metrics().register_metric("torrent_series.memory", metric_type::gauge)
+	  )
+	, m_series_torrents_metric(
+		  global_metrics().register_metric("torrent_series.torrents", metric_type::gauge)
+	  )
 {
-	m_alerts->subscribe<lt::add_torrent_alert, lt::torrent_removed_alert, lt::state_update_alert>(
-		this
-	);
+	m_alerts->subscribe<
+		lt::add_torrent_alert,
+		lt::torrent_removed_alert,
+		lt::state_update_alert,
+		lt::alerts_dropped_alert>(this, alert_handler::batch_end);
 }
 
 torrent_history::~torrent_history() { m_alerts->unsubscribe(this); }
@@ -82,61 +138,41 @@ torrent_history::~torrent_history() { m_alerts->unsubscribe(this); }
 void torrent_history::handle_alert(lt::alert const* a)
 try {
 	if (lt::add_torrent_alert const* ta = lt::alert_cast<lt::add_torrent_alert>(a)) {
-		// TODO: This is a synchronous call. use post_torrent_updates() instead
-		lt::torrent_status st = ta->handle.status();
-		TORRENT_ASSERT(st.info_hashes == st.handle.info_hashes());
-		TORRENT_ASSERT(st.handle == ta->handle);
+		if (ta->error) return;
 
+		// the entry is created once the whole batch of alerts has been
+		// dispatched, in alerts_dispatched()
+		lt::torrent_status st = added_status(*ta);
 		std::unique_lock<std::mutex> l(m_mutex);
-		m_queue.left.push_front(
-			std::make_pair(m_frame + 1, torrent_history_entry(std::move(st), m_frame + 1))
-		);
-		m_deferred_frame_count = true;
+		m_pending_adds.push_back(std::move(st));
 	} else if (lt::torrent_removed_alert const* td = lt::alert_cast<lt::torrent_removed_alert>(a)) {
 		std::unique_lock<std::mutex> l(m_mutex);
 
-		// Read filter inputs before erasing so query_filtered can apply f_old
-		// to tombstones and avoid sending spurious removes to filtered clients.
-		auto const tag_it = m_tags.find(td->handle);
-		std::uint64_t const tag_val = (tag_it != m_tags.end()) ? tag_it->second : 0;
-
-		// Drop any tag entry the torrent had. The handle's underlying
-		// shared_ptr is what unordered_map hashes on, so the erase works
-		// even though the torrent itself is going away.
-		m_tags.erase(td->handle);
-
-		torrent_history_entry st;
-		st.status.info_hashes = td->info_hashes;
-
-		// Determine when this torrent was first seen, so that removed_since()
-		// can skip notifying clients that never received an add for it.
-		frame_t added_frame = m_frame + 1;
-		std::uint8_t sbits_val = 0;
-		auto const it = m_queue.right.find(st);
-		if (it != m_queue.right.end()) {
-			added_frame = it->first.added_frame;
-			sbits_val = status_bits(it->first.status);
-			m_queue.right.erase(it);
-		}
-
-		m_removed.push_front(
-			{m_frame + 1, added_frame, td->info_hashes.get_best(), sbits_val, tag_val}
+		// the torrent may have been added in this same batch of alerts
+		m_pending_adds.erase(
+			std::remove_if(
+				m_pending_adds.begin(),
+				m_pending_adds.end(),
+				[&](lt::torrent_status const& s) { return s.handle == td->handle; }
+			),
+			m_pending_adds.end()
 		);
 
-		// Evict oldest tombstones when over the limit. The deque is
-		// newest-first, so back() is always the oldest entry.
-		while (m_removed.size() > m_max_tombstones) {
-			m_horizon = std::max(m_horizon, m_removed.back().removed_frame + 1);
-			m_removed.pop_back();
-		}
-
+		remove_entry(td->handle, td->info_hashes, m_frame + 1);
 		m_deferred_frame_count = true;
 	} else if (lt::state_update_alert const* su = lt::alert_cast<lt::state_update_alert>(a)) {
 		std::unique_lock<std::mutex> l(m_mutex);
 
+		// torrents added earlier in this batch may be in the update, and
+		// need their entries to apply it to
+		add_pending();
+
 		++m_frame;
 		m_deferred_frame_count = false;
 
+		// only torrents that changed are in the update, the series of the
+		// others implicitly hold their previous sample
+		std::int64_t const now = series_now();
 		std::vector<lt::torrent_status> const& st = su->status;
 		for (auto const& t : st) {
 			torrent_history_entry e;
@@ -148,7 +184,11 @@ try {
 			m_queue.right.replace_data(it, m_frame);
 			// bump this torrent to the beginning of the list
 			m_queue.left.relocate(m_queue.left.begin(), m_queue.project_left(it));
+
+			m_series.add(t.info_hashes.get_best(), make_sample(t, now), t.is_seeding);
 		}
+		global_metrics().set(m_series_memory_metric, std::int64_t(m_series.memory_used()));
+		global_metrics().set(m_series_torrents_metric, std::int64_t(m_series.num_torrents()));
 		/*
 			printf("===== frame: %d =====\n", m_frame);
 			for (auto const& e : m_queue.left)
@@ -157,10 +197,183 @@ try {
 //				printf("%3d: (%s) %s\n", e.first, e.second.error.c_str(), e.second.name.c_str());
 			}
 */
+	} else if (lt::alerts_dropped_alert const* ad = lt::alert_cast<lt::alerts_dropped_alert>(a)) {
+		// the torrents are reconciled with the session once the batch has
+		// been dispatched, in alerts_dispatched()
+		if (ad->dropped_alerts[lt::add_torrent_alert::alert_type]
+			|| ad->dropped_alerts[lt::torrent_removed_alert::alert_type]
+			|| ad->dropped_alerts[lt::state_update_alert::alert_type])
+			m_resync_alert = ad;
 	}
 } catch (std::exception const&) {
 }
 
+void torrent_history::alerts_dispatched()
+{
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		add_pending();
+	}
+	if (m_resync_alert != nullptr) {
+		// the alert is valid until every observer is done with the batch
+		lt::alerts_dropped_alert const& ad = *m_resync_alert;
+		m_resync_alert = nullptr;
+		try {
+			resync(*session_snapshot(ad));
+		} catch (std::exception const&) {
+		}
+	}
+
+	std::lock_guard<std::mutex> l(m_snapshot_mutex);
+	if (m_snapshot && m_snapshot_batch != m_batches) m_snapshot.reset();
+	++m_batches;
+}
+
+std::shared_ptr<std::vector<lt::torrent_status> const>
+torrent_history::session_snapshot(lt::alerts_dropped_alert const& a)
+{
+	std::lock_guard<std::mutex> l(m_snapshot_mutex);
+	// the alert's address may be reused by a later batch, its time won't
+	if (m_snapshot && m_snapshot_alert == &a && m_snapshot_time == a.timestamp())
+		return m_snapshot;
+
+	auto st = std::make_shared<std::vector<lt::torrent_status>>();
+	m_alerts->session().get_torrent_status(
+		st.get(), [](lt::torrent_status const&) { return true; }, history_status_flags
+	);
+	m_snapshot = std::move(st);
+	m_snapshot_alert = &a;
+	m_snapshot_time = a.timestamp();
+	m_snapshot_batch = m_batches;
+	return m_snapshot;
+}
+
+void torrent_history::add_pending()
+{
+	if (m_pending_adds.empty()) return;
+	std::int64_t const now = series_now();
+	for (auto& s : m_pending_adds) {
+		m_series.add(s.info_hashes.get_best(), make_sample(s, now), s.is_seeding);
+		m_queue.left.push_front(
+			std::make_pair(m_frame + 1, torrent_history_entry(std::move(s), m_frame + 1))
+		);
+	}
+	m_pending_adds.clear();
+	m_deferred_frame_count = true;
+}
+
+void torrent_history::resync()
+try {
+	std::vector<lt::torrent_status> st;
+	m_alerts->session().get_torrent_status(
+		&st, [](lt::torrent_status const&) { return true; }, history_status_flags
+	);
+	resync(st);
+} catch (std::exception const&) {
+}
+
+void torrent_history::resync(std::vector<lt::torrent_status> const& st)
+{
+	std::int64_t const now = series_now();
+	std::unique_lock<std::mutex> l(m_mutex);
+
+	// everything the resync finds goes in a frame of its own, so clients
+	// that saw the previous frame get all of it
+	++m_frame;
+	m_deferred_frame_count = false;
+
+	int added = 0;
+	int updated = 0;
+	std::unordered_set<lt::sha1_hash> live;
+	for (auto const& s : st) {
+		lt::sha1_hash const ih = s.info_hashes.get_best();
+		live.insert(ih);
+
+		torrent_history_entry e;
+		e.status.info_hashes = s.info_hashes;
+		queue_t::right_iterator it = m_queue.right.find(e);
+		if (it == m_queue.right.end()) {
+			// the add_torrent_alert was lost
+			m_series.add(ih, make_sample(s, now), s.is_seeding);
+			m_queue.left.push_front(
+				std::make_pair(m_frame, torrent_history_entry(s, m_frame))
+			);
+			++added;
+			continue;
+		}
+
+		// only the torrents that changed are moved to the new frame
+		auto& entry = const_cast<torrent_history_entry&>(it->first);
+		entry.update_status(s, m_frame);
+		if (std::find(entry.frame.begin(), entry.frame.end(), m_frame) == entry.frame.end())
+			continue;
+		m_queue.right.replace_data(it, m_frame);
+		m_queue.left.relocate(m_queue.left.begin(), m_queue.project_left(it));
+		m_series.add(ih, make_sample(s, now), s.is_seeding);
+		++updated;
+	}
+
+	// the torrent_removed_alerts of these were lost
+	std::vector<std::pair<lt::torrent_handle, lt::info_hash_t>> removed;
+	for (auto const& e : m_queue.left) {
+		lt::torrent_status const& s = e.second.status;
+		if (live.count(s.info_hashes.get_best()) == 0)
+			removed.emplace_back(s.handle, s.info_hashes);
+	}
+	for (auto const& [h, ih] : removed)
+		remove_entry(h, ih, m_frame);
+
+	global_metrics().set(m_series_memory_metric, std::int64_t(m_series.memory_used()));
+	global_metrics().set(m_series_torrents_metric, std::int64_t(m_series.num_torrents()));
+
+	fprintf(
+		stderr,
+		"alerts were dropped, resynced the torrent list: %d added, %d removed, %d updated\n",
+		added,
+		int(removed.size()),
+		updated
+	);
+}
+
+void torrent_history::remove_entry(
+	lt::torrent_handle const& h, lt::info_hash_t const& ih, frame_t const f
+)
+{
+	// Read filter inputs before erasing so query_filtered can apply f_old
+	// to tombstones and avoid sending spurious removes to filtered clients.
+	auto const tag_it = m_tags.find(h);
+	std::uint64_t const tag_val = (tag_it != m_tags.end()) ? tag_it->second : 0;
+
+	// Drop any tag entry the torrent had. The handle's underlying
+	// shared_ptr is what unordered_map hashes on, so the erase works
+	// even though the torrent itself is going away.
+	m_tags.erase(h);
+
+	torrent_history_entry st;
+	st.status.info_hashes = ih;
+
+	// Determine when this torrent was first seen, so that removed_since()
+	// can skip notifying clients that never received an add for it.
+	frame_t added_frame = f;
+	std::uint8_t sbits_val = 0;
+	auto const it = m_queue.right.find(st);
+	if (it != m_queue.right.end()) {
+		added_frame = it->first.added_frame;
+		sbits_val = status_bits(it->first.status);
+		m_queue.right.erase(it);
+	}
+	m_series.erase(ih.get_best());
+
+	m_removed.push_front({f, added_frame, ih.get_best(), sbits_val, tag_val});
+
+	// Evict oldest tombstones when over the limit. The deque is
+	// newest-first, so back() is always the oldest entry.
+	while (m_removed.size() > m_max_tombstones) {
+		m_horizon = std::max(m_horizon, m_removed.back().removed_frame + 1);
+		m_removed.pop_back();
+	}
+}
+
 void torrent_history::append_removed(
 	frame_t const since_frame, filter_spec const& filter, query_result& result
 ) const
@@ -291,7 +504,26 @@ bool torrent_history::set_tag(
 	std::unique_lock<std::mutex> l(m_mutex);
 
 	auto it = m_queue.right.find(key);
-	if (it == m_queue.right.end()) return false;
+	if (it == m_queue.right.end()) {
+		// the torrent may have been added in the batch of alerts being
+		// dispatched. Its entry doesn't exist yet, but will pick up the tag
+		// from m_tags once it does
+		auto const p = std::find_if(
+			m_pending_adds.begin(),
+			m_pending_adds.end(),
+			[&](lt::torrent_status const& e) { return e.info_hashes.get_best() == ih; }
+		);
+		if (p == m_pending_adds.end()) return false;
+		auto tag_it = m_tags.find(p->handle);
+		std::uint64_t const old_tag = (tag_it != m_tags.end()) ? tag_it->second : 0;
+		std::uint64_t const new_tag = (old_tag & ~mask) | (value & mask);
+		if (new_tag == 0) {
+			if (tag_it != m_tags.end()) m_tags.erase(tag_it);
+		} else {
+			m_tags[p->handle] = new_tag;
+		}
+		return new_tag != old_tag;
+	}
 
 	lt::torrent_handle const h = it->first.status.handle;
 
@@ -327,6 +559,24 @@ bool torrent_history::set_tag(
 	return true;
 }
 
+bool torrent_history::query_series(
+	lt::sha1_hash const& ih,
+	int const resolution,
+	std::int64_t const from,
+	std::int64_t const to,
+	std::vector<series_sample>& out
+) const
+{
+	std::unique_lock<std::mutex> l(m_mutex);
+	return m_series.query(ih, resolution, from, to, out);
+}
+
+int torrent_history::series_resolutions() const
+{
+	std::unique_lock<std::mutex> l(m_mutex);
+	return m_series.num_resolutions();
+}
+
 std::uint64_t torrent_history::get_tag(lt::torrent_handle const& h) const
 {
 	std::unique_lock<std::mutex> l(m_mutex);
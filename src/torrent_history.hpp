@@ -11,12 +11,17 @@ see LICENSE file.
 #define LTWEB_TORRENT_HISTORY_HPP
 
 #include "alert_observer.hpp"
+#include "torrent_series.hpp"
 #include "libtorrent/torrent_status.hpp"
 #include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/alert_types.hpp"
 #include <mutex> // for mutex
+#include <cstdint>
 #include <deque>
+#include <memory>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #define BOOST_BIMAP_DISABLE_SERIALIZATION
 // boost/bimap/detail/user_interface_config.hpp defines
@@ -253,6 +258,21 @@ struct torrent_history : alert_observer {
 	// get-torrent-updates serializer and by save_resume.
 	std::uint64_t get_tag(lt::torrent_handle const& h) const;
 
+	// appends the rate and progress history of the torrent, at the specified
+	// resolution, with timestamps (milliseconds since the epoch) in
+	// [from, to] to out. Returns false if there's no history for the
+	// torrent, e.g. because it was evicted to stay within the memory limit
+	bool query_series(
+		lt::sha1_hash const& ih,
+		int resolution,
+		std::int64_t from,
+		std::int64_t to,
+		std::vector<series_sample>& out
+	) const;
+
+	// the number of resolutions query_series() accepts
+	int series_resolutions() const;
+
 	// the current frame number
 	frame_t frame() const;
 
@@ -262,9 +282,36 @@ struct torrent_history : alert_observer {
 	// frame have been evicted.
 	frame_t horizon() const;
 
+	// reconciles the history with the session, after alerts may have been
+	// lost. Torrents whose add or remove was missed get an entry or a
+	// tombstone, and the ones whose status changed are updated, all in a
+	// new frame. st is the status of every torrent in the session. Called on
+	// the alert thread when the session reports having dropped alerts the
+	// history depends on. The overload without arguments queries the
+	// session itself
+	void resync(std::vector<lt::torrent_status> const& st);
+	void resync();
+
+	// the status of every torrent in the session, taken once per
+	// alerts_dropped_alert. The first observer resyncing after the drop
+	// queries the session, and the others share its snapshot. It's kept
+	// until the batch after the drop's has been dispatched
+	std::shared_ptr<std::vector<lt::torrent_status> const>
+	session_snapshot(lt::alerts_dropped_alert const& a);
+
 	virtual void handle_alert(lt::alert const* a);
+	virtual void alerts_dispatched();
+	virtual char const* observer_name() const { return "torrent_history"; }
 
 private:
+	// creates the entries of the torrents in m_pending_adds, in the frame
+	// after the current one. Must be called with m_mutex held
+	void add_pending();
+
+	// removes the entry of a torrent, if there is one, and leaves a
+	// tombstone removed in frame f. Must be called with m_mutex held
+	void remove_entry(lt::torrent_handle const& h, lt::info_hash_t const& ih, frame_t f);
+
 	// Returns the current frame while holding m_mutex. If add/remove alerts
 	// are pending in the deferred frame slot, consume that slot first so the
 	// returned frame matches the frames stored on those entries.
@@ -294,6 +341,31 @@ private:
 	// removed from the session. absent keys are treated as tag value 0.
 	std::unordered_map<lt::torrent_handle, std::uint64_t> m_tags;
 
+	// the status of the torrents added in the current batch of alerts, as
+	// far as it's known from their add_torrent_params. Their entries are
+	// created in alerts_dispatched(), and the rest of their status is filled
+	// in by the next state update
+	std::vector<lt::torrent_status> m_pending_adds;
+
+	// set when the session dropped alerts of the types we depend on. The
+	// history is resynced once the batch has been dispatched. Only accessed
+	// by the alert thread
+	lt::alerts_dropped_alert const* m_resync_alert = nullptr;
+
+	// the last session_snapshot(), and the drop alert it was taken for. The
+	// mutex is held while the session is queried, so observers resyncing
+	// after the same drop wait for one snapshot rather than taking their own
+	std::mutex m_snapshot_mutex;
+	std::shared_ptr<std::vector<lt::torrent_status> const> m_snapshot;
+	lt::alerts_dropped_alert const* m_snapshot_alert = nullptr;
+	lt::time_point m_snapshot_time;
+
+	// the number of batches dispatched to us, and the one the snapshot was
+	// taken in. Every observer is done with a batch once the next one has
+	// been dispatched, so that's when the snapshot is released
+	std::uint64_t m_batches = 0;
+	std::uint64_t m_snapshot_batch = 0;
+
 	struct removed_entry {
 		frame_t removed_frame;
 		frame_t added_frame;
@@ -325,6 +397,11 @@ private:
 
 	// Maximum number of tombstones to keep. Configurable for testing.
 	std::size_t m_max_tombstones;
+
+	// the rate and progress history of the torrents, sampled every frame
+	torrent_series_store m_series;
+	int const m_series_memory_metric;
+	int const m_series_torrents_metric;
 };
 } // namespace ltweb
 
@@ -0,0 +1,278 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "torrent_series.hpp"
+
+#include <algorithm>
+#include <tuple>
+
+namespace ltweb {
+
+namespace {
+
+// the fields stored as deltas, in the order of their bits in the sample
+// header. Bit 0 is the timestamp
+constexpr std::array<std::int64_t series_sample::*, 4> value_fields = {{
+	&series_sample::download_rate,
+	&series_sample::upload_rate,
+	&series_sample::num_peers,
+	&series_sample::progress_ppm,
+}};
+
+constexpr std::size_t num_fields = value_fields.size() + 1;
+
+// the approximate cost of a node in the store's hash table, on top of the
+// series itself
+constexpr std::size_t node_overhead = sizeof(lt::sha1_hash) + 2 * sizeof(void*);
+
+void write_varint(std::vector<std::uint8_t>& out, std::uint64_t v)
+{
+	while (v >= 0x80) {
+		out.push_back(std::uint8_t((v & 0x7f) | 0x80));
+		v >>= 7;
+	}
+	out.push_back(std::uint8_t(v));
+}
+
+bool read_varint(std::uint8_t const*& ptr, std::uint8_t const* const end, std::uint64_t& v)
+{
+	v = 0;
+	for (int shift = 0; shift < 64 && ptr != end; shift += 7) {
+		std::uint8_t const b = *ptr++;
+		v |= std::uint64_t(b & 0x7f) << shift;
+		if ((b & 0x80) == 0) return true;
+	}
+	return false;
+}
+
+// the difference between two values, mapped to an unsigned number so that
+// small negative and positive differences both make short varints. The
+// arithmetic is unsigned, and wraps rather than overflows
+std::uint64_t zigzag_delta(std::int64_t const prev, std::int64_t const v)
+{
+	std::uint64_t const d = std::uint64_t(v) - std::uint64_t(prev);
+	return (d << 1) ^ (0 - (d >> 63));
+}
+
+std::int64_t apply_zigzag_delta(std::int64_t const prev, std::uint64_t const z)
+{
+	std::uint64_t const d = (z >> 1) ^ (0 - (z & 1));
+	return std::int64_t(std::uint64_t(prev) + d);
+}
+
+bool in_range(series_sample const& s, std::int64_t const from, std::int64_t const to)
+{
+	return s.timestamp >= from && s.timestamp <= to;
+}
+
+} // anonymous namespace
+
+torrent_series::torrent_series(std::span<series_resolution const> const resolutions)
+{
+	m_levels.reserve(resolutions.size());
+	for (auto const& r : resolutions) {
+		level l;
+		l.interval = std::max(r.interval, std::int64_t(1));
+		l.span = std::max(r.span, std::int64_t(0));
+		m_levels.push_back(std::move(l));
+	}
+	m_memory = sizeof(*this) + m_levels.capacity() * sizeof(level);
+}
+
+void torrent_series::add(series_sample const& s)
+{
+	if (s.timestamp < 0) return;
+
+	for (level& l : m_levels) {
+		if (l.has_pending) {
+			// if the clock steps back, samples are dropped until it has
+			// caught up again
+			if (s.timestamp < l.pending.timestamp) continue;
+
+			// a later sample in the same interval replaces the pending one
+			if (s.timestamp / l.interval > l.pending.timestamp / l.interval) encode(l, l.pending);
+		}
+		l.pending = s;
+		l.has_pending = true;
+	}
+	if (s.timestamp >= m_last.timestamp) m_last = s;
+}
+
+void torrent_series::encode(level& l, series_sample const& s)
+{
+	if (l.chunks.empty() || l.chunks.back().count == samples_per_chunk) {
+		if (!l.chunks.empty()) {
+			// the chunk is complete, it won't grow anymore
+			auto& data = l.chunks.back().data;
+			m_memory -= data.capacity();
+			data.shrink_to_fit();
+			m_memory += data.capacity();
+		}
+
+		// drop the chunks whose samples are all older than the span
+		auto const keep = std::find_if(l.chunks.begin(), l.chunks.end(), [&](chunk const& c) {
+			return c.last_timestamp >= s.timestamp - l.span;
+		});
+		for (auto it = l.chunks.begin(); it != keep; ++it)
+			m_memory -= it->data.capacity();
+		l.chunks.erase(l.chunks.begin(), keep);
+
+		std::size_t const capacity = l.chunks.capacity();
+		l.chunks.push_back(chunk{s, s.timestamp, 1, {}});
+		m_memory += (l.chunks.capacity() - capacity) * sizeof(chunk);
+		l.prev = s;
+		l.prev_delta = 0;
+		return;
+	}
+
+	chunk& c = l.chunks.back();
+	std::size_t const capacity = c.data.capacity();
+
+	std::int64_t const delta = s.timestamp - l.prev.timestamp;
+	std::array<std::uint64_t, num_fields> z;
+	z[0] = zigzag_delta(l.prev_delta, delta);
+	for (std::size_t i = 0; i < value_fields.size(); ++i)
+		z[i + 1] = zigzag_delta(l.prev.*value_fields[i], s.*value_fields[i]);
+
+	std::uint8_t header = 0;
+	for (std::size_t i = 0; i < num_fields; ++i)
+		header |= std::uint8_t((z[i] != 0) << i);
+	c.data.push_back(header);
+	for (std::uint64_t const v : z)
+		if (v != 0) write_varint(c.data, v);
+
+	++c.count;
+	c.last_timestamp = s.timestamp;
+	l.prev = s;
+	l.prev_delta = delta;
+	m_memory += c.data.capacity() - capacity;
+}
+
+void torrent_series::query(
+	int const resolution,
+	std::int64_t const from,
+	std::int64_t const to,
+	std::vector<series_sample>& out
+) const
+{
+	if (resolution < 0 || resolution >= num_resolutions() || from > to) return;
+	level const& l = m_levels[std::size_t(resolution)];
+
+	for (chunk const& c : l.chunks) {
+		if (c.last_timestamp < from) continue;
+		if (c.first.timestamp > to) break;
+
+		series_sample cur = c.first;
+		if (in_range(cur, from, to)) out.push_back(cur);
+
+		std::int64_t delta = 0;
+		std::uint8_t const* ptr = c.data.data();
+		std::uint8_t const* const end = ptr + c.data.size();
+		for (std::uint32_t i = 1; i < c.count && ptr != end; ++i) {
+			std::uint8_t const header = *ptr++;
+			std::array<std::uint64_t, num_fields> z{};
+			for (std::size_t k = 0; k < num_fields; ++k) {
+				if ((header & (1 << k)) && !read_varint(ptr, end, z[k])) return;
+			}
+
+			delta = apply_zigzag_delta(delta, z[0]);
+			cur.timestamp += delta;
+			for (std::size_t k = 0; k < value_fields.size(); ++k)
+				cur.*value_fields[k] = apply_zigzag_delta(cur.*value_fields[k], z[k + 1]);
+
+			if (cur.timestamp > to) return;
+			if (cur.timestamp >= from) out.push_back(cur);
+		}
+	}
+
+	if (l.has_pending && in_range(l.pending, from, to)) out.push_back(l.pending);
+}
+
+torrent_series_store::torrent_series_store(
+	std::size_t const max_memory, std::span<series_resolution const> const resolutions
+)
+	: m_resolutions(resolutions.begin(), resolutions.end())
+	, m_max_memory(max_memory)
+{
+}
+
+namespace {
+template <typename Entry>
+std::size_t entry_memory(Entry const& e)
+{
+	return e.series.memory_used() + sizeof(Entry) - sizeof(torrent_series) + node_overhead;
+}
+} // anonymous namespace
+
+void torrent_series_store::add(lt::sha1_hash const& ih, series_sample const& s, bool const seeding)
+{
+	auto it = m_series.find(ih);
+	if (it == m_series.end()) {
+		it = m_series.emplace(ih, entry{torrent_series(m_resolutions), seeding}).first;
+	} else {
+		m_memory -= entry_memory(it->second);
+	}
+	it->second.series.add(s);
+	it->second.seeding = seeding;
+	m_memory += entry_memory(it->second);
+
+	if (m_memory > m_max_memory) evict();
+}
+
+void torrent_series_store::erase(lt::sha1_hash const& ih)
+{
+	auto const it = m_series.find(ih);
+	if (it == m_series.end()) return;
+	m_memory -= entry_memory(it->second);
+	m_series.erase(it);
+}
+
+bool torrent_series_store::query(
+	lt::sha1_hash const& ih,
+	int const resolution,
+	std::int64_t const from,
+	std::int64_t const to,
+	std::vector<series_sample>& out
+) const
+{
+	auto const it = m_series.find(ih);
+	if (it == m_series.end()) return false;
+	it->second.series.query(resolution, from, to, out);
+	return true;
+}
+
+void torrent_series_store::evict()
+{
+	// evict down to below the limit, so that a store at its limit doesn't
+	// scan all torrents for every sample
+	std::size_t const target = m_max_memory - m_max_memory / 8;
+
+	// idle seeds first, then by the time they last changed, oldest first
+	using candidate = std::tuple<bool, std::int64_t, decltype(m_series)::iterator>;
+	std::vector<candidate> candidates;
+	candidates.reserve(m_series.size());
+	for (auto it = m_series.begin(); it != m_series.end(); ++it) {
+		series_sample const& last = it->second.series.last();
+		bool const idle_seed =
+			it->second.seeding && last.download_rate == 0 && last.upload_rate == 0;
+		candidates.emplace_back(!idle_seed, last.timestamp, it);
+	}
+	std::sort(candidates.begin(), candidates.end(), [](candidate const& a, candidate const& b) {
+		return std::tie(std::get<0>(a), std::get<1>(a)) < std::tie(std::get<0>(b), std::get<1>(b));
+	});
+
+	for (auto const& c : candidates) {
+		if (m_memory <= target) break;
+		auto const it = std::get<2>(c);
+		m_memory -= entry_memory(it->second);
+		m_series.erase(it);
+	}
+}
+
+} // namespace ltweb
@@ -0,0 +1,166 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#ifndef LTWEB_TORRENT_SERIES_HPP
+#define LTWEB_TORRENT_SERIES_HPP
+
+#include "libtorrent/sha1_hash.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+namespace ltweb {
+
+// one sample of the transfer state of a torrent
+struct series_sample {
+	// milliseconds since the epoch
+	std::int64_t timestamp = 0;
+	// bytes per second
+	std::int64_t download_rate = 0;
+	std::int64_t upload_rate = 0;
+	std::int64_t num_peers = 0;
+	// parts per million
+	std::int64_t progress_ppm = 0;
+
+	bool operator==(series_sample const&) const = default;
+};
+
+struct series_resolution {
+	// the length of an interval, in milliseconds
+	std::int64_t interval;
+	// how far back samples are kept, in milliseconds
+	std::int64_t span;
+};
+
+// The recent rate and progress history of a single torrent, at a few
+// resolutions. Each resolution keeps the last sample taken in each of its
+// intervals. Only torrents whose status changed are sampled, so an interval
+// without a sample means the previous one still held.
+//
+// Samples are compressed in chunks. The first sample of a chunk is stored
+// as is. The following ones are a header byte, with a bit for each field
+// that is not 0, followed by those fields as zigzag varints. The timestamp
+// is stored as a delta-of-delta, which is 0 for regularly spaced samples.
+// The other fields are stored as deltas from the previous sample. An idle
+// torrent costs one byte per sample.
+struct torrent_series {
+	// 10 minutes at 1 second, a day at 5 minutes and 30 days at 1 hour. A
+	// busy torrent takes about 8 kiB for the first resolution, and a few
+	// hundred bytes per hour for the others
+	static constexpr std::array<series_resolution, 3> default_resolutions = {{
+		{1000, 10 * 60 * 1000},
+		{5 * 60 * 1000, 24 * 60 * 60 * 1000},
+		{60 * 60 * 1000, std::int64_t(30) * 24 * 60 * 60 * 1000},
+	}};
+
+	// the number of samples in a chunk. The oldest samples are dropped a
+	// chunk at a time
+	static constexpr std::uint32_t samples_per_chunk = 64;
+
+	explicit torrent_series(std::span<series_resolution const> resolutions = default_resolutions);
+
+	// samples older than the previous one, at a resolution, are ignored
+	void add(series_sample const& s);
+
+	// appends the samples at the specified resolution, with timestamps in
+	// [from, to], oldest first, to out
+	void query(
+		int resolution, std::int64_t from, std::int64_t to, std::vector<series_sample>& out
+	) const;
+
+	int num_resolutions() const { return int(m_levels.size()); }
+
+	// the most recent sample, or a default constructed one if there are none
+	series_sample const& last() const { return m_last; }
+
+	// the number of bytes allocated for this series, including the object
+	// itself
+	std::size_t memory_used() const { return m_memory; }
+
+private:
+	struct chunk {
+		series_sample first;
+		std::int64_t last_timestamp;
+		std::uint32_t count;
+		std::vector<std::uint8_t> data;
+	};
+
+	struct level {
+		std::int64_t interval;
+		std::int64_t span;
+		std::vector<chunk> chunks;
+
+		// the last sample encoded in the last chunk, and the difference of
+		// its timestamp to the one before it. The next sample is encoded
+		// relative to these
+		series_sample prev;
+		std::int64_t prev_delta = 0;
+
+		// the sample for the current interval. It's encoded once a sample
+		// for a later interval arrives
+		series_sample pending;
+		bool has_pending = false;
+	};
+
+	void encode(level& l, series_sample const& s);
+
+	std::vector<level> m_levels;
+	series_sample m_last;
+	std::size_t m_memory = 0;
+};
+
+// The series of all torrents, with a limit on the total memory use. When
+// the limit is exceeded, whole series are dropped. Idle seeds go first,
+// followed by the torrents that have been unchanged for the longest time.
+// This class is not thread safe.
+struct torrent_series_store {
+	explicit torrent_series_store(
+		std::size_t max_memory = 16 * 1024 * 1024,
+		std::span<series_resolution const> resolutions = torrent_series::default_resolutions
+	);
+
+	void add(lt::sha1_hash const& ih, series_sample const& s, bool seeding);
+	void erase(lt::sha1_hash const& ih);
+
+	// appends the samples of the torrent, at the specified resolution, with
+	// timestamps in [from, to] to out. Returns false if there's no series for
+	// the torrent
+	bool query(
+		lt::sha1_hash const& ih,
+		int resolution,
+		std::int64_t from,
+		std::int64_t to,
+		std::vector<series_sample>& out
+	) const;
+
+	int num_resolutions() const { return int(m_resolutions.size()); }
+	std::size_t num_torrents() const { return m_series.size(); }
+	std::size_t memory_used() const { return m_memory; }
+
+private:
+	void evict();
+
+	struct entry {
+		torrent_series series;
+		bool seeding = false;
+	};
+
+	std::vector<series_resolution> m_resolutions;
+	std::unordered_map<lt::sha1_hash, entry> m_series;
+	std::size_t m_max_memory;
+	std::size_t m_memory = 0;
+};
+
+} // namespace ltweb
+
+#endif
@@ -69,7 +69,9 @@ int main(int argc, char *const argv[])
 
 	lt::session ses(s);
 
-	alert_handler alerts(ses);
+	// every alert observer is called on a thread of its own, so a slow one
+	// doesn't hold up the others, or the main loop below
+	alert_handler alerts(ses, alert_handler::dispatch_mode::threaded);
 
 	save_settings sett(ses, s.settings, "settings.dat");
 
@@ -80,6 +82,8 @@ int main(int argc, char *const argv[])
 	prioritize_headers headers(&alerts);
 
 	save_resume resume(ses, "resume.dat", &alerts, hist);
+	// save_resume applies the tags of loaded torrents to torrent_history
+	alerts.dispatch_after(&resume, &hist);
 	resume.load(ec);
 	// TODO: log error if ec is set
 
@@ -118,6 +122,8 @@ int main(int argc, char *const argv[])
 	// path /bt/control. Authenticates via session cookie; redirects to the
 	// login page when the cookie is missing or expired.
 	libtorrent_webui lt_handler(ses, hist, sessions, alerts, sett, "/login");
+	// it sets the tags of torrents added through it in torrent_history
+	alerts.dispatch_after(&lt_handler, &hist);
 
 	// uTorrent-compatible HTTP API exposed at /gui. Authenticates via
 	// session cookie; redirects to the login page on auth failure.
@@ -179,6 +185,7 @@ int main(int argc, char *const argv[])
 
 	bool shutting_down = false;
 	lt::time_point last_update = lt::clock_type::now();
+	lt::time_point last_stats = last_update;
 	while (!quit || !resume.ok_to_quit())
 	{
 		alerts.dispatch_alerts(500ms);
@@ -197,6 +204,13 @@ int main(int argc, char *const argv[])
 			ses.post_torrent_updates();
 			last_update = now;
 		}
+		// sample the session stats once a second, for the stats history and
+		// the stats log
+		if (!quit && now - last_stats >= 1s)
+		{
+			ses.post_session_stats();
+			last_stats = now;
+		}
 		if (force_quit)
 		{
 			fprintf(stderr, "force quitting\n");
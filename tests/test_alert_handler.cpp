@@ -0,0 +1,245 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE alert_handler
+#include <boost/test/included/unit_test.hpp>
+
+#include "alert_handler.hpp"
+#include "alert_observer.hpp"
+
+#include <libtorrent/session.hpp>
+#include <libtorrent/settings_pack.hpp>
+#include <libtorrent/alert_types.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+lt::settings_pack make_settings_pack()
+{
+	lt::settings_pack sp;
+	sp.set_bool(lt::settings_pack::enable_dht, false);
+	sp.set_bool(lt::settings_pack::enable_lsd, false);
+	sp.set_bool(lt::settings_pack::enable_upnp, false);
+	sp.set_bool(lt::settings_pack::enable_natpmp, false);
+	sp.set_str(lt::settings_pack::listen_interfaces, "127.0.0.1:0");
+	return sp;
+}
+
+// records the order observers finish their batches in
+struct batch_log {
+	void add(int const id)
+	{
+		std::lock_guard<std::mutex> l(mutex);
+		order.push_back(id);
+	}
+	std::mutex mutex;
+	std::vector<int> order;
+};
+
+struct stats_observer : ltweb::alert_observer {
+	stats_observer(ltweb::alert_handler& h, batch_log& log, int const id)
+		: m_handler(h)
+		, m_log(log)
+		, m_id(id)
+	{
+		h.subscribe<lt::session_stats_alert>(this, ltweb::alert_handler::batch_end);
+	}
+	~stats_observer() { m_handler.unsubscribe(this); }
+
+	void handle_alert(lt::alert const*) override
+	{
+		thread = std::this_thread::get_id();
+		if (slow) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		++alerts;
+	}
+	void alerts_dispatched() override { m_log.add(m_id); }
+
+	std::atomic<int> alerts{0};
+	std::thread::id thread;
+	bool slow = false;
+
+private:
+	ltweb::alert_handler& m_handler;
+	batch_log& m_log;
+	int m_id;
+};
+
+// posts n session stats alerts and dispatches them
+void post_stats(lt::session& ses, ltweb::alert_handler& handler, int n)
+{
+	for (int i = 0; i < n; ++i)
+		ses.post_session_stats();
+	while (n > 0) {
+		ses.wait_for_alert(std::chrono::seconds(10));
+		std::vector<lt::alert*> alerts;
+		ses.pop_alerts(&alerts);
+		for (auto const* a : alerts)
+			if (a->type() == lt::session_stats_alert::alert_type) --n;
+		handler.dispatch_alerts(alerts);
+	}
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(caller_order)
+{
+	lt::session ses(make_settings_pack());
+	ltweb::alert_handler handler(ses);
+	batch_log log;
+	stats_observer a(handler, log, 1);
+	stats_observer b(handler, log, 2);
+	handler.dispatch_after(&a, &b);
+
+	post_stats(ses, handler, 1);
+	BOOST_TEST(a.alerts == 1);
+	BOOST_TEST(b.alerts == 1);
+	BOOST_TEST(a.thread == std::this_thread::get_id());
+	BOOST_TEST(log.order == (std::vector<int>{2, 1}));
+}
+
+BOOST_AUTO_TEST_CASE(unsubscribe_while_dispatching)
+{
+	lt::session ses(make_settings_pack());
+	ltweb::alert_handler handler(ses);
+	batch_log log;
+	stats_observer b(handler, log, 2);
+
+	// unsubscribes itself and b on the first alert
+	struct unsubscriber : ltweb::alert_observer {
+		void handle_alert(lt::alert const*) override
+		{
+			++alerts;
+			handler->unsubscribe(this);
+			handler->unsubscribe(other);
+		}
+		ltweb::alert_handler* handler;
+		ltweb::alert_observer* other;
+		int alerts = 0;
+	} u;
+	u.handler = &handler;
+	u.other = &b;
+	handler.subscribe<lt::session_stats_alert>(&u);
+	handler.dispatch_after(&b, &u);
+
+	post_stats(ses, handler, 2);
+	BOOST_TEST(u.alerts == 1);
+	BOOST_TEST(b.alerts == 0);
+
+	// the observers can subscribe again
+	handler.subscribe<lt::session_stats_alert>(&b, ltweb::alert_handler::batch_end);
+	post_stats(ses, handler, 1);
+	BOOST_TEST(u.alerts == 1);
+	BOOST_TEST(b.alerts == 1);
+}
+
+BOOST_AUTO_TEST_CASE(threaded)
+{
+	lt::session ses(make_settings_pack());
+	ltweb::alert_handler handler(ses, ltweb::alert_handler::dispatch_mode::threaded);
+	batch_log log;
+	stats_observer a(handler, log, 1);
+	stats_observer b(handler, log, 2);
+	stats_observer c(handler, log, 3);
+	// b is slow, but a still waits for it
+	b.slow = true;
+	handler.dispatch_after(&a, &b);
+
+	post_stats(ses, handler, 3);
+	BOOST_TEST(a.alerts == 3);
+	BOOST_TEST(b.alerts == 3);
+	BOOST_TEST(c.alerts == 3);
+	BOOST_TEST(a.thread != std::this_thread::get_id());
+	BOOST_TEST(a.thread != b.thread);
+
+	// every batch is done by b before a gets it
+	int b_batches = 0;
+	for (int const id : log.order) {
+		if (id == 2) ++b_batches;
+		if (id == 1) {
+			BOOST_TEST(b_batches > 0);
+			--b_batches;
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(threaded_pipeline)
+{
+	lt::session ses(make_settings_pack());
+	ltweb::alert_handler handler(ses, ltweb::alert_handler::dispatch_mode::threaded);
+	batch_log log;
+	stats_observer a(handler, log, 1);
+
+	// dispatch_alerts() returns before the observer is done
+	int received = 0;
+	for (int i = 0; i < 50 && received < 5; ++i) {
+		ses.post_session_stats();
+		handler.dispatch_alerts(std::chrono::milliseconds(100));
+		received = a.alerts;
+	}
+	// the last batch is finished by dispatch_alerts() with a vector
+	std::vector<lt::alert*> none;
+	handler.dispatch_alerts(none);
+	BOOST_TEST(a.alerts >= 5);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_unsubscribe)
+{
+	lt::session ses(make_settings_pack());
+	ltweb::alert_handler handler(ses, ltweb::alert_handler::dispatch_mode::threaded);
+	batch_log log;
+	stats_observer a(handler, log, 1);
+	{
+		stats_observer b(handler, log, 2);
+		handler.dispatch_after(&a, &b);
+		post_stats(ses, handler, 1);
+		BOOST_TEST(b.alerts == 1);
+	}
+	// a no longer depends on b
+	post_stats(ses, handler, 1);
+	BOOST_TEST(a.alerts == 2);
+}
+
+BOOST_AUTO_TEST_CASE(stats)
+{
+	lt::session ses(make_settings_pack());
+	ltweb::alert_handler handler(ses);
+	batch_log log;
+	stats_observer a(handler, log, 1);
+	stats_observer b(handler, log, 2);
+
+	post_stats(ses, handler, 3);
+	ltweb::alert_stats const s = handler.stats();
+	BOOST_TEST(s.batches >= 1);
+	BOOST_TEST(s.max_batch_size >= s.last_batch_size);
+
+	auto const type = std::find_if(s.types.begin(), s.types.end(), [](auto const& t) {
+		return t.type == lt::session_stats_alert::alert_type;
+	});
+	BOOST_REQUIRE(type != s.types.end());
+	BOOST_TEST(type->count == 3);
+	BOOST_TEST(type->dropped == 0);
+
+	// both observers are unnamed, and share their counters
+	BOOST_REQUIRE(s.observers.size() == 1);
+	auto const& o = s.observers.front();
+	BOOST_TEST(o.name == "unnamed");
+	BOOST_TEST(o.alerts == 6);
+	std::uint64_t histogram = 0;
+	for (std::uint64_t const n : o.histogram)
+		histogram += n;
+	BOOST_TEST(histogram == o.batches);
+	BOOST_TEST(o.max_us >= o.last_us);
+	BOOST_TEST(s.slowest_at_drop.empty());
+}
@@ -0,0 +1,172 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE byte_ranges
+#include <boost/test/included/unit_test.hpp>
+
+#include "byte_ranges.hpp"
+
+#include <string>
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+std::vector<byte_range> ranges;
+
+range_status parse(char const* value, std::int64_t size = 1000)
+{
+	return parse_byte_ranges(value, size, ranges);
+}
+
+std::string render(std::vector<stream_segment> const& segments)
+{
+	std::string ret;
+	for (auto const& s : segments) {
+		ret += s.prefix;
+		for (std::int64_t i = 0; i < s.length; ++i)
+			ret += char('a' + (s.offset + i) % 26);
+	}
+	return ret;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(single_range)
+{
+	BOOST_TEST((parse("bytes=0-499") == range_status::satisfiable));
+	BOOST_TEST(ranges.size() == 1);
+	BOOST_TEST(ranges[0].first == 0);
+	BOOST_TEST(ranges[0].last == 499);
+}
+
+BOOST_AUTO_TEST_CASE(open_ended)
+{
+	BOOST_TEST((parse("bytes=900-") == range_status::satisfiable));
+	BOOST_TEST(ranges[0].first == 900);
+	BOOST_TEST(ranges[0].last == 999);
+}
+
+BOOST_AUTO_TEST_CASE(clipped_to_end)
+{
+	BOOST_TEST((parse("bytes=500-5000") == range_status::satisfiable));
+	BOOST_TEST(ranges[0].first == 500);
+	BOOST_TEST(ranges[0].last == 999);
+}
+
+BOOST_AUTO_TEST_CASE(suffix)
+{
+	BOOST_TEST((parse("bytes=-100") == range_status::satisfiable));
+	BOOST_TEST(ranges[0].first == 900);
+	BOOST_TEST(ranges[0].last == 999);
+
+	// larger than the body
+	BOOST_TEST((parse("bytes=-5000") == range_status::satisfiable));
+	BOOST_TEST(ranges[0].first == 0);
+	BOOST_TEST(ranges[0].last == 999);
+
+	BOOST_TEST((parse("bytes=-0") == range_status::unsatisfiable));
+}
+
+BOOST_AUTO_TEST_CASE(multiple)
+{
+	BOOST_TEST((parse(" bytes=0-9, 20-29 ,,-10") == range_status::satisfiable));
+	BOOST_TEST(ranges.size() == 3);
+	BOOST_TEST(ranges[1].first == 20);
+	BOOST_TEST(ranges[1].last == 29);
+	BOOST_TEST(ranges[2].first == 990);
+}
+
+BOOST_AUTO_TEST_CASE(unsatisfiable)
+{
+	BOOST_TEST((parse("bytes=1000-") == range_status::unsatisfiable));
+	BOOST_TEST((parse("bytes=1000-2000, 3000-") == range_status::unsatisfiable));
+	BOOST_TEST((parse("bytes=0-", 0) == range_status::unsatisfiable));
+
+	// the satisfiable ones are kept
+	BOOST_TEST((parse("bytes=2000-3000, 10-20") == range_status::satisfiable));
+	BOOST_TEST(ranges.size() == 1);
+	BOOST_TEST(ranges[0].first == 10);
+}
+
+BOOST_AUTO_TEST_CASE(malformed)
+{
+	BOOST_TEST((parse("") == range_status::ignored));
+	BOOST_TEST((parse("bytes=") == range_status::ignored));
+	BOOST_TEST((parse("items=0-10") == range_status::ignored));
+	BOOST_TEST((parse("bytes=10") == range_status::ignored));
+	BOOST_TEST((parse("bytes=10-5") == range_status::ignored));
+	BOOST_TEST((parse("bytes=a-5") == range_status::ignored));
+	BOOST_TEST((parse("bytes=0-5, x") == range_status::ignored));
+	BOOST_TEST((parse("bytes=--5") == range_status::ignored));
+	BOOST_TEST(ranges.empty());
+}
+
+BOOST_AUTO_TEST_CASE(abusive)
+{
+	// more bytes than the body, by overlapping ranges
+	BOOST_TEST((parse("bytes=0-999, 0-999") == range_status::ignored));
+	BOOST_TEST(ranges.empty());
+
+	std::string many = "bytes=";
+	for (std::size_t i = 0; i <= max_byte_ranges; ++i)
+		many += std::to_string(i) + "-" + std::to_string(i) + ",";
+	BOOST_TEST((parse(many.c_str()) == range_status::ignored));
+}
+
+BOOST_AUTO_TEST_CASE(date_format)
+{
+	BOOST_TEST(http_date(784111777) == "Sun, 06 Nov 1994 08:49:37 GMT");
+	BOOST_TEST(http_date(0) == "Thu, 01 Jan 1970 00:00:00 GMT");
+}
+
+BOOST_AUTO_TEST_CASE(date_parse)
+{
+	BOOST_TEST(parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT").value_or(-1) == 784111777);
+	BOOST_TEST(parse_http_date(http_date(1791234567)).value_or(-1) == 1791234567);
+
+	BOOST_TEST(!parse_http_date(""));
+	BOOST_TEST(!parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT"));
+	BOOST_TEST(!parse_http_date("Sun Nov  6 08:49:37 1994"));
+	BOOST_TEST(!parse_http_date("Sun, 06 Foo 1994 08:49:37 GMT"));
+	BOOST_TEST(!parse_http_date("Sun, 31 Feb 1994 08:49:37 GMT"));
+	BOOST_TEST(!parse_http_date("Sun, 06 Nov 1994 25:49:37 GMT"));
+}
+
+BOOST_AUTO_TEST_CASE(if_range)
+{
+	std::string const etag = "\"abc\"";
+	BOOST_TEST(if_range_matches("\"abc\"", etag, 100));
+	BOOST_TEST(!if_range_matches("\"abd\"", etag, 100));
+	BOOST_TEST(!if_range_matches("W/\"abc\"", etag, 100));
+
+	BOOST_TEST(if_range_matches(http_date(784111777), etag, 784111777));
+	BOOST_TEST(!if_range_matches(http_date(784111776), etag, 784111777));
+
+	// without a last modified time, dates never match
+	BOOST_TEST(!if_range_matches(http_date(0), etag, 0));
+	BOOST_TEST(!if_range_matches("garbage", etag, 784111777));
+}
+
+BOOST_AUTO_TEST_CASE(multipart)
+{
+	std::vector<stream_segment> const body = {{"", 0, 0, 10}, {"XY", 0, 10, 10}};
+	BOOST_TEST(render(body) == "abcdefghijXYklmnopqrst");
+
+	auto const parts = multipart_byteranges(body, {{0, 1}, {9, 12}}, "text/plain", "BND");
+	BOOST_TEST(
+		render(parts)
+		== "--BND\r\nContent-Type: text/plain\r\nContent-Range: bytes 0-1/22\r\n\r\nab"
+		   "\r\n--BND\r\nContent-Type: text/plain\r\nContent-Range: bytes 9-12/22\r\n\r\njXYk"
+		   "\r\n--BND--\r\n"
+	);
+	BOOST_TEST(segments_size(parts) == std::int64_t(render(parts).size()));
+	BOOST_TEST(parts.back().source == -1);
+}
@@ -0,0 +1,55 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE counter_diff
+#include <boost/test/included/unit_test.hpp>
+
+#include "counter_diff.hpp"
+
+#include <cstdint>
+#include <vector>
+
+using namespace ltweb;
+
+BOOST_AUTO_TEST_CASE(nothing_changed)
+{
+	std::vector<std::int64_t> values(100, 7);
+	std::vector<std::int64_t> const current(100, 7);
+	counter_bitmap changed;
+	BOOST_TEST(!diff_counters(values, current, changed));
+	BOOST_TEST(changed == (counter_bitmap{0, 0}));
+}
+
+BOOST_AUTO_TEST_CASE(changed_bits)
+{
+	std::vector<std::int64_t> values(130, 0);
+	std::vector<std::int64_t> current(130, 0);
+	for (int const i : {0, 63, 64, 129})
+		current[std::size_t(i)] = i + 1;
+
+	counter_bitmap changed;
+	BOOST_TEST(diff_counters(values, current, changed));
+	BOOST_TEST(changed.size() == 3);
+	BOOST_TEST(changed[0] == (1 | (std::uint64_t(1) << 63)));
+	BOOST_TEST(changed[1] == 1);
+	BOOST_TEST(changed[2] == 2);
+
+	// the values are updated
+	BOOST_TEST(values == current);
+	BOOST_TEST(!diff_counters(values, current, changed));
+}
+
+BOOST_AUTO_TEST_CASE(intersection)
+{
+	BOOST_TEST(intersects({0, 4}, {1, 6}));
+	BOOST_TEST(!intersects({0, 4}, {1, 2}));
+	BOOST_TEST(!intersects({}, {1}));
+	// the shorter bitmap decides
+	BOOST_TEST(!intersects({1}, {0, 1}));
+}
@@ -0,0 +1,169 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE hashed_lru
+#include <boost/test/included/unit_test.hpp>
+
+#include "hashed_lru.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+struct value {
+	explicit value(int const v)
+		: v(v)
+	{}
+	int v;
+};
+
+using cache = hashed_lru<int, value>;
+
+std::shared_ptr<value> get(cache& c, int const key, std::size_t const memory = 100)
+{
+	auto ret = c.get(key, [&] { return std::make_shared<value>(key); });
+	c.set_memory(key, ret.get(), memory);
+	return ret;
+}
+
+std::vector<int> keys(cache const& c)
+{
+	std::vector<int> ret;
+	for (auto const& e : c.entries())
+		ret.push_back(e.first);
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(get_and_find)
+{
+	cache c("test", 100000);
+	BOOST_TEST(!c.find(1));
+	auto const a = get(c, 1);
+	BOOST_TEST(a->v == 1);
+	// the second get returns the same entry
+	BOOST_TEST(get(c, 1) == a);
+	BOOST_TEST(c.find(1) == a);
+	BOOST_TEST(c.size() == 1);
+	BOOST_TEST(c.memory_used() == 100);
+}
+
+BOOST_AUTO_TEST_CASE(memory_budget)
+{
+	// one shard, with room for 300 bytes
+	cache c("test", 300, 1);
+	get(c, 1);
+	get(c, 2);
+	get(c, 3);
+	BOOST_TEST(keys(c) == (std::vector<int>{1, 2, 3}));
+
+	// 1 is used, so 2 is the least recently used
+	get(c, 1);
+	get(c, 4);
+	BOOST_TEST(keys(c) == (std::vector<int>{1, 3, 4}));
+	BOOST_TEST(c.memory_used() == 300);
+
+	// an entry growing evicts others
+	get(c, 4, 250);
+	BOOST_TEST(keys(c) == (std::vector<int>{4}));
+
+	// the entry used last is kept, even if it's over the budget
+	get(c, 5, 1000);
+	BOOST_TEST(keys(c) == (std::vector<int>{5}));
+	BOOST_TEST(c.memory_used() == 1000);
+}
+
+BOOST_AUTO_TEST_CASE(find_doesnt_use)
+{
+	cache c("test", 200, 1);
+	get(c, 1);
+	get(c, 2);
+	c.find(1);
+	get(c, 3);
+	BOOST_TEST(keys(c) == (std::vector<int>{2, 3}));
+}
+
+BOOST_AUTO_TEST_CASE(evicted_entries_live_on)
+{
+	cache c("test", 100, 1);
+	auto const a = get(c, 1);
+	get(c, 2);
+	BOOST_TEST(!c.find(1));
+	BOOST_TEST(a->v == 1);
+
+	// the memory of an evicted entry no longer counts
+	c.set_memory(1, a.get(), 1000);
+	BOOST_TEST(c.memory_used() == 100);
+}
+
+BOOST_AUTO_TEST_CASE(erase)
+{
+	cache c("test", 100000);
+	auto const a = get(c, 1);
+	c.erase(1);
+	BOOST_TEST(!c.find(1));
+	BOOST_TEST(c.size() == 0);
+	BOOST_TEST(c.memory_used() == 0);
+
+	// an entry created since isn't erased
+	auto const b = get(c, 1);
+	c.erase(1, a.get());
+	BOOST_TEST(c.find(1) == b);
+	c.erase(1, b.get());
+	BOOST_TEST(!c.find(1));
+}
+
+BOOST_AUTO_TEST_CASE(threads)
+{
+	cache c("test", 100 * 64, 4);
+	// Boost.Test isn't thread safe, the threads count their errors instead
+	std::atomic<int> errors{0};
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; ++t) {
+		threads.emplace_back([&c, &errors, t] {
+			for (int i = 0; i < 10000; ++i) {
+				int const key = (i * 7 + t) % 100;
+				if (get(c, key)->v != key) ++errors;
+				if (i % 13 == 0) c.erase(key);
+			}
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	BOOST_TEST(errors == 0);
+	BOOST_TEST(c.size() == c.entries().size());
+	BOOST_TEST(c.memory_used() == c.size() * 100);
+}
+
+BOOST_AUTO_TEST_CASE(cache_metrics)
+{
+	cache c("metrics_test", 100000);
+	auto& m = global_metrics();
+	int const hits = m.register_metric("metrics_test.hits", metric_type::counter);
+	int const misses = m.register_metric("metrics_test.misses", metric_type::counter);
+	int const evictions = m.register_metric("metrics_test.evictions", metric_type::counter);
+	int const entries = m.register_metric("metrics_test.entries", metric_type::gauge);
+	int const memory = m.register_metric("metrics_test.memory", metric_type::gauge);
+
+	get(c, 1);
+	get(c, 1);
+	get(c, 2, 200000);
+	BOOST_TEST(m.value(hits) == 1);
+	BOOST_TEST(m.value(misses) == 2);
+	BOOST_TEST(m.value(evictions) + m.value(entries) == 2);
+	BOOST_TEST(m.value(memory) == std::int64_t(c.memory_used()));
+}
@@ -0,0 +1,313 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE log_writer
+#include <boost/test/included/unit_test.hpp>
+
+#include "log_writer.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+// RAII directory for log files, removed on destruction
+struct tempdir {
+	tempdir()
+		: path(std::filesystem::temp_directory_path()
+			/ ("ltweb_log_writer_test_" + std::to_string(std::rand())))
+	{
+		std::filesystem::create_directories(path);
+	}
+	~tempdir()
+	{
+		std::error_code ec;
+		std::filesystem::remove_all(path, ec);
+	}
+
+	std::string file(std::string const& name) const { return (path / name).string(); }
+
+	std::filesystem::path path;
+};
+
+std::string read_file(std::string const& name)
+{
+	std::ifstream f(name, std::ios::in | std::ios::binary);
+	return {std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+}
+
+std::vector<char> line(std::string const& s) { return {s.begin(), s.end()}; }
+
+log_record record(int const sink, std::string const& s) { return {sink, false, line(s)}; }
+
+// a sink writing to a single file
+log_sink_config file_sink(std::string const& name)
+{
+	log_sink_config ret;
+	ret.file_name = [name](int) { return name; };
+	return ret;
+}
+
+// writes a header and a trailer with the offset it's written at, and records
+// the offsets of the records
+struct test_format : log_file_format {
+	std::vector<char> begin_file() override { return line("H\n"); }
+	void record(std::span<char const>, std::uint64_t const offset) override
+	{
+		offsets.push_back(offset);
+	}
+	std::vector<char> end_file(std::uint64_t const offset) override
+	{
+		return line("T" + std::to_string(offset) + "\n");
+	}
+	std::vector<std::uint64_t> offsets;
+};
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(ring_order)
+{
+	log_ring r(3);
+	BOOST_TEST(r.capacity() == 4);
+
+	for (int i = 0; i < 4; ++i) {
+		log_record rec = record(i, "x");
+		BOOST_TEST(r.push(rec));
+	}
+	log_record full = record(4, "y");
+	BOOST_TEST(!r.push(full));
+	// a failed push leaves the record alone
+	BOOST_TEST(full.data.size() == 1);
+	BOOST_TEST(r.size() == 4);
+
+	log_record out;
+	for (int i = 0; i < 4; ++i) {
+		BOOST_TEST(r.pop(out));
+		BOOST_TEST(out.sink == i);
+	}
+	BOOST_TEST(!r.pop(out));
+
+	// the next lap of the ring
+	BOOST_TEST(r.push(full));
+	BOOST_TEST(r.pop(out));
+	BOOST_TEST(out.sink == 4);
+}
+
+BOOST_AUTO_TEST_CASE(ring_producers)
+{
+	log_ring r(1024);
+	int const num_threads = 4;
+	int const per_thread = 10000;
+
+	std::vector<std::thread> producers;
+	for (int t = 0; t < num_threads; ++t) {
+		producers.emplace_back([&r, t] {
+			for (int i = 0; i < per_thread; ++i) {
+				log_record rec{t, false, {char(i & 0x7f)}};
+				while (!r.push(rec))
+					std::this_thread::yield();
+			}
+		});
+	}
+
+	// each producer's records come out in the order they were pushed
+	std::vector<int> next(num_threads, 0);
+	int received = 0;
+	log_record out;
+	while (received < num_threads * per_thread) {
+		if (!r.pop(out)) continue;
+		BOOST_TEST(out.data.front() == char(next[std::size_t(out.sink)] & 0x7f));
+		++next[std::size_t(out.sink)];
+		++received;
+	}
+	for (auto& t : producers)
+		t.join();
+	BOOST_TEST(next == std::vector<int>(num_threads, per_thread));
+}
+
+BOOST_AUTO_TEST_CASE(write_and_close)
+{
+	tempdir dir;
+	log_writer w;
+	auto fmt = std::make_shared<test_format>();
+	log_sink_config cfg = file_sink(dir.file("a.log"));
+	cfg.format = fmt;
+	int const sink = w.add_sink(cfg);
+	BOOST_TEST(sink >= 0);
+
+	BOOST_TEST(w.write(sink, line("foo\n")));
+	BOOST_TEST(w.write(sink, line("bar\n")));
+	w.close_sink(sink);
+	BOOST_TEST(!w.write(sink, line("baz\n")));
+
+	BOOST_TEST(read_file(dir.file("a.log")) == "H\nfoo\nbar\nT10\n");
+	BOOST_TEST(fmt->offsets == (std::vector<std::uint64_t>{2, 6}));
+}
+
+BOOST_AUTO_TEST_CASE(flush)
+{
+	tempdir dir;
+	log_writer w(16, std::chrono::seconds(10));
+	int const sink = w.add_sink(file_sink(dir.file("a.log")));
+	w.write(sink, line("foo\n"));
+	w.flush();
+	BOOST_TEST(read_file(dir.file("a.log")) == "foo\n");
+	w.close_sink(sink);
+}
+
+BOOST_AUTO_TEST_CASE(rotate_by_size)
+{
+	tempdir dir;
+	log_writer w;
+	log_sink_config cfg;
+	cfg.file_name = [&](int const seq) { return dir.file(std::to_string(seq) + ".log"); };
+	cfg.max_size = 10;
+	int const sink = w.add_sink(cfg);
+	for (char const* s : {"12345\n", "12345\n", "123\n", "1234567890123\n"})
+		w.write(sink, line(s));
+	w.close_sink(sink);
+
+	BOOST_TEST(read_file(dir.file("0.log")) == "12345\n");
+	BOOST_TEST(read_file(dir.file("1.log")) == "12345\n123\n");
+	// a record larger than the limit gets a file of its own
+	BOOST_TEST(read_file(dir.file("2.log")) == "1234567890123\n");
+}
+
+BOOST_AUTO_TEST_CASE(rotate_same_name)
+{
+	tempdir dir;
+	{
+		std::ofstream f(dir.file("a.log"));
+		f << "old\n";
+	}
+	log_writer w;
+	log_sink_config cfg = file_sink(dir.file("a.log"));
+	cfg.append = true;
+	cfg.max_size = 8;
+	int const sink = w.add_sink(cfg);
+	w.write(sink, line("1234\n"));
+	w.write(sink, line("5678\n"));
+	w.close_sink(sink);
+
+	BOOST_TEST(read_file(dir.file("a.log.1")) == "old\n1234\n");
+	BOOST_TEST(read_file(dir.file("a.log")) == "5678\n");
+}
+
+BOOST_AUTO_TEST_CASE(rotate_shared_file)
+{
+	// what others write to a shared file (like a redirected stderr) counts
+	// towards its size limit
+	struct shared_format : log_file_format {
+		bool shared_file() const override { return true; }
+	};
+	tempdir dir;
+	log_writer w;
+	log_sink_config cfg;
+	cfg.file_name = [&](int const seq) { return dir.file(std::to_string(seq) + ".log"); };
+	cfg.max_size = 10;
+	cfg.format = std::make_shared<shared_format>();
+	int const sink = w.add_sink(cfg);
+	{
+		std::ofstream f(dir.file("0.log"), std::ios::app);
+		f << "printed to stderr\n";
+	}
+	w.flush();
+	w.write(sink, line("foo\n"));
+	w.close_sink(sink);
+
+	BOOST_TEST(read_file(dir.file("0.log")) == "printed to stderr\n");
+	BOOST_TEST(read_file(dir.file("1.log")) == "foo\n");
+}
+
+BOOST_AUTO_TEST_CASE(rate_limit)
+{
+	tempdir dir;
+	log_writer w;
+	log_sink_config cfg = file_sink(dir.file("a.log"));
+	cfg.rate_limit = 5;
+	int const sink = w.add_sink(cfg);
+	int accepted = 0;
+	for (int i = 0; i < 20; ++i)
+		accepted += w.write(sink, line("x\n"));
+	w.close_sink(sink);
+
+	// the writes may straddle a second
+	BOOST_TEST(accepted >= 5);
+	BOOST_TEST(accepted <= 10);
+	BOOST_TEST(w.rate_limited(sink) == std::uint64_t(20 - accepted));
+}
+
+BOOST_AUTO_TEST_CASE(overload)
+{
+	tempdir dir;
+	// the writer doesn't get to run before the ring is full
+	log_writer w(4, std::chrono::seconds(10));
+	int const sink = w.add_sink(file_sink(dir.file("a.log")));
+	int accepted = 0;
+	for (int i = 0; i < 1000; ++i)
+		accepted += w.write(sink, line("x\n"));
+	w.close_sink(sink);
+
+	BOOST_TEST(accepted >= 4);
+	BOOST_TEST(w.dropped() == std::uint64_t(1000 - accepted));
+	BOOST_TEST(read_file(dir.file("a.log")).size() == std::size_t(accepted) * 2);
+}
+
+BOOST_AUTO_TEST_CASE(compressed)
+{
+	tempdir dir;
+	log_writer w;
+	log_sink_config cfg = file_sink(dir.file("a.log.gz"));
+	cfg.compress = true;
+	int const sink = w.add_sink(cfg);
+	std::string expect;
+	for (int i = 0; i < 100; ++i) {
+		std::string const s = "line " + std::to_string(i) + "\n";
+		w.write(sink, line(s));
+		expect += s;
+	}
+	w.close_sink(sink);
+
+	BOOST_TEST(read_file(dir.file("a.log.gz")).size() < expect.size());
+	gzFile f = gzopen(dir.file("a.log.gz").c_str(), "rb");
+	std::string got(expect.size() + 10, '\0');
+	int const n = gzread(f, got.data(), unsigned(got.size()));
+	gzclose(f);
+	got.resize(std::size_t(std::max(n, 0)));
+	BOOST_TEST(got == expect);
+}
+
+BOOST_AUTO_TEST_CASE(too_many_sinks)
+{
+	tempdir dir;
+	log_writer w;
+	std::vector<int> sinks;
+	for (int i = 0; i < log_writer::max_sinks; ++i) {
+		sinks.push_back(w.add_sink(file_sink(dir.file(std::to_string(i)))));
+		BOOST_TEST(sinks.back() >= 0);
+	}
+	BOOST_TEST(w.add_sink(file_sink(dir.file("x"))) == -1);
+
+	// a closed sink can be reused
+	w.close_sink(sinks.front());
+	BOOST_TEST(w.add_sink(file_sink(dir.file("x"))) == sinks.front());
+}
+
+BOOST_AUTO_TEST_CASE(open_failure)
+{
+	log_writer w;
+	BOOST_TEST(w.add_sink(file_sink("/nonexistent/dir/a.log")) == -1);
+}
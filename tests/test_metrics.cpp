@@ -0,0 +1,83 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE metrics
+#include <boost/test/included/unit_test.hpp>
+
+#include "metrics.hpp"
+
+#include <stdexcept>
+#include <string>
+
+using namespace ltweb;
+
+BOOST_AUTO_TEST_CASE(register_and_update)
+{
+	metrics m;
+	BOOST_TEST(m.size() == 0);
+	int const a = m.register_metric("test.a", metric_type::counter);
+	int const b = m.register_metric("test.b", metric_type::gauge);
+	BOOST_TEST(a == 0);
+	BOOST_TEST(b == 1);
+	BOOST_TEST(m.size() == 2);
+
+	m.inc(a);
+	m.inc(a, 10);
+	m.set(b, 1234);
+	BOOST_TEST(m.value(a) == 11);
+	BOOST_TEST(m.value(b) == 1234);
+	m.set(b, -1);
+	BOOST_TEST(m.value(b) == -1);
+
+	auto const values = m.values();
+	BOOST_TEST(values.size() == 2);
+	BOOST_TEST(values[0] == 11);
+	BOOST_TEST(values[1] == -1);
+}
+
+BOOST_AUTO_TEST_CASE(register_twice)
+{
+	metrics m;
+	int const a = m.register_metric("test.a", metric_type::counter);
+	m.inc(a, 5);
+	int const a2 = m.register_metric("test.a", metric_type::counter);
+	BOOST_TEST(a == a2);
+	BOOST_TEST(m.size() == 1);
+	BOOST_TEST(m.value(a2) == 5);
+}
+
+BOOST_AUTO_TEST_CASE(list)
+{
+	metrics m;
+	m.register_metric("test.a", metric_type::counter);
+	m.register_metric("test.b", metric_type::gauge);
+	auto const l = m.list();
+	BOOST_TEST(l.size() == 2);
+	BOOST_TEST(l[0].name == "test.a");
+	BOOST_TEST((l[0].type == metric_type::counter));
+	BOOST_TEST(l[1].name == "test.b");
+	BOOST_TEST((l[1].type == metric_type::gauge));
+}
+
+BOOST_AUTO_TEST_CASE(full)
+{
+	metrics m;
+	for (int i = 0; i < metrics::max_metrics; ++i)
+		m.register_metric("test." + std::to_string(i), metric_type::counter);
+	BOOST_CHECK_THROW(m.register_metric("overflow", metric_type::counter), std::length_error);
+	// existing names can still be looked up
+	BOOST_TEST(m.register_metric("test.0", metric_type::counter) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(global)
+{
+	int const a = global_metrics().register_metric("test.global", metric_type::counter);
+	global_metrics().inc(a);
+	BOOST_TEST(global_metrics().value(a) == 1);
+}
@@ -0,0 +1,116 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE ordered_pipeline
+#include <boost/test/included/unit_test.hpp>
+
+#include "ordered_pipeline.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace ltweb;
+
+BOOST_AUTO_TEST_CASE(preserves_order)
+{
+	std::vector<int> out;
+	std::vector<std::size_t> batch_sizes;
+	{
+		ordered_pipeline<int, int> p(
+			4,
+			10,
+			3,
+			[](int& i) {
+				// make later items finish first, some of the time
+				if (i % 7 == 0) std::this_thread::sleep_for(std::chrono::microseconds(200));
+				return i * 2;
+			},
+			[&](std::vector<int>& batch) {
+				batch_sizes.push_back(batch.size());
+				out.insert(out.end(), batch.begin(), batch.end());
+			}
+		);
+		for (int i = 0; i < 1005; ++i)
+			p.push(i);
+		p.finish();
+	}
+
+	BOOST_TEST(out.size() == 1005);
+	for (int i = 0; i < int(out.size()); ++i)
+		BOOST_TEST(out[std::size_t(i)] == i * 2);
+
+	BOOST_TEST(batch_sizes.size() == 101);
+	BOOST_TEST(batch_sizes.front() == 10);
+	BOOST_TEST(batch_sizes.back() == 5);
+}
+
+BOOST_AUTO_TEST_CASE(bounded)
+{
+	// with a slow sink, the producer is held back
+	std::atomic<int> transformed{0};
+	std::atomic<int> delivered{0};
+	std::atomic<int> max_ahead{0};
+	ordered_pipeline<int, int> p(
+		2,
+		4,
+		2,
+		[&](int& i) {
+			++transformed;
+			return i;
+		},
+		[&](std::vector<int>& batch) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			delivered += int(batch.size());
+		}
+	);
+	for (int i = 0; i < 200; ++i) {
+		p.push(i);
+		max_ahead = std::max(max_ahead.load(), i + 1 - delivered.load());
+	}
+	p.finish();
+	BOOST_TEST(delivered == 200);
+	BOOST_TEST(transformed == 200);
+
+	// two batches in flight, one being delivered and one being filled
+	BOOST_TEST(max_ahead <= 4 * 4);
+}
+
+BOOST_AUTO_TEST_CASE(empty)
+{
+	int calls = 0;
+	ordered_pipeline<int, int> p(
+		3, 8, 2, [](int& i) { return i; }, [&](std::vector<int>&) { ++calls; }
+	);
+	p.finish();
+	BOOST_TEST(calls == 0);
+}
+
+BOOST_AUTO_TEST_CASE(move_only)
+{
+	std::vector<int> out;
+	{
+		ordered_pipeline<std::unique_ptr<int>, std::unique_ptr<int>> p(
+			2,
+			3,
+			2,
+			[](std::unique_ptr<int>& i) { return std::move(i); },
+			[&](std::vector<std::unique_ptr<int>>& batch) {
+				for (auto& i : batch)
+					out.push_back(*i);
+			}
+		);
+		for (int i = 0; i < 10; ++i)
+			p.push(std::make_unique<int>(i));
+		// the destructor delivers what's left
+	}
+	BOOST_TEST(out.size() == 10);
+	BOOST_TEST(out.back() == 9);
+}
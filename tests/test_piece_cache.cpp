@@ -0,0 +1,131 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE piece_cache
+#include <boost/test/included/unit_test.hpp>
+
+#include "piece_cache.hpp"
+
+using namespace ltweb;
+
+namespace {
+
+boost::shared_array<char> make_buffer(int const size)
+{
+	return boost::shared_array<char>(new char[size]);
+}
+
+lt::piece_index_t piece(int const idx) { return lt::piece_index_t(idx); }
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(empty)
+{
+	piece_cache c(1000);
+	lt::torrent_handle h;
+	BOOST_TEST(!bool(c.find(h, piece(0))));
+	BOOST_TEST(c.size() == 0);
+	BOOST_TEST(c.num_pieces() == 0);
+	BOOST_TEST(c.misses() == 1);
+	BOOST_TEST(c.hits() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(insert_find)
+{
+	piece_cache c(1000);
+	lt::torrent_handle h;
+	auto buf = make_buffer(100);
+	c.insert(h, piece(3), buf, 100);
+	BOOST_TEST(c.size() == 100);
+	BOOST_TEST(c.num_pieces() == 1);
+	BOOST_TEST(c.find(h, piece(3)).get() == buf.get());
+	BOOST_TEST(!bool(c.find(h, piece(4))));
+	BOOST_TEST(c.hits() == 1);
+	BOOST_TEST(c.misses() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(replace)
+{
+	piece_cache c(1000);
+	lt::torrent_handle h;
+	c.insert(h, piece(0), make_buffer(100), 100);
+	auto buf = make_buffer(200);
+	c.insert(h, piece(0), buf, 200);
+	BOOST_TEST(c.size() == 200);
+	BOOST_TEST(c.num_pieces() == 1);
+	BOOST_TEST(c.find(h, piece(0)).get() == buf.get());
+}
+
+BOOST_AUTO_TEST_CASE(evict_least_recently_used)
+{
+	piece_cache c(300);
+	lt::torrent_handle h;
+	c.insert(h, piece(0), make_buffer(100), 100);
+	c.insert(h, piece(1), make_buffer(100), 100);
+	c.insert(h, piece(2), make_buffer(100), 100);
+
+	// touch piece 0, making 1 the least recently used
+	BOOST_TEST(bool(c.find(h, piece(0))));
+
+	c.insert(h, piece(3), make_buffer(100), 100);
+	BOOST_TEST(c.size() == 300);
+	BOOST_TEST(bool(c.find(h, piece(0))));
+	BOOST_TEST(!bool(c.find(h, piece(1))));
+	BOOST_TEST(bool(c.find(h, piece(2))));
+	BOOST_TEST(bool(c.find(h, piece(3))));
+}
+
+BOOST_AUTO_TEST_CASE(evicted_buffer_stays_alive)
+{
+	piece_cache c(100);
+	lt::torrent_handle h;
+	c.insert(h, piece(0), make_buffer(100), 100);
+	auto held = c.find(h, piece(0));
+	c.insert(h, piece(1), make_buffer(100), 100);
+	BOOST_TEST(!bool(c.find(h, piece(0))));
+	BOOST_TEST(held.use_count() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(too_large)
+{
+	piece_cache c(100);
+	lt::torrent_handle h;
+	c.insert(h, piece(0), make_buffer(50), 50);
+	c.insert(h, piece(1), make_buffer(101), 101);
+	BOOST_TEST(!bool(c.find(h, piece(1))));
+	// the piece that didn't fit doesn't evict anything
+	BOOST_TEST(bool(c.find(h, piece(0))));
+}
+
+BOOST_AUTO_TEST_CASE(erase_torrent)
+{
+	piece_cache c(1000);
+	lt::torrent_handle h;
+	c.insert(h, piece(0), make_buffer(100), 100);
+	c.insert(h, piece(1), make_buffer(100), 100);
+	c.erase(h);
+	BOOST_TEST(c.size() == 0);
+	BOOST_TEST(c.num_pieces() == 0);
+	BOOST_TEST(!bool(c.find(h, piece(0))));
+}
+
+BOOST_AUTO_TEST_CASE(shrink)
+{
+	piece_cache c(1000);
+	lt::torrent_handle h;
+	for (int i = 0; i < 10; ++i)
+		c.insert(h, piece(i), make_buffer(100), 100);
+	BOOST_TEST(c.size() == 1000);
+	c.set_max_size(250);
+	BOOST_TEST(c.size() == 200);
+	// the most recently inserted pieces survive
+	BOOST_TEST(bool(c.find(h, piece(9))));
+	BOOST_TEST(bool(c.find(h, piece(8))));
+	BOOST_TEST(!bool(c.find(h, piece(7))));
+}
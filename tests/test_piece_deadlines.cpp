@@ -0,0 +1,198 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE piece_deadlines
+#include <boost/test/included/unit_test.hpp>
+
+#include "piece_deadlines.hpp"
+
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+using update = piece_deadlines::deadline_update;
+
+lt::piece_index_t const p0{0};
+lt::piece_index_t const p1{1};
+
+lt::time_point const t0 = lt::clock_type::now();
+lt::time_point const t1 = t0 + lt::seconds(1);
+lt::time_point const t2 = t0 + lt::seconds(2);
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(first_request_sets_deadline)
+{
+	piece_deadlines pd(100);
+	int const s = pd.add_stream();
+	std::vector<update> out;
+	pd.request(s, p0, t1, out);
+	BOOST_TEST(out.size() == 1);
+	BOOST_TEST((out[0].piece == p0));
+	BOOST_TEST(out[0].set);
+	BOOST_TEST((out[0].deadline == t1));
+	BOOST_TEST(pd.refcount(p0) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(later_deadline_keeps_earliest)
+{
+	piece_deadlines pd(100);
+	int const a = pd.add_stream();
+	int const b = pd.add_stream();
+	std::vector<update> out;
+	pd.request(a, p0, t1, out);
+	out.clear();
+	pd.request(b, p0, t2, out);
+	BOOST_TEST(out.empty());
+	BOOST_TEST(pd.refcount(p0) == 2);
+}
+
+BOOST_AUTO_TEST_CASE(earlier_deadline_replaces)
+{
+	piece_deadlines pd(100);
+	int const a = pd.add_stream();
+	int const b = pd.add_stream();
+	std::vector<update> out;
+	pd.request(a, p0, t2, out);
+	out.clear();
+	pd.request(b, p0, t1, out);
+	BOOST_TEST(out.size() == 1);
+	BOOST_TEST((out[0].deadline == t1));
+}
+
+BOOST_AUTO_TEST_CASE(release_resets_only_when_unreferenced)
+{
+	piece_deadlines pd(100);
+	int const a = pd.add_stream();
+	int const b = pd.add_stream();
+	std::vector<update> out;
+	pd.request(a, p0, t1, out);
+	pd.request(b, p0, t2, out);
+	out.clear();
+
+	// a had the earliest deadline. Releasing it relaxes the deadline to b's
+	pd.release(a, p0, out);
+	BOOST_TEST(out.size() == 1);
+	BOOST_TEST(out[0].set);
+	BOOST_TEST((out[0].deadline == t2));
+	out.clear();
+
+	// releasing twice is a no-op
+	pd.release(a, p0, out);
+	BOOST_TEST(out.empty());
+
+	pd.release(b, p0, out);
+	BOOST_TEST(out.size() == 1);
+	BOOST_TEST(!out[0].set);
+	BOOST_TEST(pd.refcount(p0) == 0);
+	BOOST_TEST(pd.num_pieces() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(release_later_deadline_no_update)
+{
+	piece_deadlines pd(100);
+	int const a = pd.add_stream();
+	int const b = pd.add_stream();
+	std::vector<update> out;
+	pd.request(a, p0, t1, out);
+	pd.request(b, p0, t2, out);
+	out.clear();
+	pd.release(b, p0, out);
+	BOOST_TEST(out.empty());
+	BOOST_TEST(pd.refcount(p0) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(remove_stream_releases_all)
+{
+	piece_deadlines pd(100);
+	int const a = pd.add_stream();
+	int const b = pd.add_stream();
+	std::vector<update> out;
+	pd.request(a, p0, t1, out);
+	pd.request(a, p1, t1, out);
+	pd.request(b, p1, t2, out);
+	out.clear();
+
+	pd.remove_stream(a, out);
+	BOOST_TEST(pd.num_streams() == 1);
+	BOOST_TEST(out.size() == 2);
+	// p0 had no other stream, so it's reset
+	BOOST_TEST((out[0].piece == p0));
+	BOOST_TEST(!out[0].set);
+	// p1 is still wanted by b
+	BOOST_TEST((out[1].piece == p1));
+	BOOST_TEST(out[1].set);
+	BOOST_TEST((out[1].deadline == t2));
+	BOOST_TEST(pd.refcount(p1) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(delivered_forgets_piece)
+{
+	piece_deadlines pd(100);
+	int const a = pd.add_stream();
+	int const b = pd.add_stream();
+	std::vector<update> out;
+	pd.request(a, p0, t1, out);
+	pd.delivered(p0);
+	BOOST_TEST(pd.refcount(p0) == 0);
+
+	// a stream asking for it again sets the deadline again
+	out.clear();
+	pd.request(b, p0, t2, out);
+	BOOST_TEST(out.size() == 1);
+	BOOST_TEST(out[0].set);
+
+	// a releasing its (already delivered) interest doesn't affect b
+	out.clear();
+	pd.release(a, p0, out);
+	BOOST_TEST(out.empty());
+	BOOST_TEST(pd.refcount(p0) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(window_within_budget)
+{
+	piece_deadlines pd(100);
+	int const a = pd.add_stream();
+	int const b = pd.add_stream();
+	BOOST_TEST(pd.window(a, 30) == 30);
+	BOOST_TEST(pd.window(b, 50) == 50);
+	BOOST_TEST(pd.window(a, 0) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(window_fair_share)
+{
+	piece_deadlines pd(100);
+	int const greedy = pd.add_stream();
+	int const modest = pd.add_stream();
+	int const other = pd.add_stream();
+	pd.window(modest, 10);
+	pd.window(other, 60);
+	// modest gets what it asks for, the other two split the remaining 90
+	BOOST_TEST(pd.window(greedy, 1000) == 45);
+	BOOST_TEST(pd.window(other, 60) == 45);
+	BOOST_TEST(pd.window(modest, 10) == 10);
+
+	// when the greedy stream goes away, the others get what they want
+	std::vector<update> out;
+	pd.remove_stream(greedy, out);
+	BOOST_TEST(pd.window(other, 60) == 60);
+}
+
+BOOST_AUTO_TEST_CASE(window_at_least_one)
+{
+	piece_deadlines pd(2);
+	int const a = pd.add_stream();
+	int const b = pd.add_stream();
+	int const c = pd.add_stream();
+	pd.window(a, 10);
+	pd.window(b, 10);
+	BOOST_TEST(pd.window(c, 10) == 1);
+}
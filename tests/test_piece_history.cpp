@@ -17,7 +17,6 @@ see LICENSE file.
 
 #include <cstring>
 #include <vector>
-#include <initializer_list>
 
 namespace {
 
@@ -35,7 +34,7 @@ lt::sha1_hash make_hash(unsigned char fill)
 struct fake_queue {
 	std::vector<lt::partial_piece_info> pieces;
 
-	void add(int idx, std::initializer_list<int> states)
+	void add(int idx, std::vector<int> const& states)
 	{
 		block_storage_.emplace_back();
 		auto& bs = block_storage_.back();
@@ -165,7 +164,7 @@ BOOST_AUTO_TEST_CASE(new_piece_sent_as_full_piece)
 	BOOST_TEST(r.block_updates.empty());
 	BOOST_TEST(r.removed.empty());
 
-	if (!r.full_pieces.empty()) BOOST_TEST((r.full_pieces[0]->piece_index == lt::piece_index_t(7)));
+	if (!r.full_pieces.empty()) BOOST_TEST((r.full_pieces[0].piece_index == lt::piece_index_t(7)));
 }
 
 // A piece that disappears after the client's last frame must appear in the
@@ -238,8 +237,8 @@ BOOST_AUTO_TEST_CASE(piece_reappears_after_removal)
 	// The re-added piece has added_frame > f1, so it must appear as a full
 	// piece update (client has no state for the new incarnation).
 	bool in_full = false;
-	for (auto const* e : r.full_pieces)
-		if (e->piece_index == lt::piece_index_t(2)) in_full = true;
+	for (auto const& e : r.full_pieces)
+		if (e.piece_index == lt::piece_index_t(2)) in_full = true;
 	BOOST_TEST(in_full);
 }
 
@@ -278,7 +277,7 @@ BOOST_AUTO_TEST_CASE(horizon_after_tombstone_eviction)
 	BOOST_TEST(r.is_snapshot);
 	BOOST_TEST(r.removed.empty());
 	BOOST_TEST(r.full_pieces.size() == 1u);
-	if (!r.full_pieces.empty()) BOOST_TEST((r.full_pieces[0]->piece_index == lt::piece_index_t(5)));
+	if (!r.full_pieces.empty()) BOOST_TEST((r.full_pieces[0].piece_index == lt::piece_index_t(5)));
 }
 
 // Before any eviction the horizon is 0 and deltas work normally.
@@ -300,3 +299,94 @@ BOOST_AUTO_TEST_CASE(horizon_zero_before_eviction)
 	BOOST_TEST(!r.is_snapshot);
 	BOOST_TEST(r.removed.size() == 1u);
 }
+
+// The block states are packed 32 to a word; pieces spanning several words
+// come back the way they went in.
+BOOST_AUTO_TEST_CASE(states_across_words)
+{
+	ltweb::piece_history ph(make_hash(0x11));
+
+	std::vector<int> states;
+	for (int i = 0; i < 70; ++i)
+		states.push_back(i % 4);
+	fake_queue q1;
+	q1.add(1, {3});
+	q1.add(4, states);
+
+	auto const f1 = ph.update(q1.pieces);
+	auto const r = ph.query(0);
+	BOOST_REQUIRE(r.full_pieces.size() == 2u);
+	BOOST_TEST(r.full_pieces[0].num_blocks == 1);
+	BOOST_TEST(r.full_pieces[0].state(0) == 3u);
+	BOOST_TEST(r.full_pieces[1].num_blocks == 70);
+	for (int i = 0; i < 70; ++i)
+		BOOST_TEST(r.full_pieces[1].state(i) == std::uint8_t(states[std::size_t(i)]));
+
+	// a change in the last word is found
+	states[65] = 0;
+	fake_queue q2;
+	q2.add(1, {3});
+	q2.add(4, states);
+	ph.update(q2.pieces);
+	auto const d = ph.query(f1);
+	BOOST_TEST(d.full_pieces.empty());
+	BOOST_REQUIRE(d.block_updates.size() == 1u);
+	BOOST_TEST((d.block_updates[0].piece_index == lt::piece_index_t(4)));
+	BOOST_TEST(d.block_updates[0].block_index == 65);
+	BOOST_TEST(d.block_updates[0].state == 0u);
+}
+
+// Only the blocks of the last change to a piece are known. A client that
+// missed earlier changes gets the whole piece.
+BOOST_AUTO_TEST_CASE(changed_twice_sends_full_piece)
+{
+	ltweb::piece_history ph(make_hash(0x11));
+
+	fake_queue q1, q2, q3;
+	q1.add(0, {0, 0, 0, 0});
+	q2.add(0, {1, 0, 0, 0});
+	q3.add(0, {1, 0, 0, 1});
+
+	auto const f1 = ph.update(q1.pieces);
+	auto const f2 = ph.update(q2.pieces);
+	ph.update(q3.pieces);
+	auto const f4 = ph.update(q3.pieces); // no change
+
+	auto const r1 = ph.query(f1);
+	BOOST_TEST(r1.full_pieces.size() == 1u);
+	BOOST_TEST(r1.block_updates.empty());
+
+	auto const r2 = ph.query(f2);
+	BOOST_TEST(r2.full_pieces.empty());
+	BOOST_REQUIRE(r2.block_updates.size() == 1u);
+	BOOST_TEST(r2.block_updates[0].block_index == 3);
+	BOOST_TEST(r2.block_updates[0].state == 1u);
+
+	auto const r4 = ph.query(f4);
+	BOOST_TEST(r4.full_pieces.empty());
+	BOOST_TEST(r4.block_updates.empty());
+}
+
+// hundreds of pieces in flight take well under a byte per block
+BOOST_AUTO_TEST_CASE(memory_used)
+{
+	ltweb::piece_history ph(make_hash(0x11));
+
+	int const num_pieces = 300;
+	int const blocks_per_piece = 256;
+	std::vector<lt::block_info> storage(std::size_t(num_pieces * blocks_per_piece));
+	for (auto& b : storage) {
+		std::memset(&b, 0, sizeof(b));
+		b.state = 2;
+	}
+	std::vector<lt::partial_piece_info> pieces(static_cast<std::size_t>(num_pieces));
+	for (int i = 0; i < num_pieces; ++i) {
+		auto& p = pieces[std::size_t(i)];
+		std::memset(&p, 0, sizeof(p));
+		p.piece_index = lt::piece_index_t(i);
+		p.blocks_in_piece = blocks_per_piece;
+		p.blocks = storage.data() + i * blocks_per_piece;
+	}
+	ph.update(pieces);
+	BOOST_TEST(ph.memory_used() < std::size_t(num_pieces * blocks_per_piece) / 2);
+}
@@ -271,3 +271,36 @@ BOOST_AUTO_TEST_CASE(explicit_max_queue_respected)
 	for (int i = 0; i < 10; ++i)
 		BOOST_TEST(snapshot_has(r, i));
 }
+
+// Completions missed while alerts were dropped are picked up from the live
+// bitfield, and delivered as a delta.
+BOOST_AUTO_TEST_CASE(reconcile_missed_completions)
+{
+	ltweb::piece_state_history ph(make_hash(0x11), make_bitfield(8, {0}));
+	ph.on_piece_finished(lt::piece_index_t{1});
+	ltweb::frame_t const f = ph.frame();
+
+	BOOST_TEST(ph.reconcile(make_bitfield(8, {0, 1, 4, 6})));
+	BOOST_TEST(ph.frame() == f + 2);
+
+	auto const r = ph.query(f);
+	BOOST_TEST(!r.is_snapshot);
+	BOOST_TEST(r.added.size() == 2);
+	BOOST_TEST(delta_has(r, 4));
+	BOOST_TEST(delta_has(r, 6));
+}
+
+// A piece the history has, but the torrent doesn't, can't be expressed as a
+// delta. The history is left alone, for the caller to discard.
+BOOST_AUTO_TEST_CASE(reconcile_regression)
+{
+	ltweb::piece_state_history ph(make_hash(0x11), make_bitfield(8, {0, 3}));
+	ltweb::frame_t const f = ph.frame();
+
+	BOOST_TEST(!ph.reconcile(make_bitfield(8, {0, 5})));
+	BOOST_TEST(!ph.reconcile(make_bitfield(16, {0, 3})));
+	BOOST_TEST(ph.frame() == f);
+	auto const r = ph.query(0);
+	BOOST_TEST(snapshot_has(r, 3));
+	BOOST_TEST(!snapshot_has(r, 5));
+}
@@ -0,0 +1,199 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE polled_cache
+#include <boost/test/included/unit_test.hpp>
+
+#include "polled_cache.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace ltweb;
+using namespace std::chrono_literals;
+
+namespace {
+
+// records the samples fed to it
+struct test_history {
+	explicit test_history(int const k)
+		: key(k)
+	{}
+	int info_hash() const { return key; }
+	std::size_t memory_used() const { return 10000; }
+	int key;
+	std::vector<std::uint32_t> samples;
+};
+
+// counts the samples taken, and returns the fields asked for
+struct test_sampler {
+	std::uint32_t operator()(std::uint32_t const fields)
+	{
+		++calls;
+		return fields;
+	}
+	std::atomic<int> calls{0};
+};
+
+void feed(test_history& h, std::uint32_t const s) { h.samples.push_back(s); }
+
+// returns the number of samples the history has been fed
+int get(polled_cache<test_history>& c, test_sampler& s, int const key, std::uint32_t fields = 1)
+{
+	return c.get(
+		key,
+		fields,
+		[&] { return test_history(key); },
+		[&](std::uint32_t const f) { return s(f); },
+		feed,
+		[](test_history const& h) { return int(h.samples.size()); }
+	);
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(once_per_interval)
+{
+	polled_cache<test_history> c("test", 1000000, 1h);
+	test_sampler s;
+	BOOST_TEST(get(c, s, 1) == 1);
+	BOOST_TEST(get(c, s, 1) == 1);
+	BOOST_TEST(get(c, s, 1) == 1);
+	BOOST_TEST(s.calls == 1);
+
+	// every torrent is sampled separately
+	BOOST_TEST(get(c, s, 2) == 1);
+	BOOST_TEST(s.calls == 2);
+}
+
+BOOST_AUTO_TEST_CASE(interval_passed)
+{
+	polled_cache<test_history> c("test", 1000000, 0ms);
+	test_sampler s;
+	BOOST_TEST(get(c, s, 1) == 1);
+	BOOST_TEST(get(c, s, 1) == 2);
+	BOOST_TEST(s.calls == 2);
+}
+
+BOOST_AUTO_TEST_CASE(fields)
+{
+	polled_cache<test_history> c("test", 1000000, 1h);
+	test_sampler s;
+	get(c, s, 1, 0x01);
+	// the second field isn't in the sample, so a new one is taken, with both
+	get(c, s, 1, 0x02);
+	BOOST_TEST(s.calls == 2);
+	get(c, s, 1, 0x01);
+	get(c, s, 1, 0x03);
+	BOOST_TEST(s.calls == 2);
+
+	std::vector<std::uint32_t> samples;
+	c.get(
+		1,
+		0,
+		[] { return test_history(1); },
+		[&](std::uint32_t const f) { return s(f); },
+		feed,
+		[&](test_history const& h) { samples = h.samples; }
+	);
+	BOOST_TEST(samples == (std::vector<std::uint32_t>{0x01, 0x03}));
+}
+
+BOOST_AUTO_TEST_CASE(coalesce)
+{
+	// without the interval, only the clients waiting for a sample share it
+	polled_cache<test_history> c("test", 1000000, 0ms);
+	std::atomic<int> calls{0};
+	std::promise<void> release;
+	std::shared_future<void> released = release.get_future().share();
+
+	auto client = [&] {
+		return c.get(
+			1,
+			1,
+			[] { return test_history(1); },
+			[&](std::uint32_t const f) {
+				++calls;
+				released.wait();
+				return f;
+			},
+			feed,
+			[](test_history const& h) { return int(h.samples.size()); }
+		);
+	};
+
+	std::vector<std::future<int>> clients;
+	clients.push_back(std::async(std::launch::async, client));
+	while (calls == 0)
+		std::this_thread::yield();
+	for (int i = 0; i < 4; ++i)
+		clients.push_back(std::async(std::launch::async, client));
+	std::this_thread::sleep_for(100ms);
+	release.set_value();
+
+	for (auto& f : clients)
+		BOOST_TEST(f.get() == 1);
+	BOOST_TEST(calls == 1);
+}
+
+BOOST_AUTO_TEST_CASE(evict)
+{
+	// room for two histories
+	polled_cache<test_history> c("test", 25000, 1h, false, 1);
+	test_sampler s;
+	get(c, s, 1);
+	get(c, s, 2);
+	get(c, s, 1);
+	get(c, s, 3);
+	BOOST_TEST(c.size() == 2);
+	BOOST_TEST(s.calls == 3);
+
+	// 2 was the least recently used
+	get(c, s, 1);
+	BOOST_TEST(s.calls == 3);
+	get(c, s, 2);
+	BOOST_TEST(s.calls == 4);
+}
+
+BOOST_AUTO_TEST_CASE(sample_throws)
+{
+	polled_cache<test_history> c("test", 1000000, 1h);
+	auto failing = [](std::uint32_t) -> std::uint32_t { throw std::runtime_error("failed"); };
+	auto const make = [] { return test_history(1); };
+	auto const fun = [](test_history const& h) { return int(h.samples.size()); };
+	BOOST_CHECK_THROW(c.get(1, 1, make, failing, feed, fun), std::runtime_error);
+
+	// the failed sample doesn't count, the next client takes a new one
+	test_sampler s;
+	BOOST_TEST(get(c, s, 1) == 1);
+	BOOST_TEST(s.calls == 1);
+}
+
+BOOST_AUTO_TEST_CASE(sample_metrics)
+{
+	polled_cache<test_history> c("metrics_test", 1000000, 1h);
+	int const samples = global_metrics().register_metric(
+		"detail.metrics_test.samples",
+		metric_type::counter
+	);
+	int const shared = global_metrics().register_metric(
+		"detail.metrics_test.shared",
+		metric_type::counter
+	);
+	test_sampler s;
+	get(c, s, 1);
+	get(c, s, 1);
+	get(c, s, 1);
+	BOOST_TEST(global_metrics().value(samples) == 1);
+	BOOST_TEST(global_metrics().value(shared) == 2);
+}
@@ -0,0 +1,143 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE read_ahead
+#include <boost/test/included/unit_test.hpp>
+
+#include "read_ahead.hpp"
+
+using namespace ltweb;
+
+namespace {
+
+constexpr int piece_size = 256 * 1024;
+constexpr std::int64_t mib = 1024 * 1024;
+
+// feed the read_ahead enough writes to establish a drain rate of
+// bytes_per_second, and to fully ramp up the window
+void drain(read_ahead& ra, std::int64_t const bytes_per_second, int const seconds = 20)
+{
+	for (int i = 0; i < seconds * 4; ++i)
+		ra.sent(bytes_per_second / 4, lt::milliseconds(250));
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(starts_small)
+{
+	read_ahead ra(piece_size);
+	BOOST_TEST(ra.drain_rate() == 0);
+	BOOST_TEST(ra.window_bytes() == 1 * mib);
+	BOOST_TEST(ra.window_pieces() == 4);
+}
+
+BOOST_AUTO_TEST_CASE(window_at_least_one_piece)
+{
+	read_ahead ra(16 * mib);
+	BOOST_TEST(ra.window_pieces() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(ramps_up_before_drain_rate_is_known)
+{
+	read_ahead ra(piece_size);
+	// a single short write is not enough for a drain rate sample
+	ra.sent(8 * mib, lt::milliseconds(100));
+	BOOST_TEST(ra.drain_rate() == 0);
+	// without a drain rate, the window is capped at 4 MiB
+	BOOST_TEST(ra.window_bytes() == 4 * mib);
+}
+
+BOOST_AUTO_TEST_CASE(drain_rate_excludes_idle_time)
+{
+	read_ahead ra(piece_size);
+	ra.sent(1 * mib, lt::milliseconds(500));
+	BOOST_TEST(ra.drain_rate() == 2 * mib);
+}
+
+BOOST_AUTO_TEST_CASE(window_follows_drain_rate)
+{
+	read_ahead ra(piece_size);
+	drain(ra, 1 * mib);
+	BOOST_TEST(ra.drain_rate() == 1 * mib);
+	// 8 seconds worth of data
+	BOOST_TEST(ra.window_bytes() == 8 * mib);
+	BOOST_TEST(ra.window_pieces() == 32);
+}
+
+BOOST_AUTO_TEST_CASE(window_is_bounded)
+{
+	read_ahead slow(piece_size);
+	drain(slow, 100 * 1024);
+	BOOST_TEST(slow.window_bytes() == 2 * mib);
+
+	read_ahead fast(piece_size);
+	drain(fast, 100 * mib, 2);
+	BOOST_TEST(fast.window_bytes() == 64 * mib);
+}
+
+BOOST_AUTO_TEST_CASE(slow_torrent_deepens_window)
+{
+	read_ahead ra(piece_size);
+	drain(ra, 1 * mib, 30);
+	ra.torrent_state(512 * 1024, 5.f);
+	BOOST_TEST(ra.window_bytes() == 16 * mib);
+
+	// capped at 3x
+	ra.torrent_state(1024, 5.f);
+	BOOST_TEST(ra.window_bytes() == 24 * mib);
+}
+
+BOOST_AUTO_TEST_CASE(fast_torrent_shrinks_window)
+{
+	read_ahead ra(piece_size);
+	drain(ra, 1 * mib);
+	ra.torrent_state(100 * mib, 5.f);
+	BOOST_TEST(ra.window_bytes() == 4 * mib);
+}
+
+BOOST_AUTO_TEST_CASE(scarce_pieces_deepen_window)
+{
+	read_ahead ra(piece_size);
+	drain(ra, 1 * mib);
+	ra.torrent_state(0, 0.5f);
+	BOOST_TEST(ra.window_bytes() == 16 * mib);
+	ra.torrent_state(0, 1.5f);
+	BOOST_TEST(ra.window_bytes() == 12 * mib);
+	// unknown
+	ra.torrent_state(0, -1.f);
+	BOOST_TEST(ra.window_bytes() == 8 * mib);
+}
+
+BOOST_AUTO_TEST_CASE(restart_keeps_drain_rate)
+{
+	read_ahead ra(piece_size);
+	drain(ra, 1 * mib);
+	ra.restart();
+	BOOST_TEST(ra.drain_rate() == 1 * mib);
+	BOOST_TEST(ra.window_bytes() == 1 * mib);
+
+	ra.sent(2 * mib, lt::milliseconds(100));
+	BOOST_TEST(ra.window_bytes() == 3 * mib);
+}
+
+BOOST_AUTO_TEST_CASE(deadline_by_arrival_time)
+{
+	read_ahead ra(piece_size);
+	// before we know the drain rate, we assume 4 MiB/s
+	BOOST_TEST(ra.deadline(0) == 1);
+	BOOST_TEST(ra.deadline(4 * mib) == 1000);
+
+	drain(ra, 1 * mib);
+	BOOST_TEST(ra.deadline(-100) == 1);
+	BOOST_TEST(ra.deadline(0) == 1);
+	BOOST_TEST(ra.deadline(mib / 2) == 500);
+	BOOST_TEST(ra.deadline(3 * mib) == 3000);
+	// capped at one minute
+	BOOST_TEST(ra.deadline(1000 * mib) == 60000);
+}
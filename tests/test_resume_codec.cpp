@@ -0,0 +1,85 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE resume_codec
+#include <boost/test/included/unit_test.hpp>
+
+#include "resume_codec.hpp"
+
+#include <string>
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+// looks like resume data: a dictionary with a large, mostly set, bitfield
+std::string resume_data()
+{
+	return "d11:total_uploadi1234e6:piecesi" + std::string(20000, '\x01') + "e";
+}
+
+std::string to_string(std::vector<char> const& v) { return std::string(v.begin(), v.end()); }
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+	std::string const resume = resume_data();
+	std::vector<char> const blob = compress_resume(resume);
+	BOOST_TEST(blob.size() < resume.size() / 10);
+	BOOST_TEST(blob[0] != 'd');
+
+	std::vector<char> out;
+	BOOST_TEST(decompress_resume({blob.data(), blob.size()}, out));
+	BOOST_TEST(to_string(out) == resume);
+}
+
+BOOST_AUTO_TEST_CASE(incompressible)
+{
+	// stored as-is when compression doesn't make it smaller
+	std::string const resume = "d1:ai1ee";
+	std::vector<char> const blob = compress_resume(resume);
+	BOOST_TEST(to_string(blob) == resume);
+
+	std::vector<char> out;
+	BOOST_TEST(decompress_resume({blob.data(), blob.size()}, out));
+	BOOST_TEST(to_string(out) == resume);
+}
+
+BOOST_AUTO_TEST_CASE(legacy_rows)
+{
+	// rows written before compression are plain bencoded dictionaries
+	std::string const resume = resume_data();
+	std::vector<char> out;
+	BOOST_TEST(decompress_resume(resume, out));
+	BOOST_TEST(to_string(out) == resume);
+
+	BOOST_TEST(decompress_resume("", out));
+	BOOST_TEST(out.empty());
+}
+
+BOOST_AUTO_TEST_CASE(corrupt)
+{
+	std::vector<char> blob = compress_resume(resume_data());
+	std::vector<char> out;
+
+	// truncated stream
+	BOOST_TEST(!decompress_resume({blob.data(), blob.size() - 4}, out));
+
+	// wrong uncompressed size
+	std::vector<char> wrong_size = blob;
+	wrong_size[7] = char(wrong_size[7] + 1);
+	BOOST_TEST(!decompress_resume({wrong_size.data(), wrong_size.size()}, out));
+
+	// unreasonably large
+	std::vector<char> huge = blob;
+	huge[4] = char(0x7f);
+	BOOST_TEST(!decompress_resume({huge.data(), huge.size()}, out));
+}
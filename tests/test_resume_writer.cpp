@@ -0,0 +1,220 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE resume_writer
+#include <boost/test/included/unit_test.hpp>
+
+#include "resume_writer.hpp"
+#include "resume_codec.hpp"
+
+#include <sqlite3.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+using namespace ltweb;
+
+namespace {
+
+// RAII database file with the TORRENTS and METADATA tables, removed (along
+// with its WAL files) on destruction
+struct tempdb {
+	tempdb()
+	{
+		path = (std::filesystem::temp_directory_path()
+			/ ("ltweb_resume_writer_test_" + std::to_string(std::rand()) + ".sqlite"))
+				   .string();
+		sqlite3* db = nullptr;
+		sqlite3_open(path.c_str(), &db);
+		sqlite3_exec(
+			db,
+			"CREATE TABLE TORRENTS("
+			"INFOHASH STRING PRIMARY KEY NOT NULL,"
+			"RESUME BLOB NOT NULL,"
+			"QUEUE_POSITION INTEGER,"
+			"TAG INTEGER);"
+			"CREATE TABLE METADATA("
+			"INFOHASH STRING PRIMARY KEY NOT NULL,"
+			"INFO BLOB NOT NULL);",
+			nullptr,
+			nullptr,
+			nullptr
+		);
+		sqlite3_close(db);
+	}
+	~tempdb()
+	{
+		std::error_code ec;
+		for (char const* suffix : {"", "-wal", "-shm"})
+			std::filesystem::remove(path + suffix, ec);
+	}
+
+	// runs a query returning a single blob
+	std::vector<char> query_blob(char const* sql) const
+	{
+		sqlite3* db = nullptr;
+		sqlite3_open(path.c_str(), &db);
+		sqlite3_stmt* stmt = nullptr;
+		sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+		std::vector<char> ret;
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			char const* b = static_cast<char const*>(sqlite3_column_blob(stmt, 0));
+			ret.assign(b, b + sqlite3_column_bytes(stmt, 0));
+		}
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		return ret;
+	}
+
+	// runs a query returning a single integer
+	std::int64_t query(char const* sql) const
+	{
+		sqlite3* db = nullptr;
+		sqlite3_open(path.c_str(), &db);
+		sqlite3_stmt* stmt = nullptr;
+		sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+		std::int64_t ret = -1;
+		if (sqlite3_step(stmt) == SQLITE_ROW) ret = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		return ret;
+	}
+
+	std::string path;
+};
+
+std::string key(int const i)
+{
+	std::string ret = std::to_string(i);
+	return std::string(40 - ret.size(), '0') + ret;
+}
+
+std::vector<char> blob(std::size_t const size) { return std::vector<char>(size, 'x'); }
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(save_and_flush)
+{
+	tempdb db;
+	resume_writer w(db.path);
+	w.save(key(1), blob(100), 3, 0x1234);
+	w.flush();
+	BOOST_TEST(w.queue_size() == 0);
+
+	BOOST_TEST(db.query("SELECT COUNT(*) FROM TORRENTS;") == 1);
+	BOOST_TEST(db.query("SELECT LENGTH(RESUME) FROM TORRENTS;") == 100);
+	BOOST_TEST(db.query("SELECT QUEUE_POSITION FROM TORRENTS;") == 3);
+	BOOST_TEST(db.query("SELECT TAG FROM TORRENTS;") == 0x1234);
+}
+
+BOOST_AUTO_TEST_CASE(wal_mode)
+{
+	tempdb db;
+	resume_writer w(db.path);
+
+	sqlite3* conn = nullptr;
+	sqlite3_open(db.path.c_str(), &conn);
+	sqlite3_stmt* stmt = nullptr;
+	sqlite3_prepare_v2(conn, "PRAGMA journal_mode;", -1, &stmt, nullptr);
+	BOOST_TEST(sqlite3_step(stmt) == SQLITE_ROW);
+	BOOST_TEST(
+		std::string(reinterpret_cast<char const*>(sqlite3_column_text(stmt, 0))) == "wal"
+	);
+	sqlite3_finalize(stmt);
+	sqlite3_close(conn);
+}
+
+BOOST_AUTO_TEST_CASE(queue_position_and_remove)
+{
+	tempdb db;
+	resume_writer w(db.path);
+	w.save(key(1), blob(10), 3, 0);
+	w.save(key(2), blob(10), 4, 0);
+	w.set_queue_position(key(1), 7);
+	w.remove(key(2));
+	w.flush();
+
+	BOOST_TEST(db.query("SELECT COUNT(*) FROM TORRENTS;") == 1);
+	BOOST_TEST(db.query("SELECT QUEUE_POSITION FROM TORRENTS;") == 7);
+}
+
+BOOST_AUTO_TEST_CASE(writes_are_ordered)
+{
+	tempdb db;
+	resume_writer w(db.path, 4);
+
+	// a save after a remove of the same torrent must win, even when they
+	// end up in different transactions
+	for (int i = 0; i < 10; ++i) {
+		w.save(key(1), blob(std::size_t(i + 1)), i, 0);
+		w.remove(key(1));
+	}
+	w.save(key(1), blob(42), 0, 0);
+	w.flush();
+	BOOST_TEST(db.query("SELECT LENGTH(RESUME) FROM TORRENTS;") == 42);
+}
+
+BOOST_AUTO_TEST_CASE(destructor_drains_queue)
+{
+	tempdb db;
+	{
+		// the delay is long enough that nothing would be written before the
+		// destructor, unless it drains the queue
+		resume_writer w(db.path, 1000, std::chrono::milliseconds(60000));
+		for (int i = 0; i < 2500; ++i)
+			w.save(key(i), blob(50), i, 0);
+	}
+	BOOST_TEST(db.query("SELECT COUNT(*) FROM TORRENTS;") == 2500);
+}
+
+BOOST_AUTO_TEST_CASE(metadata_written_once)
+{
+	tempdb db;
+	resume_writer w(db.path);
+	w.save_metadata(key(1), blob(1000));
+	w.save(key(1), blob(10), 0, 0);
+	// a second save of the metadata doesn't rewrite it
+	w.save_metadata(key(1), std::vector<char>(500, 'y'));
+	w.flush();
+
+	BOOST_TEST(db.query("SELECT COUNT(*) FROM METADATA;") == 1);
+	BOOST_TEST(db.query("SELECT LENGTH(INFO) FROM METADATA;") == 1000);
+
+	// removing the torrent removes its metadata as well
+	w.remove(key(1));
+	w.flush();
+	BOOST_TEST(db.query("SELECT COUNT(*) FROM METADATA;") == 0);
+	BOOST_TEST(db.query("SELECT COUNT(*) FROM TORRENTS;") == 0);
+}
+
+BOOST_AUTO_TEST_CASE(compressed)
+{
+	tempdb db;
+	resume_writer w(db.path, 256, std::chrono::milliseconds(500), true);
+	w.save(key(1), blob(10000), 0, 0);
+	w.flush();
+
+	std::vector<char> const stored = db.query_blob("SELECT RESUME FROM TORRENTS;");
+	BOOST_TEST(stored.size() < 1000);
+
+	std::vector<char> resume;
+	BOOST_TEST(decompress_resume({stored.data(), stored.size()}, resume));
+	BOOST_TEST((resume == blob(10000)));
+}
+
+BOOST_AUTO_TEST_CASE(missing_database)
+{
+	// writes to a database that can't be opened are dropped, but flush()
+	// still returns
+	resume_writer w("/nonexistent-directory/resume.sqlite");
+	w.save(key(1), blob(10), 0, 0);
+	w.flush();
+	BOOST_TEST(w.queue_size() == 0);
+}
@@ -0,0 +1,251 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE stats_codec
+#include <boost/test/included/unit_test.hpp>
+
+#include "stats_codec.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+using namespace ltweb;
+
+namespace {
+
+std::vector<std::string> const names = {"net.sent_bytes", "", "peer.num_peers"};
+
+// a log with two blocks of 3 and 2 samples. If with_index is false, the
+// log is left as if it wasn't closed
+std::string make_log(std::vector<stats_sample> const& samples, bool const with_index)
+{
+	std::vector<char> log = encode_stats_header(1700000000000000, names);
+	std::vector<stats_block_info> blocks;
+	stats_block_encoder enc(names.size());
+	for (std::size_t i = 0; i < samples.size(); ++i) {
+		enc.add(samples[i].timestamp, samples[i].values);
+		if (enc.num_samples() == 3 || i == samples.size() - 1) {
+			blocks.push_back(
+				{enc.first_timestamp(), std::uint64_t(log.size()), std::uint32_t(enc.num_samples())}
+			);
+			std::vector<char> const b = enc.finish();
+			log.insert(log.end(), b.begin(), b.end());
+		}
+	}
+	if (with_index) {
+		std::vector<char> const index = encode_stats_index(blocks, log.size());
+		log.insert(log.end(), index.begin(), index.end());
+	}
+	return {log.begin(), log.end()};
+}
+
+std::vector<stats_sample> test_samples()
+{
+	std::int64_t const max = std::numeric_limits<std::int64_t>::max();
+	std::int64_t const min = std::numeric_limits<std::int64_t>::min();
+	return {
+		{0, {100, 0, 5}},
+		{1000000, {200, 0, 3}},
+		{2000000, {200, 0, -7}},
+		{3000000, {max, 0, min}},
+		{4000001, {min, 0, max}},
+	};
+}
+
+std::vector<stats_sample> read_all(stats_log_reader const& r)
+{
+	std::vector<stats_sample> ret;
+	for (std::size_t i = 0; i < r.blocks().size(); ++i)
+		BOOST_TEST(r.read_block(i, ret));
+	return ret;
+}
+
+void check_equal(std::vector<stats_sample> const& lhs, std::vector<stats_sample> const& rhs)
+{
+	BOOST_TEST(lhs.size() == rhs.size());
+	for (std::size_t i = 0; i < std::min(lhs.size(), rhs.size()); ++i) {
+		BOOST_TEST(lhs[i].timestamp == rhs[i].timestamp);
+		BOOST_TEST(lhs[i].values == rhs[i].values);
+	}
+}
+
+void set_u32(std::string& buf, std::size_t const offset, std::uint32_t const v)
+{
+	for (int i = 0; i < 4; ++i)
+		buf[offset + std::size_t(i)] = char((v >> (i * 8)) & 0xff);
+}
+
+// recomputes the CRC of the block at offset, over its payload size, number
+// of samples and payload, after the header was modified
+void update_block_crc(std::string& log, std::size_t const offset)
+{
+	auto const* p = reinterpret_cast<Bytef const*>(log.data() + offset);
+	uInt const size = uInt(std::uint8_t(p[4])) | uInt(std::uint8_t(p[5])) << 8
+		| uInt(std::uint8_t(p[6])) << 16 | uInt(std::uint8_t(p[7])) << 24;
+	uLong const header = crc32(crc32(0, nullptr, 0), p + 4, 8);
+	set_u32(log, offset + 12, std::uint32_t(crc32(header, p + 16, size)));
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+	std::string const log = make_log(test_samples(), true);
+	stats_log_reader r;
+	BOOST_TEST(r.parse(log));
+	BOOST_TEST(r.start_time() == 1700000000000000);
+	BOOST_TEST(r.metrics() == names);
+	BOOST_TEST(r.blocks().size() == 2);
+	BOOST_TEST(r.blocks()[1].first_timestamp == 3000000);
+	BOOST_TEST(r.blocks()[1].num_samples == 2);
+	check_equal(read_all(r), test_samples());
+}
+
+BOOST_AUTO_TEST_CASE(short_and_long_samples)
+{
+	// missing values are recorded as 0, extra values are dropped
+	std::vector<char> log = encode_stats_header(0, names);
+	stats_block_encoder enc(names.size());
+	std::vector<std::int64_t> const short_sample = {1};
+	std::vector<std::int64_t> const long_sample = {1, 2, 3, 4};
+	enc.add(0, short_sample);
+	enc.add(1, long_sample);
+	std::vector<char> const b = enc.finish();
+	log.insert(log.end(), b.begin(), b.end());
+
+	stats_log_reader r;
+	BOOST_TEST(r.parse({log.data(), log.size()}));
+	check_equal(read_all(r), {{0, {1, 0, 0}}, {1, {1, 2, 3}}});
+}
+
+BOOST_AUTO_TEST_CASE(no_index)
+{
+	// a log that wasn't closed is read by scanning the blocks
+	std::string const log = make_log(test_samples(), false);
+	stats_log_reader r;
+	BOOST_TEST(r.parse(log));
+	BOOST_TEST(r.blocks().size() == 2);
+	BOOST_TEST(r.blocks()[0].first_timestamp == 0);
+	BOOST_TEST(r.blocks()[1].first_timestamp == 3000000);
+	check_equal(read_all(r), test_samples());
+}
+
+BOOST_AUTO_TEST_CASE(truncated)
+{
+	// the last block is cut short, the first one can still be read
+	std::string log = make_log(test_samples(), false);
+	log.resize(log.size() - 3);
+	stats_log_reader r;
+	BOOST_TEST(r.parse(log));
+	BOOST_TEST(r.blocks().size() == 1);
+
+	std::vector<stats_sample> const all = test_samples();
+	check_equal(read_all(r), {all.begin(), all.begin() + 3});
+}
+
+BOOST_AUTO_TEST_CASE(corrupt_block)
+{
+	std::string log = make_log(test_samples(), true);
+	stats_log_reader r;
+	BOOST_TEST(r.parse(log));
+
+	// flip a bit in the payload of the second block
+	log[std::size_t(r.blocks()[1].offset) + 20] ^= 1;
+	BOOST_TEST(r.parse(log));
+	std::vector<stats_sample> out;
+	BOOST_TEST(r.read_block(0, out));
+	BOOST_TEST(!r.read_block(1, out));
+	BOOST_TEST(out.size() == 3);
+}
+
+BOOST_AUTO_TEST_CASE(corrupt_block_header)
+{
+	std::string log = make_log(test_samples(), true);
+	stats_log_reader r;
+	BOOST_TEST(r.parse(log));
+
+	// the number of samples of the second block is covered by its CRC
+	set_u32(log, std::size_t(r.blocks()[1].offset) + 8, 100000);
+	BOOST_TEST(r.parse(log));
+	std::vector<stats_sample> out;
+	BOOST_TEST(r.read_block(0, out));
+	BOOST_TEST(!r.read_block(1, out));
+	BOOST_TEST(out.size() == 3);
+}
+
+BOOST_AUTO_TEST_CASE(too_many_values)
+{
+	// a block whose header is intact as far as the CRC can tell, but claims
+	// more samples than it holds. It isn't trusted to allocate gigabytes
+	std::vector<std::string> const many(4096, "metric");
+	std::vector<char> buf = encode_stats_header(0, many);
+	stats_block_encoder enc(many.size());
+	enc.add(0, {});
+	std::vector<char> const b = enc.finish();
+	std::size_t const offset = buf.size();
+	buf.insert(buf.end(), b.begin(), b.end());
+
+	std::string log(buf.begin(), buf.end());
+	set_u32(log, offset + 8, stats_log_reader::max_block_samples);
+	update_block_crc(log, offset);
+	stats_log_reader r;
+	BOOST_TEST(r.parse(log));
+	std::vector<stats_sample> out;
+	BOOST_TEST(!r.read_block(0, out));
+	BOOST_TEST(out.empty());
+}
+
+BOOST_AUTO_TEST_CASE(not_a_log)
+{
+	stats_log_reader r;
+	BOOST_TEST(!r.parse("second:net.sent_bytes\n\n0.000000\t1\n"));
+	BOOST_TEST(!r.parse(""));
+
+	// a header claiming a name longer than the file
+	std::vector<char> log = encode_stats_header(0, names);
+	log.resize(log.size() - 2);
+	BOOST_TEST(!r.parse({log.data(), log.size()}));
+}
+
+BOOST_AUTO_TEST_CASE(constant_counters_are_small)
+{
+	// a minute of samples of 1000 counters, of which only a few change. The
+	// unchanged ones cost a few bytes per block, not per sample
+	std::size_t const num_metrics = 1000;
+	stats_block_encoder enc(num_metrics);
+	std::vector<std::int64_t> values(num_metrics, 123456789);
+	for (int s = 0; s < 60; ++s) {
+		for (std::size_t m = 0; m < 10; ++m)
+			values[m] += 1000 + s;
+		enc.add(s * 1000000, values);
+	}
+	std::vector<char> const b = enc.finish();
+	BOOST_TEST(b.size() < num_metrics * 8);
+}
+
+BOOST_AUTO_TEST_CASE(block_info)
+{
+	stats_block_encoder enc(names.size());
+	for (auto const& s : test_samples())
+		enc.add(s.timestamp + 500, s.values);
+	std::vector<char> const b = enc.finish();
+
+	stats_block_info info;
+	BOOST_TEST(read_stats_block_info({b.data(), b.size()}, info));
+	BOOST_TEST(info.first_timestamp == 500);
+	BOOST_TEST(info.num_samples == 5);
+	BOOST_TEST(info.offset == 0);
+
+	BOOST_TEST(!read_stats_block_info({b.data(), b.size() - 1}, info));
+	BOOST_TEST(!read_stats_block_info("LTSS", info));
+}
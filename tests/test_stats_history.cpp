@@ -0,0 +1,129 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE stats_history
+#include <boost/test/included/unit_test.hpp>
+
+#include "stats_history.hpp"
+
+#include <cstdint>
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+// 10 samples at 1 second and 5 at 10 seconds
+std::array<stats_history::resolution, 2> const small_resolutions = {{
+	{1000, 10},
+	{10000, 5},
+}};
+
+std::vector<std::int64_t> sample(std::int64_t const a, std::int64_t const b) { return {a, b}; }
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(empty)
+{
+	stats_history h(2, small_resolutions);
+	std::vector<int> const counters = {0, 1};
+	auto const r = h.query(0, 0, 1000000, counters);
+	BOOST_TEST(r.timestamps.empty());
+	BOOST_TEST(r.values.empty());
+}
+
+BOOST_AUTO_TEST_CASE(query_range)
+{
+	stats_history h(2, small_resolutions);
+	for (int i = 0; i < 5; ++i)
+		h.add(i * 1000 + 100, sample(i, i * 10));
+
+	std::vector<int> const counters = {1};
+	auto const r = h.query(0, 1000, 3500, counters);
+	BOOST_TEST(r.timestamps == (std::vector<std::int64_t>{1100, 2100, 3100}));
+	BOOST_TEST(r.values == (std::vector<std::int64_t>{10, 20, 30}));
+}
+
+BOOST_AUTO_TEST_CASE(counter_selection)
+{
+	stats_history h(2, small_resolutions);
+	h.add(1000, sample(1, 2));
+
+	// counters are returned in the order requested, and may repeat
+	std::vector<int> const counters = {1, 0, 1};
+	auto const r = h.query(0, 0, 2000, counters);
+	BOOST_TEST(r.values == (std::vector<std::int64_t>{2, 1, 2}));
+}
+
+BOOST_AUTO_TEST_CASE(ring_wraps)
+{
+	stats_history h(2, small_resolutions);
+	for (int i = 0; i < 25; ++i)
+		h.add(i * 1000, sample(i, 0));
+
+	// only the last 10 seconds are kept at full resolution
+	std::vector<int> const counters = {0};
+	auto const r = h.query(0, 0, 100000, counters);
+	BOOST_TEST(r.timestamps.size() == 10);
+	BOOST_TEST(r.timestamps.front() == 15000);
+	BOOST_TEST(r.values.front() == 15);
+	BOOST_TEST(r.values.back() == 24);
+}
+
+BOOST_AUTO_TEST_CASE(downsampled)
+{
+	stats_history h(2, small_resolutions);
+	for (int i = 0; i < 25; ++i)
+		h.add(i * 1000, sample(i, 0));
+
+	// the coarse resolution keeps the last sample of each interval
+	std::vector<int> const counters = {0};
+	auto const r = h.query(1, 0, 100000, counters);
+	BOOST_TEST(r.timestamps == (std::vector<std::int64_t>{9000, 19000, 24000}));
+	BOOST_TEST(r.values == (std::vector<std::int64_t>{9, 19, 24}));
+}
+
+BOOST_AUTO_TEST_CASE(gaps)
+{
+	stats_history h(2, small_resolutions);
+	h.add(1000, sample(1, 0));
+	h.add(5000, sample(5, 0));
+
+	// intervals without samples are missing, rather than repeating a
+	// stale value from a previous lap of the ring
+	std::vector<int> const counters = {0};
+	auto const r = h.query(0, 0, 10000, counters);
+	BOOST_TEST(r.timestamps == (std::vector<std::int64_t>{1000, 5000}));
+
+	h.add(12000, sample(12, 0));
+	auto const r2 = h.query(0, 0, 20000, counters);
+	BOOST_TEST(r2.timestamps == (std::vector<std::int64_t>{5000, 12000}));
+}
+
+BOOST_AUTO_TEST_CASE(short_sample)
+{
+	stats_history h(2, small_resolutions);
+	h.add(1000, sample(1, 2));
+	std::vector<std::int64_t> const short_sample = {3};
+	h.add(1500, short_sample);
+
+	std::vector<int> const counters = {0, 1};
+	auto const r = h.query(0, 0, 2000, counters);
+	BOOST_TEST(r.values == (std::vector<std::int64_t>{3, 0}));
+}
+
+BOOST_AUTO_TEST_CASE(invalid_resolution)
+{
+	stats_history h(2, small_resolutions);
+	h.add(1000, sample(1, 2));
+	std::vector<int> const counters = {0};
+	BOOST_TEST(h.query(2, 0, 2000, counters).timestamps.empty());
+	BOOST_TEST(h.query(-1, 0, 2000, counters).timestamps.empty());
+	BOOST_TEST(h.query(0, 2000, 0, counters).timestamps.empty());
+}
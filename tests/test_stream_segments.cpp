@@ -0,0 +1,94 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE stream_segments
+#include <boost/test/included/unit_test.hpp>
+
+#include "stream_segments.hpp"
+
+#include <string>
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+// render the segments as a string, where source bytes are represented by
+// lower case letters derived from the source and offset
+std::string render(std::vector<stream_segment> const& segments)
+{
+	std::string ret;
+	for (auto const& s : segments) {
+		ret += s.prefix;
+		for (std::int64_t i = 0; i < s.length; ++i)
+			ret += char('a' + (s.source * 7 + s.offset + i) % 26);
+	}
+	return ret;
+}
+
+std::vector<stream_segment> sample()
+{
+	return {
+		{"HDR1", 0, 0, 10},
+		{"", 1, 5, 3},
+		{"HDR2", 2, 0, 0},
+		{"TRAILER", -1, 0, 0},
+	};
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(size)
+{
+	BOOST_TEST(segments_size({}) == 0);
+	BOOST_TEST(segments_size(sample()) == 4 + 10 + 3 + 4 + 7);
+}
+
+BOOST_AUTO_TEST_CASE(trim_everything)
+{
+	auto s = sample();
+	std::string const full = render(s);
+	trim_segments(s, 0, std::int64_t(full.size()) - 1);
+	BOOST_TEST(render(s) == full);
+	BOOST_TEST(s.size() == 4);
+}
+
+BOOST_AUTO_TEST_CASE(trim_every_range)
+{
+	std::string const full = render(sample());
+	std::int64_t const size = std::int64_t(full.size());
+	for (std::int64_t first = 0; first < size; ++first) {
+		for (std::int64_t last = first; last < size; ++last) {
+			auto s = sample();
+			trim_segments(s, first, last);
+			BOOST_TEST(render(s) == full.substr(std::size_t(first), std::size_t(last - first + 1)));
+			BOOST_TEST(segments_size(s) == last - first + 1);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(trim_within_source)
+{
+	auto s = sample();
+	trim_segments(s, 6, 8);
+	BOOST_TEST(s.size() == 1);
+	BOOST_TEST(s[0].prefix.empty());
+	BOOST_TEST(s[0].source == 0);
+	BOOST_TEST(s[0].offset == 2);
+	BOOST_TEST(s[0].length == 3);
+}
+
+BOOST_AUTO_TEST_CASE(trim_within_prefix)
+{
+	auto s = sample();
+	trim_segments(s, 1, 2);
+	BOOST_TEST(s.size() == 1);
+	BOOST_TEST(s[0].prefix == "DR");
+	BOOST_TEST(s[0].length == 0);
+}
@@ -0,0 +1,132 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE tar_archive
+#include <boost/test/included/unit_test.hpp>
+
+#include "tar_archive.hpp"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+std::int64_t octal_field(std::string const& block, std::size_t const offset, std::size_t const len)
+{
+	return std::strtoll(block.substr(offset, len).c_str(), nullptr, 8);
+}
+
+bool valid_checksum(std::string block)
+{
+	std::int64_t const expected = octal_field(block, 148, 8);
+	block.replace(148, 8, 8, ' ');
+	std::int64_t sum = 0;
+	for (char const c : block)
+		sum += static_cast<unsigned char>(c);
+	return sum == expected;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(ustar_header)
+{
+	std::string const h = tar_header({"dir/file.txt", 1234, 1700000000});
+	BOOST_TEST(h.size() == 512);
+	BOOST_TEST(h.substr(0, 13) == std::string("dir/file.txt\0", 13));
+	BOOST_TEST(octal_field(h, 124, 12) == 1234);
+	BOOST_TEST(octal_field(h, 136, 12) == 1700000000);
+	BOOST_TEST(h[156] == '0');
+	BOOST_TEST(h.substr(257, 6) == std::string("ustar\0", 6));
+	BOOST_TEST(h.substr(263, 2) == "00");
+	BOOST_TEST(valid_checksum(h));
+}
+
+BOOST_AUTO_TEST_CASE(long_name)
+{
+	std::string const name = "dir/" + std::string(200, 'x');
+	std::string const h = tar_header({name, 10, 0});
+	// pax header block, one block of records, then the ustar header
+	BOOST_TEST(h.size() == 3 * 512);
+	BOOST_TEST(h[156] == 'x');
+	BOOST_TEST(valid_checksum(h.substr(0, 512)));
+
+	std::int64_t const records_size = octal_field(h, 124, 12);
+	std::string const records = h.substr(512, std::size_t(records_size));
+	std::string const expected = "path=" + name + "\n";
+	BOOST_TEST(records.substr(records.size() - expected.size()) == expected);
+	// the length prefix covers the whole record
+	BOOST_TEST(std::atoi(records.c_str()) == records_size);
+
+	std::string const ustar = h.substr(1024);
+	BOOST_TEST(ustar[156] == '0');
+	BOOST_TEST(ustar.substr(0, 100) == name.substr(0, 100));
+	BOOST_TEST(valid_checksum(ustar));
+}
+
+BOOST_AUTO_TEST_CASE(large_file)
+{
+	std::int64_t const size = 10LL * 1024 * 1024 * 1024;
+	std::string const h = tar_header({"big.bin", size, 0});
+	BOOST_TEST(h.size() == 3 * 512);
+	BOOST_TEST(h[156] == 'x');
+	std::string const records = h.substr(512, std::size_t(octal_field(h, 124, 12)));
+	BOOST_TEST(records == "20 size=10737418240\n");
+}
+
+BOOST_AUTO_TEST_CASE(pax_record_length)
+{
+	// a record whose length crosses a power of ten when its own length
+	// prefix is included
+	std::string const name = std::string(101, 'y');
+	std::string const h = tar_header({name, 0, 0});
+	std::string const records = h.substr(512, std::size_t(octal_field(h, 124, 12)));
+	BOOST_TEST(std::atoi(records.c_str()) == int(records.size()));
+}
+
+BOOST_AUTO_TEST_CASE(segments)
+{
+	std::vector<archive_member> const members = {
+		{"a", 5, 0},
+		{"b", 512, 0},
+		{"c", 0, 0},
+	};
+	auto const s = tar_segments(members);
+	BOOST_TEST(s.size() == 4);
+
+	BOOST_TEST(s[0].prefix.size() == 512);
+	BOOST_TEST(s[0].source == 0);
+	BOOST_TEST(s[0].length == 5);
+
+	// the padding after a
+	BOOST_TEST(s[1].prefix.size() == 507 + 512);
+	BOOST_TEST(s[1].prefix.substr(0, 507) == std::string(507, '\0'));
+	BOOST_TEST(s[1].source == 1);
+	BOOST_TEST(s[1].length == 512);
+
+	// b is a multiple of the block size, no padding
+	BOOST_TEST(s[2].prefix.size() == 512);
+	BOOST_TEST(s[2].source == 2);
+	BOOST_TEST(s[2].length == 0);
+
+	BOOST_TEST(s[3].prefix == std::string(1024, '\0'));
+	BOOST_TEST(s[3].source == -1);
+	BOOST_TEST(s[3].length == 0);
+
+	BOOST_TEST(segments_size(s) == 512 * 7);
+}
+
+BOOST_AUTO_TEST_CASE(empty_archive)
+{
+	auto const s = tar_segments({});
+	BOOST_TEST(s.size() == 1);
+	BOOST_TEST(segments_size(s) == 1024);
+}
@@ -39,6 +39,19 @@ void wait_for(lt::session& ses, ltweb::alert_handler& handler, int n, int const
 	}
 }
 
+// Pops alerts without dispatching them, as if the session had dropped them,
+// until `n` alerts of the given `type` have been lost.
+void drop(lt::session& ses, int n, int const type)
+{
+	while (n > 0) {
+		ses.wait_for_alert(std::chrono::seconds(10));
+		std::vector<lt::alert*> alerts;
+		ses.pop_alerts(&alerts);
+		for (auto const* a : alerts)
+			if (a->type() == type) --n;
+	}
+}
+
 lt::settings_pack make_settings_pack()
 {
 	// Minimal session: networking disabled, not needed for these tests
@@ -210,6 +223,45 @@ BOOST_AUTO_TEST_CASE(removed_before_client_saw_add)
 	}
 }
 
+// Torrents whose add or remove alerts were lost are picked up by resync(),
+// in a new frame, as if the alerts had arrived.
+BOOST_AUTO_TEST_CASE(resync_after_dropped_alerts)
+{
+	lt::session ses(make_settings_pack());
+
+	ltweb::alert_handler handler(ses);
+	ltweb::torrent_history history(&handler);
+
+	lt::add_torrent_params p;
+	p.save_path = ".";
+	p.info_hashes = lt::info_hash_t(make_v1(0xaa));
+	lt::torrent_handle const a = ses.add_torrent(p);
+	wait_for(ses, handler, 1, lt::add_torrent_alert::alert_type);
+	ltweb::frame_t const f0 = history.query(0).current_frame;
+
+	p.info_hashes = lt::info_hash_t(make_v1(0xbb));
+	ses.add_torrent(p);
+	drop(ses, 1, lt::add_torrent_alert::alert_type);
+	ses.remove_torrent(a);
+	drop(ses, 1, lt::torrent_removed_alert::alert_type);
+
+	// the history doesn't know yet
+	{
+		auto const r = history.query(f0);
+		BOOST_TEST(r.updated.empty());
+		BOOST_TEST(r.removed.empty());
+	}
+
+	history.resync();
+	auto const r = history.query(f0);
+	BOOST_TEST(r.current_frame > f0);
+	BOOST_TEST(r.updated.size() == 1u);
+	if (!r.updated.empty())
+		BOOST_TEST((r.updated[0].status.info_hashes.get_best() == make_v1(0xbb)));
+	BOOST_TEST(r.removed.size() == 1u);
+	if (!r.removed.empty()) BOOST_TEST((r.removed[0] == make_v1(0xaa)));
+}
+
 // query() must advance any deferred add/remove frame under the same lock as
 // the payload snapshot, so the returned frame can be used as the next poll
 // cursor without duplicating or skipping those events.
@@ -831,3 +883,64 @@ BOOST_AUTO_TEST_CASE(query_filtered_empty_f_old_skips_stability_guard)
 	if (r.updated.size() == 1u)
 		BOOST_TEST((r.updated[0].status.info_hashes == lt::info_hash_t(ih_a)));
 }
+
+namespace {
+
+// tags every torrent as it's added, from the add_torrent_alert. This is what
+// save_resume does with tags loaded from the resume database, before
+// torrent_history has fetched the status of the torrent
+struct tag_on_add : ltweb::alert_observer {
+	tag_on_add(ltweb::alert_handler& h, ltweb::torrent_history& hist)
+		: m_hist(hist)
+	{
+		h.subscribe<lt::add_torrent_alert>(this);
+	}
+
+	void handle_alert(lt::alert const* a) override
+	{
+		auto const* ta = lt::alert_cast<lt::add_torrent_alert>(a);
+		if (ta == nullptr) return;
+		if (m_hist.set_tag(ta->params.info_hashes.get_best(), 0x5, ~std::uint64_t(0))) ++tagged;
+	}
+
+	ltweb::torrent_history& m_hist;
+	int tagged = 0;
+};
+
+} // anonymous namespace
+
+// Adding many torrents at once (as when loading the resume database) creates
+// their entries from the add_torrent_params, without asking the session for
+// their status. Every torrent must get an entry, and tags set while the
+// entries are pending must stick.
+BOOST_AUTO_TEST_CASE(bulk_add)
+{
+	lt::session ses(make_settings_pack());
+
+	ltweb::alert_handler handler(ses);
+	ltweb::torrent_history history(&handler);
+	tag_on_add tagger(handler, history);
+
+	int const num_torrents = 200;
+	lt::add_torrent_params p;
+	p.save_path = ".";
+	p.flags |= lt::torrent_flags::paused;
+	p.flags &= ~lt::torrent_flags::auto_managed;
+	for (int i = 0; i < num_torrents; ++i) {
+		lt::sha1_hash ih;
+		std::memcpy(ih.data(), &i, sizeof(i));
+		p.info_hashes = lt::info_hash_t(ih);
+		ses.async_add_torrent(p);
+	}
+	wait_for(ses, handler, num_torrents, lt::add_torrent_alert::alert_type);
+
+	auto const r = history.query(0);
+	BOOST_TEST(r.updated.size() == std::size_t(num_torrents));
+	BOOST_TEST(tagger.tagged == num_torrents);
+	for (auto const& e : r.updated) {
+		BOOST_TEST(history.get_tag(e.status.handle) == 0x5u);
+		BOOST_TEST(e.status.save_path == ".");
+	}
+
+	handler.unsubscribe(&tagger);
+}
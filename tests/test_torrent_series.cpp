@@ -0,0 +1,194 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#define BOOST_TEST_MODULE torrent_series
+#include <boost/test/included/unit_test.hpp>
+
+#include "torrent_series.hpp"
+
+#include <cstdint>
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+// 10 seconds at 1 second and a minute at 10 seconds
+std::array<series_resolution, 2> const small_resolutions = {{
+	{1000, 10000},
+	{10000, 60000},
+}};
+
+series_sample sample(std::int64_t const ts, std::int64_t const rate, std::int64_t const ppm = 0)
+{
+	return {ts, rate, rate / 2, 10, ppm};
+}
+
+std::vector<std::int64_t> timestamps(std::vector<series_sample> const& v)
+{
+	std::vector<std::int64_t> ret;
+	for (auto const& s : v)
+		ret.push_back(s.timestamp);
+	return ret;
+}
+
+lt::sha1_hash hash(char const c)
+{
+	lt::sha1_hash ret;
+	ret[0] = std::uint8_t(c);
+	return ret;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(empty)
+{
+	torrent_series s(small_resolutions);
+	std::vector<series_sample> out;
+	s.query(0, 0, 1000000, out);
+	BOOST_TEST(out.empty());
+	BOOST_TEST((s.last() == series_sample{}));
+}
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+	torrent_series s(small_resolutions);
+	std::vector<series_sample> in;
+	for (int i = 0; i < 200; ++i)
+		in.push_back(sample(1000000 + i * 1000 + (i % 3) * 7, (i * 7919) % 100000, i * 5000));
+	for (auto const& v : in)
+		s.add(v);
+
+	// the last 10 seconds are kept, plus what's left of the oldest chunk
+	std::vector<series_sample> out;
+	s.query(0, 0, 2000000, out);
+	BOOST_TEST(out.size() >= 10);
+	BOOST_TEST(out.size() < in.size());
+	std::vector<series_sample> const expect(in.end() - std::ptrdiff_t(out.size()), in.end());
+	BOOST_TEST((out == expect));
+	BOOST_TEST((s.last() == in.back()));
+}
+
+BOOST_AUTO_TEST_CASE(query_range)
+{
+	torrent_series s(small_resolutions);
+	for (int i = 0; i < 8; ++i)
+		s.add(sample(i * 1000 + 100, i));
+
+	std::vector<series_sample> out;
+	s.query(0, 2000, 4500, out);
+	BOOST_TEST(timestamps(out) == (std::vector<std::int64_t>{2100, 3100, 4100}));
+	BOOST_TEST((out[1] == sample(3100, 3)));
+}
+
+BOOST_AUTO_TEST_CASE(downsampled)
+{
+	torrent_series s(small_resolutions);
+	for (int i = 0; i < 25; ++i)
+		s.add(sample(i * 1000, i));
+
+	// the coarse resolution keeps the last sample of each interval
+	std::vector<series_sample> out;
+	s.query(1, 0, 100000, out);
+	BOOST_TEST(timestamps(out) == (std::vector<std::int64_t>{9000, 19000, 24000}));
+	BOOST_TEST((out.back() == sample(24000, 24)));
+}
+
+BOOST_AUTO_TEST_CASE(clock_steps_back)
+{
+	torrent_series s(small_resolutions);
+	s.add(sample(5000, 5));
+	s.add(sample(3000, 3));
+	s.add(sample(6000, 6));
+
+	std::vector<series_sample> out;
+	s.query(0, 0, 10000, out);
+	BOOST_TEST(timestamps(out) == (std::vector<std::int64_t>{5000, 6000}));
+}
+
+BOOST_AUTO_TEST_CASE(invalid_query)
+{
+	torrent_series s(small_resolutions);
+	s.add(sample(1000, 1));
+	std::vector<series_sample> out;
+	s.query(2, 0, 2000, out);
+	s.query(-1, 0, 2000, out);
+	s.query(0, 2000, 0, out);
+	BOOST_TEST(out.empty());
+}
+
+BOOST_AUTO_TEST_CASE(idle_is_cheap)
+{
+	// an idle torrent, sampled every second. Once the finest resolution is
+	// full, another hour only costs a few bytes per minute
+	torrent_series s;
+	for (int i = 0; i < 3600; ++i)
+		s.add(sample(std::int64_t(i) * 1000, 0, 1000000));
+	std::size_t const hour = s.memory_used();
+	for (int i = 3600; i < 7200; ++i)
+		s.add(sample(std::int64_t(i) * 1000, 0, 1000000));
+	BOOST_TEST(s.memory_used() - hour < 300);
+}
+
+BOOST_AUTO_TEST_CASE(store_query)
+{
+	torrent_series_store st(1024 * 1024, small_resolutions);
+	st.add(hash('a'), sample(1000, 1), false);
+	st.add(hash('a'), sample(2000, 2), false);
+	st.add(hash('b'), sample(2000, 3), false);
+	BOOST_TEST(st.num_torrents() == 2);
+
+	std::vector<series_sample> out;
+	BOOST_TEST(st.query(hash('a'), 0, 0, 10000, out));
+	BOOST_TEST(timestamps(out) == (std::vector<std::int64_t>{1000, 2000}));
+	BOOST_TEST(!st.query(hash('c'), 0, 0, 10000, out));
+
+	std::size_t const before = st.memory_used();
+	st.erase(hash('b'));
+	BOOST_TEST(st.num_torrents() == 1);
+	BOOST_TEST(st.memory_used() < before);
+	st.erase(hash('a'));
+	BOOST_TEST(st.memory_used() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(evict_idle_seeds_first)
+{
+	torrent_series_store st(1024 * 1024, small_resolutions);
+	// an idle seed that changed recently, and an active download that has
+	// been unchanged for longer
+	st.add(hash('s'), sample(5000, 0), true);
+	st.add(hash('d'), sample(1000, 100), false);
+	std::size_t const two = st.memory_used();
+
+	torrent_series_store small(two - 1, small_resolutions);
+	small.add(hash('s'), sample(5000, 0), true);
+	small.add(hash('d'), sample(1000, 100), false);
+
+	std::vector<series_sample> out;
+	BOOST_TEST(small.num_torrents() == 1);
+	BOOST_TEST(small.query(hash('d'), 0, 0, 10000, out));
+	BOOST_TEST(small.memory_used() <= two - 1);
+}
+
+BOOST_AUTO_TEST_CASE(evict_oldest)
+{
+	torrent_series_store st(1024 * 1024, small_resolutions);
+	st.add(hash('a'), sample(1000, 1), false);
+	st.add(hash('b'), sample(1000, 1), false);
+	std::size_t const two = st.memory_used();
+
+	torrent_series_store small(two - 1, small_resolutions);
+	small.add(hash('a'), sample(3000, 1), false);
+	small.add(hash('b'), sample(2000, 1), false);
+
+	// b has been unchanged for the longest
+	std::vector<series_sample> out;
+	BOOST_TEST(small.num_torrents() == 1);
+	BOOST_TEST(small.query(hash('a'), 0, 0, 10000, out));
+}
@@ -0,0 +1,182 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "alert_handler.hpp"
+#include "alert_observer.hpp"
+
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/session.hpp"
+#include "libtorrent/settings_pack.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace ltweb;
+using namespace std::chrono_literals;
+
+namespace {
+
+// the number of heap allocations made by the process, to tell whether
+// dispatching allocates
+std::atomic<std::uint64_t> g_allocations{0};
+
+using clock_type = std::chrono::steady_clock;
+
+// does as little as possible, so the benchmark measures the dispatch
+struct counting_observer : alert_observer {
+	explicit counting_observer(alert_handler& h)
+		: m_handler(h)
+	{
+		h.subscribe<lt::session_stats_alert, lt::state_update_alert, lt::torrent_removed_alert>(
+			this
+		);
+	}
+	~counting_observer() { m_handler.unsubscribe(this); }
+
+	void handle_alert(lt::alert const*) override { ++alerts; }
+
+	std::atomic<std::int64_t> alerts{0};
+
+private:
+	alert_handler& m_handler;
+};
+
+// pops the alerts posted by num_alerts calls to post_session_stats(). They
+// stay valid until the next pop_alerts()
+std::vector<lt::alert*> make_alerts(lt::session& ses, int const num_alerts)
+{
+	for (int i = 0; i < num_alerts; ++i)
+		ses.post_session_stats();
+	// the session reuses the storage of the alerts on every pop, so all of
+	// them have to be popped at once
+	std::this_thread::sleep_for(500ms);
+	std::vector<lt::alert*> ret;
+	ses.pop_alerts(&ret);
+	ret.erase(
+		std::remove_if(
+			ret.begin(),
+			ret.end(),
+			[](lt::alert* a) { return a->type() != lt::session_stats_alert::alert_type; }
+		),
+		ret.end()
+	);
+	return ret;
+}
+
+void run(
+	lt::session& ses,
+	alert_handler::dispatch_mode const mode,
+	char const* name,
+	int const num_observers,
+	int const num_alerts,
+	int const rounds
+)
+{
+	alert_handler handler(ses, mode);
+	std::vector<std::unique_ptr<counting_observer>> observers;
+	for (int i = 0; i < num_observers; ++i)
+		observers.push_back(std::make_unique<counting_observer>(handler));
+
+	std::vector<lt::alert*> const alerts = make_alerts(ses, num_alerts);
+	if (alerts.empty()) {
+		std::fprintf(stderr, "no alerts\n");
+		return;
+	}
+
+	// dispatch_alerts() clears the vector it's passed
+	std::vector<lt::alert*> batch;
+	batch.reserve(alerts.size());
+
+	std::chrono::nanoseconds elapsed{0};
+	std::uint64_t allocations = 0;
+	for (int r = 0; r < rounds; ++r) {
+		batch.assign(alerts.begin(), alerts.end());
+		std::uint64_t const allocs = g_allocations.load(std::memory_order_relaxed);
+		auto const start = clock_type::now();
+		handler.dispatch_alerts(batch);
+		elapsed += clock_type::now() - start;
+		allocations += g_allocations.load(std::memory_order_relaxed) - allocs;
+	}
+
+	std::int64_t const dispatched = std::int64_t(alerts.size()) * rounds;
+	std::int64_t received = 0;
+	for (auto const& o : observers)
+		received += o->alerts;
+	std::fprintf(
+		stderr,
+		"%-8s %2d observers: %7.1f ns per alert, %.3f allocations per alert, %s\n",
+		name,
+		num_observers,
+		double(elapsed.count()) / double(dispatched),
+		double(allocations) / double(dispatched),
+		received == dispatched * num_observers ? "ok" : "ALERTS LOST"
+	);
+}
+
+void usage()
+{
+	std::fprintf(
+		stderr,
+		"usage:\n"
+		"  alert_dispatch_bench [batch-size] [rounds]\n"
+		"\n"
+		"  Dispatches batches of batch-size alerts (default 1000), rounds times\n"
+		"  (default 1000), to 1, 4 and 16 observers, and reports the cost of\n"
+		"  dispatching one alert, in both dispatch modes.\n"
+	);
+}
+
+} // anonymous namespace
+
+void* operator new(std::size_t const size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* ret = std::malloc(size == 0 ? 1 : size)) return ret;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+int main(int argc, char* argv[])
+{
+	if (argc > 3) {
+		usage();
+		return 1;
+	}
+
+	int const num_alerts = argc >= 2 ? std::atoi(argv[1]) : 1000;
+	int const rounds = argc >= 3 ? std::atoi(argv[2]) : 1000;
+	if (num_alerts <= 0 || rounds <= 0) {
+		usage();
+		return 1;
+	}
+
+	lt::settings_pack sp;
+	sp.set_bool(lt::settings_pack::enable_dht, false);
+	sp.set_bool(lt::settings_pack::enable_lsd, false);
+	sp.set_bool(lt::settings_pack::enable_upnp, false);
+	sp.set_bool(lt::settings_pack::enable_natpmp, false);
+	sp.set_str(lt::settings_pack::listen_interfaces, "127.0.0.1:0");
+	sp.set_int(lt::settings_pack::alert_queue_size, num_alerts * 2);
+	lt::session ses(sp);
+
+	for (int const n : {1, 4, 16})
+		run(ses, alert_handler::dispatch_mode::caller, "caller", n, num_alerts, rounds);
+	for (int const n : {1, 4, 16})
+		run(ses, alert_handler::dispatch_mode::threaded, "threaded", n, num_alerts, rounds);
+	return 0;
+}
@@ -0,0 +1,286 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "alert_handler.hpp"
+#include "ordered_pipeline.hpp"
+#include "resume_codec.hpp"
+#include "resume_writer.hpp"
+#include "save_resume.hpp"
+#include "torrent_history.hpp"
+#include "hex.hpp"
+
+#include "libtorrent/add_torrent_params.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/create_torrent.hpp"
+#include "libtorrent/read_resume_data.hpp"
+#include "libtorrent/session.hpp"
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/torrent_info.hpp"
+#include "libtorrent/write_resume_data.hpp"
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace ltweb;
+using namespace std::chrono_literals;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+// the synthetic torrents have this many pieces each, which makes the resume
+// data a few kiB, like a typical torrent with its info-dictionary
+constexpr int pieces_per_torrent = 256;
+constexpr int piece_size = 256 * 1024;
+
+int elapsed_ms(clock_type::time_point const start)
+{
+	return int(std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - start)
+				   .count());
+}
+
+struct synthetic_torrent {
+	std::string info_hash;
+	std::vector<char> metadata;
+	std::vector<char> resume;
+};
+
+// the metadata and the resume data are stored separately, like save_resume
+// does
+synthetic_torrent make_torrent(int const i)
+{
+	lt::file_storage fs;
+	fs.add_file(
+		"bench/torrent-" + std::to_string(i) + "/file.bin",
+		std::int64_t(pieces_per_torrent) * piece_size
+	);
+	lt::create_torrent ct(fs, piece_size, lt::create_torrent::v1_only);
+	for (lt::piece_index_t p(0); p < fs.end_piece(); ++p) {
+		lt::sha1_hash h;
+		for (int k = 0; k < int(h.size()); ++k)
+			h[k] = std::uint8_t(i * 31 + static_cast<int>(p) * 7 + k);
+		ct.set_hash(p, h);
+	}
+	std::vector<char> torrent;
+	lt::bencode(std::back_inserter(torrent), ct.generate());
+
+	lt::torrent_info const ti(torrent, lt::from_span);
+	lt::sha1_hash const ih = ti.info_hashes().get_best();
+
+	lt::add_torrent_params p;
+	p.info_hashes = ti.info_hashes();
+	p.save_path = "bench";
+	p.flags |= lt::torrent_flags::paused;
+	p.flags &= ~lt::torrent_flags::auto_managed;
+	return {
+		to_hex(lt::span<char const>{ih.data(), lt::sha1_hash::size()}),
+		std::move(torrent),
+		lt::write_resume_data_buf(p)
+	};
+}
+
+struct stored_row {
+	std::vector<char> resume;
+	std::vector<char> metadata;
+};
+
+std::vector<stored_row> read_rows(std::string const& db_path)
+{
+	std::vector<stored_row> ret;
+	sqlite3* db = nullptr;
+	if (sqlite3_open(db_path.c_str(), &db) != SQLITE_OK) {
+		sqlite3_close(db);
+		return ret;
+	}
+	sqlite3_stmt* stmt = nullptr;
+	if (sqlite3_prepare_v2(
+			db,
+			"SELECT T.RESUME, M.INFO FROM TORRENTS T "
+			"LEFT JOIN METADATA M ON M.INFOHASH = T.INFOHASH;",
+			-1,
+			&stmt,
+			nullptr
+		)
+		== SQLITE_OK) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			stored_row r;
+			for (int col = 0; col < 2; ++col) {
+				char const* buf = static_cast<char const*>(sqlite3_column_blob(stmt, col));
+				(col == 0 ? r.resume : r.metadata)
+					.assign(buf, buf + sqlite3_column_bytes(stmt, col));
+			}
+			ret.push_back(std::move(r));
+		}
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return ret;
+}
+
+// the work the loader's workers do for each row
+bool decode(stored_row const& r)
+{
+	std::vector<char> resume;
+	if (!decompress_resume({r.resume.data(), r.resume.size()}, resume)) return false;
+	lt::error_code ec;
+	lt::add_torrent_params p =
+		lt::read_resume_data({resume.data(), std::ptrdiff_t(resume.size())}, ec);
+	if (ec) return false;
+	p.ti = std::make_shared<lt::torrent_info>(
+		lt::span<char const>{r.metadata.data(), std::ptrdiff_t(r.metadata.size())},
+		ec,
+		lt::from_span
+	);
+	return !ec;
+}
+
+void usage()
+{
+	std::fprintf(
+		stderr,
+		"usage:\n"
+		"  resume_load_bench [num-torrents] [db-path]\n"
+		"\n"
+		"  Creates a resume database with num-torrents synthetic torrents\n"
+		"  (default 10000) at db-path (default ./resume_bench.sqlite), and\n"
+		"  measures how long it takes to decode and to load them.\n"
+		"  An existing database at db-path is replaced.\n"
+	);
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+	if (argc > 3) {
+		usage();
+		return 1;
+	}
+
+	int const num_torrents = argc >= 2 ? std::atoi(argv[1]) : 10000;
+	std::string const db_path = argc >= 3 ? argv[2] : "./resume_bench.sqlite";
+	if (num_torrents <= 0) {
+		usage();
+		return 1;
+	}
+
+	std::error_code fs_ec;
+	for (char const* suffix : {"", "-wal", "-shm"})
+		std::filesystem::remove(db_path + suffix, fs_ec);
+
+	lt::settings_pack sp;
+	sp.set_bool(lt::settings_pack::enable_dht, false);
+	sp.set_bool(lt::settings_pack::enable_lsd, false);
+	sp.set_bool(lt::settings_pack::enable_upnp, false);
+	sp.set_bool(lt::settings_pack::enable_natpmp, false);
+	sp.set_str(lt::settings_pack::listen_interfaces, "127.0.0.1:0");
+
+	// populate the database. Constructing save_resume creates the schema
+	{
+		auto const start = clock_type::now();
+		lt::session ses(sp);
+		alert_handler alerts(ses);
+		torrent_history hist(&alerts);
+		save_resume resume(ses, db_path, &alerts, hist);
+
+		resume_writer writer(db_path, 256, 500ms, true);
+		for (int i = 0; i < num_torrents; ++i) {
+			synthetic_torrent t = make_torrent(i);
+			writer.save_metadata(t.info_hash, std::move(t.metadata));
+			writer.save(t.info_hash, std::move(t.resume), i, 0);
+		}
+		writer.flush();
+		std::fprintf(stderr, "created %d torrents in %d ms\n", num_torrents, elapsed_ms(start));
+	}
+
+	std::vector<stored_row> const rows = read_rows(db_path);
+
+	// decoding the resume data on a single thread, like the loader used to
+	{
+		auto const start = clock_type::now();
+		int decoded = 0;
+		for (auto const& r : rows)
+			if (decode(r)) ++decoded;
+		std::fprintf(
+			stderr, "decoded %d torrents on 1 thread in %d ms\n", decoded, elapsed_ms(start)
+		);
+	}
+
+	// decoding the resume data in the pipeline the loader uses
+	{
+		int const threads = std::max(1, int(std::thread::hardware_concurrency()));
+		auto const start = clock_type::now();
+		int decoded = 0;
+		{
+			ordered_pipeline<stored_row const*, int> pipeline(
+				threads,
+				256,
+				8,
+				[](stored_row const*& r) { return decode(*r) ? 1 : 0; },
+				[&](std::vector<int>& batch) {
+					for (int const ok : batch)
+						decoded += ok;
+				}
+			);
+			for (auto const& r : rows)
+				pipeline.push(&r);
+		}
+		std::fprintf(
+			stderr,
+			"decoded %d torrents on %d threads in %d ms\n",
+			decoded,
+			threads,
+			elapsed_ms(start)
+		);
+	}
+
+	// loading the database into a session, until torrent_history has
+	// every torrent
+	{
+		lt::session ses(sp);
+		alert_handler alerts(ses);
+		torrent_history hist(&alerts);
+		save_resume resume(ses, db_path, &alerts, hist);
+
+		auto const start = clock_type::now();
+		lt::error_code ec;
+		resume.load(ec);
+
+		int first_visible = -1;
+		std::size_t visible = 0;
+		while (visible < rows.size() && clock_type::now() - start < 10min) {
+			alerts.dispatch_alerts(100ms);
+			visible = hist.query(0).updated.size();
+			if (visible > 0 && first_visible < 0) first_visible = elapsed_ms(start);
+		}
+		int const total = elapsed_ms(start);
+		std::fprintf(
+			stderr,
+			"loaded %d torrents in %d ms (first visible after %d ms, %d torrents/s)\n",
+			int(visible),
+			total,
+			first_visible,
+			int(visible * 1000 / std::max(total, 1))
+		);
+	}
+
+	for (char const* suffix : {"", "-wal", "-shm"})
+		std::filesystem::remove(db_path + suffix, fs_ec);
+	return 0;
+}
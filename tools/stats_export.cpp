@@ -0,0 +1,98 @@
+/*
+
+Copyright (c) 2026, Arvid Norberg
+All rights reserved.
+
+You may use, distribute and modify this code under the terms of the BSD license,
+see LICENSE file.
+*/
+
+#include "stats_codec.hpp"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using namespace ltweb;
+
+namespace {
+
+void usage()
+{
+	std::fprintf(
+		stderr,
+		"usage:\n"
+		"  stats_export [--csv] <log-file>\n"
+		"\n"
+		"  Converts a binary session stats log (session_stats/*.stats) to text,\n"
+		"  written to stdout. The default is the tab separated format read by\n"
+		"  parse_session_stats.py. With --csv, a header row with the metric\n"
+		"  names is followed by one comma separated row per sample.\n"
+		"  The first column is the number of seconds since the first log file of\n"
+		"  the session was started.\n"
+	);
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+	bool csv = false;
+	if (argc == 3 && std::strcmp(argv[1], "--csv") == 0) {
+		csv = true;
+		++argv;
+		--argc;
+	}
+	if (argc != 2) {
+		usage();
+		return 1;
+	}
+
+	std::ifstream f(argv[1], std::ios::in | std::ios::binary);
+	if (!f) {
+		std::fprintf(stderr, "failed to open \"%s\"\n", argv[1]);
+		return 1;
+	}
+	std::string const buf{std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+
+	stats_log_reader log;
+	if (!log.parse(buf)) {
+		std::fprintf(stderr, "\"%s\" is not a session stats log\n", argv[1]);
+		return 1;
+	}
+
+	char const sep = csv ? ',' : '\t';
+	std::fputs("second", stdout);
+	for (auto const& name : log.metrics()) {
+		std::putchar(csv ? ',' : ':');
+		std::fputs(name.c_str(), stdout);
+	}
+	std::fputs(csv ? "\n" : "\n\n", stdout);
+
+	int corrupt = 0;
+	std::vector<stats_sample> samples;
+	for (std::size_t i = 0; i < log.blocks().size(); ++i) {
+		samples.clear();
+		if (!log.read_block(i, samples)) {
+			++corrupt;
+			continue;
+		}
+		for (auto const& s : samples) {
+			std::printf("%.6f", double(s.timestamp) / 1000000.0);
+			for (std::int64_t const v : s.values)
+				std::printf("%c%" PRId64, sep, v);
+			std::putchar('\n');
+		}
+	}
+
+	if (corrupt > 0) {
+		std::fprintf(
+			stderr, "skipped %d corrupt blocks (of %d)\n", corrupt, int(log.blocks().size())
+		);
+	}
+	return 0;
+}